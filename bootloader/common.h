@@ -6,6 +6,10 @@
 
 #define PAGE_SIZE 0x1000
 
+// Sizes of the pages mapped by large leaf entries in a PDT and a PDPT
+#define PAGE_SIZE_2MB 0x200000ULL
+#define PAGE_SIZE_1GB 0x40000000ULL
+
 static inline int strncmp(const char *s1, const char *s2, UINT64 n) {
     for (UINT64 i = 0; i < n; i++) {
         if (s1[i] != s2[i]) {
@@ -175,15 +175,35 @@ EFI_STATUS LoadElfSegments(
         }
     }
 
-    // Allocate contiguous memory block
-    VOID* ContiguousBase = NULL;
+    //
+    // Allocate contiguous memory block. The base is aligned to 2MB so
+    // that the higher half direct map, which keeps the kernel's offset
+    // between virtual and physical addresses, can use 2MB pages.
+    //
+    UINT64 AlignmentPages = EFI_SIZE_TO_PAGES(PAGE_SIZE_2MB);
     UINTN TotalPages = EFI_SIZE_TO_PAGES(*TotalSize);
-    Status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, TotalPages, (EFI_PHYSICAL_ADDRESS*)&ContiguousBase);
+    EFI_PHYSICAL_ADDRESS AllocationBase = 0;
+    Status = uefi_call_wrapper(BS->AllocatePages, 4, AllocateAnyPages, EfiLoaderData, TotalPages + AlignmentPages - 1, &AllocationBase);
     if (EFI_ERROR(Status)) {
         Print(L"Error allocating contiguous pages: %r\n\r", Status);
         return Status;
     }
 
+    // Give the slack around the aligned block back to the firmware
+    EFI_PHYSICAL_ADDRESS AlignedBase = (AllocationBase + PAGE_SIZE_2MB - 1) & ~(PAGE_SIZE_2MB - 1);
+    UINT64 LeadingPages = (AlignedBase - AllocationBase) / PAGE_SIZE;
+    UINT64 TrailingPages = AlignmentPages - 1 - LeadingPages;
+
+    if (LeadingPages) {
+        uefi_call_wrapper(BS->FreePages, 2, AllocationBase, LeadingPages);
+    }
+
+    if (TrailingPages) {
+        uefi_call_wrapper(BS->FreePages, 2, AlignedBase + TotalPages * PAGE_SIZE, TrailingPages);
+    }
+
+    VOID* ContiguousBase = (VOID*)AlignedBase;
+
     *PhysicalBase = ContiguousBase;
 
     UINT64 Offset = 0;
@@ -45,69 +45,167 @@ void VirtualAddressToPageLevels(
     dict->PTLevel4 = addr & 0x1ff;
 }
 
+// Index of the entry translating the address in a table of the given level, 4 being the PML4
+static UINT64 GetPageTableIndex(UINT64 vaddr, UINT8 Level) {
+	return (vaddr >> (12 + 9 * (Level - 1))) & 0x1ff;
+}
+
+// Size of the page mapped by a leaf entry of the given level
+static UINT64 GetLevelPageSize(UINT8 Level) {
+	return 1ULL << (12 + 9 * (Level - 1));
+}
+
+static BOOLEAN IsGigabytePageSupported() {
+	static INT8 Supported = -1;
+
+	if (Supported == -1) {
+		UINT32 eax, ebx, ecx, edx;
+
+		__asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000000), "c"(0));
+		Supported = 0;
+
+		// CPUID.80000001H:EDX.Page1GB[bit 26]
+		if (eax >= 0x80000001) {
+			__asm__ volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0x80000001), "c"(0));
+			Supported = (edx >> 26) & 1;
+		}
+	}
+
+	return Supported;
+}
+
+//
+// Replaces a large leaf with a table of 512 leaves of the next smaller
+// size that map the same memory with the same attributes.
+//
+static void SplitLargePage(struct PageTableEntry* Entry, UINT8 Level, UINT8 privilege) {
+	struct PageTable* Table = (struct PageTable*)RequestPage();
+	SetMem(Table, PAGE_SIZE, 0);
+
+	UINT64 ChildPageSize = GetLevelPageSize(Level - 1);
+	UINT64 Base = ((UINT64)Entry->PFN << 12) & ~(GetLevelPageSize(Level) - 1);
+
+	// The PAT bit moves to bit 7 in 4KB entries, which is the page size bit in the upper levels
+	struct PageTableEntry Leaf = *Entry;
+	UINT64 PageAccessType = Leaf.LargePageAccessType;
+	Leaf.PFN = 0;
+
+	if (Level - 1 == 1) {
+		Leaf.PageAccessType = PageAccessType;
+	}
+
+	for (UINT64 i = 0; i < 512; ++i) {
+		Table->Entries[i] = Leaf;
+		Table->Entries[i].PFN = (Base + i * ChildPageSize) >> 12;
+
+		if (Level - 1 > 1) {
+			Table->Entries[i].LargePageAccessType = PageAccessType;
+		}
+	}
+
+	Entry->Value = 0;
+	Entry->Present = 1;
+	Entry->ReadWrite = 1;
+	Entry->UserSupervisor = privilege;
+	Entry->PFN = (UINT64)Table >> 12;
+}
+
 void MapPage(VOID* vaddr, VOID* paddr, UINT8 leafpriv, struct PageTable* PML4) {
-    struct PageLevelDictionary pdict;
-	VirtualAddressToPageLevels((UINT64)vaddr, &pdict);
+	MapLargePage(vaddr, paddr, PAGE_SIZE, leafpriv, PML4);
+}
 
-	struct PageTable *PDL3 = NULL, *PDL2 = NULL, *PageTable = NULL;
+void MapLargePage(VOID* vaddr, VOID* paddr, UINT64 PageSize, UINT8 leafpriv, struct PageTable* PML4) {
+	UINT8 LeafLevel = 1;
 
-	struct PageTableEntry* PTE_L4 = &PML4->Entries[pdict.PTLevel4];
+	if (PageSize == PAGE_SIZE_1GB) {
+		LeafLevel = 3;
+	} else if (PageSize == PAGE_SIZE_2MB) {
+		LeafLevel = 2;
+	}
 
 	UINT8 privilege = 0;
+	UINT8 global = 0;
 
 	// For all kernel pages in the higher half of the address space, privilege should be set to
 	// usermode (PL=3) with the exception of pages explicitly marked as privileged.
 	// This is due to the idea that the majority of the kernel should be operating in usermode with
 	// the exception of very few privileged regions performing privileged instructions.
-	if (pdict.PTLevel4 == 511) {
+	// The higher half is also shared by every address space, so its leaves are marked global
+	// to stay cached across cr3 writes once the kernel sets CR4.PGE.
+	if (GetPageTableIndex((UINT64)vaddr, 4) == 511) {
 		privilege = 1;
+		global = 1;
 	}
 
-	if (PTE_L4->Present == 0) {
-		PDL3 = (struct PageTable*)RequestPage();
-		SetMem(PDL3, PAGE_SIZE, 0);
+	struct PageTable* Table = PML4;
+
+	for (UINT8 Level = 4; Level > LeafLevel; --Level) {
+		struct PageTableEntry* Entry = &Table->Entries[GetPageTableIndex((UINT64)vaddr, Level)];
+
+		if (Entry->Present == 0) {
+			struct PageTable* NextTable = (struct PageTable*)RequestPage();
+			SetMem(NextTable, PAGE_SIZE, 0);
 
-		PTE_L4->Present = 1;
-		PTE_L4->ReadWrite = 1;
-		PTE_L4->UserSupervisor = privilege;
-		PTE_L4->PFN = (UINT64)PDL3 >> 12;
-	} else {
-		PDL3 = (struct PageTable*)((UINT64)PTE_L4->PFN << 12);
+			Entry->Present = 1;
+			Entry->ReadWrite = 1;
+			Entry->UserSupervisor = privilege;
+			Entry->PFN = (UINT64)NextTable >> 12;
+		} else if (Level < 4 && Entry->PageSize) {
+			// A smaller page is being mapped into a large one
+			SplitLargePage(Entry, Level, privilege);
+		}
+
+		Table = (struct PageTable*)((UINT64)Entry->PFN << 12);
 	}
 
-	struct PageTableEntry* PTE_L3 = &PDL3->Entries[pdict.PTLevel3];
-	
-	if (PTE_L3->Present == 0) {
-		PDL2 = (struct PageTable*)RequestPage();
-		SetMem(PDL2, PAGE_SIZE, 0);
+	struct PageTableEntry* Leaf = &Table->Entries[GetPageTableIndex((UINT64)vaddr, LeafLevel)];
 
-		PTE_L3->Present = 1;
-		PTE_L3->ReadWrite = 1;
-		PTE_L3->UserSupervisor = privilege;
-		PTE_L3->PFN = (UINT64)PDL2 >> 12;
-	} else {
-		PDL2 = (struct PageTable*)((UINT64)PTE_L3->PFN << 12);
+	// Tables of smaller mappings already in place are kept, the large page gets mapped piece by piece
+	if (LeafLevel > 1 && Leaf->Present && !Leaf->PageSize) {
+		UINT64 ChildPageSize = GetLevelPageSize(LeafLevel - 1);
+
+		for (UINT64 Offset = 0; Offset < PageSize; Offset += ChildPageSize) {
+			MapLargePage((VOID*)((UINT64)vaddr + Offset), (VOID*)((UINT64)paddr + Offset), ChildPageSize, leafpriv, PML4);
+		}
+
+		return;
 	}
 
-	struct PageTableEntry* PTE_L2 = &PDL2->Entries[pdict.PTLevel2];
-	
-	if (PTE_L2->Present == 0) {
-		PageTable = (struct PageTable*)RequestPage();
-		SetMem(PageTable, PAGE_SIZE, 0);
+	Leaf->Value = 0;
+	Leaf->Present = 1;
+	Leaf->ReadWrite = 1;
+	Leaf->UserSupervisor = leafpriv;
+	Leaf->Global = global;
+	Leaf->PFN = (UINT64)paddr >> 12;
+
+	if (LeafLevel > 1) {
+		Leaf->PageSize = 1;
+	}
+}
 
-		PTE_L2->Present = 1;
-		PTE_L2->ReadWrite = 1;
-		PTE_L2->UserSupervisor = privilege;
-		PTE_L2->PFN = (UINT64)PageTable >> 12;
-	} else {
-		PageTable = (struct PageTable*)((UINT64)PTE_L2->PFN << 12);
+UINT64 GetLargestPageSize(UINT64 vaddr, UINT64 paddr, UINT64 size) {
+	if (IsGigabytePageSupported() && ((vaddr | paddr) & (PAGE_SIZE_1GB - 1)) == 0 && size >= PAGE_SIZE_1GB) {
+		return PAGE_SIZE_1GB;
 	}
 
-	struct PageTableEntry* PTE_L1 = &PageTable->Entries[pdict.PTLevel1];
-	PTE_L1->Present = 1;
-	PTE_L1->ReadWrite = 1;
-	PTE_L1->UserSupervisor = leafpriv;
-	PTE_L1->PFN = (UINT64)paddr >> 12;
+	if (((vaddr | paddr) & (PAGE_SIZE_2MB - 1)) == 0 && size >= PAGE_SIZE_2MB) {
+		return PAGE_SIZE_2MB;
+	}
+
+	return PAGE_SIZE;
+}
+
+// Identity maps the range with the largest pages that fit
+static void IdentityMapRange(UINT64 Base, UINT64 Size, struct PageTable* PML4) {
+	UINT64 Address = Base & ~(PAGE_SIZE - 1);
+	UINT64 End = Base + Size;
+
+	while (Address < End) {
+		UINT64 PageSize = GetLargestPageSize(Address, Address, End - Address);
+		MapLargePage((VOID*)Address, (VOID*)Address, PageSize, 0, PML4);
+
+		Address += PageSize;
+	}
 }
 
 struct PageTable* CreateIdentityMappedPageTable(
@@ -120,18 +218,10 @@ struct PageTable* CreateIdentityMappedPageTable(
     SetMem(PML4, PAGE_SIZE, 0);
 
     // Identity map all system memory
-    for (UINT64 i = 0; i < TotalSystemMemory; i += PAGE_SIZE) {
-        MapPage((VOID*)i, (VOID*)i, 0, PML4);
-    }
+    IdentityMapRange(0, TotalSystemMemory, PML4);
 
 	// Identity mapping the graphics output buffer
-    for (
-		UINT64 i = (UINT64)GraphicsOutputBufferBase;
-		i < (UINT64)GraphicsOutputBufferBase + GraphicsOutputBufferSize;
-		i += PAGE_SIZE
-	) {
-        MapPage((VOID*)i, (VOID*)i, 0, PML4);
-    }
+    IdentityMapRange((UINT64)GraphicsOutputBufferBase, GraphicsOutputBufferSize, PML4);
 
     return PML4;
 }
@@ -159,6 +249,64 @@ INT64 FindElfSectionByVaddr(
     return -1;  // Address not found in any section
 }
 
+// Kernel pages are usermode by default unless they belong to a privileged section
+static UINT8 GetLeafPrivilegeLevel(
+    struct ElfSectionInfo* KernelElfSections,
+	UINT64 KernelElfSectionCount,
+	UINT64 KernelVirtualBase,
+	UINT64 vaddr
+) {
+	if (vaddr < KernelVirtualBase) {
+		return 0;
+	}
+
+	INT64 sectionIdx = FindElfSectionByVaddr(KernelElfSections, KernelElfSectionCount, KernelVirtualBase, vaddr);
+
+	if (sectionIdx != -1) {
+		// Logging
+		// if (KernelElfSections[sectionIdx].Privileged) {
+		// 	Print(L"Mapping privileged kernel segment v:%llx section:%a\n", vaddr, KernelElfSections[sectionIdx].Name);
+		// }
+
+		return !KernelElfSections[sectionIdx].Privileged;
+	}
+
+	return 1;
+}
+
+// Checks whether every 4KB page of the range would get the same privilege level
+static BOOLEAN IsPrivilegeLevelUniform(
+    struct ElfSectionInfo* KernelElfSections,
+	UINT64 KernelElfSectionCount,
+	UINT64 KernelVirtualBase,
+	UINT64 vaddr,
+	UINT64 size
+) {
+	UINT64 last = vaddr + size - 1;
+
+	if (last < KernelVirtualBase) {
+		return TRUE;
+	}
+
+	if (vaddr < KernelVirtualBase) {
+		return FALSE;
+	}
+
+	for (UINT64 i = 0; i < KernelElfSectionCount; ++i) {
+		struct ElfSectionInfo section = KernelElfSections[i];
+
+		if (section.VirtualBase < KernelVirtualBase || !section.Privileged || !section.VirtualSize) {
+			continue;
+		}
+
+		if (section.VirtualBase <= last && section.VirtualBase + section.VirtualSize - 1 >= vaddr) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
 void CreateHigherHalfMapping(
     struct PageTable* PML4,
 	struct ElfSegmentInfo* KernelElfSegments,
@@ -172,35 +320,40 @@ void CreateHigherHalfMapping(
 	// Calculate the offset between virtual and physical addresses for kernel
     UINT64 Offset = KernelVirtualBase - KernelPhysicalBase;
 
-    for (UINT64 i = 0; i < TotalSystemMemory; i += PAGE_SIZE) {
+    for (UINT64 i = 0; i < TotalSystemMemory;) {
 		// Calculate the corresponding higher-half virtual address
 		UINT64 paddr = i;
 		UINT64 vaddr = paddr + Offset;
 
-		UINT8 LeafPrivilegeLevel = 0;
-		
-		if (vaddr >= KernelVirtualBase) {
-			INT64 sectionIdx = FindElfSectionByVaddr(KernelElfSections, KernelElfSectionCount, KernelVirtualBase, vaddr);
-			struct ElfSectionInfo section = KernelElfSections[sectionIdx];
-
-			// Kernel pages are usermode by default unless explicitly marked as privileged
-			LeafPrivilegeLevel = 1;
-
-			if (sectionIdx != -1) {
-				LeafPrivilegeLevel = !section.Privileged;
-				
-				// Logging
-				// if (section.Privileged) {
-				// 	Print(L"Mapping privileged kernel segment p:%llx -> v:%llx section:%a\n", paddr, vaddr, section.Name);
-				// }
-			}
-		}
-
 		// Check virtual address overflows
 		if (vaddr == 0x0) {
 			break;
 		}
 
-		MapPage((VOID*)vaddr, (VOID*)paddr, LeafPrivilegeLevel, PML4);
+		// Pages can't run past the top of the address space
+		UINT64 Remaining = TotalSystemMemory - i;
+		if (Remaining > 0 - vaddr) {
+			Remaining = 0 - vaddr;
+		}
+
+		//
+		// The direct map uses the largest pages that fit, large pages
+		// are only an option if the privilege level doesn't change within
+		// them, so privileged kernel sections always end up in 4KB pages.
+		//
+		UINT64 PageSize = GetLargestPageSize(vaddr, paddr, Remaining);
+
+		while (
+			PageSize > PAGE_SIZE &&
+			!IsPrivilegeLevelUniform(KernelElfSections, KernelElfSectionCount, KernelVirtualBase, vaddr, PageSize)
+		) {
+			PageSize = (PageSize == PAGE_SIZE_1GB) ? PAGE_SIZE_2MB : PAGE_SIZE;
+		}
+
+		UINT8 LeafPrivilegeLevel = GetLeafPrivilegeLevel(KernelElfSections, KernelElfSectionCount, KernelVirtualBase, vaddr);
+
+		MapLargePage((VOID*)vaddr, (VOID*)paddr, PageSize, LeafPrivilegeLevel, PML4);
+
+		i += PageSize;
     }
 }
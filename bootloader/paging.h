@@ -31,6 +31,15 @@ struct PageTableEntry {
             UINT64 PK                     : 4;    // If the PKE bit of CR4 is set, determines the protection key.
             UINT64 EXD                    : 1;    // If 1, instruction fetches not allowed.
         };
+        // View of the 2MB and 1GB leaves in PDT and PDPT entries
+        struct
+        {
+            UINT64                        : 7;
+            UINT64 PageSize               : 1;    // If 1, the entry maps a large page instead of a page table.
+            UINT64                        : 4;
+            UINT64 LargePageAccessType    : 1;    // PAT bit of a large page.
+            UINT64                        : 51;
+        };
         UINT64 Value;
     };
 } __attribute__((packed));
@@ -51,6 +60,12 @@ void VirtualAddressToPageLevels(
 
 void MapPage(VOID* vaddr, VOID* paddr, UINT8 leafpriv, struct PageTable* pml4);
 
+// Maps a single 4KB, 2MB or 1GB page, both addresses have to be aligned to the page size
+void MapLargePage(VOID* vaddr, VOID* paddr, UINT64 PageSize, UINT8 leafpriv, struct PageTable* pml4);
+
+// Largest page size supported by the cpu that both addresses are aligned to and that fits into the range
+UINT64 GetLargestPageSize(UINT64 vaddr, UINT64 paddr, UINT64 size);
+
 // Returns PML4 (top level page table)
 struct PageTable* CreateIdentityMappedPageTable(
     UINT64 TotalSystemMemory,
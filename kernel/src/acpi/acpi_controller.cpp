@@ -235,6 +235,10 @@ void AcpiController::init(void* rsdp) {
             m_mcfg->enumeratePciDevices();
         } else if (memcmp(table->signature, (char*)"HPET", 4) == 0) {
             m_hpet = kstl::SharedPtr<Hpet>(new Hpet((HpetTable*)table));
+        } else if (memcmp(table->signature, (char*)"SRAT", 4) == 0) {
+            m_srat = kstl::SharedPtr<Srat>(new Srat((SratDescriptor*)table));
+        } else if (memcmp(table->signature, (char*)"SLIT", 4) == 0) {
+            m_slit = kstl::SharedPtr<Slit>(new Slit((SlitDescriptor*)table));
         }
     }
     kprint("\n");
@@ -3,6 +3,8 @@
 #include "madt.h"
 #include "hpet.h"
 #include "mcfg.h"
+#include "srat.h"
+#include "slit.h"
 
 // ACPI RSDP (Root System Description Pointer)
 struct AcpiRsdp {
@@ -101,16 +103,22 @@ public:
     inline bool hasApicTable() const { return (m_madt.get() != nullptr); }
     inline bool hasHpetTable() const { return (m_hpet.get() != nullptr); }
     inline bool hasPciDeviceTable() const { return (m_mcfg.get() != nullptr); }
+    inline bool hasSratTable() const { return (m_srat.get() != nullptr); }
+    inline bool hasSlitTable() const { return (m_slit.get() != nullptr); }
 
     Madt* getApicTable() { return m_madt.get(); }
     Hpet* getHpet() { return m_hpet.get(); }
     Mcfg* getPciDeviceTable() { return m_mcfg.get(); }
+    Srat* getSratTable() { return m_srat.get(); }
+    Slit* getSlitTable() { return m_slit.get(); }
 
 private:
     AcpiXsdt*               m_xsdt;
     kstl::SharedPtr<Madt>   m_madt;
     kstl::SharedPtr<Hpet>   m_hpet;
     kstl::SharedPtr<Mcfg>   m_mcfg;
+    kstl::SharedPtr<Srat>   m_srat;
+    kstl::SharedPtr<Slit>   m_slit;
     uint64_t                m_acpiTableEntries;
 };
 
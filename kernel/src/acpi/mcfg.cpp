@@ -12,6 +12,15 @@ void Mcfg::enumeratePciDevices() {
     int entries = ((m_base->header.length) - sizeof(McfgHeader)) / sizeof(PciDeviceConfig);
     for (int t = 0; t < entries; t++) {
         PciDeviceConfig* newDeviceConfig = (PciDeviceConfig*)((uint64_t)m_base + sizeof(McfgHeader) + (sizeof(PciDeviceConfig) * t));
+
+        // Identity map the configuration space of every bus in the segment at once, 1MB per bus
+        if (newDeviceConfig->endBus > newDeviceConfig->startBus) {
+            uint64_t ecamBase = newDeviceConfig->base + ((uint64_t)newDeviceConfig->startBus << 20);
+            uint64_t ecamPages = ((uint64_t)(newDeviceConfig->endBus - newDeviceConfig->startBus) << 20) / PAGE_SIZE;
+
+            paging::mapPages((void*)ecamBase, (void*)ecamBase, ecamPages, KERNEL_PAGE, 0, paging::getCurrentTopLevelPageTable());
+        }
+
         for (uint64_t bus = newDeviceConfig->startBus; bus < newDeviceConfig->endBus; bus++) {
             _enumeratePciBus(newDeviceConfig->base, bus);
         }
@@ -38,7 +47,6 @@ void Mcfg::_enumeratePciFunction(uint64_t deviceAddress, uint64_t function) {
     uint64_t offset = function << 12;
 
     uint64_t functionAddress = deviceAddress + offset;
-    paging::mapPage((void*)functionAddress, (void*)functionAddress, KERNEL_PAGE, 0, paging::getCurrentTopLevelPageTable());
 
     volatile PciDeviceHeader* pciDeviceHeader = (volatile PciDeviceHeader*)functionAddress;
 
@@ -70,7 +78,6 @@ void Mcfg::_enumeratePciDevice(uint64_t busAddress, uint64_t device) {
     uint64_t offset = device << 15;
 
     uint64_t deviceAddress = busAddress + offset;
-    paging::mapPage((void*)deviceAddress, (void*)deviceAddress, KERNEL_PAGE, 0, paging::getCurrentTopLevelPageTable());
 
     PciDeviceHeader* pciDeviceHeader = (PciDeviceHeader*)deviceAddress;
 
@@ -87,7 +94,6 @@ void Mcfg::_enumeratePciBus(uint64_t baseAddress, uint64_t bus) {
     uint64_t offset = bus << 20;
 
     uint64_t busAddress = baseAddress + offset;
-    paging::mapPage((void*)busAddress, (void*)busAddress, KERNEL_PAGE, 0, paging::getCurrentTopLevelPageTable());
 
     PciDeviceHeader* pciDeviceHeader = (PciDeviceHeader*)busAddress;
 
@@ -0,0 +1,22 @@
+#include "slit.h"
+
+Slit::Slit(SlitDescriptor* desc) {
+    m_localityCount = desc->localityCount;
+
+    // The table may live in memory that is only accessible while
+    // elevated, so the distance matrix gets copied over.
+    uint64_t entryCount = m_localityCount * m_localityCount;
+    m_distances.reserve(entryCount);
+
+    for (uint64_t i = 0; i < entryCount; ++i) {
+        m_distances.pushBack(desc->entries[i]);
+    }
+}
+
+uint8_t Slit::getDistance(uint32_t from, uint32_t to) const {
+    if (from >= m_localityCount || to >= m_localityCount) {
+        return (from == to) ? SLIT_LOCAL_DISTANCE : SLIT_REMOTE_DISTANCE;
+    }
+
+    return m_distances[from * m_localityCount + to];
+}
@@ -0,0 +1,34 @@
+#ifndef SLIT_H
+#define SLIT_H
+#include "acpi.h"
+#include <kvector.h>
+
+// Relative distance of a proximity domain to itself
+#define SLIT_LOCAL_DISTANCE     10
+
+// Distance reported for remote domains when no SLIT is present
+#define SLIT_REMOTE_DISTANCE    20
+
+// SLIT (System Locality Information Table) structure
+struct SlitDescriptor {
+    AcpiTableHeader header;
+    uint64_t localityCount;
+    uint8_t entries[]; // localityCount x localityCount distance matrix
+} __attribute__((packed));
+
+class Slit {
+public:
+    Slit(SlitDescriptor* desc);
+    ~Slit() = default;
+
+    inline uint64_t getLocalityCount() const { return m_localityCount; }
+
+    // Relative memory access distance between two proximity domains
+    uint8_t getDistance(uint32_t from, uint32_t to) const;
+
+private:
+    uint64_t                m_localityCount;
+    kstl::vector<uint8_t>   m_distances;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include "srat.h"
+
+Srat::Srat(SratDescriptor* desc) {
+    uint8_t* entryPtr = desc->tableEntries;
+    uint8_t* sratEnd = (uint8_t*)desc + desc->header.length;
+
+    while (entryPtr < sratEnd) {
+        uint8_t entryType = *entryPtr;
+        uint8_t entryLength = *(entryPtr + 1);
+
+        // Malformed entry, bail out instead of looping forever
+        if (entryLength == 0) {
+            break;
+        }
+
+        switch (entryType) {
+        case SRAT_TYPE_PROCESSOR_AFFINITY: {
+            SratProcessorAffinityDescriptor* cpu = (SratProcessorAffinityDescriptor*)entryPtr;
+            if (cpu->flags & SRAT_AFFINITY_ENABLED) {
+                SratCpuAffinity affinity;
+                affinity.apicId = cpu->apicId;
+                affinity.proximityDomain =
+                    (uint32_t)cpu->proximityDomainLow |
+                    ((uint32_t)cpu->proximityDomainHigh[0] << 8) |
+                    ((uint32_t)cpu->proximityDomainHigh[1] << 16) |
+                    ((uint32_t)cpu->proximityDomainHigh[2] << 24);
+
+                m_cpuAffinities.pushBack(affinity);
+            }
+            break;
+        }
+        case SRAT_TYPE_MEMORY_AFFINITY: {
+            SratMemoryAffinityDescriptor* memory = (SratMemoryAffinityDescriptor*)entryPtr;
+            if ((memory->flags & SRAT_AFFINITY_ENABLED) && memory->rangeLength) {
+                SratMemoryRange range;
+                range.base = memory->baseAddress;
+                range.length = memory->rangeLength;
+                range.proximityDomain = memory->proximityDomain;
+
+                m_memoryRanges.pushBack(range);
+            }
+            break;
+        }
+        case SRAT_TYPE_X2APIC_AFFINITY: {
+            SratX2ApicAffinityDescriptor* cpu = (SratX2ApicAffinityDescriptor*)entryPtr;
+            if (cpu->flags & SRAT_AFFINITY_ENABLED) {
+                SratCpuAffinity affinity;
+                affinity.apicId = cpu->x2apicId;
+                affinity.proximityDomain = cpu->proximityDomain;
+
+                m_cpuAffinities.pushBack(affinity);
+            }
+            break;
+        }
+        default: break;
+        }
+
+        entryPtr += entryLength;  // Move to the next entry
+    }
+}
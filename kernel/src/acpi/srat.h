@@ -0,0 +1,88 @@
+#ifndef SRAT_H
+#define SRAT_H
+#include "acpi.h"
+#include <kvector.h>
+
+// SRAT affinity structure types
+#define SRAT_TYPE_PROCESSOR_AFFINITY        0
+#define SRAT_TYPE_MEMORY_AFFINITY           1
+#define SRAT_TYPE_X2APIC_AFFINITY           2
+
+// Affinity structure flags
+#define SRAT_AFFINITY_ENABLED               (1 << 0)
+#define SRAT_MEMORY_HOT_PLUGGABLE           (1 << 1)
+
+// SRAT (System Resource Affinity Table) structure
+struct SratDescriptor {
+    AcpiTableHeader header;
+    uint32_t tableRevision;
+    uint64_t reserved;
+    uint8_t tableEntries[];
+} __attribute__((packed));
+
+// Processor Local APIC affinity entry in SRAT
+struct SratProcessorAffinityDescriptor {
+    uint8_t type;   // should be 0 for Processor Local APIC affinity
+    uint8_t length; // should be 16
+    uint8_t proximityDomainLow;
+    uint8_t apicId;
+    uint32_t flags;
+    uint8_t localSapicEid;
+    uint8_t proximityDomainHigh[3];
+    uint32_t clockDomain;
+} __attribute__((packed));
+
+// Memory affinity entry in SRAT
+struct SratMemoryAffinityDescriptor {
+    uint8_t type;   // should be 1 for Memory affinity
+    uint8_t length; // should be 40
+    uint32_t proximityDomain;
+    uint16_t reserved;
+    uint64_t baseAddress;
+    uint64_t rangeLength;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+// Processor x2APIC affinity entry in SRAT
+struct SratX2ApicAffinityDescriptor {
+    uint8_t type;   // should be 2 for Processor x2APIC affinity
+    uint8_t length; // should be 24
+    uint16_t reserved;
+    uint32_t proximityDomain;
+    uint32_t x2apicId;
+    uint32_t flags;
+    uint32_t clockDomain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+struct SratCpuAffinity {
+    uint32_t apicId;
+    uint32_t proximityDomain;
+};
+
+struct SratMemoryRange {
+    uint64_t base;
+    uint64_t length;
+    uint32_t proximityDomain;
+};
+
+class Srat {
+public:
+    Srat(SratDescriptor* desc);
+    ~Srat() = default;
+
+    SratCpuAffinity& getCpuAffinity(size_t idx) { return m_cpuAffinities[idx]; }
+    SratMemoryRange& getMemoryRange(size_t idx) { return m_memoryRanges[idx]; }
+
+    size_t getCpuAffinityCount() const { return m_cpuAffinities.size(); }
+    size_t getMemoryRangeCount() const { return m_memoryRanges.size(); }
+
+private:
+    // Only enabled entries are recorded
+    kstl::vector<SratCpuAffinity> m_cpuAffinities;
+    kstl::vector<SratMemoryRange> m_memoryRanges;
+};
+
+#endif
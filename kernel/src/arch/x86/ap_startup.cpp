@@ -1,7 +1,12 @@
 #include "ap_startup.h"
+#include "cpuid.h"
+#include "x86_cpu_control.h"
 #include <acpi/acpi_controller.h>
+#include <memory/slab.h>
 #include <paging/page_frame_allocator.h>
 #include <paging/page.h>
+#include <paging/pcid.h>
+#include <paging/tlb.h>
 #include <time/ktime.h>
 #include <kelevate/kelevate.h>
 #include <gdt/gdt.h>
@@ -109,12 +114,17 @@ void initializeApCores() {
         // and send the appropriate startup signal.
         // *Note* starting at 1 because BSP_ID is 0
         for (size_t cpu = 1; cpu < apicTable->getCpuCount(); cpu++) {
-            // Create a scheduler run queue for each detected core
-            sched.registerCpuCore(cpu);
-
             // Get the APIC ID of the core
             uint8_t apicid = apicTable->getLocalApicDescriptor(cpu).apicId;
 
+            // Per-cpu data is indexed by the APIC ID, there's no slot for this core
+            if (apicid >= MAX_CPUS) {
+                continue;
+            }
+
+            // Create a scheduler run queue for each detected core
+            sched.registerCpuCore(cpu);
+
             // Send the startup IPIs
             bootAndInitApCore(apicid);
         }
@@ -136,6 +146,9 @@ void bootAndInitApCore(uint8_t apicid) {
 
 EXTERN_C __PRIVILEGED_CODE
 void apStartupEntryC(int apicid) {
+    // The allocator below already needs the cpu index for its per-cpu caches
+    setCurrentCpuIndex(apicid);
+
     // Allocate a clean 2k kernel stack
     void* apKernelStack = zallocPages(2);
     uint64_t apKernelStackTop = (uint64_t)apKernelStack + 2 * PAGE_SIZE;
@@ -164,6 +177,14 @@ void apStartupEntryC(int apicid) {
 
     // Update cr3
     paging::setCurrentTopLevelPageTable(paging::g_kernelRootPageTable);
+
+    // Tag the TLB entries with PCIDs (if supported)
+    paging::enablePcid();
+
+    // Keep the global kernel half translations cached across cr3 writes
+    if (cpuid_isPgeSupported()) {
+        x86_cpu_pge_enable();
+    }
     
     // Setup a clean 8k per-cpu stack
     char* usermodeStack = (char*)zallocPages(8);
@@ -178,11 +199,25 @@ void apStartupEntryLowered() {
     // Initialize core's LAPIC
     Apic::initializeLocalApic();
 
+    // The core can take part in TLB shootdowns once its LAPIC is up
+    RUN_ELEVATED({
+        paging::registerTlbShootdownCpu();
+    });
+
     // Calibrate apic timer tickrate to 100 milliseconds
     KernelTimer::calibrateApicTimer(100);
 
     // Start the kernel-wide APIC periodic timer
     KernelTimer::startApicPeriodicTimer();
 
-    while (1);
+    // Idle loop, spends spare cycles zeroing pages ahead of time and collecting remotely freed slab objects
+    auto& globalPageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    while (1) {
+        bool busy = globalPageFrameAllocator.refillZeroedPagePool();
+        busy |= SlabAllocator::get().collectRemoteFrees() > 0;
+
+        if (!busy) {
+            __asm__ volatile("nop");
+        }
+    }
 }
@@ -9,6 +9,9 @@
 #define APIC_ICR_LO 0x300  
 #define APIC_ICR_HI 0x310
 
+// Set in the low ICR dword while the previous IPI hasn't been accepted yet
+#define APIC_ICR_DELIVERY_PENDING (1 << 12)
+
 class Apic {
 public:
     static void initializeLocalApic();
@@ -324,6 +324,7 @@ __asm_ctx_switch_no_irq:
 .global __asm_irq_handler_13
 .global __asm_irq_handler_14
 .global __asm_irq_handler_15
+.global __asm_irq_handler_16
 
 # ----------- EXCEPTIONS ----------- #
 __asm_exc_handler_div:
@@ -517,4 +518,9 @@ __asm_irq_handler_15:
     push 47
     jmp __asm_common_isr_entry
 
+__asm_irq_handler_16:
+    push 0
+    push 48
+    jmp __asm_common_isr_entry
+
 .section .note.GNU-stack,"",@progbits
@@ -17,13 +17,19 @@
 #define CPUID_FEAT_EDX_PGE         (1 << 13)
 #define CPUID_FEAT_EDX_PAT         (1 << 16)
 
+// Feature bits in EDX for CPUID with EAX=0x80000001
+#define CPUID_EXT_FEAT_EDX_PAGE1GB (1 << 26)
+#define CPUID_EXT_FEAT_EDX_RDTSCP  (1 << 27)
+
 // Feature bits in ECX for CPUID with EAX=1
 #define CPUID_FEAT_ECX_SSE3        (1 << 0)
 #define CPUID_FEAT_ECX_VMX         (1 << 5)
+#define CPUID_FEAT_ECX_PCID        (1 << 17)
 
 // Feature bits in ECX for CPUID with EAX=7, ECX=0
 #define CPUID_FEAT_ECX_FSGSBASE    (1 << 0)
 #define CPUID_FEAT_ECX_LA57        (1 << 16)  // 5-level paging
+#define CPUID_FEAT_ECX_RDPID       (1 << 22)
 
 // SSE (Streaming SIMD Extensions) Feature Bit
 #define CPUID_EDX_SSE         0x02000000
@@ -68,6 +74,17 @@ static inline int cpuid_isLa57Supported() {
     return (a & CPUID_FEAT_ECX_LA57) != 0;
 }
 
+//
+// Returns the initial local APIC ID of the executing core, which the kernel
+// also uses as the cpu index. Unlike getCurrentCpuId() this doesn't require
+// elevating since cpuid is available to lowered code as well.
+//
+static inline uint8_t cpuid_readInitialApicId() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(CPUID_FEATURES));
+    return (uint8_t)(ebx >> 24);
+}
+
 // Reads the Vendor ID into the specified buffer.
 // *Note: vendor buffer should be at least 13 bytes in size
 __PRIVILEGED_CODE
@@ -122,4 +139,44 @@ static inline bool cpuid_isPATSupported() {
     return (edx & CPUID_FEAT_EDX_PAT) != 0;
 }
 
+// Returns whether or not translations can be marked global through CR4.PGE
+__PRIVILEGED_CODE
+static inline bool cpuid_isPgeSupported() {
+    uint32_t eax, edx;
+    readCpuid(CPUID_FEATURES, &eax, &edx);
+    return (edx & CPUID_FEAT_EDX_PGE) != 0;
+}
+
+// Returns whether or not cr3 can tag TLB entries with process-context identifiers
+__PRIVILEGED_CODE
+static inline bool cpuid_isPcidSupported() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(CPUID_FEATURES),"c"(0));
+    return (ecx & CPUID_FEAT_ECX_PCID) != 0;
+}
+
+// Returns whether or not 1GB leaf entries are supported in PDPTs
+__PRIVILEGED_CODE
+static inline bool cpuid_is1GbPageSupported() {
+    uint32_t eax, edx;
+    readCpuidExtended(CPUID_EXTENDED_FEATURES, &eax, &edx);
+    return (edx & CPUID_EXT_FEAT_EDX_PAGE1GB) != 0;
+}
+
+// Returns whether or not rdtscp (and with it IA32_TSC_AUX) is supported
+__PRIVILEGED_CODE
+static inline bool cpuid_isRdtscpSupported() {
+    uint32_t eax, edx;
+    readCpuidExtended(CPUID_EXTENDED_FEATURES, &eax, &edx);
+    return (edx & CPUID_EXT_FEAT_EDX_RDTSCP) != 0;
+}
+
+// Returns whether or not rdpid can read IA32_TSC_AUX without the timestamp
+__PRIVILEGED_CODE
+static inline bool cpuid_isRdpidSupported() {
+    uint32_t eax, ebx, ecx, edx;
+    asm volatile("cpuid":"=a"(eax),"=b"(ebx),"=c"(ecx),"=d"(edx):"a"(7),"c"(0));
+    return (ecx & CPUID_FEAT_ECX_RDPID) != 0;
+}
+
 #endif
@@ -10,6 +10,7 @@
 
 #define IA32_GS_BASE        0xC0000101
 #define IA32_KERNEL_GS_BASE 0xC0000102
+#define IA32_TSC_AUX        0xC0000103
 
 #define IA32_MTRRCAP          0xFE
 #define IA32_MTRR_DEF_TYPE    0x2FF
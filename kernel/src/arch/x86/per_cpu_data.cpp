@@ -1,3 +1,22 @@
 #include "per_cpu_data.h"
+#include "msr.h"
 
 PerCpuData __per_cpu_data = {};
+
+CpuIndexSource g_cpuIndexSource = CpuIndexSource::Cpuid;
+
+__PRIVILEGED_CODE
+void setCurrentCpuIndex(uint8_t cpu) {
+    // All cpus share the same feature set, the bootstrapping core picks the instruction
+    if (cpu == BSP_CPU_ID) {
+        if (cpuid_isRdpidSupported()) {
+            g_cpuIndexSource = CpuIndexSource::Rdpid;
+        } else if (cpuid_isRdtscpSupported()) {
+            g_cpuIndexSource = CpuIndexSource::Rdtscp;
+        }
+    }
+
+    if (g_cpuIndexSource != CpuIndexSource::Cpuid) {
+        writeMsr(IA32_TSC_AUX, cpu);
+    }
+}
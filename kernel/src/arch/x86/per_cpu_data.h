@@ -1,6 +1,7 @@
 #ifndef PER_CPU_DATA_H
 #define PER_CPU_DATA_H
 #include <process/process.h>
+#include "cpuid.h"
 
 #define MAX_CPUS 64
 
@@ -35,4 +36,51 @@ static __attribute__((always_inline)) inline PCB* getCurrentTask() {
 
 #define current getCurrentTask()
 
+// Instruction getCurrentCpuIndex() reads the logical cpu index with
+enum class CpuIndexSource : uint8_t {
+    // Falls back to the initial APIC ID, cpuid is serializing and traps under a hypervisor
+    Cpuid = 0,
+
+    // IA32_TSC_AUX through rdtscp, which also reads the timestamp counter
+    Rdtscp,
+
+    // IA32_TSC_AUX through rdpid
+    Rdpid
+};
+
+extern CpuIndexSource g_cpuIndexSource;
+
+//
+// Stores the per-cpu data slot of the calling cpu in IA32_TSC_AUX. Unlike
+// the gs-relative per-cpu data, which is swapped out while the kernel runs
+// lowered, rdpid and rdtscp can read it from lowered code as well. Has to
+// run on every cpu before it touches any of the per-cpu allocator caches.
+//
+__PRIVILEGED_CODE
+void setCurrentCpuIndex(uint8_t cpu);
+
+// Logical index of the executing cpu, always below MAX_CPUS
+static __attribute__((always_inline)) inline uint8_t getCurrentCpuIndex() {
+    uint64_t index;
+
+    switch (g_cpuIndexSource) {
+    case CpuIndexSource::Rdpid: {
+        asm volatile ("rdpid %0" : "=r" (index));
+        break;
+    }
+    case CpuIndexSource::Rdtscp: {
+        uint32_t lo, hi, aux;
+        asm volatile ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+        index = aux;
+        break;
+    }
+    default: {
+        index = cpuid_readInitialApicId();
+        break;
+    }
+    }
+
+    return (index < MAX_CPUS) ? static_cast<uint8_t>(index) : BSP_CPU_ID;
+}
+
 #endif
@@ -84,3 +84,23 @@ void x86_cpu_pge_enable() {
     __write_cr4(cr4);
 }
 
+__PRIVILEGED_CODE
+bool x86_cpu_is_pge_enabled() {
+    return (__read_cr4() & CR4_PGE) != 0;
+}
+
+__PRIVILEGED_CODE
+void x86_cpu_pcid_enable() {
+    uint64_t cr4 = __read_cr4();
+
+    // Set the PCID Enable (PCIDE) bit
+    cr4 |= CR4_PCIDE;
+
+    __write_cr4(cr4);
+}
+
+__PRIVILEGED_CODE
+bool x86_cpu_is_pcid_enabled() {
+    return (__read_cr4() & CR4_PCIDE) != 0;
+}
+
@@ -52,4 +52,14 @@ void x86_cpu_pge_clear();
 __PRIVILEGED_CODE
 void x86_cpu_pge_enable();
 
+__PRIVILEGED_CODE
+bool x86_cpu_is_pge_enabled();
+
+// Requires the PCID bits of cr3 to be 0 at the time PCIDs get enabled
+__PRIVILEGED_CODE
+void x86_cpu_pcid_enable();
+
+__PRIVILEGED_CODE
+bool x86_cpu_is_pcid_enabled();
+
 #endif
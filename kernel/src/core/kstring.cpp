@@ -308,27 +308,48 @@ namespace kstl {
         size_t currentLength = this->length();
         size_t newLength = currentLength + len;
 
+        // The source can be (a suffix of) this string, which moves along with a reallocated buffer
+        uint64_t buffer = reinterpret_cast<uint64_t>(data());
+        uint64_t source = reinterpret_cast<uint64_t>(str);
+        bool selfAppend = source >= buffer && source <= buffer + currentLength;
+
         if (newLength < SSO_SIZE) {
             // Append within SSO buffer
-            memcpy(m_ssoBuffer + currentLength, str, len + 1); // +1 for null terminator
+            memcpy(m_ssoBuffer + currentLength, str, len);
+            m_ssoBuffer[newLength] = '\0';
         } else {
             if (!m_isUsingSSOBuffer && newLength < m_capacity) {
-                // Append in existing heap space
-                memcpy(m_data + currentLength, str, len + 1); // +1 for null terminator
+                // Append in existing heap space, the terminator is written last as the source may end on it
+                memcpy(m_data + currentLength, str, len);
+                m_data[newLength] = '\0';
             } else {
-                // Allocate new heap space
                 size_t newCapacity = newLength + 1; // +1 for null terminator
-                char* newData = static_cast<char*>(kmalloc(newCapacity));
-
-                // Copy old data to new data
-                memcpy(newData, m_isUsingSSOBuffer ? m_ssoBuffer : m_data, currentLength);
-                memcpy(newData + currentLength, str, len + 1); // +1 for null terminator
-
-                if (!m_isUsingSSOBuffer) {
-                    // Free old heap data
-                    kfree(m_data);
+                char* newData;
+
+                if (m_isUsingSSOBuffer) {
+                    // Allocate new heap space and copy the SSO buffer over
+                    newData = static_cast<char*>(kmalloc(newCapacity));
+                    if (!newData) {
+                        return;
+                    }
+
+                    memcpy(newData, m_ssoBuffer, currentLength);
+                } else {
+                    // Let the heap grow the existing buffer in place if it can
+                    newData = static_cast<char*>(krealloc(m_data, newCapacity));
+                    if (!newData) {
+                        return;
+                    }
+
+                    // The old buffer is gone, the source has to be read from the new one
+                    if (selfAppend) {
+                        str = newData + (source - buffer);
+                    }
                 }
 
+                memcpy(newData + currentLength, str, len);
+                newData[newLength] = '\0';
+
                 // Update data pointer and size/capacity
                 m_data = newData;
                 m_size = newLength;
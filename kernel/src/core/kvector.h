@@ -328,6 +328,18 @@ void vector<T>::clear() {
 
 template <typename T>
 void vector<T>::_reallocate(size_t newCapacity) {
+    // Primitive elements can be moved bytewise, letting the heap grow the block in place
+    if constexpr (is_primitive<T>::value) {
+        T* newBlock = static_cast<T*>(krealloc(m_data, newCapacity * sizeof(T)));
+
+        if (newBlock) {
+            m_data = newBlock;
+            m_capacity = newCapacity;
+        }
+
+        return;
+    }
+
     T* newBlock = static_cast<T*>(kmalloc(newCapacity * sizeof(T)));
 
     if (newBlock) {
@@ -20,6 +20,17 @@ static inline void acquireSpinlock(Spinlock* lock) {
     __sync_synchronize();
 }
 
+// Attempt to acquire the lock without spinning, returns true on success
+static inline bool tryAcquireSpinlock(Spinlock* lock) {
+    if (__sync_lock_test_and_set(&lock->lockVar, 1)) {
+        return false;
+    }
+
+    // Memory barrier to prevent reordering
+    __sync_synchronize();
+    return true;
+}
+
 // Release the lock
 static inline void releaseSpinlock(Spinlock* lock) {
     // Memory barrier to prevent reordering
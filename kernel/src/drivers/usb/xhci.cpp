@@ -3,6 +3,8 @@
 #include <paging/phys_addr_translation.h>
 #include <paging/tlb.h>
 #include <memory/kmemory.h>
+#include <memory/dma.h>
+#include <memory/object_cache.h>
 #include <time/ktime.h>
 #include <arch/x86/ioapic.h>
 #include <interrupts/interrupts.h>
@@ -11,24 +13,30 @@
 namespace drivers {
     XhciDriver g_globalXhciInstance;
 
-    void* _allocXhciMemory(size_t size, size_t alignment = 64, size_t boundary = PAGE_SIZE) {
-        // Allocate extra memory to ensure we can align the block within the boundary
-        size_t totalSize = size + boundary - 1;
-        void* memblock = kmallocAligned(totalSize, alignment);
+    kstl::ObjectCache<XhciCommandRing> g_xhciCommandRingCache("xhci_command_ring", nullptr, OBJECT_CACHE_ALIGN_CACHELINE);
+    kstl::ObjectCache<XhciEventRing> g_xhciEventRingCache("xhci_event_ring", nullptr, OBJECT_CACHE_ALIGN_CACHELINE);
+    kstl::ObjectCache<XhciTransferRing> g_xhciTransferRingCache("xhci_transfer_ring", nullptr, OBJECT_CACHE_ALIGN_CACHELINE);
+
+    // Zeroed uncacheable memory shared with the controller, addressable by the controller
+    DmaBuffer _allocXhciMemory(size_t size, size_t alignment = 64, size_t boundary = PAGE_SIZE) {
+        DmaAddressLimit addressLimit = XhciDriver::get().is64bitAddressingCapable()
+            ? DmaAddressLimit::Any
+            : DmaAddressLimit::Below4GB;
+
+        DmaBuffer buffer = DmaAllocator::get().allocate(
+            size,
+            alignment,
+            boundary,
+            addressLimit,
+            DmaCacheAttribute::Uncacheable
+        );
 
-        if (!memblock) {
+        if (!buffer.virtualBase) {
             kuPrint("[XHCI] ======= MEMORY ALLOCATION PROBLEM =======\n");
             while (true);
         }
 
-        // Align the memory block to the specified boundary
-        size_t alignedAddress = ((size_t)memblock + boundary - 1) & ~(boundary - 1);
-        void* aligned = (void*)alignedAddress;
-
-        // Mark the aligned memory block as uncacheable
-        paging::markPageUncacheable(aligned);
-
-        return aligned;
+        return buffer;
     }
 
     const char* extendedCapabilityToString(XhciExtendedCapabilityCode capid) {
@@ -227,6 +235,15 @@ namespace drivers {
         ringDoorbell(doorbell, XHCI_DOORBELL_TARGET_CONTROL_EP_RING);
     }
 
+    void* XhciCommandRing::operator new(size_t size) {
+        (void)size;
+        return g_xhciCommandRingCache.allocate();
+    }
+
+    void XhciCommandRing::operator delete(void* ptr) {
+        g_xhciCommandRingCache.free(static_cast<XhciCommandRing*>(ptr));
+    }
+
     XhciCommandRing::XhciCommandRing(size_t maxTrbs) {
         m_maxTrbCount = maxTrbs;
         m_rcsBit = XHCI_CRCR_RING_CYCLE_STATE;
@@ -235,17 +252,14 @@ namespace drivers {
         const uint64_t ringSize = maxTrbs * sizeof(XhciTrb_t);
 
         // Create the command ring memory block
-        m_trbRing = (XhciTrb_t*)_allocXhciMemory(
+        DmaBuffer ringBuffer = _allocXhciMemory(
             ringSize,
             XHCI_COMMAND_RING_SEGMENTS_ALIGNMENT,
             XHCI_COMMAND_RING_SEGMENTS_BOUNDARY
         );
 
-        // Zero out the memory by default
-        zeromem(m_trbRing, ringSize);
-
-        // Get the physical mapping
-        m_physicalRingBase = (uint64_t)__pa(m_trbRing);
+        m_trbRing = (XhciTrb_t*)ringBuffer.virtualBase;
+        m_physicalRingBase = ringBuffer.physicalBase;
 
         // Set the last TRB as a link TRB to point back to the first TRB
         m_trbRing[255].parameter = m_physicalRingBase;
@@ -267,6 +281,15 @@ namespace drivers {
         }
     }
 
+    void* XhciEventRing::operator new(size_t size) {
+        (void)size;
+        return g_xhciEventRingCache.allocate();
+    }
+
+    void XhciEventRing::operator delete(void* ptr) {
+        g_xhciEventRingCache.free(static_cast<XhciEventRing*>(ptr));
+    }
+
     XhciEventRing::XhciEventRing(size_t maxTrbs, XhciInterrupterRegisters* primaryInterrupterRegisters) {
         m_interrupterRegs = primaryInterrupterRegisters;
         m_segmentTrbCount = maxTrbs;
@@ -277,27 +300,24 @@ namespace drivers {
         const uint64_t eventRingSegmentTableSize = m_segmentCount * sizeof(XhciErstEntry);
 
         // Create the event ring segment memory block
-        m_primarySegmentRing = (XhciTrb_t*)_allocXhciMemory(
+        DmaBuffer segmentBuffer = _allocXhciMemory(
             eventRingSegmentSize,
             XHCI_EVENT_RING_SEGMENTS_ALIGNMENT,
             XHCI_EVENT_RING_SEGMENTS_BOUNDARY
         );
 
-        // Zero out the memory by default
-        zeromem(m_primarySegmentRing, eventRingSegmentSize);
-
-        // Get the physical mapping to the main event ring segment
-        m_primarySegmentPhysicalBase = (uint64_t)__pa(m_primarySegmentRing);
+        m_primarySegmentRing = (XhciTrb_t*)segmentBuffer.virtualBase;
+        m_primarySegmentPhysicalBase = segmentBuffer.physicalBase;
 
         // Create the event ring segment table
-        m_segmentTable = (XhciErstEntry*)_allocXhciMemory(
+        DmaBuffer segmentTableBuffer = _allocXhciMemory(
             eventRingSegmentTableSize,
             XHCI_EVENT_RING_SEGMENT_TABLE_ALIGNMENT,
             XHCI_EVENT_RING_SEGMENT_TABLE_BOUNDARY
         );
 
-        // Get the physical mapping to the segment table
-        m_segmentTablePhysicalBase = (uint64_t)__pa(m_segmentTable);
+        m_segmentTable = (XhciErstEntry*)segmentTableBuffer.virtualBase;
+        m_segmentTablePhysicalBase = segmentTableBuffer.physicalBase;
 
         // Construct the segment table entry
         XhciErstEntry entry;
@@ -368,6 +388,15 @@ namespace drivers {
         return ret;
     }
 
+    void* XhciTransferRing::operator new(size_t size) {
+        (void)size;
+        return g_xhciTransferRingCache.allocate();
+    }
+
+    void XhciTransferRing::operator delete(void* ptr) {
+        g_xhciTransferRingCache.free(static_cast<XhciTransferRing*>(ptr));
+    }
+
     XhciTransferRing::XhciTransferRing(size_t maxTrbs, uint8_t doorbellId) {
         m_maxTrbCount = maxTrbs;
         m_dcsBit = 1;
@@ -378,17 +407,14 @@ namespace drivers {
         const uint64_t ringSize = maxTrbs * sizeof(XhciTrb_t);
 
         // Create the transfer ring memory block
-        m_trbRing = (XhciTrb_t*)_allocXhciMemory(
+        DmaBuffer ringBuffer = _allocXhciMemory(
             ringSize,
             XHCI_TRANSFER_RING_SEGMENTS_ALIGNMENT,
             XHCI_TRANSFER_RING_SEGMENTS_BOUNDARY
         );
 
-        // Zero out the memory by default
-        zeromem(m_trbRing, ringSize);
-
-        // Get the physical mapping
-        m_physicalRingBase = (uint64_t)__pa(m_trbRing);
+        m_trbRing = (XhciTrb_t*)ringBuffer.virtualBase;
+        m_physicalRingBase = ringBuffer.physicalBase;
 
         // Set the last TRB as a link TRB to point back to the first TRB
         m_trbRing[255].parameter = m_physicalRingBase;
@@ -641,11 +667,11 @@ namespace drivers {
     }
 
     void XhciDriver::_setupDcbaa() {
-        size_t contextEntrySize = m_64ByteContextSize ? 64 : 32;
-        size_t dcbaaSize = contextEntrySize * (m_maxDeviceSlots + 1);
+        // Every DCBAA entry is a 64-bit pointer to a device context
+        size_t dcbaaSize = sizeof(uint64_t) * (m_maxDeviceSlots + 1);
 
-        m_dcbaa = (uint64_t*)_allocXhciMemory(dcbaaSize, XHCI_DEVICE_CONTEXT_ALIGNMENT, XHCI_DEVICE_CONTEXT_BOUNDARY);
-        zeromem(m_dcbaa, dcbaaSize);
+        DmaBuffer dcbaaBuffer = _allocXhciMemory(dcbaaSize, XHCI_DEVICE_CONTEXT_ALIGNMENT, XHCI_DEVICE_CONTEXT_BOUNDARY);
+        m_dcbaa = (uint64_t*)dcbaaBuffer.virtualBase;
 
         /*
         // xHci Spec Section 6.1 (page 404)
@@ -659,26 +685,25 @@ namespace drivers {
 
         // Initialize scratchpad buffer array if needed
         if (m_maxScratchpadBuffers > 0) {
-            uint64_t* scratchpadArray = (uint64_t*)_allocXhciMemory(m_maxScratchpadBuffers * sizeof(uint64_t));
+            DmaBuffer scratchpadArrayBuffer = _allocXhciMemory(
+                m_maxScratchpadBuffers * sizeof(uint64_t),
+                XHCI_SCRATCHPAD_BUFFER_ARRAY_ALIGNMENT,
+                XHCI_SCRATCHPAD_BUFFER_ARRAY_BOUNDARY
+            );
+            uint64_t* scratchpadArray = (uint64_t*)scratchpadArrayBuffer.virtualBase;
             
             // Create scratchpad pages
             for (uint8_t i = 0; i < m_maxScratchpadBuffers; i++) {
-                void* scratchpad = _allocXhciMemory(PAGE_SIZE, XHCI_SCRATCHPAD_BUFFERS_ALIGNMENT, XHCI_SCRATCHPAD_BUFFERS_BOUNDARY);
-                uint64_t scratchpadPhysicalBase = (uint64_t)__pa(scratchpad);
-
-                scratchpadArray[i] = scratchpadPhysicalBase;
+                DmaBuffer scratchpad = _allocXhciMemory(PAGE_SIZE, XHCI_SCRATCHPAD_BUFFERS_ALIGNMENT, XHCI_SCRATCHPAD_BUFFERS_BOUNDARY);
+                scratchpadArray[i] = scratchpad.physicalBase;
             }
 
-            uint64_t scratchpadArrayPhysicalBase = (uint64_t)__pa(scratchpadArray);
-
             // Set the first slot in the DCBAA to point to the scratchpad array
-            m_dcbaa[0] = scratchpadArrayPhysicalBase;
+            m_dcbaa[0] = scratchpadArrayBuffer.physicalBase;
         }
 
         // Set DCBAA pointer in the operational registers
-        uint64_t dcbaaPhysicalBase = (uint64_t)__pa(m_dcbaa);
-
-        m_opRegs->dcbaap = dcbaaPhysicalBase;
+        m_opRegs->dcbaap = dcbaaBuffer.physicalBase;
     }
 
     void XhciDriver::_createDeviceContext(uint8_t slotId) {
@@ -686,24 +711,21 @@ namespace drivers {
         // based on the capability register parameters.
         uint64_t deviceContextSize = m_64ByteContextSize ? sizeof(XhciDeviceContext64) : sizeof(XhciDeviceContext32);
 
-        // Allocate a memory block for the device context
-        void* ctx = _allocXhciMemory(
+        // Allocate a zeroed memory block for the device context
+        DmaBuffer ctx = _allocXhciMemory(
             deviceContextSize,
             XHCI_DEVICE_CONTEXT_ALIGNMENT,
             XHCI_DEVICE_CONTEXT_BOUNDARY
         );
 
-        if (!ctx) {
+        if (!ctx.virtualBase) {
             kprintError("[*] CRITICAL FAILURE: Failed to allocate memory for a device context\n");
             return;
         }
 
-        // Zero out the device context memory by default
-        zeromem(ctx, sizeof(deviceContextSize));
-
         // Insert the device context's physical address
         // into the Device Context Base Addres Array (DCBAA).
-        m_dcbaa[slotId] = (uint64_t)__pa(ctx);
+        m_dcbaa[slotId] = ctx.physicalBase;
     }
 
     XhciCommandCompletionTrb_t* XhciDriver::_sendXhciCommand(XhciTrb_t* trb) {
@@ -750,12 +772,8 @@ namespace drivers {
 
     void XhciDriver::_mapDeviceMmio(uint64_t pciBarAddress) {
         // Map a conservatively large space for xHCI registers
-        for (size_t offset = 0; offset < 0x20000; offset += PAGE_SIZE) {
-            void* mmioPage = (void*)(pciBarAddress + offset);
-            paging::mapPage(mmioPage, mmioPage, KERNEL_PAGE, PAGE_ATTRIB_CACHE_DISABLED, paging::g_kernelRootPageTable);
-        }
-
-        paging::flushTlbAll();
+        void* mmioBase = (void*)pciBarAddress;
+        paging::mapPages(mmioBase, mmioBase, 0x20000 / PAGE_SIZE, KERNEL_PAGE, PAGE_ATTRIB_CACHE_DISABLED, paging::g_kernelRootPageTable);
 
         m_xhcBase = pciBarAddress;
     }
@@ -930,12 +948,12 @@ namespace drivers {
         uint64_t inputContextSize = m_64ByteContextSize ? sizeof(XhciInputContext64) : sizeof(XhciInputContext32);
 
         // Allocate and zero out the input context
-        void* inputCtxBuffer = (XhciInputContext32*)_allocXhciMemory(
+        DmaBuffer inputCtxDmaBuffer = _allocXhciMemory(
             inputContextSize,
             XHCI_INPUT_CONTROL_CONTEXT_ALIGNMENT,
             XHCI_INPUT_CONTROL_CONTEXT_BOUNDARY
         );
-        zeromem(inputCtxBuffer, inputContextSize);
+        void* inputCtxBuffer = inputCtxDmaBuffer.virtualBase;
 
         if (m_64ByteContextSize) {
             XhciInputContext64* inputContext = (XhciInputContext64*)inputCtxBuffer;
@@ -988,7 +1006,7 @@ namespace drivers {
         }
 
         // Get the physical address of the input context
-        uint64_t inputContextPhysicalBase = (uint64_t)__pa(inputCtxBuffer);
+        uint64_t inputContextPhysicalBase = inputCtxDmaBuffer.physicalBase;
 
         // Construct the Address Device TRB
         XhciAddressDeviceCommandTrb_t addressDeviceTrb;
@@ -1032,10 +1050,10 @@ namespace drivers {
         kprintInfo("TRDP: 0x%llx\n", deviceContext->controlEndpointContext.transferRingDequeuePtr);
 
         // Buffer to hold the bytes received from GET_DESCRIPTOR command
-        uint8_t* descriptorBuffer = (uint8_t*)_allocXhciMemory(64, 128, 64);
+        DmaBuffer descriptorDmaBuffer = _allocXhciMemory(64, 128, 64);
 
         // Buffer to hold the bytes received from GET_DESCRIPTOR command
-        uint8_t* transferStatusBuffer = (uint8_t*)_allocXhciMemory(64, 16, 16);
+        DmaBuffer transferStatusDmaBuffer = _allocXhciMemory(64, 16);
 
         // Construct the Setup Stage TRB
         XhciSetupStageTrb_t setupStageTrb;
@@ -1064,7 +1082,7 @@ namespace drivers {
         dataStageTrb.ent = 1;
         dataStageTrb.chain = 1;
         dataStageTrb.dir = 1;
-        dataStageTrb.dataBuffer = (uint64_t)__pa(descriptorBuffer);
+        dataStageTrb.dataBuffer = descriptorDmaBuffer.physicalBase;
 
         // Construct the first Event Data TRB
         XhciEventDataTrb_t eventDataTrb;
@@ -1074,7 +1092,7 @@ namespace drivers {
         eventDataTrb.interrupterTarget = 0;
         eventDataTrb.chain = 0;
         eventDataTrb.ioc = 1;
-        eventDataTrb.eventData = (uint64_t)__pa(transferStatusBuffer);
+        eventDataTrb.eventData = transferStatusDmaBuffer.physicalBase;
 
         // Small delay period between ringing the
         // doorbell and polling the event ring.
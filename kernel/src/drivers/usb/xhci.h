@@ -3125,6 +3125,10 @@ class XhciCommandRing {
 public:
     XhciCommandRing(size_t maxTrbs);
 
+    // Ring objects come out of a dedicated object cache
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     inline uint64_t getVirtualBase() const { return (uint64_t)m_trbRing; }
     inline uint64_t getPhysicalBase() const { return m_physicalRingBase; }
     inline uint8_t  getCycleBit() const { return m_rcsBit; }
@@ -3144,6 +3148,9 @@ class XhciEventRing {
 public:
     XhciEventRing(size_t maxTrbs, XhciInterrupterRegisters* primaryInterrupterRegisters);
 
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     inline uint64_t getVirtualBase() const { return (uint64_t)m_primarySegmentRing; }
     inline uint64_t getPhysicalBase() const { return m_primarySegmentPhysicalBase; }
     inline uint8_t  getCycleBit() const { return m_rcsBit; }
@@ -3177,6 +3184,9 @@ class XhciTransferRing {
 public:
     XhciTransferRing(size_t maxTrbs, uint8_t doorbellId);
 
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
     inline uint64_t getVirtualBase() const { return (uint64_t)m_trbRing; }
     inline uint64_t getPhysicalBase() const { return m_physicalRingBase; }
     inline uint8_t  getCycleBit() const { return m_dcsBit; }
@@ -3204,6 +3214,8 @@ public:
 
     bool init(PciDeviceInfo& deviceInfo);
 
+    inline bool is64bitAddressingCapable() const { return m_64bitAddressingCapability; }
+
 private:
     uint64_t m_xhcBase;
 
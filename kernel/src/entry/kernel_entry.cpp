@@ -1,11 +1,14 @@
 #include "entry_params.h"
 #include <memory/kmemory.h>
+#include <memory/vmalloc.h>
+#include <memory/slab.h>
 #include <graphics/kdisplay.h>
 #include <gdt/gdt.h>
 #include <paging/phys_addr_translation.h>
 #include <paging/page.h>
 #include <ports/serial.h>
 #include <paging/tlb.h>
+#include <paging/pcid.h>
 #include <interrupts/idt.h>
 #include <arch/x86/cpuid.h>
 #include <arch/x86/msr.h>
@@ -15,6 +18,7 @@
 #include <arch/x86/gsfsbase.h>
 #include <arch/x86/pat.h>
 #include <arch/x86/ap_startup.h>
+#include <arch/x86/x86_cpu_control.h>
 #include <sched/sched.h>
 #include <syscall/syscalls.h>
 #include <kelevate/kelevate.h>
@@ -30,6 +34,11 @@
 // #define KE_TEST_CPU_TEMP_READINGS
 // #define KE_TEST_PRINT_CURRENT_TIME
 // #define KE_TEST_GRAPHICS
+// #define KE_TEST_PAGE_ALLOC_BENCHMARK
+// #define KE_TEST_HEAP_BENCHMARK
+// #define KE_TEST_HEAP_PROFILER
+// #define KE_TEST_CONTEXT_SWITCH_BENCHMARK
+// #define KE_TEST_TLB_SHOOTDOWN
 
 EXTERN_C __PRIVILEGED_CODE void _kentry(KernelEntryParams* params);
 extern uint64_t __kern_phys_base;
@@ -55,6 +64,9 @@ __PRIVILEGED_CODE void _kentry(KernelEntryParams* params) {
     // First thing we have to take care of
     // is setting up the Global Descriptor Table.
     initializeAndInstallGDT(BSP_CPU_ID, (void*)kernelStackTop);
+
+    // Make the cpu index readable for the per-cpu allocator caches
+    setCurrentCpuIndex(BSP_CPU_ID);
     
     // Enable the syscall functionality
     enableSyscallInterface();
@@ -106,6 +118,14 @@ void _kuser_entry() {
 
         // Update the root pml4 page table
         paging::g_kernelRootPageTable = paging::getCurrentTopLevelPageTable();
+
+        // Tag the TLB entries with PCIDs (if supported)
+        paging::enablePcid();
+
+        // Keep the global kernel half translations cached across cr3 writes
+        if (cpuid_isPgeSupported()) {
+            x86_cpu_pge_enable();
+        }
     });
 
     globalPageFrameAllocator.lockPage(&g_kernelEntryParameters);
@@ -137,6 +157,11 @@ void _kuser_entry() {
     kuPrint("System total memory : %llu MB\n", globalPageFrameAllocator.getTotalSystemMemory() / 1024 / 1024);
     kuPrint("System free memory  : %llu MB\n", globalPageFrameAllocator.getFreeSystemMemory() / 1024 / 1024);
     kuPrint("System used memory  : %llu MB\n", globalPageFrameAllocator.getUsedSystemMemory() / 1024 / 1024);
+    kuPrint("Memory map ingested in %llu cycles\n", globalPageFrameAllocator.getMemoryMapIngestionCycles());
+    kuPrint("Kernel heap         : %llu KB committed, %llu MB reserved\n",
+        DynamicMemoryAllocator::get().getCommittedSize() / 1024, DynamicMemoryAllocator::get().getReservedSize() / 1024 / 1024);
+    kuPrint("Vmalloc area        : %llu KB mapped in %llu areas\n",
+        VmallocAllocator::get().getStats().mappedBytes / 1024, VmallocAllocator::get().getStats().areaCount);
 
     kuPrint("The kernel is loaded at:\n");
     kuPrint("    Physical : 0x%llx\n", (uint64_t)__kern_phys_base);
@@ -145,12 +170,35 @@ void _kuser_entry() {
 
     Apic::initializeLocalApic();
 
+    // The BSP can take part in TLB shootdowns once its LAPIC is up
+    RUN_ELEVATED({
+        paging::registerTlbShootdownCpu();
+    });
+
     auto& acpiController = AcpiController::get();
 
     RUN_ELEVATED({
         acpiController.init(g_kernelEntryParameters.rsdp);
+
+        // Split physical memory into per-node zones if the firmware describes NUMA topology
+        if (acpiController.hasSratTable()) {
+            globalPageFrameAllocator.initializeNumaZones(
+                acpiController.getSratTable(),
+                acpiController.hasSlitTable() ? acpiController.getSlitTable() : nullptr
+            );
+        }
     });
 
+    // Give every NUMA node its own kmalloc arena
+    DynamicMemoryAllocator::initializeNodeHeaps();
+
+    for (uint8_t node = 0; node < globalPageFrameAllocator.getNodeCount(); ++node) {
+        paging::NumaNodeStats stats = globalPageFrameAllocator.getNodeStats(node);
+
+        kuPrint("NUMA node %u: total %llu MB, free %llu MB, used %llu MB\n",
+            (unsigned int)node, stats.totalMemory / 1024 / 1024, stats.freeMemory / 1024 / 1024, stats.usedMemory / 1024 / 1024);
+    }
+
     // Initialize high precision event timer and query hardware frequency
     KernelTimer::init();
 
@@ -205,6 +253,33 @@ void _kuser_entry() {
     ke_test_graphics();
 #endif
 
-    // Infinite loop
-    while (1) { __asm__ volatile("nop"); }
+#ifdef KE_TEST_PAGE_ALLOC_BENCHMARK
+    ke_test_page_alloc_benchmark();
+#endif
+
+#ifdef KE_TEST_HEAP_BENCHMARK
+    ke_test_heap_benchmark();
+#endif
+
+#ifdef KE_TEST_HEAP_PROFILER
+    ke_test_heap_profiler();
+#endif
+
+#ifdef KE_TEST_CONTEXT_SWITCH_BENCHMARK
+    ke_test_context_switch_benchmark();
+#endif
+
+#ifdef KE_TEST_TLB_SHOOTDOWN
+    ke_test_tlb_shootdown();
+#endif
+
+    // Idle loop, spends spare cycles zeroing pages ahead of time and collecting remotely freed slab objects
+    while (1) {
+        bool busy = globalPageFrameAllocator.refillZeroedPagePool();
+        busy |= SlabAllocator::get().collectRemoteFrees() > 0;
+
+        if (!busy) {
+            __asm__ volatile("nop");
+        }
+    }
 }
@@ -0,0 +1,121 @@
+#include "kernel_entry_tests.h"
+#include <core/kprint.h>
+#include <memory/kmemory.h>
+#include <paging/pcid.h>
+#include <arch/x86/per_cpu_data.h>
+#include <kelevate/kelevate.h>
+#include <time/ktime.h>
+
+#define CONTEXT_SWITCH_BENCHMARK_ITERATIONS 64
+
+// Pages touched between switches, roughly the working set of a task's timeslice
+#define CONTEXT_SWITCH_BENCHMARK_PAGES      256
+
+enum class AddressSpaceSwitchMode {
+    // What every switch used to do, cr3 gets rewritten and the TLB flushed
+    Flushing,
+
+    // cr3 gets rewritten with the no-flush bit set (requires PCIDs)
+    Preserving,
+
+    // Both tasks share the root page table and cr3 is left alone
+    Elided
+};
+
+struct ContextSwitchSample {
+    uint64_t switchCycles;
+    uint64_t refillCycles;
+};
+
+static void _touchPages(volatile uint8_t* buffer) {
+    for (uint64_t page = 0; page < CONTEXT_SWITCH_BENCHMARK_PAGES; ++page) {
+        buffer[page * PAGE_SIZE]++;
+    }
+}
+
+__PRIVILEGED_CODE
+static ContextSwitchSample _measureAddressSpaceSwitch(volatile uint8_t* buffer, AddressSpaceSwitchMode mode) {
+    paging::PageTable* pml4 = paging::getCurrentTopLevelPageTable();
+    uint16_t pcid = paging::getCurrentPcid();
+    int cpu = current->cpu;
+
+    ContextSwitchSample sample = { 0, 0 };
+
+    for (int it = 0; it < CONTEXT_SWITCH_BENCHMARK_ITERATIONS; ++it) {
+        // Warm up the TLB with the working set
+        _touchPages(buffer);
+
+        uint64_t start = rdtsc();
+        switch (mode) {
+        case AddressSpaceSwitchMode::Flushing: {
+            paging::setCurrentTopLevelPageTable(pml4, pcid, false);
+            break;
+        }
+        case AddressSpaceSwitchMode::Preserving: {
+            paging::setCurrentTopLevelPageTable(pml4, pcid, true);
+            break;
+        }
+        case AddressSpaceSwitchMode::Elided: {
+            paging::switchAddressSpace(cpu, pml4);
+            break;
+        }
+        default: break;
+        }
+        uint64_t switched = rdtsc();
+
+        // Every translation the switch dropped has to be walked again
+        _touchPages(buffer);
+
+        sample.switchCycles += switched - start;
+        sample.refillCycles += rdtsc() - switched;
+    }
+
+    // The flushing writes only dropped the current PCID
+    if (mode == AddressSpaceSwitchMode::Flushing) {
+        paging::invalidateInactivePcids();
+    }
+
+    sample.switchCycles /= CONTEXT_SWITCH_BENCHMARK_ITERATIONS;
+    sample.refillCycles /= CONTEXT_SWITCH_BENCHMARK_ITERATIONS;
+
+    return sample;
+}
+
+void ke_test_context_switch_benchmark() {
+    kuPrint("---- Context switch benchmark (%llu page working set) ----\n", (uint64_t)CONTEXT_SWITCH_BENCHMARK_PAGES);
+
+    volatile uint8_t* buffer = static_cast<volatile uint8_t*>(kmalloc(CONTEXT_SWITCH_BENCHMARK_PAGES * PAGE_SIZE));
+    if (!buffer) {
+        kuPrint("  failed to allocate the working set\n");
+        return;
+    }
+
+    const char* modeNames[] = { "flushing cr3 write", "no-flush cr3 write", "elided switch" };
+    bool pcidEnabled = false;
+
+    RUN_ELEVATED({
+        pcidEnabled = paging::isPcidEnabled();
+    });
+
+    kuPrint("  PCIDs: %s\n", pcidEnabled ? "enabled" : "not supported");
+
+    for (uint8_t mode = 0; mode < sizeof(modeNames) / sizeof(modeNames[0]); ++mode) {
+        if (static_cast<AddressSpaceSwitchMode>(mode) == AddressSpaceSwitchMode::Preserving && !pcidEnabled) {
+            continue;
+        }
+
+        ContextSwitchSample sample;
+        RUN_ELEVATED({
+            sample = _measureAddressSpaceSwitch(buffer, static_cast<AddressSpaceSwitchMode>(mode));
+        });
+
+        kuPrint("  %s: switch %llu cycles, TLB refill %llu cycles\n",
+            modeNames[mode], sample.switchCycles, sample.refillCycles);
+    }
+
+    kfree(const_cast<uint8_t*>(buffer));
+
+    paging::AddressSpaceSwitchStats stats = paging::getAddressSpaceSwitchStats();
+    kuPrint("  task switches: %llu elided, %llu preserving, %llu flushing\n",
+        stats.elidedSwitches, stats.preservingSwitches, stats.flushingSwitches);
+}
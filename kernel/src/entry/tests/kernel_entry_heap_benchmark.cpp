@@ -0,0 +1,285 @@
+#include "kernel_entry_tests.h"
+#include <core/kprint.h>
+#include <memory/kmemory.h>
+#include <memory/slab.h>
+#include <memory/object_cache.h>
+#include <paging/page_frame_allocator.h>
+#include <time/ktime.h>
+
+#define HEAP_BENCHMARK_ITERATIONS       128
+#define HEAP_BENCHMARK_MIXED_OBJECTS    128
+#define HEAP_BENCHMARK_MAX_CACHES       16
+
+// Stand-in for a typical hot kernel object
+struct HeapBenchmarkObject {
+    uint8_t data[192];
+};
+
+kstl::ObjectCache<HeapBenchmarkObject> g_heapBenchmarkObjectCache("heap_benchmark", nullptr, OBJECT_CACHE_ALIGN_CACHELINE);
+
+// Small deterministic generator for the mixed size workload
+static uint64_t _nextBenchmarkRandom(uint64_t* state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+static void _printObjectCacheStats() {
+    kstl::ObjectCacheStats cacheStats[HEAP_BENCHMARK_MAX_CACHES];
+    size_t cacheCount = kstl::ObjectCacheBase::getAllStats(cacheStats, HEAP_BENCHMARK_MAX_CACHES);
+
+    for (size_t i = 0; i < cacheCount && i < HEAP_BENCHMARK_MAX_CACHES; ++i) {
+        kstl::ObjectCacheStats& stats = cacheStats[i];
+
+        kuPrint("  cache %s: %llu byte objects, %llu/%llu active, %llu slabs, %llu%% hit rate\n",
+            stats.name, stats.objectSize, stats.activeObjects, stats.totalObjects, stats.slabCount,
+            stats.allocations ? stats.magazineHits * 100 / stats.allocations : 0);
+    }
+}
+
+void ke_test_heap_benchmark() {
+    auto& segmentHeap = DynamicMemoryAllocator::get();
+    auto& slabAllocator = SlabAllocator::get();
+
+    const size_t sizes[] = { 16, 48, 128, 512, 1024, 4096 };
+    void* objects[HEAP_BENCHMARK_MIXED_OBJECTS];
+
+    kuPrint("---- Kernel heap benchmark ----\n");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        size_t size = sizes[i];
+
+        // Latency of the first-fit segment heap that used to serve every kmalloc()
+        uint64_t start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            objects[it] = segmentHeap.allocate(size);
+        }
+        uint64_t segmentAllocCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            if (objects[it]) {
+                segmentHeap.free(objects[it]);
+            }
+        }
+        uint64_t segmentFreeCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        // Latency of kmalloc() served by the per-cpu slab caches
+        start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            objects[it] = kmalloc(size);
+        }
+        uint64_t slabAllocCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            kfree(objects[it]);
+        }
+        uint64_t slabFreeCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        kuPrint("  %llu bytes: segment heap alloc %llu / free %llu cycles, slab alloc %llu / free %llu cycles\n",
+            (uint64_t)size, segmentAllocCycles, segmentFreeCycles, slabAllocCycles, slabFreeCycles);
+    }
+
+    //
+    // Worst case segment heap latency with many live segments of mixed sizes,
+    // freed in an interleaved order to exercise merging with both neighbors.
+    //
+    uint64_t seed = 0x5354454c4c5558ULL;
+    uint64_t worstAllocCycles = 0;
+    uint64_t worstFreeCycles = 0;
+
+    for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+        size_t size = SLAB_MAX_OBJECT_SIZE + _nextBenchmarkRandom(&seed) % 0x10000;
+
+        uint64_t start = rdtsc();
+        objects[it] = segmentHeap.allocate(size);
+        uint64_t cycles = rdtsc() - start;
+
+        if (cycles > worstAllocCycles) {
+            worstAllocCycles = cycles;
+        }
+    }
+
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int it = pass; it < HEAP_BENCHMARK_ITERATIONS; it += 2) {
+            if (!objects[it]) {
+                continue;
+            }
+
+            uint64_t start = rdtsc();
+            segmentHeap.free(objects[it]);
+            uint64_t cycles = rdtsc() - start;
+
+            if (cycles > worstFreeCycles) {
+                worstFreeCycles = cycles;
+            }
+        }
+    }
+
+    kuPrint("  segment heap worst case: alloc %llu cycles, free %llu cycles (%s)\n",
+        worstAllocCycles, worstFreeCycles, segmentHeap.__detectHeapCorruption(false) ? "corrupted" : "consistent");
+
+    //
+    // Free latency of small segments under every validation level, and the
+    // memory a segment takes up on top of the payload it hands out.
+    //
+    const char* validationLevelNames[] = { "none", "canary", "full" };
+    HeapValidationLevel defaultValidationLevel = segmentHeap.getValidationLevel();
+
+    for (uint8_t level = 0; level < sizeof(validationLevelNames) / sizeof(validationLevelNames[0]); ++level) {
+        segmentHeap.setValidationLevel(static_cast<HeapValidationLevel>(level));
+
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            objects[it] = segmentHeap.allocate(64);
+        }
+
+        uint64_t start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            if (objects[it]) {
+                segmentHeap.free(objects[it]);
+            }
+        }
+        uint64_t validatedFreeCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        kuPrint("  %s validation: free %llu cycles\n", validationLevelNames[level], validatedFreeCycles);
+    }
+
+    segmentHeap.setValidationLevel(defaultValidationLevel);
+
+    kuPrint("  segment header %llu bytes, minimum segment %llu bytes\n",
+        (uint64_t)sizeof(HeapSegmentHeader), (uint64_t)KERNEL_HEAP_MIN_SEGMENT_SIZE);
+
+    // Natively aligned allocations released with plain kfree()
+    const size_t alignments[] = { 64, 256, PAGE_SIZE };
+    uint64_t misaligned = 0;
+
+    for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); ++i) {
+        uint64_t start = rdtsc();
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            objects[it] = kmallocAligned(SLAB_MAX_OBJECT_SIZE + it * 64, alignments[i]);
+
+            if (reinterpret_cast<uint64_t>(objects[it]) & (alignments[i] - 1)) {
+                misaligned++;
+            }
+        }
+        uint64_t alignedAllocCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+        for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+            kfree(objects[it]);
+        }
+
+        kuPrint("  %llu byte aligned alloc: %llu cycles\n", (uint64_t)alignments[i], alignedAllocCycles);
+    }
+
+    kuPrint("  aligned allocations: %llu misaligned, heap %s\n",
+        misaligned, segmentHeap.__detectHeapCorruption(false) ? "corrupted" : "consistent");
+
+    //
+    // Fragmentation of a mixed size workload with every other object freed,
+    // comparing the memory each allocator consumes for the surviving objects.
+    //
+    seed = 0x5354454c4c5558ULL;
+    uint64_t requestedBytes = 0;
+    uint64_t segmentBytes = 0;
+
+    // Objects sitting in the per-cpu caches count as allocated
+    slabAllocator.drainCpuCaches();
+    SlabAllocatorStats before = slabAllocator.getStats();
+
+    for (int it = 0; it < HEAP_BENCHMARK_MIXED_OBJECTS; ++it) {
+        size_t size = 8 + _nextBenchmarkRandom(&seed) % (SLAB_MAX_OBJECT_SIZE - 8);
+        objects[it] = kmalloc(size);
+
+        if (it % 2) {
+            requestedBytes += size;
+            segmentBytes += size + sizeof(HeapSegmentHeader);
+        }
+    }
+
+    for (int it = 0; it < HEAP_BENCHMARK_MIXED_OBJECTS; it += 2) {
+        kfree(objects[it]);
+        objects[it] = nullptr;
+    }
+
+    slabAllocator.drainCpuCaches();
+    SlabAllocatorStats after = slabAllocator.getStats();
+
+    uint64_t slabBytes = after.slabMemory - before.slabMemory;
+    uint64_t slabAllocatedBytes = after.allocatedMemory - before.allocatedMemory;
+
+    kuPrint("  mixed workload: %llu bytes live, segment heap %llu bytes (%llu%% overhead)\n",
+        requestedBytes, segmentBytes, (segmentBytes - requestedBytes) * 100 / requestedBytes);
+    kuPrint("  mixed workload: slab size classes %llu bytes, %llu slabs (%llu bytes, %llu%% utilized)\n",
+        slabAllocatedBytes, after.slabCount - before.slabCount, slabBytes,
+        slabBytes ? slabAllocatedBytes * 100 / slabBytes : 0);
+
+    for (int it = 1; it < HEAP_BENCHMARK_MIXED_OBJECTS; it += 2) {
+        kfree(objects[it]);
+    }
+
+    //
+    // Growing a buffer step by step the way vectors and strings do,
+    // most steps should be absorbed by the free space behind the buffer.
+    //
+    HeapStats heapStatsBefore = DynamicMemoryAllocator::get().getStats();
+
+    uint64_t start = rdtsc();
+    void* buffer = kmalloc(SLAB_MAX_OBJECT_SIZE * 2);
+    for (size_t size = SLAB_MAX_OBJECT_SIZE * 3; buffer && size <= SLAB_MAX_OBJECT_SIZE * 64; size += SLAB_MAX_OBJECT_SIZE) {
+        buffer = krealloc(buffer, size);
+    }
+    uint64_t reallocCycles = rdtsc() - start;
+    kfree(buffer);
+
+    HeapStats heapStats = DynamicMemoryAllocator::get().getStats();
+
+    kuPrint("  realloc growth: %llu cycles, %llu in place, %llu copied\n",
+        reallocCycles,
+        heapStats.inPlaceGrowths - heapStatsBefore.inPlaceGrowths,
+        heapStats.copiedReallocations - heapStatsBefore.copiedReallocations);
+    kuPrint("  heap reallocations: %llu total, %llu grown / %llu shrunk in place, %llu bytes copied, %llu bytes not copied\n",
+        heapStats.reallocations, heapStats.inPlaceGrowths, heapStats.inPlaceShrinks,
+        heapStats.bytesCopied, heapStats.copyBytesAvoided);
+
+    //
+    // Typed object cache against kmalloc for the same object size
+    //
+    start = rdtsc();
+    for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+        objects[it] = g_heapBenchmarkObjectCache.allocate();
+    }
+    uint64_t cacheAllocCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+    start = rdtsc();
+    for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+        g_heapBenchmarkObjectCache.free(static_cast<HeapBenchmarkObject*>(objects[it]));
+    }
+    uint64_t cacheFreeCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+    start = rdtsc();
+    for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+        objects[it] = kmalloc(sizeof(HeapBenchmarkObject));
+    }
+    uint64_t kmallocObjectCycles = (rdtsc() - start) / HEAP_BENCHMARK_ITERATIONS;
+
+    for (int it = 0; it < HEAP_BENCHMARK_ITERATIONS; ++it) {
+        kfree(objects[it]);
+    }
+
+    kuPrint("  %llu byte object: cache alloc %llu / free %llu cycles, kmalloc %llu cycles\n",
+        (uint64_t)sizeof(HeapBenchmarkObject), cacheAllocCycles, cacheFreeCycles, kmallocObjectCycles);
+
+    _printObjectCacheStats();
+
+    SlabCpuCacheStats cpuCacheStats = slabAllocator.getCpuCacheStats();
+
+    kuPrint("  per-cpu caches: hits %llu, misses %llu, remote frees %llu, cached objects %llu\n",
+        cpuCacheStats.hits, cpuCacheStats.misses, cpuCacheStats.remoteFrees, cpuCacheStats.cachedObjects);
+
+    for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+        SlabSizeClassStats stats = slabAllocator.getSizeClassStats(sizeClass);
+
+        kuPrint("  class %llu: %llu slabs, %llu/%llu objects in use\n",
+            stats.objectSize, stats.slabCount, stats.objectsInUse, stats.objectCapacity);
+    }
+}
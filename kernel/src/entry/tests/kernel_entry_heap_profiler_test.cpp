@@ -0,0 +1,43 @@
+#include "kernel_entry_tests.h"
+#include <core/kprint.h>
+#include <memory/kmemory.h>
+#include <memory/heap_profiler.h>
+
+#define HEAP_PROFILER_TEST_OBJECTS  64
+
+void ke_test_heap_profiler() {
+    auto& profiler = HeapProfiler::get();
+    void* objects[HEAP_PROFILER_TEST_OBJECTS];
+
+    if (!profiler.enable()) {
+        kuPrint("[HEAP PROFILER] Failed to allocate the side table\n");
+        return;
+    }
+
+    HeapProfileSnapshot before = profiler.takeSnapshot();
+
+    for (int i = 0; i < HEAP_PROFILER_TEST_OBJECTS; ++i) {
+        objects[i] = kmalloc(64 + i * 256);
+    }
+
+    // Every other object stays allocated and has to show up in the leak report
+    for (int i = 0; i < HEAP_PROFILER_TEST_OBJECTS; i += 2) {
+        kfree(objects[i]);
+    }
+
+    HeapProfileSnapshot after = profiler.takeSnapshot();
+    HeapProfilerStats stats = profiler.getStats();
+
+    kuPrint("[HEAP PROFILER] %llu live allocations (%llu bytes), %llu dropped, reports on COM2\n",
+        stats.liveAllocations, stats.liveBytes, stats.droppedRecords);
+
+    profiler.reportTopCallers();
+    profiler.reportFragmentation();
+    profiler.reportLeaks(before, after);
+
+    for (int i = 1; i < HEAP_PROFILER_TEST_OBJECTS; i += 2) {
+        kfree(objects[i]);
+    }
+
+    profiler.disable();
+}
@@ -0,0 +1,142 @@
+#include "kernel_entry_tests.h"
+#include <core/kprint.h>
+#include <memory/kmemory.h>
+#include <paging/page_frame_allocator.h>
+#include <time/ktime.h>
+
+#define PAGE_ALLOC_BENCHMARK_ITERATIONS 64
+
+//
+// Reproduces the search performed by the original bitmap-only
+// requestFreePages() implementation where every candidate start
+// page re-checks the whole block, without actually allocating.
+//
+uint64_t legacyFindFreePageRun(paging::PageFrameBitmap& bitmap, uint64_t totalMemory, size_t pages) {
+    for (uint8_t* page = NULL; page < reinterpret_cast<uint8_t*>(totalMemory); page += PAGE_SIZE) {
+        bool freeContiguousBlockFound = true;
+
+        for (uint8_t* pageBlockPtr = page; pageBlockPtr < (page + PAGE_SIZE * pages); pageBlockPtr += PAGE_SIZE) {
+            if (bitmap.isPageUsed(pageBlockPtr)) {
+                freeContiguousBlockFound = false;
+                break;
+            }
+        }
+
+        if (freeContiguousBlockFound) {
+            return reinterpret_cast<uint64_t>(page);
+        }
+    }
+
+    return 0;
+}
+
+void ke_test_page_alloc_benchmark() {
+    auto& allocator = paging::getGlobalPageFrameAllocator();
+    const size_t blockSizes[] = { 2, 8, 32, 128, 512 };
+
+    kuPrint("---- Page frame allocator benchmark (%llu MB RAM) ----\n", allocator.getTotalSystemMemory() / 1024 / 1024);
+
+    for (size_t i = 0; i < sizeof(blockSizes) / sizeof(blockSizes[0]); ++i) {
+        size_t pages = blockSizes[i];
+        void* blocks[PAGE_ALLOC_BENCHMARK_ITERATIONS];
+
+        // Latency of the legacy linear search
+        uint64_t start = rdtsc();
+        for (int it = 0; it < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++it) {
+            legacyFindFreePageRun(allocator.getPageFrameBitmap(), allocator.getTotalSystemMemory(), pages);
+        }
+        uint64_t legacyCycles = (rdtsc() - start) / PAGE_ALLOC_BENCHMARK_ITERATIONS;
+
+        // Latency of the buddy allocator backed requestFreePages()
+        start = rdtsc();
+        for (int it = 0; it < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++it) {
+            blocks[it] = allocPages(pages);
+        }
+        uint64_t buddyCycles = (rdtsc() - start) / PAGE_ALLOC_BENCHMARK_ITERATIONS;
+
+        for (int it = 0; it < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++it) {
+            if (blocks[it]) {
+                allocator.freePages(blocks[it], pages);
+            }
+        }
+
+        kuPrint("  %llu pages: legacy scan %llu cycles, buddy %llu cycles\n",
+            (uint64_t)pages, legacyCycles, buddyCycles);
+    }
+
+    // Single page requests served by the per-cpu page magazines
+    void* pages[PAGE_ALLOC_BENCHMARK_ITERATIONS];
+    paging::PageMagazineStats before = allocator.getPageMagazineStats();
+
+    uint64_t start = rdtsc();
+    for (int round = 0; round < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++round) {
+        for (int it = 0; it < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++it) {
+            pages[it] = allocPage();
+        }
+
+        for (int it = 0; it < PAGE_ALLOC_BENCHMARK_ITERATIONS; ++it) {
+            if (pages[it]) {
+                allocator.freePage(pages[it]);
+            }
+        }
+    }
+    uint64_t singlePageCycles = (rdtsc() - start) / (PAGE_ALLOC_BENCHMARK_ITERATIONS * PAGE_ALLOC_BENCHMARK_ITERATIONS);
+
+    paging::PageMagazineStats after = allocator.getPageMagazineStats();
+
+    kuPrint("  1 page alloc+free: %llu cycles, magazine hits %llu, misses %llu, cached frames %llu\n",
+        singlePageCycles, after.hits - before.hits, after.misses - before.misses, after.cachedFrames);
+
+    // Zeroed task stack sized requests with an empty and a full zeroed page pool
+    allocator.drainPageMagazines();
+
+    start = rdtsc();
+    for (int it = 0; it < ZEROED_BLOCK_POOL_CAPACITY; ++it) {
+        pages[it] = zallocPages(ZEROED_BLOCK_PAGES);
+    }
+    uint64_t syncZeroCycles = (rdtsc() - start) / ZEROED_BLOCK_POOL_CAPACITY;
+
+    for (int it = 0; it < ZEROED_BLOCK_POOL_CAPACITY; ++it) {
+        if (pages[it]) {
+            allocator.freePages(pages[it], ZEROED_BLOCK_PAGES);
+        }
+    }
+
+    while (allocator.refillZeroedPagePool());
+
+    start = rdtsc();
+    for (int it = 0; it < ZEROED_BLOCK_POOL_CAPACITY; ++it) {
+        pages[it] = zallocPages(ZEROED_BLOCK_PAGES);
+    }
+    uint64_t pooledZeroCycles = (rdtsc() - start) / ZEROED_BLOCK_POOL_CAPACITY;
+
+    for (int it = 0; it < ZEROED_BLOCK_POOL_CAPACITY; ++it) {
+        if (pages[it]) {
+            allocator.freePages(pages[it], ZEROED_BLOCK_PAGES);
+        }
+    }
+
+    kuPrint("  %u zeroed pages: synchronous %llu cycles, pre-zeroed pool %llu cycles\n",
+        (unsigned int)ZEROED_BLOCK_PAGES, syncZeroCycles, pooledZeroCycles);
+
+    // Naturally aligned huge frames
+    uint8_t hugeOrders[] = { HUGE_FRAME_ORDER_2MB, HUGE_FRAME_ORDER_1GB };
+
+    for (size_t i = 0; i < sizeof(hugeOrders) / sizeof(hugeOrders[0]); ++i) {
+        uint8_t allocatedOrder = 0;
+
+        start = rdtsc();
+        void* frame = allocator.requestHugeFrame(hugeOrders[i], paging::HugeFrameFallback::SmallerOrder, &allocatedOrder);
+        uint64_t hugeFrameCycles = rdtsc() - start;
+
+        if (!frame) {
+            kuPrint("  huge frame order %u: unavailable\n", (unsigned int)hugeOrders[i]);
+            continue;
+        }
+
+        kuPrint("  huge frame order %u: got order %u at 0x%llx in %llu cycles\n",
+            (unsigned int)hugeOrders[i], (unsigned int)allocatedOrder, (uint64_t)frame, hugeFrameCycles);
+
+        allocator.freeHugeFrame(frame, allocatedOrder);
+    }
+}
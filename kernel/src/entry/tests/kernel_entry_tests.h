@@ -13,4 +13,14 @@ void ke_test_print_current_time();
 
 void ke_test_graphics();
 
+void ke_test_page_alloc_benchmark();
+
+void ke_test_heap_benchmark();
+
+void ke_test_heap_profiler();
+
+void ke_test_context_switch_benchmark();
+
+void ke_test_tlb_shootdown();
+
 #endif // KERNEL_ENTRY_TESTS_H
@@ -0,0 +1,66 @@
+#include "kernel_entry_tests.h"
+#include <core/kprint.h>
+#include <memory/kmemory.h>
+#include <memory/vmalloc.h>
+#include <paging/tlb.h>
+#include <kelevate/kelevate.h>
+#include <time/ktime.h>
+
+#define TLB_SHOOTDOWN_TEST_ITERATIONS   32
+
+// Pages per released area, enough to go through the vmalloc area
+#define TLB_SHOOTDOWN_TEST_AREA_PAGES   (VMALLOC_KMALLOC_THRESHOLD / PAGE_SIZE)
+
+void ke_test_tlb_shootdown() {
+    kuPrint("---- TLB shootdown test ----\n");
+
+    paging::TlbShootdownStats before = paging::getTlbShootdownStats();
+
+    // Every released area has to be gone from all TLBs before its frames get reused
+    uint64_t freeCycles = 0;
+    for (int it = 0; it < TLB_SHOOTDOWN_TEST_ITERATIONS; ++it) {
+        uint8_t* area = static_cast<uint8_t*>(kmalloc(TLB_SHOOTDOWN_TEST_AREA_PAGES * PAGE_SIZE));
+        if (!area) {
+            kuPrint("  failed to allocate a vmalloc area\n");
+            return;
+        }
+
+        for (uint64_t page = 0; page < TLB_SHOOTDOWN_TEST_AREA_PAGES; ++page) {
+            area[page * PAGE_SIZE] = static_cast<uint8_t>(page);
+        }
+
+        uint64_t start = rdtsc();
+        kfree(area);
+        freeCycles += rdtsc() - start;
+    }
+
+    kuPrint("  vmalloc area free with shootdown: %llu cycles\n", freeCycles / TLB_SHOOTDOWN_TEST_ITERATIONS);
+
+    //
+    // A burst of single page requests that don't wait should mostly
+    // pile up behind the first IPI and get handled as one range.
+    //
+    uint64_t burstCycles = 0;
+    RUN_ELEVATED({
+        uint64_t start = rdtsc();
+
+        for (int it = 0; it < TLB_SHOOTDOWN_TEST_ITERATIONS; ++it) {
+            void* page = reinterpret_cast<void*>(VMALLOC_VIRTUAL_BASE + it * PAGE_SIZE);
+            paging::shootdownTlbRange(page, PAGE_SIZE, paging::getCurrentTopLevelPageTable(), false);
+        }
+
+        paging::shootdownTlbAll(paging::getCurrentTopLevelPageTable(), true);
+        burstCycles = rdtsc() - start;
+    });
+
+    kuPrint("  %llu page burst: %llu cycles\n", (uint64_t)TLB_SHOOTDOWN_TEST_ITERATIONS, burstCycles);
+
+    paging::TlbShootdownStats after = paging::getTlbShootdownStats();
+
+    kuPrint("  shootdowns %llu, IPIs sent %llu, coalesced requests %llu, range flushes %llu, full flushes %llu\n",
+        after.shootdowns - before.shootdowns,
+        after.ipisSent - before.ipisSent,
+        after.coalescedRequests - before.coalescedRequests,
+        after.rangeFlushes - before.rangeFlushes,
+        after.fullFlushes - before.fullFlushes);
+}
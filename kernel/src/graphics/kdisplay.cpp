@@ -40,18 +40,7 @@ void Display::initialize(void* framebuffer, void* font) {
     memset(s_backBuffer, 0xA, s_framebuffer.size);
 
     // Set the framebuffer pages to use Write-Combining access type
-    uint64_t gopBase = (uint64_t)s_framebuffer.base;
-    uint64_t gopSize = s_framebuffer.size;
-    for (
-        uint64_t page = gopBase;
-        page < gopBase + gopSize;
-        page += PAGE_SIZE
-    ) {
-        paging::pte_t* pte = paging::getPteForAddr((void*)page, paging::g_kernelRootPageTable);
-        pte->pageAccessType = 1;
-    }
-
-    paging::flushTlbAll();
+    paging::changeRangeAttribs(s_framebuffer.base, s_framebuffer.size, PAGE_ATTRIB_ACCESS_TYPE, paging::g_kernelRootPageTable);
 }
 
 __PRIVILEGED_CODE
@@ -44,6 +44,7 @@ EXTERN_C void __asm_irq_handler_12();
 EXTERN_C void __asm_irq_handler_13();
 EXTERN_C void __asm_irq_handler_14();
 EXTERN_C void __asm_irq_handler_15();
+EXTERN_C void __asm_irq_handler_16();
 
 InterruptHandler_t g_int_exc_handlers[15] = {
     _exc_handler_div,
@@ -51,10 +52,11 @@ InterruptHandler_t g_int_exc_handlers[15] = {
     _exc_handler_pf
 };
 
-InterruptHandler_t g_int_irq_handlers[15] = {
+InterruptHandler_t g_int_irq_handlers[17] = {
     _irq_handler_timer,
     _irq_handler_keyboard,
-    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    _irq_handler_tlb_shootdown
 };
 
 IdtDescriptor g_kernelIdtDescriptor = {
@@ -145,6 +147,7 @@ void setupInterruptDescriptorTable() {
     SET_KERNEL_TRAP_GATE(IRQ13, __asm_irq_handler_13);
     SET_KERNEL_TRAP_GATE(IRQ14, __asm_irq_handler_14);
     SET_KERNEL_TRAP_GATE(IRQ15, __asm_irq_handler_15);
+    SET_KERNEL_TRAP_GATE(IRQ16, __asm_irq_handler_16);
 }
 
 __PRIVILEGED_CODE
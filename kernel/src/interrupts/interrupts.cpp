@@ -39,6 +39,14 @@ DEFINE_INT_HANDLER(_exc_handler_div) {
 }
 
 DEFINE_INT_HANDLER(_exc_handler_pf) {
+    uint64_t cr2;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+
+    // Pages being migrated are briefly unmapped
+    if (!(frame->error & PF_PRESENT) && paging::handlePageMigrationFault(reinterpret_cast<void*>(cr2))) {
+        return;
+    }
+
     acquireSpinlock(&__kexc_log_lock);
 
     kprintColoredEx("#PF", TEXT_COLOR_RED);
@@ -72,8 +80,6 @@ DEFINE_INT_HANDLER(_exc_handler_pf) {
     
     kprintChar('\n');
 
-    uint64_t cr2;
-    __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
     kprintWarn("Faulting address: 0x%llx\n", cr2);
 
     kprintChar('\n');
@@ -108,3 +114,11 @@ DEFINE_INT_HANDLER(_irq_handler_keyboard) {
 
     kprint("Scancode: %i\n", (int)scancode);
 }
+
+DEFINE_INT_HANDLER(_irq_handler_tlb_shootdown) {
+    (void)frame;
+
+    paging::handleTlbShootdownIpi();
+
+    Apic::__irqGetLocalApic()->completeIrq();
+}
@@ -64,6 +64,10 @@
 #define IRQ13  45
 #define IRQ14  46
 #define IRQ15  47
+#define IRQ16  48
+
+// Inter-processor interrupts
+#define IRQ_TLB_SHOOTDOWN IRQ16
 
 // Additional Software Interrupts can be defined here (INT)
 // ...
@@ -118,5 +122,6 @@ DEFINE_INT_HANDLER(_exc_handler_pf);
 
 DEFINE_INT_HANDLER(_irq_handler_timer);
 DEFINE_INT_HANDLER(_irq_handler_keyboard);
+DEFINE_INT_HANDLER(_irq_handler_tlb_shootdown);
 
 #endif
@@ -0,0 +1,319 @@
+#include "dma.h"
+#include "kmemory.h"
+#include <paging/page.h>
+#include <paging/phys_addr_translation.h>
+#include <kprint.h>
+
+struct DmaChunk {
+    DmaChunk*           next;
+
+    void*               virtualBase;
+    uint64_t            physicalBase;
+    size_t              size;
+
+    DmaAddressLimit     addressLimit;
+    DmaCacheAttribute   cacheAttribute;
+
+    // Dedicated chunks back a single large allocation and are released with it
+    bool                dedicated;
+
+    uint64_t            usedBlocks;
+
+    // A set bit marks a used DMA_BLOCK_SIZE block
+    uint64_t            bitmap[DMA_CHUNK_BITMAP_WORDS];
+};
+
+DmaAllocator g_dmaAllocator;
+
+DmaAllocator& DmaAllocator::get() {
+    return g_dmaAllocator;
+}
+
+static uint8_t _getPageAttribs(DmaCacheAttribute cacheAttribute) {
+    switch (cacheAttribute) {
+    // PAT entry 2 is programmed as UC and PAT entry 4 as WC on kernel entry
+    case DmaCacheAttribute::Uncacheable: return PAGE_ATTRIB_CACHE_DISABLED;
+    case DmaCacheAttribute::WriteCombining: return PAGE_ATTRIB_ACCESS_TYPE;
+    default: break;
+    }
+
+    return 0;
+}
+
+// Reads the cache attribute bits back out of every leaf entry mapping the range
+__PRIVILEGED_CODE
+static bool _hasPageAttribs(void* vaddr, size_t size, uint8_t attribs) {
+    paging::PageTable* pml4 = paging::getCurrentTopLevelPageTable();
+
+    for (uint64_t offset = 0; offset < size; offset += PAGE_SIZE) {
+        uint64_t pageSize;
+        paging::pte_t* entry = paging::getPteForAddr(static_cast<uint8_t*>(vaddr) + offset, pml4, &pageSize);
+        if (!entry) {
+            return false;
+        }
+
+        // Large leaves keep their PAT bit in bit 12
+        bool pat = (pageSize == PAGE_SIZE) ? entry->pageAccessType : entry->largePageAccessType;
+
+        uint8_t mapped = 0;
+        mapped |= entry->pageCacheDisabled ? PAGE_ATTRIB_CACHE_DISABLED : 0;
+        mapped |= entry->pageWriteThrough ? PAGE_ATTRIB_WRITE_THROUGH : 0;
+        mapped |= pat ? PAGE_ATTRIB_ACCESS_TYPE : 0;
+
+        if (mapped != attribs) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool _isBlockRangeFree(DmaChunk* chunk, uint64_t start, uint64_t count) {
+    for (uint64_t block = start; block < start + count; ++block) {
+        if (chunk->bitmap[block / 64] & (1ULL << (block % 64))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void _setBlockRange(DmaChunk* chunk, uint64_t start, uint64_t count, bool used) {
+    for (uint64_t block = start; block < start + count; ++block) {
+        if (used) {
+            chunk->bitmap[block / 64] |= (1ULL << (block % 64));
+        } else {
+            chunk->bitmap[block / 64] &= ~(1ULL << (block % 64));
+        }
+    }
+}
+
+static inline bool _isPowerOfTwo(size_t value) {
+    return value && !(value & (value - 1));
+}
+
+__PRIVILEGED_CODE
+DmaBuffer DmaAllocator::allocate(
+    size_t size,
+    size_t alignment,
+    size_t boundary,
+    DmaAddressLimit addressLimit,
+    DmaCacheAttribute cacheAttribute
+) {
+    DmaBuffer buffer = { nullptr, 0, 0, nullptr };
+
+    if (size == 0 || !_isPowerOfTwo(alignment) || (boundary && (!_isPowerOfTwo(boundary) || size > boundary))) {
+        return buffer;
+    }
+
+    if (alignment < DMA_BLOCK_SIZE) {
+        alignment = DMA_BLOCK_SIZE;
+    }
+
+    DmaPool* pool = _getPool(addressLimit, cacheAttribute);
+
+    // Requests that don't fit into a pool chunk get their own pages
+    if (size > DMA_POOL_CHUNK_SIZE / 2 || alignment > DMA_POOL_CHUNK_SIZE) {
+        // Aligning the chunk to the next power of two of its size keeps it within any boundary
+        uint64_t chunkAlignment = (alignment > PAGE_SIZE) ? alignment : PAGE_SIZE;
+        if (boundary) {
+            while (chunkAlignment < size) {
+                chunkAlignment <<= 1;
+            }
+        }
+
+        DmaChunk* chunk = _createChunk(addressLimit, cacheAttribute, size, chunkAlignment / PAGE_SIZE, true);
+        if (!chunk) {
+            return buffer;
+        }
+
+        buffer.virtualBase = chunk->virtualBase;
+        buffer.physicalBase = chunk->physicalBase;
+        buffer.size = size;
+        buffer.chunk = chunk;
+
+        zeromem(buffer.virtualBase, size);
+        return buffer;
+    }
+
+    acquireSpinlock(&pool->lock);
+
+    bool allocated = false;
+    for (DmaChunk* chunk = pool->chunks; chunk && !allocated; chunk = chunk->next) {
+        allocated = _allocateFromChunk(chunk, size, alignment, boundary, buffer);
+    }
+
+    if (!allocated) {
+        DmaChunk* chunk = _createChunk(
+            addressLimit,
+            cacheAttribute,
+            DMA_POOL_CHUNK_SIZE,
+            DMA_POOL_CHUNK_SIZE / PAGE_SIZE,
+            false
+        );
+
+        if (chunk) {
+            chunk->next = pool->chunks;
+            pool->chunks = chunk;
+
+            allocated = _allocateFromChunk(chunk, size, alignment, boundary, buffer);
+        }
+    }
+
+    releaseSpinlock(&pool->lock);
+
+    if (allocated) {
+        zeromem(buffer.virtualBase, size);
+    }
+
+    return buffer;
+}
+
+__PRIVILEGED_CODE
+void DmaAllocator::free(DmaBuffer& buffer) {
+    DmaChunk* chunk = buffer.chunk;
+    if (!chunk || !buffer.virtualBase) {
+        return;
+    }
+
+    if (chunk->dedicated) {
+        _destroyChunk(chunk);
+    } else {
+        DmaPool* pool = _getPool(chunk->addressLimit, chunk->cacheAttribute);
+
+        uint64_t start = (buffer.physicalBase - chunk->physicalBase) / DMA_BLOCK_SIZE;
+        uint64_t count = (buffer.size + DMA_BLOCK_SIZE - 1) / DMA_BLOCK_SIZE;
+
+        acquireSpinlock(&pool->lock);
+        _setBlockRange(chunk, start, count, false);
+        chunk->usedBlocks -= count;
+        releaseSpinlock(&pool->lock);
+    }
+
+    buffer.virtualBase = nullptr;
+    buffer.physicalBase = 0;
+    buffer.size = 0;
+    buffer.chunk = nullptr;
+}
+
+DmaAllocatorStats DmaAllocator::getStats() const {
+    DmaAllocatorStats stats = { 0, 0, 0 };
+
+    for (int limit = 0; limit < DMA_ADDRESS_LIMIT_COUNT; ++limit) {
+        for (int attribute = 0; attribute < DMA_CACHE_ATTRIBUTE_COUNT; ++attribute) {
+            for (DmaChunk* chunk = m_pools[limit][attribute].chunks; chunk; chunk = chunk->next) {
+                stats.chunkCount++;
+                stats.poolMemory += chunk->size;
+                stats.allocatedMemory += chunk->usedBlocks * DMA_BLOCK_SIZE;
+            }
+        }
+    }
+
+    return stats;
+}
+
+DmaAllocator::DmaPool* DmaAllocator::_getPool(DmaAddressLimit addressLimit, DmaCacheAttribute cacheAttribute) {
+    return &m_pools[static_cast<int>(addressLimit)][static_cast<int>(cacheAttribute)];
+}
+
+__PRIVILEGED_CODE
+DmaChunk* DmaAllocator::_createChunk(
+    DmaAddressLimit addressLimit,
+    DmaCacheAttribute cacheAttribute,
+    size_t size,
+    uint64_t alignment,
+    bool dedicated
+) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Frames past the end of the higher half mapping can't be accessed through __va()
+    uint64_t maxPhysicalAddress = 0ULL - reinterpret_cast<uint64_t>(__va(nullptr));
+
+    if (addressLimit == DmaAddressLimit::Below4GB && maxPhysicalAddress > DMA_32BIT_ADDRESS_LIMIT) {
+        maxPhysicalAddress = DMA_32BIT_ADDRESS_LIMIT;
+    }
+
+    void* paddr = pageFrameAllocator.requestFreePhysicalPages(pages, maxPhysicalAddress, alignment);
+    if (!paddr) {
+        return nullptr;
+    }
+
+    DmaChunk* chunk = static_cast<DmaChunk*>(kmalloc(sizeof(DmaChunk)));
+    if (!chunk) {
+        pageFrameAllocator.freePhysicalPages(paddr, pages);
+        return nullptr;
+    }
+
+    // Devices hold on to the physical address, so the pages can never move
+    pageFrameAllocator.setPhysicalPageOwner(paddr, pages, paging::PageOwner::Dma);
+
+    zeromem(chunk, sizeof(DmaChunk));
+    chunk->virtualBase = __va(paddr);
+    chunk->physicalBase = reinterpret_cast<uint64_t>(paddr);
+    chunk->size = pages * PAGE_SIZE;
+    chunk->addressLimit = addressLimit;
+    chunk->cacheAttribute = cacheAttribute;
+    chunk->dedicated = dedicated;
+
+    // Every page of the chunk gets the same cache attribute
+    uint8_t attribs = _getPageAttribs(cacheAttribute);
+    paging::changeRangeAttribs(chunk->virtualBase, chunk->size, attribs);
+
+    // A device writing through a mapping with the wrong memory type corrupts the buffer silently
+    if (!_hasPageAttribs(chunk->virtualBase, chunk->size, attribs)) {
+        kprintError("DMA chunk at 0x%llx didn't take its cache attributes\n", chunk->physicalBase);
+        _destroyChunk(chunk);
+        return nullptr;
+    }
+
+    return chunk;
+}
+
+__PRIVILEGED_CODE
+void DmaAllocator::_destroyChunk(DmaChunk* chunk) {
+    // Restore the default write-back attributes before the pages get reused
+    paging::changeRangeAttribs(chunk->virtualBase, chunk->size, 0);
+
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    pageFrameAllocator.freePhysicalPages(reinterpret_cast<void*>(chunk->physicalBase), chunk->size / PAGE_SIZE);
+
+    kfree(chunk);
+}
+
+bool DmaAllocator::_allocateFromChunk(DmaChunk* chunk, size_t size, size_t alignment, size_t boundary, DmaBuffer& buffer) {
+    uint64_t blockCount = (size + DMA_BLOCK_SIZE - 1) / DMA_BLOCK_SIZE;
+    uint64_t step = alignment / DMA_BLOCK_SIZE;
+
+    if (chunk->usedBlocks + blockCount > DMA_CHUNK_BLOCK_COUNT) {
+        return false;
+    }
+
+    //
+    // Pool chunks are aligned to their size, so checking the alignment and
+    // boundary of the offset is enough for values up to the chunk size, and
+    // larger boundaries can't be crossed within a chunk at all.
+    //
+    for (uint64_t start = 0; start + blockCount <= DMA_CHUNK_BLOCK_COUNT; start += step) {
+        uint64_t offset = start * DMA_BLOCK_SIZE;
+
+        if (boundary && (offset / boundary) != ((offset + size - 1) / boundary)) {
+            continue;
+        }
+
+        if (!_isBlockRangeFree(chunk, start, blockCount)) {
+            continue;
+        }
+
+        _setBlockRange(chunk, start, blockCount, true);
+        chunk->usedBlocks += blockCount;
+
+        buffer.virtualBase = static_cast<uint8_t*>(chunk->virtualBase) + offset;
+        buffer.physicalBase = chunk->physicalBase + offset;
+        buffer.size = size;
+        buffer.chunk = chunk;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,106 @@
+#ifndef DMA_H
+#define DMA_H
+#include <sync.h>
+
+// Size of the physically contiguous chunks backing the DMA pools
+#define DMA_POOL_CHUNK_SIZE         0x10000 // 64KB
+
+// Granularity of allocations carved out of a pool chunk
+#define DMA_BLOCK_SIZE              64
+#define DMA_CHUNK_BLOCK_COUNT       (DMA_POOL_CHUNK_SIZE / DMA_BLOCK_SIZE)
+#define DMA_CHUNK_BITMAP_WORDS      (DMA_CHUNK_BLOCK_COUNT / 64)
+
+// Exclusive physical address limit for devices that can only do 32-bit addressing
+#define DMA_32BIT_ADDRESS_LIMIT     0x100000000ULL
+
+enum class DmaAddressLimit {
+    Below4GB = 0,
+    Any
+};
+
+enum class DmaCacheAttribute {
+    WriteBack = 0,
+    Uncacheable,
+    WriteCombining
+};
+
+#define DMA_ADDRESS_LIMIT_COUNT     2
+#define DMA_CACHE_ATTRIBUTE_COUNT   3
+
+struct DmaChunk;
+
+struct DmaBuffer {
+    // Null if the allocation failed
+    void*       virtualBase;
+    uint64_t    physicalBase;
+    size_t      size;
+
+    // Chunk the buffer was carved out of
+    DmaChunk*   chunk;
+};
+
+struct DmaAllocatorStats {
+    uint64_t chunkCount;
+    uint64_t poolMemory;
+    uint64_t allocatedMemory;
+};
+
+//
+// Allocator for memory shared with devices. Allocations are physically
+// contiguous, zeroed and mapped through the kernel's higher half with the
+// requested cache attribute applied to every page they touch. Each address
+// limit and cache attribute combination has its own pool of 64KB chunks,
+// so pages never end up with mixed attributes. Requests that don't fit
+// into a pool chunk get a dedicated physically contiguous chunk.
+//
+class DmaAllocator {
+public:
+    static DmaAllocator& get();
+
+    //
+    // Allocates 'size' bytes aligned to 'alignment' (a power of two) that
+    // don't cross a multiple of 'boundary' (a power of two, 0 for none).
+    //
+    __PRIVILEGED_CODE
+    DmaBuffer allocate(
+        size_t size,
+        size_t alignment = DMA_BLOCK_SIZE,
+        size_t boundary = 0,
+        DmaAddressLimit addressLimit = DmaAddressLimit::Any,
+        DmaCacheAttribute cacheAttribute = DmaCacheAttribute::Uncacheable
+    );
+
+    __PRIVILEGED_CODE
+    void free(DmaBuffer& buffer);
+
+    DmaAllocatorStats getStats() const;
+
+private:
+    struct DmaPool {
+        Spinlock    lock;
+        DmaChunk*   chunks;
+    };
+
+    DmaPool m_pools[DMA_ADDRESS_LIMIT_COUNT][DMA_CACHE_ATTRIBUTE_COUNT];
+
+private:
+    DmaPool* _getPool(DmaAddressLimit addressLimit, DmaCacheAttribute cacheAttribute);
+
+    // Maps a physically contiguous run of pages with the pool's cache attribute
+    __PRIVILEGED_CODE
+    DmaChunk* _createChunk(
+        DmaAddressLimit addressLimit,
+        DmaCacheAttribute cacheAttribute,
+        size_t size,
+        uint64_t alignment,
+        bool dedicated
+    );
+
+    __PRIVILEGED_CODE
+    void _destroyChunk(DmaChunk* chunk);
+
+    // Expects the caller to hold the pool lock
+    bool _allocateFromChunk(DmaChunk* chunk, size_t size, size_t alignment, size_t boundary, DmaBuffer& buffer);
+};
+
+#endif
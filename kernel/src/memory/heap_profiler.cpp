@@ -0,0 +1,568 @@
+#include "heap_profiler.h"
+#include "kmemory.h"
+#include "slab.h"
+#include "vmalloc.h"
+#include <paging/page_frame_allocator.h>
+#include <ports/serial.h>
+#include <kelevate/kelevate.h>
+#include <time/ktime.h>
+#include <kstring.h>
+
+#define HEAP_PROFILER_LINE_SIZE 192
+
+HeapProfiler g_heapProfiler;
+
+struct HeapProfileLine {
+    char    text[HEAP_PROFILER_LINE_SIZE];
+    size_t  length;
+};
+
+static void _appendText(HeapProfileLine& line, const char* str) {
+    while (*str && line.length < HEAP_PROFILER_LINE_SIZE - 2) {
+        line.text[line.length++] = *str++;
+    }
+}
+
+static void _beginLine(HeapProfileLine& line, const char* record) {
+    line.length = 0;
+    _appendText(line, "heapprof.");
+    _appendText(line, record);
+}
+
+static void _appendField(HeapProfileLine& line, const char* key, uint64_t value) {
+    char buf[24] = { 0 };
+    lltoa(value, buf, sizeof(buf));
+
+    _appendText(line, " ");
+    _appendText(line, key);
+    _appendText(line, "=");
+    _appendText(line, buf);
+}
+
+static void _appendHexField(HeapProfileLine& line, const char* key, uint64_t value) {
+    char buf[24] = { 0 };
+    htoa(value, buf, sizeof(buf));
+
+    _appendText(line, " ");
+    _appendText(line, key);
+    _appendText(line, "=0x");
+    _appendText(line, buf);
+}
+
+static void _appendStringField(HeapProfileLine& line, const char* key, const char* value) {
+    _appendText(line, " ");
+    _appendText(line, key);
+    _appendText(line, "=");
+    _appendText(line, value);
+}
+
+static void _emitLine(HeapProfileLine& line) {
+    line.text[line.length++] = '\n';
+    line.text[line.length] = '\0';
+
+    RUN_ELEVATED({
+        writeToSerialPort(SERIAL_PORT_BASE_COM2, line.text);
+    });
+}
+
+static void _emitMarker(const char* record, const char* kind) {
+    HeapProfileLine line;
+    _beginLine(line, record);
+    _appendStringField(line, "kind", kind);
+    _emitLine(line);
+}
+
+static inline uint64_t _pagesFor(uint64_t bytes) {
+    return (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+HeapProfiler& HeapProfiler::get() {
+    return g_heapProfiler;
+}
+
+bool HeapProfiler::enable(size_t maxRecords) {
+    if (m_enabled) {
+        return true;
+    }
+
+    uint64_t capacity = 1;
+    while (capacity < maxRecords) {
+        capacity <<= 1;
+    }
+
+    uint64_t tablePages = _pagesFor(capacity * sizeof(HeapProfileRecord));
+
+    // The table comes straight from the page frame allocator to keep the heap out of the picture
+    HeapProfileRecord* records = static_cast<HeapProfileRecord*>(zallocPages(tablePages));
+    if (!records) {
+        return false;
+    }
+
+    acquireSpinlock(&m_lock);
+
+    m_records = records;
+    m_capacity = capacity;
+    m_tablePages = tablePages;
+
+    m_liveAllocations = 0;
+    m_liveBytes = 0;
+    m_allocations = 0;
+    m_frees = 0;
+    m_droppedRecords = 0;
+
+    m_enabled = true;
+
+    releaseSpinlock(&m_lock);
+
+    return true;
+}
+
+void HeapProfiler::disable() {
+    acquireSpinlock(&m_lock);
+
+    if (!m_enabled) {
+        releaseSpinlock(&m_lock);
+        return;
+    }
+
+    m_enabled = false;
+
+    HeapProfileRecord* records = m_records;
+    uint64_t tablePages = m_tablePages;
+
+    m_records = nullptr;
+    m_capacity = 0;
+    m_tablePages = 0;
+
+    releaseSpinlock(&m_lock);
+
+    paging::getGlobalPageFrameAllocator().freePages(records, tablePages);
+}
+
+void HeapProfiler::recordAllocation(void* ptr, size_t size, void* caller) {
+    if (!ptr) {
+        return;
+    }
+
+    uint64_t address = reinterpret_cast<uint64_t>(ptr);
+    uint64_t timestamp = rdtsc();
+
+    acquireSpinlock(&m_lock);
+
+    // The profiler could have been disabled since the caller checked
+    if (!m_enabled) {
+        releaseSpinlock(&m_lock);
+        return;
+    }
+
+    m_allocations++;
+
+    HeapProfileRecord* record = _findRecord(address);
+
+    if (record->address == address) {
+        // Reallocated in place, the allocation keeps its original timestamp
+        m_liveBytes -= record->size;
+    } else if ((m_liveAllocations + 1) * 100 > m_capacity * HEAP_PROFILER_MAX_LOAD) {
+        m_droppedRecords++;
+        releaseSpinlock(&m_lock);
+        return;
+    } else {
+        record->address = address;
+        record->timestamp = timestamp;
+        m_liveAllocations++;
+    }
+
+    record->caller = reinterpret_cast<uint64_t>(caller);
+    record->size = size;
+    m_liveBytes += size;
+
+    releaseSpinlock(&m_lock);
+}
+
+void HeapProfiler::recordFree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    acquireSpinlock(&m_lock);
+
+    if (!m_enabled) {
+        releaseSpinlock(&m_lock);
+        return;
+    }
+
+    m_frees++;
+
+    // Allocations made before profiling started have no record
+    HeapProfileRecord* record = _findRecord(reinterpret_cast<uint64_t>(ptr));
+    if (record->address) {
+        m_liveAllocations--;
+        m_liveBytes -= record->size;
+
+        _removeRecord(record);
+    }
+
+    releaseSpinlock(&m_lock);
+}
+
+HeapProfileSnapshot HeapProfiler::takeSnapshot() {
+    HeapProfileSnapshot snapshot;
+
+    acquireSpinlock(&m_lock);
+    snapshot.timestamp = rdtsc();
+    snapshot.liveAllocations = m_liveAllocations;
+    snapshot.liveBytes = m_liveBytes;
+    releaseSpinlock(&m_lock);
+
+    return snapshot;
+}
+
+HeapProfilerStats HeapProfiler::getStats() {
+    HeapProfilerStats stats;
+
+    acquireSpinlock(&m_lock);
+    stats.capacity = m_capacity;
+    stats.liveAllocations = m_liveAllocations;
+    stats.liveBytes = m_liveBytes;
+    stats.allocations = m_allocations;
+    stats.frees = m_frees;
+    stats.droppedRecords = m_droppedRecords;
+    releaseSpinlock(&m_lock);
+
+    return stats;
+}
+
+void HeapProfiler::reportTopCallers(size_t count) {
+    uint64_t callerPages = _pagesFor(HEAP_PROFILER_MAX_CALLERS * sizeof(CallerEntry));
+
+    CallerEntry* callers = static_cast<CallerEntry*>(zallocPages(callerPages));
+    if (!callers) {
+        return;
+    }
+
+    acquireSpinlock(&m_reportLock);
+
+    HeapProfilerStats stats = getStats();
+    size_t callerCount = _aggregateCallers(0, static_cast<uint64_t>(-1), callers, nullptr, 0, nullptr);
+
+    HeapProfileLine line;
+    _beginLine(line, "begin");
+    _appendStringField(line, "kind", "top_callers");
+    _appendField(line, "ts", rdtsc());
+    _appendField(line, "live_bytes", stats.liveBytes);
+    _appendField(line, "live_allocations", stats.liveAllocations);
+    _appendField(line, "callers", callerCount);
+    _appendField(line, "dropped", stats.droppedRecords);
+    _emitLine(line);
+
+    _selectTopCallers(callers, callerCount, count, true);
+
+    for (size_t rank = 0; rank < count && rank < callerCount; ++rank) {
+        _beginLine(line, "top_bytes");
+        _appendField(line, "rank", rank + 1);
+        _appendHexField(line, "caller", callers[rank].caller);
+        _appendField(line, "bytes", callers[rank].bytes);
+        _appendField(line, "allocations", callers[rank].allocations);
+        _emitLine(line);
+    }
+
+    _selectTopCallers(callers, callerCount, count, false);
+
+    for (size_t rank = 0; rank < count && rank < callerCount; ++rank) {
+        _beginLine(line, "top_count");
+        _appendField(line, "rank", rank + 1);
+        _appendHexField(line, "caller", callers[rank].caller);
+        _appendField(line, "allocations", callers[rank].allocations);
+        _appendField(line, "bytes", callers[rank].bytes);
+        _emitLine(line);
+    }
+
+    _emitMarker("end", "top_callers");
+
+    releaseSpinlock(&m_reportLock);
+
+    paging::getGlobalPageFrameAllocator().freePages(callers, callerPages);
+}
+
+void HeapProfiler::reportFragmentation() {
+    acquireSpinlock(&m_reportLock);
+
+    HeapProfileLine line;
+    _beginLine(line, "begin");
+    _appendStringField(line, "kind", "fragmentation");
+    _appendField(line, "ts", rdtsc());
+    _emitLine(line);
+
+    // Nodes without their own arena share the boot heap
+    DynamicMemoryAllocator* reported[MAX_NUMA_NODES] = { nullptr };
+    size_t reportedCount = 0;
+
+    for (uint8_t node = 0; node < MAX_NUMA_NODES; ++node) {
+        DynamicMemoryAllocator* heap = &DynamicMemoryAllocator::getForNode(node);
+
+        bool alreadyReported = false;
+        for (size_t i = 0; i < reportedCount; ++i) {
+            alreadyReported |= (reported[i] == heap);
+        }
+
+        if (alreadyReported) {
+            continue;
+        }
+
+        reported[reportedCount++] = heap;
+
+        uint64_t heapBase = reinterpret_cast<uint64_t>(heap->getHeapBase());
+        HeapFragmentationStats stats = heap->getFragmentationStats();
+
+        // Share of the free memory that can't be handed out as a single block
+        uint64_t fragmentation = stats.freeBytes
+            ? (stats.freeBytes - stats.largestFreeSegment) * 100 / stats.freeBytes
+            : 0;
+
+        _beginLine(line, "heap");
+        _appendHexField(line, "base", heapBase);
+        _appendField(line, "committed", heap->getCommittedSize());
+        _appendField(line, "used_segments", stats.usedSegments);
+        _appendField(line, "used_bytes", stats.usedBytes);
+        _appendField(line, "free_segments", stats.freeSegments);
+        _appendField(line, "free_bytes", stats.freeBytes);
+        _appendField(line, "largest_free", stats.largestFreeSegment);
+        _appendField(line, "fragmentation_pct", fragmentation);
+        _emitLine(line);
+
+        for (int bucket = 0; bucket < KERNEL_HEAP_FRAGMENTATION_BUCKETS; ++bucket) {
+            if (!stats.freeSegmentHistogram[bucket]) {
+                continue;
+            }
+
+            _beginLine(line, "free_histogram");
+            _appendHexField(line, "base", heapBase);
+            _appendField(line, "min_size", 1ULL << bucket);
+            _appendField(line, "segments", stats.freeSegmentHistogram[bucket]);
+            _emitLine(line);
+        }
+    }
+
+    VmallocStats vmallocStats = VmallocAllocator::get().getStats();
+
+    _beginLine(line, "vmalloc");
+    _appendField(line, "areas", vmallocStats.areaCount);
+    _appendField(line, "mapped_bytes", vmallocStats.mappedBytes);
+    _appendField(line, "reserved_bytes", vmallocStats.reservedBytes);
+    _emitLine(line);
+
+    auto& slabAllocator = SlabAllocator::get();
+
+    for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+        SlabSizeClassStats stats = slabAllocator.getSizeClassStats(sizeClass);
+
+        _beginLine(line, "slab_class");
+        _appendField(line, "size", stats.objectSize);
+        _appendField(line, "slabs", stats.slabCount);
+        _appendField(line, "in_use", stats.objectsInUse);
+        _appendField(line, "capacity", stats.objectCapacity);
+        _emitLine(line);
+    }
+
+    _emitMarker("end", "fragmentation");
+
+    releaseSpinlock(&m_reportLock);
+}
+
+void HeapProfiler::reportLeaks(const HeapProfileSnapshot& from, const HeapProfileSnapshot& to) {
+    uint64_t callerPages = _pagesFor(HEAP_PROFILER_MAX_CALLERS * sizeof(CallerEntry));
+    uint64_t recordPages = _pagesFor(HEAP_PROFILER_MAX_LEAK_RECORDS * sizeof(HeapProfileRecord));
+
+    CallerEntry* callers = static_cast<CallerEntry*>(zallocPages(callerPages));
+    HeapProfileRecord* records = static_cast<HeapProfileRecord*>(zallocPages(recordPages));
+
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+
+    if (!callers || !records) {
+        if (callers) {
+            pageFrameAllocator.freePages(callers, callerPages);
+        }
+
+        if (records) {
+            pageFrameAllocator.freePages(records, recordPages);
+        }
+
+        return;
+    }
+
+    acquireSpinlock(&m_reportLock);
+
+    size_t recordCount = 0;
+    size_t callerCount = _aggregateCallers(
+        from.timestamp,
+        to.timestamp,
+        callers,
+        records,
+        HEAP_PROFILER_MAX_LEAK_RECORDS,
+        &recordCount
+    );
+
+    uint64_t leakedBytes = 0;
+    uint64_t leakedAllocations = 0;
+
+    for (size_t i = 0; i < callerCount; ++i) {
+        leakedBytes += callers[i].bytes;
+        leakedAllocations += callers[i].allocations;
+    }
+
+    HeapProfileLine line;
+    _beginLine(line, "begin");
+    _appendStringField(line, "kind", "leaks");
+    _appendField(line, "from", from.timestamp);
+    _appendField(line, "to", to.timestamp);
+    _appendField(line, "live_bytes_from", from.liveBytes);
+    _appendField(line, "live_bytes_to", to.liveBytes);
+    _appendField(line, "leaked_bytes", leakedBytes);
+    _appendField(line, "leaked_allocations", leakedAllocations);
+    _emitLine(line);
+
+    _selectTopCallers(callers, callerCount, callerCount, true);
+
+    for (size_t i = 0; i < callerCount; ++i) {
+        _beginLine(line, "leak_caller");
+        _appendHexField(line, "caller", callers[i].caller);
+        _appendField(line, "bytes", callers[i].bytes);
+        _appendField(line, "allocations", callers[i].allocations);
+        _emitLine(line);
+    }
+
+    for (size_t i = 0; i < recordCount; ++i) {
+        _beginLine(line, "leak");
+        _appendHexField(line, "address", records[i].address);
+        _appendField(line, "size", records[i].size);
+        _appendHexField(line, "caller", records[i].caller);
+        _appendField(line, "ts", records[i].timestamp);
+        _emitLine(line);
+    }
+
+    _emitMarker("end", "leaks");
+
+    releaseSpinlock(&m_reportLock);
+
+    pageFrameAllocator.freePages(callers, callerPages);
+    pageFrameAllocator.freePages(records, recordPages);
+}
+
+uint64_t HeapProfiler::_getSlot(uint64_t address) const {
+    // Allocations are at least 16 byte aligned, the low bits carry no information
+    return ((address >> 4) * 0x9e3779b97f4a7c15ULL >> 17) & (m_capacity - 1);
+}
+
+HeapProfileRecord* HeapProfiler::_findRecord(uint64_t address) {
+    uint64_t slot = _getSlot(address);
+
+    // The load limit guarantees an empty slot to terminate the probe
+    while (m_records[slot].address && m_records[slot].address != address) {
+        slot = (slot + 1) & (m_capacity - 1);
+    }
+
+    return &m_records[slot];
+}
+
+void HeapProfiler::_removeRecord(HeapProfileRecord* record) {
+    uint64_t mask = m_capacity - 1;
+    uint64_t hole = record - m_records;
+    uint64_t slot = (hole + 1) & mask;
+
+    //
+    // Linear probing can't leave holes in a probe sequence, so every record
+    // after the removed one that could live in the hole gets shifted back.
+    //
+    while (m_records[slot].address) {
+        uint64_t home = _getSlot(m_records[slot].address);
+
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            m_records[hole] = m_records[slot];
+            hole = slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    m_records[hole].address = 0;
+}
+
+size_t HeapProfiler::_aggregateCallers(
+    uint64_t from,
+    uint64_t to,
+    CallerEntry* callers,
+    HeapProfileRecord* records,
+    size_t maxRecords,
+    size_t* recordCount
+) {
+    const uint64_t mask = HEAP_PROFILER_MAX_CALLERS - 1;
+    size_t callerCount = 0;
+    size_t copied = 0;
+
+    acquireSpinlock(&m_lock);
+
+    for (uint64_t i = 0; i < m_capacity; ++i) {
+        HeapProfileRecord& record = m_records[i];
+
+        if (!record.address || record.timestamp < from || record.timestamp >= to) {
+            continue;
+        }
+
+        if (records && copied < maxRecords) {
+            records[copied++] = record;
+        }
+
+        uint64_t slot = (record.caller * 0x9e3779b97f4a7c15ULL >> 20) & mask;
+        while (callers[slot].caller && callers[slot].caller != record.caller) {
+            slot = (slot + 1) & mask;
+        }
+
+        if (!callers[slot].caller) {
+            // Call sites beyond the table size are left out of the report
+            if (callerCount == HEAP_PROFILER_MAX_CALLERS - 1) {
+                continue;
+            }
+
+            callers[slot].caller = record.caller;
+            callerCount++;
+        }
+
+        callers[slot].bytes += record.size;
+        callers[slot].allocations++;
+    }
+
+    releaseSpinlock(&m_lock);
+
+    // Pack the used entries to the front of the table
+    size_t packed = 0;
+    for (uint64_t slot = 0; slot < HEAP_PROFILER_MAX_CALLERS; ++slot) {
+        if (callers[slot].caller) {
+            callers[packed++] = callers[slot];
+        }
+    }
+
+    if (recordCount) {
+        *recordCount = copied;
+    }
+
+    return packed;
+}
+
+void HeapProfiler::_selectTopCallers(CallerEntry* callers, size_t callerCount, size_t count, bool byBytes) {
+    for (size_t rank = 0; rank < count && rank < callerCount; ++rank) {
+        size_t best = rank;
+
+        for (size_t i = rank + 1; i < callerCount; ++i) {
+            uint64_t value = byBytes ? callers[i].bytes : callers[i].allocations;
+            uint64_t bestValue = byBytes ? callers[best].bytes : callers[best].allocations;
+
+            if (value > bestValue) {
+                best = i;
+            }
+        }
+
+        CallerEntry entry = callers[rank];
+        callers[rank] = callers[best];
+        callers[best] = entry;
+    }
+}
@@ -0,0 +1,136 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+#include <sync.h>
+
+// Live allocations tracked by default, rounded up to a power of two
+#define HEAP_PROFILER_DEFAULT_RECORDS   65536
+
+// The side table stops taking new records past this fill level (in percent)
+#define HEAP_PROFILER_MAX_LOAD          75
+
+// Distinct call sites a single report can aggregate
+#define HEAP_PROFILER_MAX_CALLERS       4096
+
+// Individual leaked allocations listed by a leak report
+#define HEAP_PROFILER_MAX_LEAK_RECORDS  256
+
+#define HEAP_PROFILER_TOP_CALLERS       16
+
+struct HeapProfileRecord {
+    // Zero marks an empty slot
+    uint64_t address;
+    uint64_t caller;
+    uint64_t timestamp;
+    uint64_t size;
+};
+
+struct HeapProfileSnapshot {
+    uint64_t timestamp;
+    uint64_t liveAllocations;
+    uint64_t liveBytes;
+};
+
+struct HeapProfilerStats {
+    uint64_t capacity;
+    uint64_t liveAllocations;
+    uint64_t liveBytes;
+    uint64_t allocations;
+    uint64_t frees;
+
+    // Allocations that couldn't be recorded because the side table was full
+    uint64_t droppedRecords;
+};
+
+//
+// Optional allocation profiler hooked into kmalloc(), krealloc(), kfree()
+// and the global new/delete operators. While enabled, every live allocation
+// has a record with the calling return address, requested size and the tsc
+// at allocation time in an open-addressed side table that lives in its own
+// pages, so profiling never recurses into the heap.
+//
+// Reports are written to COM2 as one record per line, each line being a
+// record type followed by space separated key=value pairs:
+//
+//   heapprof.begin kind=top_callers ts=... live_bytes=... live_allocations=...
+//   heapprof.top_bytes rank=1 caller=0x... bytes=... allocations=...
+//   heapprof.end kind=top_callers
+//
+// Allocations made before the profiler got enabled are not tracked.
+//
+class HeapProfiler {
+public:
+    static HeapProfiler& get();
+
+    // Allocates the side table and starts recording, returns false if the table couldn't be allocated
+    bool enable(size_t maxRecords = HEAP_PROFILER_DEFAULT_RECORDS);
+
+    // Stops recording and releases the side table
+    void disable();
+
+    inline bool isEnabled() const { return m_enabled; }
+
+    void recordAllocation(void* ptr, size_t size, void* caller);
+    void recordFree(void* ptr);
+
+    HeapProfileSnapshot takeSnapshot();
+    HeapProfilerStats getStats();
+
+    // Call sites owning the most live bytes and the most live allocations
+    void reportTopCallers(size_t count = HEAP_PROFILER_TOP_CALLERS);
+
+    // Free segment size histogram of every heap arena and the slab size class utilization
+    void reportFragmentation();
+
+    // Allocations made between the two snapshots that are still live
+    void reportLeaks(const HeapProfileSnapshot& from, const HeapProfileSnapshot& to);
+
+private:
+    struct CallerEntry {
+        uint64_t caller;
+        uint64_t bytes;
+        uint64_t allocations;
+    };
+
+    volatile bool       m_enabled;
+
+    Spinlock            m_lock;
+
+    // Serializes reports so their lines don't interleave on the serial port
+    Spinlock            m_reportLock;
+
+    HeapProfileRecord*  m_records;
+    uint64_t            m_capacity;
+    uint64_t            m_tablePages;
+
+    uint64_t            m_liveAllocations;
+    uint64_t            m_liveBytes;
+    uint64_t            m_allocations;
+    uint64_t            m_frees;
+    uint64_t            m_droppedRecords;
+
+private:
+    uint64_t _getSlot(uint64_t address) const;
+
+    // Expect the caller to hold the table lock
+    HeapProfileRecord* _findRecord(uint64_t address);
+    void _removeRecord(HeapProfileRecord* record);
+
+    //
+    // Sums up the live allocations made within [from, to) per call site,
+    // returns the number of distinct call sites. Optionally copies up to
+    // 'maxRecords' of the matching records.
+    //
+    size_t _aggregateCallers(
+        uint64_t from,
+        uint64_t to,
+        CallerEntry* callers,
+        HeapProfileRecord* records,
+        size_t maxRecords,
+        size_t* recordCount
+    );
+
+    // Moves the entries with the largest bytes or allocations count to the front
+    void _selectTopCallers(CallerEntry* callers, size_t callerCount, size_t count, bool byBytes);
+};
+
+#endif
@@ -1,99 +1,250 @@
 #include "kheap.h"
 #include "kmemory.h"
 #include <paging/page_frame_allocator.h>
+#include <paging/phys_addr_translation.h>
+#include <paging/page.h>
+#include <kelevate/kelevate.h>
 #include <sync.h>
 #include <kprint.h>
-
-#define MIN_HEAP_SEGMENT_CAPACITY 1
+#include <time/ktime.h>
 
 #define GET_USABLE_BLOCK_MEMORY_SIZE(seg) seg->size - sizeof(HeapSegmentHeader)
 
-#define WRITE_SEGMENT_MAGIC_FIELD(seg) \
-    memcpy(seg->magic, (void*)KERNEL_HEAP_SEGMENT_HDR_SIGNATURE, sizeof(seg->magic));
+#define GET_SEGMENT_FOOTER(seg) \
+    reinterpret_cast<HeapSegmentFooter*>(reinterpret_cast<uint8_t*>(seg) + seg->size - sizeof(HeapSegmentFooter))
+
+#define GET_SEGMENT_FREE_LINKS(seg) \
+    reinterpret_cast<HeapFreeSegmentLinks*>(reinterpret_cast<uint8_t*>(seg) + sizeof(HeapSegmentHeader))
+
+// Mixed into every canary, picked when the first heap gets set up
+uint64_t g_heapCanarySecret;
+
+static inline uint32_t _computeSegmentCanary(HeapSegmentHeader* segment) {
+    uint64_t hash = reinterpret_cast<uint64_t>(segment) ^ (segment->size * 0x9e3779b97f4a7c15ULL) ^ g_heapCanarySecret;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    // Cleared canaries of free and merged segments never match
+    return static_cast<uint32_t>(hash) | 1;
+}
+
+static inline void _clearSegmentHeader(HeapSegmentHeader* segment, uint64_t size) {
+    segment->size = size;
+    segment->flags = {
+        .free = false,
+        .previousFree = false,
+        .reserved = 0
+    };
+    segment->reserved[0] = 0;
+    segment->reserved[1] = 0;
+    segment->reserved[2] = 0;
+    segment->canary = 0;
+}
+
+// Size of the segment holding an allocation of the given size
+static inline size_t _getSegmentSize(size_t size) {
+    size_t segmentSize = sizeof(HeapSegmentHeader) + ((size + KERNEL_HEAP_ALIGNMENT - 1) & ~(KERNEL_HEAP_ALIGNMENT - 1));
+    return (segmentSize < KERNEL_HEAP_MIN_SEGMENT_SIZE) ? KERNEL_HEAP_MIN_SEGMENT_SIZE : segmentSize;
+}
 
 DynamicMemoryAllocator g_kernelHeapAllocator;
 
-DECLARE_SPINLOCK(__kheap_lock);
+// Per-node heap arenas, nodes without an arena of their own use the boot heap
+DynamicMemoryAllocator  g_nodeHeapArenas[MAX_NUMA_NODES];
+DynamicMemoryAllocator* g_nodeHeapAllocators[MAX_NUMA_NODES];
 
 DynamicMemoryAllocator& DynamicMemoryAllocator::get() {
     return g_kernelHeapAllocator;
 }
 
+DynamicMemoryAllocator& DynamicMemoryAllocator::getForNode(uint8_t node) {
+    if (node < MAX_NUMA_NODES && g_nodeHeapAllocators[node]) {
+        return *g_nodeHeapAllocators[node];
+    }
+
+    return g_kernelHeapAllocator;
+}
+
+DynamicMemoryAllocator& DynamicMemoryAllocator::getForAddress(void* ptr) {
+    for (uint8_t node = 0; node < MAX_NUMA_NODES; ++node) {
+        if (g_nodeHeapAllocators[node] && g_nodeHeapAllocators[node]->containsAddress(ptr)) {
+            return *g_nodeHeapAllocators[node];
+        }
+    }
+
+    return g_kernelHeapAllocator;
+}
+
+bool DynamicMemoryAllocator::isHeapAddress(void* ptr) {
+    if (g_kernelHeapAllocator.containsAddress(ptr)) {
+        return true;
+    }
+
+    for (uint8_t node = 0; node < MAX_NUMA_NODES; ++node) {
+        if (g_nodeHeapAllocators[node] && g_nodeHeapAllocators[node]->containsAddress(ptr)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void DynamicMemoryAllocator::initializeNodeHeaps() {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint64_t arenaPages = KERNEL_NODE_HEAP_SIZE / PAGE_SIZE;
+
+    // The boot heap commits frames on demand from the bsp's node
+    uint8_t bootHeapNode = pageFrameAllocator.getCurrentNode();
+
+    for (uint8_t node = 0; node < pageFrameAllocator.getNodeCount(); ++node) {
+        if (node == bootHeapNode) {
+            g_nodeHeapAllocators[node] = &g_kernelHeapAllocator;
+            continue;
+        }
+
+        void* base = pageFrameAllocator.requestFreePagesOnNode(arenaPages, node);
+        if (!base) {
+            continue;
+        }
+
+        uint64_t arenaStart = reinterpret_cast<uint64_t>(base);
+        uint64_t arenaLast = arenaStart + KERNEL_NODE_HEAP_SIZE - 1;
+        uint8_t arenaNode = pageFrameAllocator.getNodeForPfn(reinterpret_cast<uint64_t>(__pa(base)) / PAGE_SIZE);
+
+        // The arena has to be local to the node and fully reachable through the higher half
+        if (arenaNode != node || arenaStart < 0xffff000000000000 || arenaLast < arenaStart) {
+            pageFrameAllocator.freePages(base, arenaPages);
+            continue;
+        }
+
+        g_nodeHeapArenas[node].init(arenaStart, KERNEL_NODE_HEAP_SIZE);
+        g_nodeHeapAllocators[node] = &g_nodeHeapArenas[node];
+    }
+}
+
 void DynamicMemoryAllocator::init(uint64_t base, size_t size) {
     m_heapSize = size;
+    m_reservedSize = size;
+    m_growable = false;
+    m_validationLevel = KERNEL_HEAP_VALIDATION_LEVEL;
 
     m_firstSegment = reinterpret_cast<HeapSegmentHeader*>(base);
 
-    // Lock the pages pertaining to the heap
-    paging::getGlobalPageFrameAllocator().lockPages(reinterpret_cast<void*>(base), size / PAGE_SIZE);
+    // Lock the pages pertaining to the heap. The arena is reached through
+    // the direct map, which migration can't remap, so the pages are pinned
+    // in place for good.
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    pageFrameAllocator.lockPages(reinterpret_cast<void*>(base), size / PAGE_SIZE);
+    pageFrameAllocator.setPageOwner(reinterpret_cast<void*>(base), size / PAGE_SIZE, paging::PageOwner::HeapArena);
 
-    // Setup the root segment
-    WRITE_SEGMENT_MAGIC_FIELD(m_firstSegment);
-    m_firstSegment->flags = {
-        .free = true,
-        .reserved = 0
-    };
-    m_firstSegment->size = size;
-    m_firstSegment->next = nullptr;
-    m_firstSegment->prev = nullptr;
+    _initializeSegments();
 }
 
-void* DynamicMemoryAllocator::allocate(size_t size) {
-    acquireSpinlock(&__kheap_lock);
+void DynamicMemoryAllocator::initGrowable(uint64_t base, size_t reservedSize, size_t initialSize) {
+    m_heapSize = 0;
+    m_reservedSize = reservedSize;
+    m_growable = true;
+    m_validationLevel = KERNEL_HEAP_VALIDATION_LEVEL;
 
-    size_t newSegmentSize = size + sizeof(HeapSegmentHeader);
+    m_firstSegment = reinterpret_cast<HeapSegmentHeader*>(base);
 
-    // + sizeof(HeapSegmentHeader) is to account for the splitting
-    HeapSegmentHeader* segment = _findFreeSegment(newSegmentSize + sizeof(HeapSegmentHeader));
+    if (!_commitRange(0, initialSize)) {
+        kprintError("Failed to commit the initial kernel heap memory\n");
+        return;
+    }
 
-    if (!segment) {
-        releaseSpinlock(&__kheap_lock);
+    m_heapSize = initialSize;
+
+    _initializeSegments();
+}
+
+void* DynamicMemoryAllocator::allocate(size_t size) {
+    return allocateAligned(size, KERNEL_HEAP_ALIGNMENT);
+}
+
+void* DynamicMemoryAllocator::allocateAligned(size_t size, size_t alignment) {
+    if (size > m_reservedSize || !alignment || (alignment & (alignment - 1)) || alignment > m_reservedSize) {
         return nullptr;
     }
 
-    if (!_splitSegment(segment, newSegmentSize)) {
-        releaseSpinlock(&__kheap_lock);
+    if (alignment < KERNEL_HEAP_ALIGNMENT) {
+        alignment = KERNEL_HEAP_ALIGNMENT;
+    }
+
+    size_t newSegmentSize = _getSegmentSize(size);
+
+    // Leave room for the aligned segment plus a leading free segment of at least the minimum size
+    size_t searchSize = newSegmentSize;
+    if (alignment > KERNEL_HEAP_ALIGNMENT) {
+        searchSize += alignment + KERNEL_HEAP_MIN_SEGMENT_SIZE;
+    }
+
+    acquireSpinlock(&m_lock);
+
+    HeapSegmentHeader* segment = _takeFreeSegment(searchSize);
+
+    // Commit more memory if the heap still has reserved address space left
+    if (!segment && m_growable && _growHeap(searchSize)) {
+        segment = _takeFreeSegment(searchSize);
+    }
+
+    if (!segment) {
+        releaseSpinlock(&m_lock);
         return nullptr;
     }
 
     // Mark segment as used
     segment->flags.free = false;
 
+    HeapSegmentHeader* nextSegment = _getNextSegment(segment);
+    if (nextSegment) {
+        nextSegment->flags.previousFree = false;
+    }
+
+    if (alignment > KERNEL_HEAP_ALIGNMENT) {
+        segment = _alignSegment(segment, alignment);
+    }
+
+    // Give the unneeded tail back to the free lists
+    _splitSegment(segment, newSegmentSize);
+
+    _sealSegment(segment);
+
+    m_stats.allocations++;
+
     // Return the usable memory after the segment header
     uint8_t* usableRegionStart = reinterpret_cast<uint8_t*>(segment) + sizeof(HeapSegmentHeader);
 
-    releaseSpinlock(&__kheap_lock);
+    releaseSpinlock(&m_lock);
     return static_cast<void*>(usableRegionStart);
 }
 
 void DynamicMemoryAllocator::free(void* ptr) {
-    acquireSpinlock(&__kheap_lock);
+    acquireSpinlock(&m_lock);
 
     HeapSegmentHeader* segment = reinterpret_cast<HeapSegmentHeader*>(
         reinterpret_cast<uint8_t*>(ptr) - sizeof(HeapSegmentHeader)
     );
 
-    // Verify the given pointer to be a heap segment header
-    if (memcmp(segment->magic, (void*)KERNEL_HEAP_SEGMENT_HDR_SIGNATURE, 7) != 0) {
+    // Verify the given pointer to be a used heap segment header
+    if (!_validateSegment(segment)) {
         kuPrint("Invalid pointer provided to free()!\n");
-        releaseSpinlock(&__kheap_lock);
+        releaseSpinlock(&m_lock);
         return;
     }
 
-    segment->flags.free = true;
+    // Coalesce with both physical neighbors, the previous
+    // segment is found through the footer preceding the header.
+    _mergeSegmentWithNext(segment);
+    segment = _mergeSegmentWithPrevious(segment);
 
-    // Merging with the next segment has to come first
-    // to preserve correct base-relative calculations.
-    if (segment->next && segment->next->flags.free) {
-        _mergeSegmentWithNext(segment);
-    }
+    _insertFreeSegment(segment);
 
-    // Check if merging with the previous segment is possible
-    if (segment->prev && segment->prev->flags.free) {
-        _mergeSegmentWithPrevious(segment);
-    }
+    m_stats.frees++;
 
-    releaseSpinlock(&__kheap_lock);
+    releaseSpinlock(&m_lock);
 }
 
 void* DynamicMemoryAllocator::reallocate(void* ptr, size_t newSize) {
@@ -102,66 +253,473 @@ void* DynamicMemoryAllocator::reallocate(void* ptr, size_t newSize) {
         return allocate(newSize);
     }
 
-    acquireSpinlock(&__kheap_lock);
+    if (newSize > m_reservedSize) {
+        return nullptr;
+    }
+
+    acquireSpinlock(&m_lock);
 
     HeapSegmentHeader* segment = reinterpret_cast<HeapSegmentHeader*>(
         reinterpret_cast<uint8_t*>(ptr) - sizeof(HeapSegmentHeader)
     );
 
-    // Verify the given pointer to be a heap segment header
-    if (memcmp(segment->magic, (void*)KERNEL_HEAP_SEGMENT_HDR_SIGNATURE, 7) != 0) {
+    // Verify the given pointer to be a used heap segment header
+    if (!_validateSegment(segment)) {
         kuPrint("Invalid pointer provided to realloc()!\n");
-        releaseSpinlock(&__kheap_lock);
+        releaseSpinlock(&m_lock);
         return nullptr;
     }
 
+    size_t newSegmentSize = _getSegmentSize(newSize);
+    size_t oldUsableSize = GET_USABLE_BLOCK_MEMORY_SIZE(segment);
+
+    m_stats.reallocations++;
+
     // If the current segment is big enough to hold the new size,
     // potentially resize (shrink) it and return the same pointer.
-    if (segment->size >= newSize + sizeof(HeapSegmentHeader)) {
-        _splitSegment(segment, newSize + sizeof(HeapSegmentHeader));
-        releaseSpinlock(&__kheap_lock);
+    if (segment->size >= newSegmentSize) {
+        _splitSegment(segment, newSegmentSize);
+        _sealSegment(segment);
+
+        m_stats.inPlaceShrinks++;
+        m_stats.copyBytesAvoided += (newSize < oldUsableSize) ? newSize : oldUsableSize;
+
+        releaseSpinlock(&m_lock);
         return ptr;
-    } else {
-        // Release the currently held lock because further `allocate`
-        // and `free` calls will attempt to acquire the lock themselves.
-        releaseSpinlock(&__kheap_lock);
+    }
+
+    // Grow into the following free segment without moving the data
+    if (_extendSegment(segment, newSegmentSize)) {
+        _sealSegment(segment);
+
+        m_stats.inPlaceGrowths++;
+        m_stats.copyBytesAvoided += oldUsableSize;
+
+        releaseSpinlock(&m_lock);
+        return ptr;
+    }
+
+    // Release the currently held lock because further `allocate`
+    // and `free` calls will attempt to acquire the lock themselves.
+    releaseSpinlock(&m_lock);
+
+    // Allocate new memory, and check if allocation was successful
+    void* newPtr = allocate(newSize);
+    if (!newPtr) {
+        return nullptr;
+    }
+
+    // Copy the old data to the new location
+    memcpy(newPtr, ptr, oldUsableSize);
+
+    // Free the old segment
+    free(ptr);
+
+    __sync_fetch_and_add(&m_stats.copiedReallocations, 1);
+    __sync_fetch_and_add(&m_stats.bytesCopied, oldUsableSize);
+
+    return newPtr;
+}
+
+uint64_t DynamicMemoryAllocator::trim() {
+    if (!m_growable || !tryAcquireSpinlock(&m_lock)) {
+        return 0;
+    }
+
+    uint64_t heapBase = reinterpret_cast<uint64_t>(m_firstSegment);
+    HeapSegmentHeader* sentinel = reinterpret_cast<HeapSegmentHeader*>(heapBase + m_heapSize - sizeof(HeapSegmentHeader));
+
+    // Only a free segment right in front of the sentinel can cover whole chunks at the end
+    if (!sentinel->flags.previousFree) {
+        releaseSpinlock(&m_lock);
+        return 0;
+    }
+
+    HeapSegmentFooter* lastFooter = reinterpret_cast<HeapSegmentFooter*>(
+        reinterpret_cast<uint8_t*>(sentinel) - sizeof(HeapSegmentFooter)
+    );
+
+    HeapSegmentHeader* lastSegment = reinterpret_cast<HeapSegmentHeader*>(
+        reinterpret_cast<uint8_t*>(sentinel) - lastFooter->size
+    );
+
+    // The last segment keeps its minimum size and is followed by the new sentinel
+    uint64_t lastSegmentOffset = reinterpret_cast<uint64_t>(lastSegment) - heapBase;
+    uint64_t newHeapSize = lastSegmentOffset + KERNEL_HEAP_MIN_SEGMENT_SIZE + sizeof(HeapSegmentHeader);
+    newHeapSize = (newHeapSize + KERNEL_HEAP_CHUNK_SIZE - 1) & ~(static_cast<uint64_t>(KERNEL_HEAP_CHUNK_SIZE) - 1);
+
+    if (newHeapSize < KERNEL_HEAP_INITIAL_COMMIT_SIZE) {
+        newHeapSize = KERNEL_HEAP_INITIAL_COMMIT_SIZE;
+    }
 
-        // Allocate new memory, and check if allocation was successful
-        void* newPtr = allocate(newSize);
-        if (!newPtr) {
+    if (newHeapSize >= m_heapSize) {
+        releaseSpinlock(&m_lock);
+        return 0;
+    }
+
+    uint64_t releasedSize = m_heapSize - newHeapSize;
+
+    _removeFreeSegment(lastSegment);
+
+    m_heapSize = newHeapSize;
+    lastSegment->size = newHeapSize - sizeof(HeapSegmentHeader) - lastSegmentOffset;
+
+    _writeSentinelSegment();
+    _insertFreeSegment(lastSegment);
+
+    _decommitRange(newHeapSize, releasedSize);
+
+    releaseSpinlock(&m_lock);
+    return releasedSize;
+}
+
+uint64_t DynamicMemoryAllocator::migratePages(uint64_t startPfn, uint64_t endPfn) {
+    // The lock keeps chunks from being committed or released while their pages move
+    if (!m_growable || !tryAcquireSpinlock(&m_lock)) {
+        return 0;
+    }
+
+    uint64_t moved = 0;
+
+    RUN_ELEVATED({
+        moved = paging::migrateMappedPages(
+            m_firstSegment,
+            m_heapSize,
+            startPfn,
+            endPfn,
+            paging::PageOwner::Heap,
+            paging::getCurrentTopLevelPageTable()
+        );
+    });
+
+    releaseSpinlock(&m_lock);
+
+    return moved;
+}
+
+HeapFragmentationStats DynamicMemoryAllocator::getFragmentationStats() {
+    HeapFragmentationStats stats;
+    zeromem(&stats, sizeof(HeapFragmentationStats));
+
+    acquireSpinlock(&m_lock);
+
+    HeapSegmentHeader* segment = m_firstSegment;
+
+    // The last segment is the sentinel
+    while (segment && _getNextSegment(segment)) {
+        if (segment->flags.free) {
+            int bucket = 63 - __builtin_clzll(segment->size);
+            if (bucket >= KERNEL_HEAP_FRAGMENTATION_BUCKETS) {
+                bucket = KERNEL_HEAP_FRAGMENTATION_BUCKETS - 1;
+            }
+
+            stats.freeSegments++;
+            stats.freeBytes += segment->size;
+            stats.freeSegmentHistogram[bucket]++;
+
+            if (segment->size > stats.largestFreeSegment) {
+                stats.largestFreeSegment = segment->size;
+            }
+        } else {
+            stats.usedSegments++;
+            stats.usedBytes += segment->size;
+        }
+
+        segment = _getNextSegment(segment);
+    }
+
+    releaseSpinlock(&m_lock);
+
+    return stats;
+}
+
+void DynamicMemoryAllocator::_initializeSegments() {
+    // Start out with empty bins
+    m_flBitmap = 0;
+    zeromem(m_slBitmaps, sizeof(m_slBitmaps));
+    zeromem(m_freeLists, sizeof(m_freeLists));
+
+    // Canaries only have to be unpredictable, not cryptographically strong
+    if (!g_heapCanarySecret) {
+        g_heapCanarySecret = (rdtsc() * 0x9e3779b97f4a7c15ULL) | 1;
+    }
+
+    // Setup the root segment spanning everything up to the sentinel
+    _clearSegmentHeader(m_firstSegment, m_heapSize - sizeof(HeapSegmentHeader));
+
+    _writeSentinelSegment();
+    _insertFreeSegment(m_firstSegment);
+}
+
+void DynamicMemoryAllocator::_writeSentinelSegment() {
+    HeapSegmentHeader* sentinel = reinterpret_cast<HeapSegmentHeader*>(
+        reinterpret_cast<uint8_t*>(m_firstSegment) + m_heapSize - sizeof(HeapSegmentHeader)
+    );
+
+    _clearSegmentHeader(sentinel, sizeof(HeapSegmentHeader));
+    _sealSegment(sentinel);
+}
+
+void DynamicMemoryAllocator::_sealSegment(HeapSegmentHeader* segment) {
+    segment->canary = _computeSegmentCanary(segment);
+}
+
+bool DynamicMemoryAllocator::_validateSegment(HeapSegmentHeader* segment) {
+    if (segment->flags.free) {
+        return false;
+    }
+
+    if (m_validationLevel == HeapValidationLevel::None) {
+        return true;
+    }
+
+    // The canary covers the size, so the neighbors can be located safely past this point
+    if (segment->canary != _computeSegmentCanary(segment)) {
+        return false;
+    }
+
+    if (m_validationLevel != HeapValidationLevel::Full) {
+        return true;
+    }
+
+    // A used segment never has a free successor that believes otherwise
+    HeapSegmentHeader* nextSegment = _getNextSegment(segment);
+    if (nextSegment) {
+        if (nextSegment->flags.previousFree) {
+            return false;
+        }
+
+        if (nextSegment->flags.free ? GET_SEGMENT_FOOTER(nextSegment)->size != nextSegment->size
+                                    : nextSegment->canary != _computeSegmentCanary(nextSegment)) {
+            return false;
+        }
+    }
+
+    if (segment->flags.previousFree) {
+        HeapSegmentFooter* previousFooter = reinterpret_cast<HeapSegmentFooter*>(
+            reinterpret_cast<uint8_t*>(segment) - sizeof(HeapSegmentFooter)
+        );
+
+        uint64_t previousOffset = reinterpret_cast<uint64_t>(segment) - reinterpret_cast<uint64_t>(m_firstSegment);
+        if (previousFooter->size < KERNEL_HEAP_MIN_SEGMENT_SIZE || previousFooter->size > previousOffset) {
+            return false;
+        }
+
+        HeapSegmentHeader* previousSegment = reinterpret_cast<HeapSegmentHeader*>(
+            reinterpret_cast<uint8_t*>(segment) - previousFooter->size
+        );
+
+        if (!previousSegment->flags.free || previousSegment->size != previousFooter->size) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool DynamicMemoryAllocator::_growHeap(size_t minSegmentSize) {
+    //
+    // _takeFreeSegment() only looks at bins whose segments are all large
+    // enough, so the new segment has to reach the bin the search starts
+    // at. Past 64MB that bin boundary lies beyond the next chunk boundary.
+    //
+    uint64_t growSize = _roundUpToSearchBin(minSegmentSize);
+    growSize = (growSize + KERNEL_HEAP_CHUNK_SIZE - 1) & ~(static_cast<uint64_t>(KERNEL_HEAP_CHUNK_SIZE) - 1);
+
+    if (m_heapSize + growSize > m_reservedSize || !_commitRange(m_heapSize, growSize)) {
+        return false;
+    }
+
+    // The old sentinel becomes the header of the newly committed segment
+    HeapSegmentHeader* segment = reinterpret_cast<HeapSegmentHeader*>(
+        reinterpret_cast<uint8_t*>(m_firstSegment) + m_heapSize - sizeof(HeapSegmentHeader)
+    );
+
+    segment->size = growSize;
+    m_heapSize += growSize;
+
+    _writeSentinelSegment();
+
+    segment = _mergeSegmentWithPrevious(segment);
+    _insertFreeSegment(segment);
+
+    return true;
+}
+
+bool DynamicMemoryAllocator::_commitRange(uint64_t offset, uint64_t size) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint8_t* base = reinterpret_cast<uint8_t*>(m_firstSegment) + offset;
+    uint64_t committed = 0;
+
+    // Only the heap mappings reference the frames, compaction moves them through migratePages()
+    RUN_ELEVATED({
+        committed = paging::allocateAndMapPages(
+            base,
+            size / PAGE_SIZE,
+            USERSPACE_PAGE,
+            0,
+            paging::PageOwner::Heap,
+            paging::getCurrentTopLevelPageTable(),
+            pageFrameAllocator
+        ) * PAGE_SIZE;
+    });
+
+    if (committed < size) {
+        _decommitRange(offset, committed);
+        return false;
+    }
+
+    return true;
+}
+
+void DynamicMemoryAllocator::_decommitRange(uint64_t offset, uint64_t size) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint8_t* base = reinterpret_cast<uint8_t*>(m_firstSegment) + offset;
+
+    // The released frames only go back once every cpu dropped their translations
+    RUN_ELEVATED({
+        paging::unmapPages(base, size / PAGE_SIZE, paging::getCurrentTopLevelPageTable(), true, pageFrameAllocator);
+    });
+}
+
+void DynamicMemoryAllocator::_mapSizeToBin(size_t size, uint32_t* fl, uint32_t* sl) {
+    if (size < KERNEL_HEAP_SMALL_SEGMENT_SIZE) {
+        *fl = 0;
+        *sl = static_cast<uint32_t>(size) / (KERNEL_HEAP_SMALL_SEGMENT_SIZE / KERNEL_HEAP_SL_INDEX_COUNT);
+        return;
+    }
+
+    uint32_t highestBit = 63 - __builtin_clzll(size);
+
+    *sl = static_cast<uint32_t>(size >> (highestBit - KERNEL_HEAP_SL_INDEX_COUNT_LOG2)) ^ KERNEL_HEAP_SL_INDEX_COUNT;
+    *fl = highestBit - (KERNEL_HEAP_FL_INDEX_SHIFT - 1);
+
+    // Anything past the largest range shares its last bin
+    if (*fl >= KERNEL_HEAP_FL_INDEX_COUNT) {
+        *fl = KERNEL_HEAP_FL_INDEX_COUNT - 1;
+        *sl = KERNEL_HEAP_SL_INDEX_COUNT - 1;
+    }
+}
+
+size_t DynamicMemoryAllocator::_roundUpToSearchBin(size_t size) {
+    // Rounding up to the next bin boundary makes every segment of the bin large enough
+    if (size >= KERNEL_HEAP_SMALL_SEGMENT_SIZE) {
+        uint32_t highestBit = 63 - __builtin_clzll(size);
+        uint64_t binSize = 1ULL << (highestBit - KERNEL_HEAP_SL_INDEX_COUNT_LOG2);
+
+        size = (size + binSize - 1) & ~(binSize - 1);
+    }
+
+    return size;
+}
+
+void DynamicMemoryAllocator::_mapSizeToSearchBin(size_t size, uint32_t* fl, uint32_t* sl) {
+    _mapSizeToBin(_roundUpToSearchBin(size), fl, sl);
+}
+
+HeapSegmentHeader* DynamicMemoryAllocator::_takeFreeSegment(size_t minSize) {
+    uint32_t fl, sl;
+    _mapSizeToSearchBin(minSize, &fl, &sl);
+
+    // Non-empty bins of the same range holding large enough segments
+    uint32_t slMap = m_slBitmaps[fl] & (~0U << sl);
+
+    if (!slMap) {
+        // Fall back to the smallest non-empty larger range
+        uint32_t flMap = (fl + 1 < 32) ? (m_flBitmap & (~0U << (fl + 1))) : 0;
+        if (!flMap) {
             return nullptr;
         }
 
-        // Copy the old data to the new location
-        memcpy(newPtr, ptr, segment->size - sizeof(HeapSegmentHeader));
+        fl = __builtin_ctz(flMap);
+        slMap = m_slBitmaps[fl];
+    }
+
+    sl = __builtin_ctz(slMap);
 
-        // Free the old segment
-        free(ptr);
+    HeapSegmentHeader* segment = m_freeLists[fl][sl];
 
-        return newPtr;
+    // The last bin also collects oversized segments that might still be too small
+    if (segment->size < minSize) {
+        return nullptr;
     }
 
-    // Should never get here
-    return nullptr;
+    _removeFreeSegment(segment);
+    return segment;
 }
 
-HeapSegmentHeader* DynamicMemoryAllocator::_findFreeSegment(size_t minSize) {
-    HeapSegmentHeader* seg = m_firstSegment;
+void DynamicMemoryAllocator::_insertFreeSegment(HeapSegmentHeader* segment) {
+    uint32_t fl, sl;
+    _mapSizeToBin(segment->size, &fl, &sl);
 
-    while (seg) {
-        if (seg->flags.free && (seg->size >= minSize)) {
-            return seg;
+    segment->flags.free = true;
+    segment->canary = 0;
+    GET_SEGMENT_FOOTER(segment)->size = segment->size;
+
+    HeapSegmentHeader* head = m_freeLists[fl][sl];
+    HeapFreeSegmentLinks* links = GET_SEGMENT_FREE_LINKS(segment);
+
+    links->prevFree = nullptr;
+    links->nextFree = head;
+
+    if (head) {
+        GET_SEGMENT_FREE_LINKS(head)->prevFree = segment;
+    }
+
+    m_freeLists[fl][sl] = segment;
+    m_slBitmaps[fl] |= (1U << sl);
+    m_flBitmap |= (1U << fl);
+
+    // Let the following segment know where to find its free predecessor
+    HeapSegmentHeader* nextSegment = _getNextSegment(segment);
+    if (nextSegment) {
+        nextSegment->flags.previousFree = true;
+    }
+}
+
+void DynamicMemoryAllocator::_removeFreeSegment(HeapSegmentHeader* segment) {
+    uint32_t fl, sl;
+    _mapSizeToBin(segment->size, &fl, &sl);
+
+    HeapFreeSegmentLinks* links = GET_SEGMENT_FREE_LINKS(segment);
+
+    if (links->prevFree) {
+        GET_SEGMENT_FREE_LINKS(links->prevFree)->nextFree = links->nextFree;
+    } else {
+        m_freeLists[fl][sl] = links->nextFree;
+    }
+
+    if (links->nextFree) {
+        GET_SEGMENT_FREE_LINKS(links->nextFree)->prevFree = links->prevFree;
+    }
+
+    // Keep the bitmaps in sync with the bins
+    if (!m_freeLists[fl][sl]) {
+        m_slBitmaps[fl] &= ~(1U << sl);
+
+        if (!m_slBitmaps[fl]) {
+            m_flBitmap &= ~(1U << fl);
         }
+    }
+
+    links->nextFree = nullptr;
+    links->prevFree = nullptr;
+}
+
+HeapSegmentHeader* DynamicMemoryAllocator::_getNextSegment(HeapSegmentHeader* segment) const {
+    uint64_t heapEnd = reinterpret_cast<uint64_t>(m_firstSegment) + m_heapSize;
+    uint64_t next = reinterpret_cast<uint64_t>(segment) + segment->size;
 
-        seg = seg->next;
+    if (next >= heapEnd) {
+        return nullptr;
     }
 
-    return nullptr;
+    return reinterpret_cast<HeapSegmentHeader*>(next);
 }
 
 bool DynamicMemoryAllocator::_splitSegment(HeapSegmentHeader* segment, size_t size) {
     // Check if two sub-segments can be formed from the given segment
-    if (static_cast<int64_t>(segment->size - (size + sizeof(HeapSegmentHeader))) < MIN_HEAP_SEGMENT_CAPACITY * 2) {
+    if (segment->size < size + KERNEL_HEAP_MIN_SEGMENT_SIZE) {
         return false;
     }
 
@@ -170,59 +728,110 @@ bool DynamicMemoryAllocator::_splitSegment(HeapSegmentHeader* segment, size_t si
     );
 
     // Setup the new segment
-    WRITE_SEGMENT_MAGIC_FIELD(newSegment)
-    newSegment->flags.free = segment->flags.free;
-    newSegment->size = segment->size - size;
-    newSegment->next = segment->next;
-    newSegment->prev = segment;
+    _clearSegmentHeader(newSegment, segment->size - size);
 
     // Adjust the existing segment
     segment->size = size;
-    segment->next = newSegment;
+
+    _mergeSegmentWithNext(newSegment);
+    _insertFreeSegment(newSegment);
 
     return true;
 }
 
-bool DynamicMemoryAllocator::_mergeSegmentWithPrevious(HeapSegmentHeader* segment) {
-    HeapSegmentHeader* previousSegment = segment->prev;
+bool DynamicMemoryAllocator::_extendSegment(HeapSegmentHeader* segment, size_t size) {
+    HeapSegmentHeader* nextSegment = _getNextSegment(segment);
+
+    // A used segment right in front of the sentinel can take in freshly committed memory
+    if (m_growable && nextSegment && !nextSegment->flags.free && !_getNextSegment(nextSegment)) {
+        if (_growHeap(size - segment->size)) {
+            nextSegment = _getNextSegment(segment);
+        }
+    }
 
-    if (previousSegment == nullptr) {
+    if (!nextSegment || !nextSegment->flags.free || segment->size + nextSegment->size < size) {
         return false;
     }
 
+    _removeFreeSegment(nextSegment);
+
+    segment->size += nextSegment->size;
+    nextSegment->canary = 0;
+
+    HeapSegmentHeader* followingSegment = _getNextSegment(segment);
+    if (followingSegment) {
+        followingSegment->flags.previousFree = false;
+    }
+
+    // Give back whatever isn't needed of the absorbed segment
+    _splitSegment(segment, size);
+
+    return true;
+}
+
+HeapSegmentHeader* DynamicMemoryAllocator::_alignSegment(HeapSegmentHeader* segment, size_t alignment) {
+    uint64_t segmentStart = reinterpret_cast<uint64_t>(segment);
+    uint64_t userStart = (segmentStart + sizeof(HeapSegmentHeader) + alignment - 1) & ~(static_cast<uint64_t>(alignment) - 1);
+
+    if (userStart - sizeof(HeapSegmentHeader) == segmentStart) {
+        return segment;
+    }
+
+    // The leading slack has to be able to stand on its own as a free segment
+    while (userStart - sizeof(HeapSegmentHeader) - segmentStart < KERNEL_HEAP_MIN_SEGMENT_SIZE) {
+        userStart += alignment;
+    }
+
+    uint64_t slackSize = userStart - sizeof(HeapSegmentHeader) - segmentStart;
+
+    HeapSegmentHeader* alignedSegment = reinterpret_cast<HeapSegmentHeader*>(userStart - sizeof(HeapSegmentHeader));
+
+    _clearSegmentHeader(alignedSegment, segment->size - slackSize);
+
+    // The segment in front of a free segment is always in use, so the slack can't be merged
+    segment->size = slackSize;
+    _insertFreeSegment(segment);
+
+    return alignedSegment;
+}
+
+HeapSegmentHeader* DynamicMemoryAllocator::_mergeSegmentWithPrevious(HeapSegmentHeader* segment) {
+    if (!segment->flags.previousFree) {
+        return segment;
+    }
+
+    // The free predecessor's footer sits right in front of the header
+    HeapSegmentFooter* previousFooter = reinterpret_cast<HeapSegmentFooter*>(
+        reinterpret_cast<uint8_t*>(segment) - sizeof(HeapSegmentFooter)
+    );
+
+    HeapSegmentHeader* previousSegment = reinterpret_cast<HeapSegmentHeader*>(
+        reinterpret_cast<uint8_t*>(segment) - previousFooter->size
+    );
+
+    _removeFreeSegment(previousSegment);
+
     // When merging with a previous segment,
     // this segment essentially ceases to exist.
     previousSegment->size += segment->size;
-    previousSegment->next = segment->next;
-    
-    // Adjust the next segment's "previous"
-    // pointer to point to the previous segment.
-    if (previousSegment->next) {
-        previousSegment->next->prev = previousSegment;
-    }
+    segment->canary = 0;
 
-    return true;
+    return previousSegment;
 }
 
-bool DynamicMemoryAllocator::_mergeSegmentWithNext(HeapSegmentHeader* segment) {
-    HeapSegmentHeader* nextSegment = segment->next;
+void DynamicMemoryAllocator::_mergeSegmentWithNext(HeapSegmentHeader* segment) {
+    HeapSegmentHeader* nextSegment = _getNextSegment(segment);
 
-    if (nextSegment == nullptr) {
-        return false;
+    if (!nextSegment || !nextSegment->flags.free) {
+        return;
     }
 
+    _removeFreeSegment(nextSegment);
+
     // When merging with a next segment, the
     // next segment essentially ceases to exist.
     segment->size += nextSegment->size;
-    segment->next = nextSegment->next;
-    
-    // Adjust the futher next segment's "previous"
-    // pointer to point to the current segment.
-    if (segment->next) {
-        segment->next->prev = segment;
-    }
-
-    return true;
+    nextSegment->canary = 0;
 }
 
 void DynamicMemoryAllocator::__debugHeap() {
@@ -231,17 +840,10 @@ void DynamicMemoryAllocator::__debugHeap() {
 
     kuPrint("---------------------------------------------\n");
     while (seg) {
-        kuPrint("Segment %llu:\n", segId);
-        kuPrint("    base         : %llx\n", (uint64_t)seg);
-        kuPrint("    userptr      : %llx\n", (uint64_t)seg + sizeof(HeapSegmentHeader));
-        kuPrint("    total size   : %llx\n", seg->size);
-        kuPrint("    usable size  : %llx\n", GET_USABLE_BLOCK_MEMORY_SIZE(seg));
-        kuPrint("    status       : %s\n", seg->flags.free ? "free" : "used");
-        kuPrint("    next         : %llx\n", (uint64_t)seg->next);
-        kuPrint("    prev         : %llx\n\n", (uint64_t)seg->prev);
-        
+        __debugHeapSegment(seg, segId);
+
         segId++;
-        seg = seg->next;
+        seg = _getNextSegment(seg);
     }
     kuPrint("---------------------------------------------\n");
 }
@@ -259,8 +861,15 @@ void DynamicMemoryAllocator::__debugHeapSegment(void* ptr, int64_t segId) {
     kuPrint("    total size   : %llx\n", seg->size);
     kuPrint("    usable size  : %llx\n", GET_USABLE_BLOCK_MEMORY_SIZE(seg));
     kuPrint("    status       : %s\n", seg->flags.free ? "free" : "used");
-    kuPrint("    next         : %llx\n", (uint64_t)seg->next);
-    kuPrint("    prev         : %llx\n\n", (uint64_t)seg->prev);
+
+    kuPrint("    canary       : %x\n", seg->canary);
+
+    if (seg->flags.free) {
+        kuPrint("    next free    : %llx\n", (uint64_t)GET_SEGMENT_FREE_LINKS(seg)->nextFree);
+        kuPrint("    prev free    : %llx\n", (uint64_t)GET_SEGMENT_FREE_LINKS(seg)->prevFree);
+    }
+
+    kuPrint("\n");
 }
 
 void DynamicMemoryAllocator::__debugUserHeapPointer(void* ptr, int64_t id) {
@@ -271,9 +880,23 @@ void DynamicMemoryAllocator::__debugUserHeapPointer(void* ptr, int64_t id) {
 bool DynamicMemoryAllocator::__detectHeapCorruption(bool dbgLog) {
     HeapSegmentHeader* seg = m_firstSegment;
     int64_t segId = 1;
+    bool previousFree = false;
 
     while (seg) {
-        if (memcmp(seg->magic, (void*)KERNEL_HEAP_SEGMENT_HDR_SIGNATURE, sizeof(seg->magic)) != 0) {
+        // Free segments have their canary cleared, used ones have to match
+        bool corrupted = seg->flags.free ? seg->canary != 0 : seg->canary != _computeSegmentCanary(seg);
+
+        // Only the sentinel at the end of the heap is smaller than the minimum segment size
+        bool sentinel = _getNextSegment(seg) == nullptr;
+
+        // Boundary tags have to agree with the header and the predecessor
+        if (!corrupted) {
+            corrupted = (seg->size < KERNEL_HEAP_MIN_SEGMENT_SIZE && !sentinel) ||
+                        seg->flags.previousFree != previousFree ||
+                        (seg->flags.free && GET_SEGMENT_FOOTER(seg)->size != seg->size);
+        }
+
+        if (corrupted) {
             if (dbgLog) {
                 kuPrint("---- Detected Heap Corruption (segment %lli) ----\n", segId);
                 __debugHeapSegment(seg, segId);
@@ -281,9 +904,11 @@ bool DynamicMemoryAllocator::__detectHeapCorruption(bool dbgLog) {
 
             return true;
         }
-        
+
+        previousFree = seg->flags.free;
+
         segId++;
-        seg = seg->next;
+        seg = _getNextSegment(seg);
     }
 
     if (dbgLog) {
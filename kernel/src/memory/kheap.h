@@ -1,37 +1,212 @@
 #ifndef KHEAP_H
 #define KHEAP_H
-#include <ktypes.h>
+#include <sync.h>
 
-#define KERNEL_HEAP_INIT_SIZE               0x60000000 // 1.5GB Kernel Heap
+// Virtual address range reserved for the boot heap, it is shared by all address spaces through PML4 entry 511
+#define KERNEL_HEAP_VIRTUAL_BASE            0xffffff8000000000
+#define KERNEL_HEAP_RESERVED_SIZE           0x60000000 // 1.5GB Kernel Heap
 
-#define KERNEL_HEAP_SEGMENT_HDR_SIGNATURE   "HEAPHDR"
+// Granularity in which physical frames get committed to and released from the boot heap
+#define KERNEL_HEAP_CHUNK_SIZE              0x200000   // 2MB
 
+// Memory committed when the boot heap is created, the heap never shrinks below it
+#define KERNEL_HEAP_INITIAL_COMMIT_SIZE     (KERNEL_HEAP_CHUNK_SIZE * 2)
+
+// Size of the heap arena carved out of every NUMA node other than the boot heap's node
+#define KERNEL_NODE_HEAP_SIZE               0x4000000  // 64MB
+
+// Segment sizes and user pointers are multiples of the heap alignment
+#define KERNEL_HEAP_ALIGNMENT               16
+
+//
+// Two-level segregated fit bins. The first level splits sizes into power of
+// two ranges, the second level splits every range into 2^SL_INDEX_COUNT_LOG2
+// linear bins. Segments below KERNEL_HEAP_SMALL_SEGMENT_SIZE all share the
+// first first-level range with 16 byte wide bins.
+//
+#define KERNEL_HEAP_SL_INDEX_COUNT_LOG2     4
+#define KERNEL_HEAP_SL_INDEX_COUNT          (1 << KERNEL_HEAP_SL_INDEX_COUNT_LOG2)
+#define KERNEL_HEAP_FL_INDEX_SHIFT          (KERNEL_HEAP_SL_INDEX_COUNT_LOG2 + 4)
+#define KERNEL_HEAP_FL_INDEX_MAX            32
+#define KERNEL_HEAP_FL_INDEX_COUNT          (KERNEL_HEAP_FL_INDEX_MAX - KERNEL_HEAP_FL_INDEX_SHIFT + 1)
+#define KERNEL_HEAP_SMALL_SEGMENT_SIZE      (1 << KERNEL_HEAP_FL_INDEX_SHIFT)
+
+//
+// Every segment starts with a compact 16 byte header. Free segments
+// additionally carry their free list links right after the header and a
+// footer holding their size in their last 8 bytes, which lets the following
+// segment find its physical predecessor when merging. Both only exist
+// while the segment is free, in-use segments hand that memory out.
+//
 struct HeapSegmentHeader {
-    uint8_t     magic[7];
-    
+    // Size of the whole segment including the header
+    uint64_t    size;
+
     struct {
-        uint8_t free        : 1;
-        uint8_t reserved    : 7;
+        uint8_t free            : 1;
+        uint8_t previousFree    : 1;
+        uint8_t reserved        : 6;
     } flags;
 
-    uint64_t    size;
+    uint8_t     reserved[3];
 
-    HeapSegmentHeader* next;
-    HeapSegmentHeader* prev;
+    //
+    // Hash of the segment address, size and a per-boot secret. Only in-use
+    // segments carry a valid canary, it gets cleared as soon as the segment
+    // is freed or merged into a neighbor.
+    //
+    uint32_t    canary;
 } __attribute__((packed, aligned(16)));
 
+struct HeapFreeSegmentLinks {
+    HeapSegmentHeader* nextFree;
+    HeapSegmentHeader* prevFree;
+};
+
+struct HeapSegmentFooter {
+    uint64_t    size;
+};
+
+// Smallest segment that still has room for the free list links and the footer once it gets freed
+#define KERNEL_HEAP_MIN_SEGMENT_SIZE \
+    ((sizeof(HeapSegmentHeader) + sizeof(HeapFreeSegmentLinks) + sizeof(HeapSegmentFooter) + KERNEL_HEAP_ALIGNMENT - 1) & ~(KERNEL_HEAP_ALIGNMENT - 1))
+
+//
+// Checks free() and realloc() run on the segment behind a pointer before
+// trusting it. Every level includes the checks of the levels below it.
+//
+enum class HeapValidationLevel : uint8_t {
+    // Only rejects segments that are already free
+    None    = 0,
+
+    // Verifies the header canary, catches wild pointers, double frees and smashed headers
+    Canary  = 1,
+
+    // Also cross-checks the boundary tags of both physical neighbors
+    Full    = 2
+};
+
+// Validation level every heap arena starts out with
+#ifndef KERNEL_HEAP_VALIDATION_LEVEL
+#define KERNEL_HEAP_VALIDATION_LEVEL        HeapValidationLevel::Canary
+#endif
+
+struct HeapStats {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t reallocations;
+
+    uint64_t inPlaceShrinks;
+    uint64_t inPlaceGrowths;
+    uint64_t copiedReallocations;
+
+    // Bytes that in-place reallocations didn't have to copy
+    uint64_t copyBytesAvoided;
+    uint64_t bytesCopied;
+};
+
+// Number of power of two buckets in the free segment size histogram
+#define KERNEL_HEAP_FRAGMENTATION_BUCKETS   32
+
+struct HeapFragmentationStats {
+    uint64_t usedSegments;
+    uint64_t usedBytes;
+
+    uint64_t freeSegments;
+    uint64_t freeBytes;
+    uint64_t largestFreeSegment;
+
+    // Bucket i counts the free segments of [2^i, 2^(i+1)) bytes
+    uint64_t freeSegmentHistogram[KERNEL_HEAP_FRAGMENTATION_BUCKETS];
+};
+
+//
+// Segment heap serving allocations that are too large for the slab
+// allocator. Free segments are kept in segregated, size-binned lists
+// (TLSF) with two bitmaps of non-empty bins, so allocate() and free()
+// run in constant time regardless of the number of live segments.
+//
+// A header-only sentinel segment that is always in use marks the end of
+// the committed memory. Growable heaps only reserve virtual address space
+// up front and map physical frames in KERNEL_HEAP_CHUNK_SIZE steps when
+// they run out of free segments, trim() gives fully free chunks at the end
+// of the heap back to the page frame allocator.
+//
 class DynamicMemoryAllocator {
 public:
     static DynamicMemoryAllocator& get();
 
+    // Heap arena local to the given NUMA node, falls back to the boot heap
+    static DynamicMemoryAllocator& getForNode(uint8_t node);
+
+    // Heap arena that the given pointer has been allocated from
+    static DynamicMemoryAllocator& getForAddress(void* ptr);
+
+    // Checks whether the pointer lies within the boot heap or any of the node heap arenas
+    static bool isHeapAddress(void* ptr);
+
+    // Carves a heap arena out of the memory of every NUMA node that doesn't hold the boot heap
+    static void initializeNodeHeaps();
+
+    // Sets up a heap over already mapped memory of a fixed size
     void init(uint64_t base, size_t size);
 
+    // Reserves 'reservedSize' bytes of unmapped address space and commits the first 'initialSize' bytes
+    void initGrowable(uint64_t base, size_t reservedSize, size_t initialSize);
+
     inline void* getHeapBase() const { return static_cast<void*>(m_firstSegment); }
 
+    inline bool containsAddress(void* ptr) const {
+        uint64_t base = reinterpret_cast<uint64_t>(m_firstSegment);
+        uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+
+        return addr >= base && addr < base + m_reservedSize;
+    }
+
+    inline uint64_t getCommittedSize() const { return m_heapSize; }
+    inline uint64_t getReservedSize() const { return m_reservedSize; }
+
+    inline HeapStats getStats() const { return m_stats; }
+
+    inline HeapValidationLevel getValidationLevel() const { return m_validationLevel; }
+    inline void setValidationLevel(HeapValidationLevel level) { m_validationLevel = level; }
+
+    // Walks every committed segment, sizes include the segment headers
+    HeapFragmentationStats getFragmentationStats();
+
     void* allocate(size_t size);
+
+    //
+    // Allocates memory aligned to 'alignment' (a power of two). The slack in
+    // front of the aligned segment is split off into a free segment, so the
+    // result is an ordinary segment that can be released with free().
+    //
+    void* allocateAligned(size_t size, size_t alignment);
+
     void free(void* ptr);
+
+    //
+    // Resizes the allocation in place whenever the segment itself or a free
+    // segment following it has enough room, only falls back to allocating,
+    // copying and freeing if neither does.
+    //
     void* reallocate(void* ptr, size_t newSize);
 
+    //
+    // Unmaps the fully free chunks at the end of a growable heap and returns
+    // their frames to the page frame allocator. Returns the number of bytes
+    // released, nothing is released if the heap is busy.
+    //
+    uint64_t trim();
+
+    //
+    // Moves the committed pages of a growable heap whose frames lie in
+    // [startPfn, endPfn) to other frames, keeping their virtual addresses.
+    // Serves as the compaction migration handler, nothing is moved if the
+    // heap is busy.
+    //
+    uint64_t migratePages(uint64_t startPfn, uint64_t endPfn);
+
     void __debugHeap();
     void __debugHeapSegment(void* ptr, int64_t segId = -1);
     void __debugUserHeapPointer(void* ptr, int64_t id = -1);
@@ -39,11 +214,61 @@ public:
     bool __detectHeapCorruption(bool dbgLog = true);
 
 private:
+    // Committed memory including the sentinel segment
     uint64_t            m_heapSize;
+    uint64_t            m_reservedSize;
+    bool                m_growable;
+
+    HeapValidationLevel m_validationLevel;
+
     HeapSegmentHeader*  m_firstSegment;
+    Spinlock            m_lock;
+
+    HeapStats           m_stats;
+
+    // A set bit marks a first-level range with at least one non-empty bin
+    uint32_t            m_flBitmap;
+    uint32_t            m_slBitmaps[KERNEL_HEAP_FL_INDEX_COUNT];
+
+    HeapSegmentHeader*  m_freeLists[KERNEL_HEAP_FL_INDEX_COUNT][KERNEL_HEAP_SL_INDEX_COUNT];
 
 private:
-    HeapSegmentHeader* _findFreeSegment(size_t minSize);
+    // Lays out a single free segment and the sentinel over the committed memory
+    void _initializeSegments();
+
+    void _writeSentinelSegment();
+
+    // Writes the canary of a segment that is handed out or whose size changed while in use
+    static void _sealSegment(HeapSegmentHeader* segment);
+
+    // Checks a used segment according to the validation level, expects the heap lock to be held
+    bool _validateSegment(HeapSegmentHeader* segment);
+
+    // Commits enough chunks for a free segment of at least the given size, expects the heap lock to be held
+    bool _growHeap(size_t minSegmentSize);
+
+    // Maps fresh frames or unmaps and frees the frames of a page aligned range at the given heap offset
+    bool _commitRange(uint64_t offset, uint64_t size);
+    void _decommitRange(uint64_t offset, uint64_t size);
+
+    // Bin indices of the list a segment of the given size gets inserted into
+    static void _mapSizeToBin(size_t size, uint32_t* fl, uint32_t* sl);
+
+    // Smallest size at or above the given one that starts a bin
+    static size_t _roundUpToSearchBin(size_t size);
+
+    // Bin indices of the first list whose segments are all at least the given size
+    static void _mapSizeToSearchBin(size_t size, uint32_t* fl, uint32_t* sl);
+
+    // Finds and unlinks a free segment of at least the given size in constant time
+    HeapSegmentHeader* _takeFreeSegment(size_t minSize);
+
+    // Marks the segment as free, writes its footer and links it into its bin
+    void _insertFreeSegment(HeapSegmentHeader* segment);
+    void _removeFreeSegment(HeapSegmentHeader* segment);
+
+    // Physically following segment or nullptr for the last segment of the heap
+    HeapSegmentHeader* _getNextSegment(HeapSegmentHeader* segment) const;
 
     //
     // |-----|--------------|     |-----|------------|  |-----|------------|
@@ -52,10 +277,24 @@ private:
     //
     // <-------- x --------->     <------ size ------>  <---- x - size ---->
     //
+    // Splits a used segment and returns the tail to the free lists,
+    // merging it with the following segment if that one is free.
+    //
     bool _splitSegment(HeapSegmentHeader* segment, size_t size);
 
-    bool _mergeSegmentWithPrevious(HeapSegmentHeader* segment);
-    bool _mergeSegmentWithNext(HeapSegmentHeader* segment);
+    //
+    // Grows a used segment to the given size by absorbing the free segment
+    // following it, committing more memory first if the segment is the last
+    // one of a growable heap. Expects the heap lock to be held.
+    //
+    bool _extendSegment(HeapSegmentHeader* segment, size_t size);
+
+    // Moves the start of a freshly taken segment to the alignment, returning the leading slack to the free lists
+    HeapSegmentHeader* _alignSegment(HeapSegmentHeader* segment, size_t alignment);
+
+    // Merges a segment that isn't on a free list yet with its free neighbors
+    HeapSegmentHeader* _mergeSegmentWithPrevious(HeapSegmentHeader* segment);
+    void _mergeSegmentWithNext(HeapSegmentHeader* segment);
 };
 
 #endif
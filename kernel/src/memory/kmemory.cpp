@@ -1,4 +1,8 @@
 #include "kmemory.h"
+#include "slab.h"
+#include "object_cache.h"
+#include "heap_profiler.h"
+#include "vmalloc.h"
 #include <paging/page_frame_allocator.h>
 
 EXTERN_C {
@@ -201,49 +205,204 @@ void* zallocPages(size_t pages) {
     return allocator.requestFreePagesZeroed(pages);
 }
 
+static void* _allocate(size_t size) {
+    // Large buffers get their own area so they don't fragment the heap
+    if (size >= VMALLOC_KMALLOC_THRESHOLD) {
+        void* area = VmallocAllocator::get().allocate(size);
+        if (area) {
+            return area;
+        }
+    }
+
+    // Small requests are served by the size-class slabs
+    if (SlabAllocator::isSlabSize(size)) {
+        void* object = SlabAllocator::get().allocate(size);
+        if (object) {
+            return object;
+        }
+    }
+
+    // Allocate from the heap arena of the calling cpu's NUMA node
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    auto& heapAllocator = DynamicMemoryAllocator::getForNode(pageFrameAllocator.getCurrentNode());
+
+    void* ptr = heapAllocator.allocate(size);
+
+    // Fall back to the boot heap once the local arena runs out of space
+    if (!ptr && &heapAllocator != &DynamicMemoryAllocator::get()) {
+        ptr = DynamicMemoryAllocator::get().allocate(size);
+    }
+
+    return ptr;
+}
+
+static void _free(void* ptr) {
+    if (VmallocAllocator::containsAddress(ptr)) {
+        VmallocAllocator::get().free(ptr);
+        return;
+    }
+
+    // Anything outside of the heap arenas has to be a slab object
+    if (!DynamicMemoryAllocator::isHeapAddress(ptr)) {
+        SlabAllocator::get().free(ptr);
+        return;
+    }
+
+    auto& heapAllocator = DynamicMemoryAllocator::getForAddress(ptr);
+    heapAllocator.free(ptr);
+}
+
+// The profiler records the return address of the public entry points, so they must not call each other
+static inline void _profileAllocation(void* ptr, size_t size, void* caller) {
+    auto& profiler = HeapProfiler::get();
+
+    if (ptr && profiler.isEnabled()) {
+        profiler.recordAllocation(ptr, size, caller);
+    }
+}
+
+static inline void _profileFree(void* ptr) {
+    auto& profiler = HeapProfiler::get();
+
+    if (profiler.isEnabled()) {
+        profiler.recordFree(ptr);
+    }
+}
+
 void* kmalloc(size_t size) {
-    auto& heapAllocator = DynamicMemoryAllocator::get();
-    return heapAllocator.allocate(size);
+    void* ptr = _allocate(size);
+    _profileAllocation(ptr, size, __builtin_return_address(0));
+
+    return ptr;
 }
 
 void* kmallocAligned(size_t size, size_t alignment) {
-    // Allocate extra memory for alignment and storing the original pointer
-    void* original = kmalloc(size + alignment + sizeof(void*));
+    // Every allocation is at least aligned to the heap alignment
+    if (alignment <= KERNEL_HEAP_ALIGNMENT) {
+        void* ptr = _allocate(size);
+        _profileAllocation(ptr, size, __builtin_return_address(0));
+
+        return ptr;
+    }
+
+    // Vmalloc areas are page aligned, but the heap fallback in _allocate() isn't
+    if (alignment <= PAGE_SIZE && size >= VMALLOC_KMALLOC_THRESHOLD) {
+        void* area = VmallocAllocator::get().allocate(size);
+        if (area) {
+            _profileAllocation(area, size, __builtin_return_address(0));
+            return area;
+        }
+    }
+
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    auto& heapAllocator = DynamicMemoryAllocator::getForNode(pageFrameAllocator.getCurrentNode());
 
-    if (!original) return nullptr;
+    void* ptr = heapAllocator.allocateAligned(size, alignment);
 
-    // Calculate the aligned memory address
-    size_t offset = alignment + sizeof(void*);
-    void* aligned = (void*)(((uint64_t)original + offset) & ~(alignment - 1));
+    // Fall back to the boot heap once the local arena runs out of space
+    if (!ptr && &heapAllocator != &DynamicMemoryAllocator::get()) {
+        ptr = DynamicMemoryAllocator::get().allocateAligned(size, alignment);
+    }
 
-    // Store the original pointer just before the aligned address
-    ((void**)aligned)[-1] = original;
+    _profileAllocation(ptr, size, __builtin_return_address(0));
 
-    return aligned;
+    return ptr;
 }
 
 void kfree(void* ptr) {
     if (!ptr) return;
 
-    auto& heapAllocator = DynamicMemoryAllocator::get();
-    heapAllocator.free(ptr);
+    // Drop the record first, the memory can be handed out again as soon as it's freed
+    _profileFree(ptr);
+    _free(ptr);
 }
 
 void kfreeAligned(void* ptr) {
+    // Aligned allocations are ordinary heap segments or vmalloc areas
     if (!ptr) return;
 
-    // Retrieve the original pointer stored just before the aligned address
-    void* original = ((void**)ptr)[-1];
-
-    // Free the original (unaligned) memory
-    kfree(original);
+    _profileFree(ptr);
+    _free(ptr);
 }
 
 void* krealloc(void* ptr, size_t size) {
-    auto& heapAllocator = DynamicMemoryAllocator::get();
-    return heapAllocator.reallocate(ptr, size);
+    if (!ptr) {
+        void* newPtr = _allocate(size);
+        _profileAllocation(newPtr, size, __builtin_return_address(0));
+
+        return newPtr;
+    }
+
+    void* newPtr = nullptr;
+
+    if (VmallocAllocator::containsAddress(ptr)) {
+        size_t areaSize = VmallocAllocator::get().getAllocationSize(ptr);
+        if (!areaSize) {
+            return nullptr;
+        }
+
+        // The area's pages already cover the new size
+        if (size <= areaSize) {
+            _profileAllocation(ptr, size, __builtin_return_address(0));
+            return ptr;
+        }
+
+        newPtr = _allocate(size);
+        if (!newPtr) {
+            return nullptr;
+        }
+
+        memcpy(newPtr, ptr, areaSize);
+
+        _profileFree(ptr);
+        _free(ptr);
+    } else if (!DynamicMemoryAllocator::isHeapAddress(ptr)) {
+        size_t objectSize = SlabAllocator::get().getAllocationSize(ptr);
+        if (!objectSize) {
+            return nullptr;
+        }
+
+        // The object's size class already has room for the new size
+        if (size <= objectSize) {
+            _profileAllocation(ptr, size, __builtin_return_address(0));
+            return ptr;
+        }
+
+        newPtr = _allocate(size);
+        if (!newPtr) {
+            return nullptr;
+        }
+
+        memcpy(newPtr, ptr, objectSize);
+
+        _profileFree(ptr);
+        _free(ptr);
+    } else {
+        auto& heapAllocator = DynamicMemoryAllocator::getForAddress(ptr);
+        newPtr = heapAllocator.reallocate(ptr, size);
+
+        if (newPtr && newPtr != ptr) {
+            _profileFree(ptr);
+        }
+    }
+
+    _profileAllocation(newPtr, size, __builtin_return_address(0));
+
+    return newPtr;
 }
 
+namespace kstl {
+ObjectCache<size_t> g_sharedRefCountCache("shared_ptr_refcount");
+
+size_t* allocateSharedRefCount() {
+    return g_sharedRefCountCache.allocate();
+}
+
+void freeSharedRefCount(size_t* refCount) {
+    g_sharedRefCountCache.free(refCount);
+}
+} // namespace kstl
+
 // Placement new operator
 void* operator new(size_t, void* ptr) noexcept {
     return ptr;
@@ -256,15 +415,24 @@ void operator delete(void*, void*) noexcept {
 
 // Global new ooperator
 void* operator new(size_t size) {
-    return kmalloc(size);
+    void* ptr = _allocate(size);
+    _profileAllocation(ptr, size, __builtin_return_address(0));
+
+    return ptr;
 }
 
 // Global delete operator
 void operator delete(void* ptr) noexcept {
-    kfree(ptr);
+    if (!ptr) return;
+
+    _profileFree(ptr);
+    _free(ptr);
 }
 
 void operator delete(void* ptr, size_t) noexcept {
-    kfree(ptr);
+    if (!ptr) return;
+
+    _profileFree(ptr);
+    _free(ptr);
 }
 
@@ -18,9 +18,15 @@ void* zallocPage();
 void* allocPages(size_t pages);
 void* zallocPages(size_t pages);
 
+// Requests of VMALLOC_KMALLOC_THRESHOLD bytes and more get a page-aligned vmalloc area
 void* kmalloc(size_t size);
+
+// Alignment has to be a power of two, the result can be released with kfree()
 void* kmallocAligned(size_t size, size_t alignment);
+
 void kfree(void* ptr);
+
+// Equivalent to kfree(), kept for existing callers
 void kfreeAligned(void* ptr);
 void* krealloc(void* ptr, size_t size);
 
@@ -39,13 +45,18 @@ void operator delete(void* ptr) noexcept;
 void operator delete(void* ptr, size_t) noexcept;
 
 namespace kstl {
+// Reference counts of shared pointers come out of their own object cache
+size_t* allocateSharedRefCount();
+void freeSharedRefCount(size_t* refCount);
+
 template <typename T>
 class SharedPtr {
 public:
     // Constructor
     explicit SharedPtr(T* ptr = nullptr) : m_ptr(ptr) {
         if (ptr) {
-            m_refCount = new size_t(1);
+            m_refCount = allocateSharedRefCount();
+            *m_refCount = 1;
         } else {
             m_refCount = nullptr;
         }
@@ -118,7 +129,7 @@ private:
     void release() {
         if (m_refCount && --(*m_refCount) == 0) {
             delete m_ptr;
-            delete m_refCount;
+            freeSharedRefCount(m_refCount);
         }
         m_ptr = nullptr;
         m_refCount = nullptr;
@@ -0,0 +1,383 @@
+#include "object_cache.h"
+#include <kprint.h>
+
+namespace kstl {
+struct ObjectCacheSlab {
+    uint64_t            magic;
+    ObjectCacheBase*    cache;
+
+    ObjectCacheSlab*    next;
+    ObjectCacheSlab*    prev;
+
+    uint32_t            inUse;
+
+    // Number of valid entries on the free index stack following the header
+    uint32_t            freeCount;
+
+    bool                onPartialList;
+};
+
+// Caches that have been initialized, used for reporting statistics
+ObjectCacheBase* g_objectCacheList;
+DECLARE_SPINLOCK(g_objectCacheListLock);
+
+static inline size_t _alignUp(size_t value, size_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline uint16_t* _getFreeStack(ObjectCacheSlab* slab) {
+    return reinterpret_cast<uint16_t*>(slab + 1);
+}
+
+void* ObjectCacheBase::allocate() {
+    if (!m_initialized) {
+        _initialize();
+    }
+
+    ObjectCacheMagazine* magazine = &m_magazines[getCurrentCpuIndex()];
+
+    if (tryAcquireSpinlock(&magazine->lock)) {
+        void* object = nullptr;
+        bool hit = magazine->count > 0;
+
+        if (hit || _refillMagazine(magazine)) {
+            object = magazine->objects[--magazine->count];
+        }
+
+        magazine->allocations++;
+        if (hit) {
+            magazine->hits++;
+        }
+
+        releaseSpinlock(&magazine->lock);
+        return object;
+    }
+
+    // The magazine is in use by a preempted task on this cpu
+    acquireSpinlock(&m_lock);
+    void* object = _allocateObject();
+    m_fallbackAllocations++;
+    releaseSpinlock(&m_lock);
+
+    return object;
+}
+
+void ObjectCacheBase::free(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+
+    ObjectCacheSlab* slab = _getSlab(ptr);
+    if (!slab) {
+        kprint("[OBJECT CACHE] Invalid free of 0x%llx in cache '%s'\n", (uint64_t)ptr, m_name);
+        return;
+    }
+
+    ObjectCacheMagazine* magazine = &m_magazines[getCurrentCpuIndex()];
+
+    if (tryAcquireSpinlock(&magazine->lock)) {
+        if (magazine->count == OBJECT_CACHE_MAGAZINE_SIZE) {
+            _drainMagazine(magazine, OBJECT_CACHE_MAGAZINE_SIZE / 2);
+        }
+
+        magazine->objects[magazine->count++] = ptr;
+        magazine->frees++;
+
+        releaseSpinlock(&magazine->lock);
+        return;
+    }
+
+    acquireSpinlock(&m_lock);
+    _freeObject(slab, ptr);
+    m_fallbackFrees++;
+    releaseSpinlock(&m_lock);
+}
+
+uint64_t ObjectCacheBase::drainMagazines() {
+    uint64_t drained = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        ObjectCacheMagazine* magazine = &m_magazines[cpu];
+
+        acquireSpinlock(&magazine->lock);
+        drained += _drainMagazine(magazine, magazine->count);
+        releaseSpinlock(&magazine->lock);
+    }
+
+    return drained;
+}
+
+ObjectCacheStats ObjectCacheBase::getStats() const {
+    ObjectCacheStats stats;
+    zeromem(&stats, sizeof(ObjectCacheStats));
+
+    stats.name = m_name;
+    stats.objectSize = m_objectSize;
+    stats.slabSize = m_slabSize;
+    stats.slabCount = m_slabCount;
+    stats.totalObjects = m_slabCount * m_objectsPerSlab;
+    stats.allocations = m_fallbackAllocations;
+    stats.frees = m_fallbackFrees;
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        const ObjectCacheMagazine* magazine = &m_magazines[cpu];
+
+        stats.cachedObjects += magazine->count;
+        stats.allocations += magazine->allocations;
+        stats.frees += magazine->frees;
+        stats.magazineHits += magazine->hits;
+    }
+
+    // Counters are read without locks, a magazine might have changed in between
+    stats.activeObjects = (m_objectsInUse > stats.cachedObjects) ? m_objectsInUse - stats.cachedObjects : 0;
+
+    return stats;
+}
+
+size_t ObjectCacheBase::getAllStats(ObjectCacheStats* stats, size_t maxCount) {
+    size_t count = 0;
+
+    acquireSpinlock(&g_objectCacheListLock);
+
+    for (ObjectCacheBase* cache = g_objectCacheList; cache; cache = cache->m_nextCache) {
+        if (count < maxCount) {
+            stats[count] = cache->getStats();
+        }
+
+        ++count;
+    }
+
+    releaseSpinlock(&g_objectCacheListLock);
+
+    return count;
+}
+
+void ObjectCacheBase::_initialize() {
+    acquireSpinlock(&m_lock);
+
+    if (m_initialized) {
+        releaseSpinlock(&m_lock);
+        return;
+    }
+
+    size_t alignment = (m_requestedAlignment > sizeof(uint64_t)) ? m_requestedAlignment : sizeof(uint64_t);
+    if ((m_flags & OBJECT_CACHE_ALIGN_CACHELINE) && alignment < OBJECT_CACHE_LINE_SIZE) {
+        alignment = OBJECT_CACHE_LINE_SIZE;
+    }
+
+    size_t objectSize = _alignUp(m_requestedSize ? m_requestedSize : 1, alignment);
+    size_t slabSize = OBJECT_CACHE_MIN_SLAB_SIZE;
+    size_t objectsPerSlab = 0;
+
+    //
+    // The free index stack sits right behind the slab header and
+    // the objects start at the next suitably aligned offset after it.
+    //
+    while (true) {
+        objectsPerSlab = (slabSize - sizeof(ObjectCacheSlab)) / (objectSize + sizeof(uint16_t));
+
+        while (objectsPerSlab &&
+            _alignUp(sizeof(ObjectCacheSlab) + objectsPerSlab * sizeof(uint16_t), alignment) +
+            objectsPerSlab * objectSize > slabSize
+        ) {
+            --objectsPerSlab;
+        }
+
+        if (objectsPerSlab >= OBJECT_CACHE_MIN_OBJECTS_PER_SLAB) {
+            break;
+        }
+
+        slabSize <<= 1;
+    }
+
+    // Object indices have to fit into the 16-bit free stack entries
+    if (objectsPerSlab > 0xffff) {
+        objectsPerSlab = 0xffff;
+    }
+
+    m_objectSize = objectSize;
+    m_slabSize = slabSize;
+    m_objectsPerSlab = objectsPerSlab;
+    m_objectOffset = _alignUp(sizeof(ObjectCacheSlab) + objectsPerSlab * sizeof(uint16_t), alignment);
+
+    acquireSpinlock(&g_objectCacheListLock);
+    m_nextCache = g_objectCacheList;
+    g_objectCacheList = this;
+    releaseSpinlock(&g_objectCacheListLock);
+
+    m_initialized = true;
+
+    releaseSpinlock(&m_lock);
+}
+
+void* ObjectCacheBase::_allocateObject() {
+    if (!m_partialSlabs && !_createSlab()) {
+        return nullptr;
+    }
+
+    ObjectCacheSlab* slab = m_partialSlabs;
+    uint16_t index = _getFreeStack(slab)[--slab->freeCount];
+
+    if (slab->inUse++ == 0) {
+        m_emptySlabCount--;
+    }
+
+    if (slab->freeCount == 0) {
+        _unlinkPartialSlab(slab);
+    }
+
+    m_objectsInUse++;
+
+    return reinterpret_cast<uint8_t*>(slab) + m_objectOffset + index * m_objectSize;
+}
+
+void ObjectCacheBase::_freeObject(ObjectCacheSlab* slab, void* ptr) {
+    uint64_t offset = reinterpret_cast<uint8_t*>(ptr) - reinterpret_cast<uint8_t*>(slab) - m_objectOffset;
+
+    _getFreeStack(slab)[slab->freeCount++] = static_cast<uint16_t>(offset / m_objectSize);
+    slab->inUse--;
+    m_objectsInUse--;
+
+    if (!slab->onPartialList) {
+        _pushPartialSlab(slab);
+    }
+
+    if (slab->inUse == 0) {
+        if (m_emptySlabCount >= OBJECT_CACHE_MAX_EMPTY_SLABS) {
+            _destroySlab(slab);
+        } else {
+            m_emptySlabCount++;
+        }
+    }
+}
+
+uint32_t ObjectCacheBase::_refillMagazine(ObjectCacheMagazine* magazine) {
+    acquireSpinlock(&m_lock);
+
+    while (magazine->count < OBJECT_CACHE_MAGAZINE_SIZE / 2) {
+        void* object = _allocateObject();
+        if (!object) {
+            break;
+        }
+
+        magazine->objects[magazine->count++] = object;
+    }
+
+    releaseSpinlock(&m_lock);
+
+    return magazine->count;
+}
+
+uint32_t ObjectCacheBase::_drainMagazine(ObjectCacheMagazine* magazine, uint32_t count) {
+    if (count > magazine->count) {
+        count = magazine->count;
+    }
+
+    if (!count) {
+        return 0;
+    }
+
+    acquireSpinlock(&m_lock);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        void* object = magazine->objects[--magazine->count];
+        _freeObject(_getSlab(object), object);
+    }
+
+    releaseSpinlock(&m_lock);
+
+    return count;
+}
+
+ObjectCacheSlab* ObjectCacheBase::_createSlab() {
+    ObjectCacheSlab* slab = static_cast<ObjectCacheSlab*>(kmallocAligned(m_slabSize, m_slabSize));
+    if (!slab) {
+        return nullptr;
+    }
+
+    zeromem(slab, m_objectOffset);
+    slab->magic = OBJECT_CACHE_SLAB_MAGIC;
+    slab->cache = this;
+    slab->freeCount = m_objectsPerSlab;
+
+    // Hand out the lowest addresses first
+    uint16_t* freeStack = _getFreeStack(slab);
+    for (uint32_t i = 0; i < m_objectsPerSlab; ++i) {
+        freeStack[i] = static_cast<uint16_t>(m_objectsPerSlab - 1 - i);
+    }
+
+    if (m_constructor) {
+        uint8_t* objects = reinterpret_cast<uint8_t*>(slab) + m_objectOffset;
+
+        for (uint32_t i = 0; i < m_objectsPerSlab; ++i) {
+            m_constructor(objects + i * m_objectSize);
+        }
+    }
+
+    m_slabCount++;
+    m_emptySlabCount++;
+
+    _pushPartialSlab(slab);
+
+    return slab;
+}
+
+void ObjectCacheBase::_destroySlab(ObjectCacheSlab* slab) {
+    if (slab->onPartialList) {
+        _unlinkPartialSlab(slab);
+    }
+
+    slab->magic = 0;
+    m_slabCount--;
+
+    kfree(slab);
+}
+
+void ObjectCacheBase::_pushPartialSlab(ObjectCacheSlab* slab) {
+    slab->prev = nullptr;
+    slab->next = m_partialSlabs;
+
+    if (m_partialSlabs) {
+        m_partialSlabs->prev = slab;
+    }
+
+    m_partialSlabs = slab;
+    slab->onPartialList = true;
+}
+
+void ObjectCacheBase::_unlinkPartialSlab(ObjectCacheSlab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        m_partialSlabs = slab->next;
+    }
+
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = nullptr;
+    slab->prev = nullptr;
+    slab->onPartialList = false;
+}
+
+ObjectCacheSlab* ObjectCacheBase::_getSlab(void* ptr) const {
+    if (!m_initialized) {
+        return nullptr;
+    }
+
+    uint64_t slabBase = reinterpret_cast<uint64_t>(ptr) & ~(static_cast<uint64_t>(m_slabSize) - 1);
+    ObjectCacheSlab* slab = reinterpret_cast<ObjectCacheSlab*>(slabBase);
+
+    if (slab->magic != OBJECT_CACHE_SLAB_MAGIC || slab->cache != this) {
+        return nullptr;
+    }
+
+    uint64_t offset = reinterpret_cast<uint64_t>(ptr) - slabBase;
+    if (offset < m_objectOffset || (offset - m_objectOffset) % m_objectSize) {
+        return nullptr;
+    }
+
+    return slab;
+}
+} // namespace kstl
@@ -0,0 +1,204 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+#include "kmemory.h"
+#include <arch/x86/per_cpu_data.h>
+
+// Smallest slab an object cache carves objects out of, slabs are naturally aligned
+#define OBJECT_CACHE_MIN_SLAB_SIZE          0x4000 // 16KB
+
+// Slabs get doubled in size until they hold at least this many objects
+#define OBJECT_CACHE_MIN_OBJECTS_PER_SLAB   8
+
+// Objects each per-cpu magazine can hold
+#define OBJECT_CACHE_MAGAZINE_SIZE          12
+
+// Number of completely free slabs a cache keeps around before releasing them
+#define OBJECT_CACHE_MAX_EMPTY_SLABS        1
+
+#define OBJECT_CACHE_LINE_SIZE              64
+
+#define OBJECT_CACHE_SLAB_MAGIC             0x4548434154424f53ULL // "SOBTACHE"
+
+// Cache flags
+#define OBJECT_CACHE_ALIGN_CACHELINE        0x1 // Objects start on their own cache line
+
+namespace kstl {
+struct ObjectCacheSlab;
+
+// Runs once on every object when its slab gets created, freed objects have to be returned in that state
+typedef void (*ObjectCacheConstructor)(void* object);
+
+struct ObjectCacheStats {
+    const char* name;
+
+    uint64_t objectSize;
+    uint64_t slabSize;
+    uint64_t slabCount;
+
+    // Objects handed out to callers
+    uint64_t activeObjects;
+
+    // Objects the slabs have room for
+    uint64_t totalObjects;
+
+    // Objects sitting in the per-cpu magazines
+    uint64_t cachedObjects;
+
+    uint64_t allocations;
+    uint64_t frees;
+
+    // Allocations served straight out of a per-cpu magazine
+    uint64_t magazineHits;
+};
+
+//
+// Per-cpu stack of free objects in front of the central slab lists. The lock
+// is only ever try-acquired, contention means a task got preempted in the
+// middle of an operation and the caller goes to the central lists instead.
+// Unlike the kmalloc slab caches, objects are kept in an array rather than
+// chained through their first word, so constructed state survives caching.
+//
+struct ObjectCacheMagazine {
+    Spinlock    lock;
+    uint32_t    count;
+
+    void*       objects[OBJECT_CACHE_MAGAZINE_SIZE];
+
+    uint64_t    allocations;
+    uint64_t    frees;
+    uint64_t    hits;
+} __attribute__((aligned(OBJECT_CACHE_LINE_SIZE)));
+
+//
+// Type-erased cache of equally sized objects (kmem_cache). Every cache owns
+// its slabs, so hot kernel objects of one type end up packed next to each
+// other instead of being scattered across the general purpose size classes.
+// Slabs are naturally aligned heap blocks, the slab of an object is found by
+// masking its address, and free objects are tracked by an index stack in the
+// slab header so that objects never get written to while they are free.
+//
+// Caches are meant to be globals. The constructor only stores the
+// configuration and is constant evaluated, the slab geometry gets computed
+// lazily by the first allocation.
+//
+class ObjectCacheBase {
+public:
+    constexpr ObjectCacheBase(
+        const char* name,
+        size_t objectSize,
+        size_t alignment,
+        ObjectCacheConstructor constructor,
+        uint32_t flags
+    ) : m_name(name), m_requestedSize(objectSize), m_requestedAlignment(alignment),
+        m_constructor(constructor), m_flags(flags), m_initialized(false),
+        m_objectSize(0), m_objectOffset(0), m_slabSize(0), m_objectsPerSlab(0),
+        m_lock{}, m_partialSlabs(nullptr), m_slabCount(0), m_emptySlabCount(0),
+        m_objectsInUse(0), m_fallbackAllocations(0), m_fallbackFrees(0),
+        m_nextCache(nullptr), m_magazines{} {}
+
+    void* allocate();
+    void free(void* ptr);
+
+    // Returns the objects held by every magazine to the slabs, returns the number of objects moved
+    uint64_t drainMagazines();
+
+    ObjectCacheStats getStats() const;
+
+    inline const char* getName() const { return m_name; }
+
+    // Fills in the statistics of up to 'maxCount' caches that have been used so far, returns the cache count
+    static size_t getAllStats(ObjectCacheStats* stats, size_t maxCount);
+
+private:
+    const char*             m_name;
+    size_t                  m_requestedSize;
+    size_t                  m_requestedAlignment;
+    ObjectCacheConstructor  m_constructor;
+    uint32_t                m_flags;
+
+    volatile bool           m_initialized;
+
+    // Slab geometry
+    uint32_t                m_objectSize;
+    uint32_t                m_objectOffset;
+    uint32_t                m_slabSize;
+    uint32_t                m_objectsPerSlab;
+
+    Spinlock                m_lock;
+
+    // Slabs with at least one free object
+    ObjectCacheSlab*        m_partialSlabs;
+
+    uint64_t                m_slabCount;
+    uint64_t                m_emptySlabCount;
+
+    // Objects taken out of the slabs, including the ones cached in magazines
+    uint64_t                m_objectsInUse;
+
+    // Operations that bypassed a busy magazine
+    uint64_t                m_fallbackAllocations;
+    uint64_t                m_fallbackFrees;
+
+    ObjectCacheBase*        m_nextCache;
+
+    ObjectCacheMagazine     m_magazines[MAX_CPUS];
+
+private:
+    void _initialize();
+
+    // Expect the caller to hold the cache lock
+    void* _allocateObject();
+    void _freeObject(ObjectCacheSlab* slab, void* ptr);
+
+    // Expect the caller to hold the magazine lock
+    uint32_t _refillMagazine(ObjectCacheMagazine* magazine);
+    uint32_t _drainMagazine(ObjectCacheMagazine* magazine, uint32_t count);
+
+    // Expect the caller to hold the cache lock
+    ObjectCacheSlab* _createSlab();
+    void _destroySlab(ObjectCacheSlab* slab);
+
+    void _pushPartialSlab(ObjectCacheSlab* slab);
+    void _unlinkPartialSlab(ObjectCacheSlab* slab);
+
+    // Returns the slab of an object belonging to this cache or nullptr
+    ObjectCacheSlab* _getSlab(void* ptr) const;
+};
+
+template <typename T>
+class ObjectCache : public ObjectCacheBase {
+public:
+    constexpr ObjectCache(const char* name, ObjectCacheConstructor constructor = nullptr, uint32_t flags = 0)
+        : ObjectCacheBase(name, sizeof(T), alignof(T), constructor, flags) {}
+
+    // Returns raw storage in the state left by the cache constructor
+    T* allocate() {
+        return static_cast<T*>(ObjectCacheBase::allocate());
+    }
+
+    void free(T* object) {
+        ObjectCacheBase::free(object);
+    }
+
+    // Allocates an object and runs the constructor of T on it
+    template <typename... Args>
+    T* create(Args... args) {
+        void* object = ObjectCacheBase::allocate();
+        if (!object) {
+            return nullptr;
+        }
+
+        return new (object) T(args...);
+    }
+
+    // Runs the destructor of T and returns the object to the cache
+    void destroy(T* object) {
+        if (object) {
+            object->~T();
+            ObjectCacheBase::free(object);
+        }
+    }
+};
+} // namespace kstl
+
+#endif
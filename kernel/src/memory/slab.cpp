@@ -0,0 +1,521 @@
+#include "slab.h"
+#include "kmemory.h"
+#include <paging/page_frame_allocator.h>
+#include <kprint.h>
+
+struct SlabHeader {
+    uint64_t    magic;
+
+    uint32_t    sizeClass;
+    uint32_t    inUse;
+
+    SlabHeader* next;
+    SlabHeader* prev;
+
+    // Objects that have been handed out and freed again
+    void*       freeList;
+
+    // Objects past this point have never been handed out
+    uint8_t*    unusedObjects;
+
+    bool        onPartialList;
+
+    // Cpu whose cache gets the objects freed on other cpus
+    uint8_t     ownerCpu;
+} __attribute__((aligned(SLAB_HEADER_SIZE)));
+
+static_assert(sizeof(SlabHeader) == SLAB_HEADER_SIZE, "Slab header has to fit into its cache line");
+
+// Power of two classes with an intermediate class in between to limit internal fragmentation
+const uint32_t g_slabSizeClasses[SLAB_SIZE_CLASS_COUNT] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096
+};
+
+SlabAllocator g_slabAllocator;
+
+// Number of objects a per-cpu cache holds at most for the given object size
+static inline uint32_t _getCpuCacheLimit(uint32_t objectSize) {
+    uint32_t limit = SLAB_CPU_CACHE_BYTES / objectSize;
+
+    if (limit < SLAB_CPU_CACHE_MIN_OBJECTS) {
+        return SLAB_CPU_CACHE_MIN_OBJECTS;
+    }
+
+    if (limit > SLAB_CPU_CACHE_MAX_OBJECTS) {
+        return SLAB_CPU_CACHE_MAX_OBJECTS;
+    }
+
+    return limit;
+}
+
+SlabAllocator& SlabAllocator::get() {
+    return g_slabAllocator;
+}
+
+int SlabAllocator::getSizeClass(size_t size) {
+    if (!isSlabSize(size)) {
+        return -1;
+    }
+
+    for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+        if (size <= g_slabSizeClasses[sizeClass]) {
+            return sizeClass;
+        }
+    }
+
+    return -1;
+}
+
+void* SlabAllocator::allocate(size_t size) {
+    int sizeClass = getSizeClass(size);
+    if (sizeClass == -1) {
+        return nullptr;
+    }
+
+    uint8_t cpu = getCurrentCpuIndex();
+    SlabCpuCache* cpuCache = &m_cpuCaches[cpu][sizeClass];
+
+    // Another task on this core is in the middle of using the cache
+    if (tryAcquireSpinlock(&cpuCache->lock)) {
+        if (cpuCache->count > 0) {
+            cpuCache->hits++;
+        } else {
+            cpuCache->misses++;
+
+            // Objects handed back by other cpus come first, then a batch from the central cache
+            if (_collectRemoteFrees(cpuCache)) {
+                uint32_t limit = _getCpuCacheLimit(_getCache(sizeClass)->objectSize);
+                if (cpuCache->count > limit) {
+                    _drainCpuCache(sizeClass, cpuCache, cpuCache->count - limit);
+                }
+            } else {
+                _refillCpuCache(sizeClass, cpuCache, cpu);
+            }
+        }
+
+        void* object = nullptr;
+        if (cpuCache->count > 0) {
+            object = cpuCache->objects;
+            cpuCache->objects = *static_cast<void**>(object);
+            cpuCache->count--;
+        }
+
+        releaseSpinlock(&cpuCache->lock);
+
+        if (object) {
+            return object;
+        }
+    }
+
+    SlabCache* cache = _getCache(sizeClass);
+
+    acquireSpinlock(&cache->lock);
+    void* object = _allocateObject(cache, sizeClass, cpu);
+    releaseSpinlock(&cache->lock);
+
+    return object;
+}
+
+void SlabAllocator::free(void* ptr) {
+    SlabHeader* slab = _getSlabHeader(ptr);
+    if (!slab) {
+        kuPrint("Invalid pointer provided to free()!\n");
+        return;
+    }
+
+    int sizeClass = static_cast<int>(slab->sizeClass);
+    uint8_t cpu = getCurrentCpuIndex();
+
+    // Hand the object back to the cpu owning its slab without taking any lock
+    if (slab->ownerCpu != cpu) {
+        SlabCpuCache* ownerCache = &m_cpuCaches[slab->ownerCpu][sizeClass];
+
+        void* head;
+        do {
+            head = ownerCache->remoteFrees;
+            *static_cast<void**>(ptr) = head;
+        } while (!__sync_bool_compare_and_swap(&ownerCache->remoteFrees, head, ptr));
+
+        __sync_fetch_and_add(&m_cpuCaches[cpu][sizeClass].remoteFreeCount, 1);
+        return;
+    }
+
+    SlabCpuCache* cpuCache = &m_cpuCaches[cpu][sizeClass];
+
+    if (tryAcquireSpinlock(&cpuCache->lock)) {
+        *static_cast<void**>(ptr) = cpuCache->objects;
+        cpuCache->objects = ptr;
+        cpuCache->count++;
+
+        // Objects handed back by other cpus would otherwise wait for the cache to run dry
+        _collectRemoteFrees(cpuCache);
+
+        // Give half of the cache back once it overflows
+        uint32_t limit = _getCpuCacheLimit(_getCache(sizeClass)->objectSize);
+        if (cpuCache->count > limit) {
+            _drainCpuCache(sizeClass, cpuCache, cpuCache->count - limit / 2);
+        }
+
+        releaseSpinlock(&cpuCache->lock);
+        return;
+    }
+
+    SlabCache* cache = _getCache(sizeClass);
+
+    acquireSpinlock(&cache->lock);
+    _freeObject(cache, slab, ptr);
+    releaseSpinlock(&cache->lock);
+}
+
+uint64_t SlabAllocator::collectRemoteFrees() {
+    uint8_t cpu = getCurrentCpuIndex();
+    uint64_t collected = 0;
+
+    for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+        SlabCpuCache* cpuCache = &m_cpuCaches[cpu][sizeClass];
+
+        if (!cpuCache->remoteFrees || !tryAcquireSpinlock(&cpuCache->lock)) {
+            continue;
+        }
+
+        collected += _collectRemoteFrees(cpuCache);
+
+        uint32_t limit = _getCpuCacheLimit(_getCache(sizeClass)->objectSize);
+        if (cpuCache->count > limit) {
+            _drainCpuCache(sizeClass, cpuCache, cpuCache->count - limit);
+        }
+
+        releaseSpinlock(&cpuCache->lock);
+    }
+
+    return collected;
+}
+
+uint64_t SlabAllocator::drainCpuCaches() {
+    uint64_t drained = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+            SlabCpuCache* cpuCache = &m_cpuCaches[cpu][sizeClass];
+
+            // Caches that are busy right now get skipped
+            if (!tryAcquireSpinlock(&cpuCache->lock)) {
+                continue;
+            }
+
+            _collectRemoteFrees(cpuCache);
+            drained += _drainCpuCache(sizeClass, cpuCache, cpuCache->count);
+
+            releaseSpinlock(&cpuCache->lock);
+        }
+    }
+
+    return drained;
+}
+
+void* SlabAllocator::_allocateObject(SlabCache* cache, int sizeClass, uint8_t cpu) {
+    SlabHeader* slab = cache->partialSlabs;
+    if (!slab) {
+        slab = _createSlab(cache);
+
+        if (!slab) {
+            return nullptr;
+        }
+
+        slab->sizeClass = static_cast<uint32_t>(sizeClass);
+        _pushPartialSlab(cache, slab);
+    }
+
+    slab->ownerCpu = cpu;
+
+    void* object;
+    if (slab->freeList) {
+        object = slab->freeList;
+        slab->freeList = *static_cast<void**>(object);
+    } else {
+        object = slab->unusedObjects;
+        slab->unusedObjects += cache->objectSize;
+    }
+
+    if (slab->inUse == 0) {
+        cache->emptySlabCount--;
+    }
+
+    slab->inUse++;
+
+    // Full slabs come back onto the partial list once an object gets freed
+    if (slab->inUse == cache->objectsPerSlab) {
+        _unlinkPartialSlab(cache, slab);
+    }
+
+    cache->objectsInUse++;
+    cache->allocations++;
+
+    return object;
+}
+
+void SlabAllocator::_freeObject(SlabCache* cache, SlabHeader* slab, void* ptr) {
+    *static_cast<void**>(ptr) = slab->freeList;
+    slab->freeList = ptr;
+
+    if (!slab->onPartialList) {
+        _pushPartialSlab(cache, slab);
+    }
+
+    slab->inUse--;
+    cache->objectsInUse--;
+    cache->frees++;
+
+    if (slab->inUse == 0) {
+        cache->emptySlabCount++;
+
+        // Keep a few empty slabs around to absorb alloc/free bursts
+        if (cache->emptySlabCount > SLAB_MAX_EMPTY_SLABS) {
+            _unlinkPartialSlab(cache, slab);
+            _destroySlab(cache, slab);
+        }
+    }
+}
+
+uint32_t SlabAllocator::_refillCpuCache(int sizeClass, SlabCpuCache* cpuCache, uint8_t cpu) {
+    SlabCache* cache = _getCache(sizeClass);
+    uint32_t batch = _getCpuCacheLimit(cache->objectSize) / 2;
+    uint32_t refilled = 0;
+
+    acquireSpinlock(&cache->lock);
+
+    while (refilled < batch) {
+        void* object = _allocateObject(cache, sizeClass, cpu);
+        if (!object) {
+            break;
+        }
+
+        *static_cast<void**>(object) = cpuCache->objects;
+        cpuCache->objects = object;
+        cpuCache->count++;
+        ++refilled;
+    }
+
+    releaseSpinlock(&cache->lock);
+    return refilled;
+}
+
+uint32_t SlabAllocator::_drainCpuCache(int sizeClass, SlabCpuCache* cpuCache, uint32_t count) {
+    SlabCache* cache = _getCache(sizeClass);
+    uint32_t drained = 0;
+
+    acquireSpinlock(&cache->lock);
+
+    while (drained < count && cpuCache->count > 0) {
+        void* object = cpuCache->objects;
+        cpuCache->objects = *static_cast<void**>(object);
+        cpuCache->count--;
+
+        _freeObject(cache, _getSlabHeader(object), object);
+        ++drained;
+    }
+
+    releaseSpinlock(&cache->lock);
+    return drained;
+}
+
+uint32_t SlabAllocator::_collectRemoteFrees(SlabCpuCache* cpuCache) {
+    if (!cpuCache->remoteFrees) {
+        return 0;
+    }
+
+    // The owner is the only consumer, so detaching the whole stack at once avoids ABA issues
+    void* list = __sync_lock_test_and_set(&cpuCache->remoteFrees, nullptr);
+    uint32_t collected = 0;
+
+    while (list) {
+        void* object = list;
+        list = *static_cast<void**>(object);
+
+        *static_cast<void**>(object) = cpuCache->objects;
+        cpuCache->objects = object;
+        cpuCache->count++;
+        ++collected;
+    }
+
+    return collected;
+}
+
+size_t SlabAllocator::getAllocationSize(void* ptr) const {
+    SlabHeader* slab = _getSlabHeader(ptr);
+    if (!slab) {
+        return 0;
+    }
+
+    return g_slabSizeClasses[slab->sizeClass];
+}
+
+SlabSizeClassStats SlabAllocator::getSizeClassStats(int sizeClass) const {
+    SlabSizeClassStats stats = { 0, 0, 0, 0, 0, 0 };
+
+    if (sizeClass < 0 || sizeClass >= SLAB_SIZE_CLASS_COUNT) {
+        return stats;
+    }
+
+    const SlabCache* cache = &m_caches[sizeClass];
+
+    stats.objectSize = g_slabSizeClasses[sizeClass];
+    stats.slabCount = cache->slabCount;
+    stats.objectsInUse = cache->objectsInUse;
+    stats.objectCapacity = cache->slabCount * ((SLAB_SIZE - SLAB_HEADER_SIZE) / g_slabSizeClasses[sizeClass]);
+    stats.allocations = cache->allocations;
+    stats.frees = cache->frees;
+
+    return stats;
+}
+
+SlabCpuCacheStats SlabAllocator::getCpuCacheStats(int cpu) const {
+    SlabCpuCacheStats stats = { 0, 0, 0, 0 };
+
+    for (int i = 0; i < MAX_CPUS; ++i) {
+        if (cpu != -1 && cpu != i) {
+            continue;
+        }
+
+        for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+            const SlabCpuCache* cpuCache = &m_cpuCaches[i][sizeClass];
+
+            stats.hits += cpuCache->hits;
+            stats.misses += cpuCache->misses;
+            stats.remoteFrees += cpuCache->remoteFreeCount;
+            stats.cachedObjects += cpuCache->count;
+        }
+    }
+
+    return stats;
+}
+
+SlabAllocatorStats SlabAllocator::getStats() const {
+    SlabAllocatorStats stats = { 0, 0, 0, 0, 0 };
+
+    for (int sizeClass = 0; sizeClass < SLAB_SIZE_CLASS_COUNT; ++sizeClass) {
+        SlabSizeClassStats classStats = getSizeClassStats(sizeClass);
+
+        stats.slabCount += classStats.slabCount;
+        stats.slabMemory += classStats.slabCount * SLAB_SIZE;
+        stats.allocatedMemory += classStats.objectsInUse * classStats.objectSize;
+        stats.allocations += classStats.allocations;
+        stats.frees += classStats.frees;
+    }
+
+    return stats;
+}
+
+SlabAllocator::SlabCache* SlabAllocator::_getCache(int sizeClass) {
+    SlabCache* cache = &m_caches[sizeClass];
+
+    // Caches live in zeroed memory and are set up on first use
+    if (!cache->objectSize) {
+        cache->objectsPerSlab = (SLAB_SIZE - SLAB_HEADER_SIZE) / g_slabSizeClasses[sizeClass];
+        cache->objectSize = g_slabSizeClasses[sizeClass];
+    }
+
+    return cache;
+}
+
+SlabHeader* SlabAllocator::_createSlab(SlabCache* cache) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+
+    //
+    // The kernel's physical base is only page aligned, so a physically aligned
+    // run doesn't guarantee an aligned virtual address. Over-allocate instead
+    // and give back the pages in front of and behind the aligned slab.
+    //
+    uint64_t runPages = SLAB_PAGES * 2 - 1;
+
+    uint8_t* run = static_cast<uint8_t*>(pageFrameAllocator.requestFreePages(runPages));
+    if (!run) {
+        return nullptr;
+    }
+
+    uint64_t runStart = reinterpret_cast<uint64_t>(run);
+    uint64_t slabStart = (runStart + SLAB_SIZE - 1) & ~(static_cast<uint64_t>(SLAB_SIZE) - 1);
+
+    uint64_t headPages = (slabStart - runStart) / PAGE_SIZE;
+    uint64_t tailPages = runPages - headPages - SLAB_PAGES;
+
+    if (headPages) {
+        pageFrameAllocator.freePages(run, headPages);
+    }
+
+    if (tailPages) {
+        pageFrameAllocator.freePages(reinterpret_cast<void*>(slabStart + SLAB_SIZE), tailPages);
+    }
+
+    // Slabs are reached through the direct map, which migration can't remap, so their pages are pinned
+    pageFrameAllocator.setPageOwner(reinterpret_cast<void*>(slabStart), SLAB_PAGES, paging::PageOwner::Slab);
+
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>(slabStart);
+    zeromem(slab, sizeof(SlabHeader));
+
+    slab->magic = SLAB_HEADER_MAGIC;
+    slab->unusedObjects = reinterpret_cast<uint8_t*>(slabStart) + SLAB_HEADER_SIZE;
+
+    cache->slabCount++;
+    cache->emptySlabCount++;
+
+    return slab;
+}
+
+void SlabAllocator::_destroySlab(SlabCache* cache, SlabHeader* slab) {
+    slab->magic = 0;
+
+    cache->slabCount--;
+    cache->emptySlabCount--;
+
+    paging::getGlobalPageFrameAllocator().freePages(slab, SLAB_PAGES);
+}
+
+void SlabAllocator::_pushPartialSlab(SlabCache* cache, SlabHeader* slab) {
+    slab->prev = nullptr;
+    slab->next = cache->partialSlabs;
+
+    if (cache->partialSlabs) {
+        cache->partialSlabs->prev = slab;
+    }
+
+    cache->partialSlabs = slab;
+    slab->onPartialList = true;
+}
+
+void SlabAllocator::_unlinkPartialSlab(SlabCache* cache, SlabHeader* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        cache->partialSlabs = slab->next;
+    }
+
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+
+    slab->next = nullptr;
+    slab->prev = nullptr;
+    slab->onPartialList = false;
+}
+
+SlabHeader* SlabAllocator::_getSlabHeader(void* ptr) const {
+    uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+    uint64_t slabStart = addr & ~(static_cast<uint64_t>(SLAB_SIZE) - 1);
+
+    if (addr < 0xffff000000000000 || addr - slabStart < SLAB_HEADER_SIZE) {
+        return nullptr;
+    }
+
+    SlabHeader* slab = reinterpret_cast<SlabHeader*>(slabStart);
+    if (slab->magic != SLAB_HEADER_MAGIC || slab->sizeClass >= SLAB_SIZE_CLASS_COUNT) {
+        return nullptr;
+    }
+
+    // The pointer has to refer to the start of an object
+    if ((addr - slabStart - SLAB_HEADER_SIZE) % g_slabSizeClasses[slab->sizeClass] != 0) {
+        return nullptr;
+    }
+
+    return slab;
+}
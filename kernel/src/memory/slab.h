@@ -0,0 +1,179 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include <sync.h>
+#include <arch/x86/per_cpu_data.h>
+
+// Size of the naturally aligned, physically contiguous region backing a slab
+#define SLAB_SIZE                   0x10000 // 64KB
+#define SLAB_PAGES                  (SLAB_SIZE / PAGE_SIZE)
+
+// The slab header occupies the first cache line of every slab
+#define SLAB_HEADER_SIZE            64
+
+#define SLAB_MIN_OBJECT_SIZE        16
+#define SLAB_MAX_OBJECT_SIZE        4096
+#define SLAB_SIZE_CLASS_COUNT       16
+
+// Number of completely free slabs a size class keeps around before returning pages
+#define SLAB_MAX_EMPTY_SLABS        1
+
+// Bytes worth of objects each per-cpu cache may hold per size class
+#define SLAB_CPU_CACHE_BYTES        0x8000 // 32KB
+
+// Object count bounds of a per-cpu cache, independent of the object size
+#define SLAB_CPU_CACHE_MIN_OBJECTS  4
+#define SLAB_CPU_CACHE_MAX_OBJECTS  128
+
+#define SLAB_HEADER_MAGIC           0x42414c5358554c53ULL // "SLUXSLAB"
+
+struct SlabHeader;
+
+struct SlabSizeClassStats {
+    uint64_t objectSize;
+    uint64_t slabCount;
+    uint64_t objectsInUse;
+    uint64_t objectCapacity;
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+struct SlabCpuCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t remoteFrees;
+    uint64_t cachedObjects;
+};
+
+//
+// Per-cpu free list of one size class in front of the central slab caches.
+// Like the page magazines, the lock is only ever try-acquired by the fast
+// path and only gets contended when a task is preempted mid-operation, in
+// which case the caller falls back to the central cache. Objects freed on
+// a cpu other than their owner are pushed onto the owner's remote free
+// queue, a lock-free multi-producer single-consumer stack that the owner
+// detaches as a whole when it frees an object of the size class, before
+// going to the central cache for a refill and from the idle loop.
+//
+struct SlabCpuCache {
+    Spinlock        lock;
+    uint32_t        count;
+
+    // Objects chained through their first word
+    void*           objects;
+
+    void* volatile  remoteFrees;
+
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        remoteFreeCount;
+} __attribute__((aligned(64)));
+
+struct SlabAllocatorStats {
+    uint64_t slabCount;
+
+    // Memory held by slabs including their headers
+    uint64_t slabMemory;
+
+    // Memory handed out to callers, rounded up to the size class
+    uint64_t allocatedMemory;
+
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+//
+// Allocator for small kmalloc() requests. Every size class owns 64KB slabs
+// that are carved into equally sized objects, free objects are chained
+// through their first word. Slabs are aligned to their size, so the slab
+// header of any object is found by masking its address. Slabs with free
+// objects sit on their size class' partial list, full slabs are unlinked
+// until one of their objects gets freed.
+//
+// The central size class caches are locked, so every cpu first goes to its
+// own per-cpu cache which is refilled from and drained to the central cache
+// in batches. A slab is owned by the cpu that last refilled from it.
+// Objects cached per-cpu are accounted as in use by the central caches.
+//
+class SlabAllocator {
+public:
+    static SlabAllocator& get();
+
+    // Index of the smallest size class that fits the given size, -1 if there is none
+    static int getSizeClass(size_t size);
+
+    static inline bool isSlabSize(size_t size) {
+        return size && size <= SLAB_MAX_OBJECT_SIZE;
+    }
+
+    void* allocate(size_t size);
+    void free(void* ptr);
+
+    //
+    // Moves the objects other cpus freed into the calling cpu's caches, the
+    // surplus goes back to the central caches. Called from the idle loop so
+    // that objects don't stay queued on a cpu that stopped allocating them.
+    // Returns the number of objects collected.
+    //
+    uint64_t collectRemoteFrees();
+
+    // Returns the objects cached by every cpu to the central caches, returns the number of objects moved
+    uint64_t drainCpuCaches();
+
+    // Usable size of the object the pointer refers to, 0 for invalid pointers
+    size_t getAllocationSize(void* ptr) const;
+
+    SlabSizeClassStats getSizeClassStats(int sizeClass) const;
+    SlabAllocatorStats getStats() const;
+
+    // Returns the per-cpu cache counters of the given cpu, or the sum across all cpus if cpu is -1
+    SlabCpuCacheStats getCpuCacheStats(int cpu = -1) const;
+
+private:
+    struct SlabCache {
+        Spinlock    lock;
+
+        uint32_t    objectSize;
+        uint32_t    objectsPerSlab;
+
+        // Slabs with at least one free object
+        SlabHeader* partialSlabs;
+
+        uint64_t    slabCount;
+        uint64_t    emptySlabCount;
+        uint64_t    objectsInUse;
+
+        uint64_t    allocations;
+        uint64_t    frees;
+    };
+
+    SlabCache       m_caches[SLAB_SIZE_CLASS_COUNT];
+    SlabCpuCache    m_cpuCaches[MAX_CPUS][SLAB_SIZE_CLASS_COUNT];
+
+private:
+    SlabCache* _getCache(int sizeClass);
+
+    // Central cache object operations, expect the caller to hold the cache lock
+    void* _allocateObject(SlabCache* cache, int sizeClass, uint8_t cpu);
+    void _freeObject(SlabCache* cache, SlabHeader* slab, void* ptr);
+
+    // Moves a batch of objects from the central cache into the cpu cache, caller holds the cpu cache lock
+    uint32_t _refillCpuCache(int sizeClass, SlabCpuCache* cpuCache, uint8_t cpu);
+
+    // Returns 'count' objects from the cpu cache to the central cache, caller holds the cpu cache lock
+    uint32_t _drainCpuCache(int sizeClass, SlabCpuCache* cpuCache, uint32_t count);
+
+    // Moves the objects queued by other cpus into the cpu cache, caller holds the cpu cache lock
+    uint32_t _collectRemoteFrees(SlabCpuCache* cpuCache);
+
+    // Expects the caller to hold the cache lock
+    SlabHeader* _createSlab(SlabCache* cache);
+    void _destroySlab(SlabCache* cache, SlabHeader* slab);
+
+    void _pushPartialSlab(SlabCache* cache, SlabHeader* slab);
+    void _unlinkPartialSlab(SlabCache* cache, SlabHeader* slab);
+
+    // Returns the header of the slab containing the pointer or nullptr if it isn't a slab object
+    SlabHeader* _getSlabHeader(void* ptr) const;
+};
+
+#endif
@@ -0,0 +1,222 @@
+#include "vmalloc.h"
+#include "kmemory.h"
+#include <paging/page.h>
+#include <paging/page_frame_allocator.h>
+#include <kelevate/kelevate.h>
+
+struct VmallocArea {
+    uint64_t        base;
+
+    // Mapped pages, not counting the guard pages
+    uint64_t        pages;
+
+    VmallocArea*    next;
+};
+
+VmallocAllocator g_vmallocAllocator;
+
+VmallocAllocator& VmallocAllocator::get() {
+    return g_vmallocAllocator;
+}
+
+void* VmallocAllocator::allocate(size_t size) {
+    if (size == 0 || size > VMALLOC_VIRTUAL_SIZE) {
+        return nullptr;
+    }
+
+    VmallocArea* area = static_cast<VmallocArea*>(kmalloc(sizeof(VmallocArea)));
+    if (!area) {
+        return nullptr;
+    }
+
+    area->pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    acquireSpinlock(&m_lock);
+    bool reserved = _insertArea(area);
+    releaseSpinlock(&m_lock);
+
+    if (!reserved) {
+        kfree(area);
+        return nullptr;
+    }
+
+    // The area is already claimed, so the frames can be mapped without holding the lock
+    uint64_t mappedPages = _mapRange(area->base, area->pages);
+
+    acquireSpinlock(&m_lock);
+    m_mappedPages += mappedPages;
+    m_allocations++;
+    releaseSpinlock(&m_lock);
+
+    // Pages that never got mapped are skipped when the area gets released
+    if (mappedPages < area->pages) {
+        free(reinterpret_cast<void*>(area->base));
+        return nullptr;
+    }
+
+    return reinterpret_cast<void*>(area->base);
+}
+
+void VmallocAllocator::free(void* ptr) {
+    uint64_t base = reinterpret_cast<uint64_t>(ptr);
+
+    acquireSpinlock(&m_lock);
+
+    VmallocArea* prev = nullptr;
+    VmallocArea* area = m_areas;
+
+    while (area && area->base != base) {
+        prev = area;
+        area = area->next;
+    }
+
+    if (!area) {
+        releaseSpinlock(&m_lock);
+        return;
+    }
+
+    if (prev) {
+        prev->next = area->next;
+    } else {
+        m_areas = area->next;
+    }
+
+    m_areaCount--;
+    m_frees++;
+
+    releaseSpinlock(&m_lock);
+
+    _unmapRange(area->base, area->pages);
+
+    kfree(area);
+}
+
+size_t VmallocAllocator::getAllocationSize(void* ptr) {
+    uint64_t base = reinterpret_cast<uint64_t>(ptr);
+    size_t size = 0;
+
+    acquireSpinlock(&m_lock);
+
+    for (VmallocArea* area = m_areas; area; area = area->next) {
+        if (area->base == base) {
+            size = area->pages * PAGE_SIZE;
+            break;
+        }
+    }
+
+    releaseSpinlock(&m_lock);
+
+    return size;
+}
+
+VmallocStats VmallocAllocator::getStats() {
+    VmallocStats stats;
+
+    acquireSpinlock(&m_lock);
+
+    stats.areaCount = m_areaCount;
+    stats.mappedBytes = m_mappedPages * PAGE_SIZE;
+    stats.reservedBytes = 0;
+    stats.allocations = m_allocations;
+    stats.frees = m_frees;
+
+    for (VmallocArea* area = m_areas; area; area = area->next) {
+        stats.reservedBytes += (area->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+    }
+
+    releaseSpinlock(&m_lock);
+
+    return stats;
+}
+
+uint64_t VmallocAllocator::migratePages(uint64_t startPfn, uint64_t endPfn) {
+    // Areas being released are already off the list, the lock keeps the rest from going away
+    if (!tryAcquireSpinlock(&m_lock)) {
+        return 0;
+    }
+
+    uint64_t moved = 0;
+
+    RUN_ELEVATED({
+        for (VmallocArea* area = m_areas; area; area = area->next) {
+            moved += paging::migrateMappedPages(
+                reinterpret_cast<void*>(area->base),
+                area->pages * PAGE_SIZE,
+                startPfn,
+                endPfn,
+                paging::PageOwner::Vmalloc,
+                paging::getCurrentTopLevelPageTable()
+            );
+        }
+    });
+
+    releaseSpinlock(&m_lock);
+
+    return moved;
+}
+
+bool VmallocAllocator::_insertArea(VmallocArea* area) {
+    uint64_t span = (area->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+    uint64_t candidate = VMALLOC_VIRTUAL_BASE;
+
+    VmallocArea* prev = nullptr;
+    VmallocArea* next = m_areas;
+
+    // First fit between the existing areas
+    while (next && candidate + span > next->base) {
+        candidate = next->base + (next->pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE;
+        prev = next;
+        next = next->next;
+    }
+
+    if (candidate + span > VMALLOC_VIRTUAL_BASE + VMALLOC_VIRTUAL_SIZE) {
+        return false;
+    }
+
+    area->base = candidate;
+    area->next = next;
+
+    if (prev) {
+        prev->next = area;
+    } else {
+        m_areas = area;
+    }
+
+    m_areaCount++;
+
+    return true;
+}
+
+uint64_t VmallocAllocator::_mapRange(uint64_t base, uint64_t pages) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint64_t mapped = 0;
+
+    // Only the mappings reference the frames, so compaction can move them through migratePages()
+    RUN_ELEVATED({
+        mapped = paging::allocateAndMapPages(
+            reinterpret_cast<void*>(base),
+            pages,
+            USERSPACE_PAGE,
+            0,
+            paging::PageOwner::Vmalloc,
+            paging::getCurrentTopLevelPageTable(),
+            pageFrameAllocator
+        );
+    });
+
+    return mapped;
+}
+
+void VmallocAllocator::_unmapRange(uint64_t base, uint64_t pages) {
+    auto& pageFrameAllocator = paging::getGlobalPageFrameAllocator();
+    uint64_t released = 0;
+
+    // Like the heap's decommitted chunks, the frames are freed after a shootdown
+    RUN_ELEVATED({
+        released = paging::unmapPages(reinterpret_cast<void*>(base), pages, paging::getCurrentTopLevelPageTable(), true, pageFrameAllocator);
+    });
+
+    acquireSpinlock(&m_lock);
+    m_mappedPages -= released;
+    releaseSpinlock(&m_lock);
+}
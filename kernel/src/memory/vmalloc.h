@@ -0,0 +1,79 @@
+#ifndef VMALLOC_H
+#define VMALLOC_H
+#include <sync.h>
+
+// Kernel virtual range large allocations get mapped into, right after the heap reservation
+#define VMALLOC_VIRTUAL_BASE        0xffffff8080000000
+#define VMALLOC_VIRTUAL_SIZE        0x40000000 // 1GB
+
+// kmalloc() requests of at least this size are served from the vmalloc area
+#define VMALLOC_KMALLOC_THRESHOLD   0x40000 // 256KB
+
+// Unmapped pages left after every area to catch overruns
+#define VMALLOC_GUARD_PAGES         1
+
+struct VmallocArea;
+
+struct VmallocStats {
+    uint64_t areaCount;
+
+    // Physical memory backing the areas
+    uint64_t mappedBytes;
+
+    // Virtual address space taken up by the areas including their guard pages
+    uint64_t reservedBytes;
+
+    uint64_t allocations;
+    uint64_t frees;
+};
+
+//
+// Allocator for large, virtually contiguous buffers. Every allocation gets
+// its own page-aligned area in a dedicated kernel virtual range that is
+// backed by individually allocated, not necessarily contiguous frames, so
+// large buffers neither need a physically contiguous run of frames nor
+// carve huge segments out of the heap. Areas are kept in a list sorted by
+// address and new ones go into the first gap that fits.
+//
+class VmallocAllocator {
+public:
+    static VmallocAllocator& get();
+
+    static inline bool containsAddress(void* ptr) {
+        uint64_t addr = reinterpret_cast<uint64_t>(ptr);
+        return addr >= VMALLOC_VIRTUAL_BASE && addr < VMALLOC_VIRTUAL_BASE + VMALLOC_VIRTUAL_SIZE;
+    }
+
+    // Returns a page-aligned buffer of at least 'size' bytes
+    void* allocate(size_t size);
+    void free(void* ptr);
+
+    // Usable size of the area starting at the pointer, 0 if there is none
+    size_t getAllocationSize(void* ptr);
+
+    VmallocStats getStats();
+
+    // Moves the mapped pages whose frames lie in [startPfn, endPfn) to other frames, used by compaction
+    uint64_t migratePages(uint64_t startPfn, uint64_t endPfn);
+
+private:
+    Spinlock        m_lock;
+
+    // Areas sorted by their base address
+    VmallocArea*    m_areas;
+
+    uint64_t        m_areaCount;
+    uint64_t        m_mappedPages;
+    uint64_t        m_allocations;
+    uint64_t        m_frees;
+
+private:
+    // Finds a free range for the area and links it into the list, expects the caller to hold the lock
+    bool _insertArea(VmallocArea* area);
+
+    // Maps freshly allocated frames to the given range, returns the number of pages mapped
+    uint64_t _mapRange(uint64_t base, uint64_t pages);
+    void _unmapRange(uint64_t base, uint64_t pages);
+};
+
+#endif
@@ -0,0 +1,223 @@
+#include "buddy_allocator.h"
+
+namespace paging {
+    uint64_t BuddyAllocator::getMetadataSize(uint64_t frameCount) {
+        return frameCount * sizeof(FrameMetadata);
+    }
+
+    uint8_t BuddyAllocator::getOrderForFrameCount(uint64_t count) {
+        uint8_t order = 0;
+        while ((1ULL << order) < count) {
+            ++order;
+        }
+
+        return order;
+    }
+
+    void BuddyAllocator::initialize(uint64_t basePfn, uint64_t frameCount, void* metadata) {
+        m_basePfn = basePfn;
+        m_frameCount = frameCount;
+        m_freeFrameCount = 0;
+
+        m_frames = static_cast<FrameMetadata*>(metadata);
+
+        // No frame starts out as the head of a free block
+        for (uint64_t i = 0; i < frameCount; ++i) {
+            m_frames[i].order = BUDDY_NOT_A_FREE_HEAD;
+        }
+
+        for (uint8_t order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+            m_freeLists[order] = BUDDY_INVALID_PFN;
+            m_freeBlockCounts[order] = 0;
+        }
+    }
+
+    void BuddyAllocator::addFreeRange(uint64_t pfn, uint64_t count) {
+        uint64_t end = pfn + count;
+
+        // Clamp the range to the frames tracked by this allocator
+        if (pfn < m_basePfn) {
+            pfn = m_basePfn;
+        }
+
+        if (end > m_basePfn + m_frameCount) {
+            end = m_basePfn + m_frameCount;
+        }
+
+        // Decompose the range into the largest naturally aligned blocks
+        while (pfn < end) {
+            uint8_t order = 0;
+            while (
+                order < BUDDY_MAX_ORDER &&
+                (pfn & ((1ULL << (order + 1)) - 1)) == 0 &&
+                pfn + (1ULL << (order + 1)) <= end
+            ) {
+                ++order;
+            }
+
+            _freeBlock(pfn, order);
+            pfn += (1ULL << order);
+        }
+    }
+
+    uint64_t BuddyAllocator::removeRange(uint64_t pfn, uint64_t count) {
+        uint64_t removed = 0;
+        uint64_t end = pfn + count;
+
+        while (pfn < end) {
+            uint8_t order;
+            uint64_t head = _findFreeBlockContaining(pfn, &order);
+
+            // Frames that aren't free are simply skipped
+            if (head == BUDDY_INVALID_PFN) {
+                ++pfn;
+                continue;
+            }
+
+            _unlinkBlock(head, order);
+            m_freeFrameCount -= (1ULL << order);
+
+            uint64_t blockEnd = head + (1ULL << order);
+            uint64_t removedEnd = (blockEnd < end) ? blockEnd : end;
+
+            // Give back the parts of the block lying outside of the requested range
+            addFreeRange(head, pfn - head);
+            addFreeRange(removedEnd, blockEnd - removedEnd);
+
+            removed += removedEnd - pfn;
+            pfn = removedEnd;
+        }
+
+        return removed;
+    }
+
+    uint64_t BuddyAllocator::allocateBlock(uint8_t order) {
+        if (order > BUDDY_MAX_ORDER) {
+            return BUDDY_INVALID_PFN;
+        }
+
+        // Find the smallest available block that can satisfy the request
+        uint8_t currentOrder = order;
+        while (currentOrder <= BUDDY_MAX_ORDER && m_freeLists[currentOrder] == BUDDY_INVALID_PFN) {
+            ++currentOrder;
+        }
+
+        if (currentOrder > BUDDY_MAX_ORDER) {
+            return BUDDY_INVALID_PFN;
+        }
+
+        uint64_t pfn = m_freeLists[currentOrder];
+        _unlinkBlock(pfn, currentOrder);
+
+        // Split the block until it matches the requested
+        // order, returning upper halves to the free lists.
+        while (currentOrder > order) {
+            --currentOrder;
+            _pushBlock(pfn + (1ULL << currentOrder), currentOrder);
+        }
+
+        m_freeFrameCount -= (1ULL << order);
+        return pfn;
+    }
+
+    uint64_t BuddyAllocator::allocateFrames(uint64_t count) {
+        if (count == 0) {
+            return BUDDY_INVALID_PFN;
+        }
+
+        uint8_t order = getOrderForFrameCount(count);
+        uint64_t pfn = allocateBlock(order);
+
+        if (pfn == BUDDY_INVALID_PFN) {
+            return BUDDY_INVALID_PFN;
+        }
+
+        // Return the unused tail of the block
+        uint64_t blockSize = 1ULL << order;
+        if (blockSize > count) {
+            addFreeRange(pfn + count, blockSize - count);
+        }
+
+        return pfn;
+    }
+
+    void BuddyAllocator::_pushBlock(uint64_t pfn, uint8_t order) {
+        uint64_t idx = pfn - m_basePfn;
+        uint32_t head = m_freeLists[order];
+
+        m_frames[idx].next = head;
+        m_frames[idx].prev = BUDDY_INVALID_PFN;
+
+        if (head != BUDDY_INVALID_PFN) {
+            m_frames[head - m_basePfn].prev = static_cast<uint32_t>(pfn);
+        }
+
+        m_freeLists[order] = static_cast<uint32_t>(pfn);
+        m_frames[idx].order = order;
+        m_freeBlockCounts[order]++;
+    }
+
+    void BuddyAllocator::_unlinkBlock(uint64_t pfn, uint8_t order) {
+        uint64_t idx = pfn - m_basePfn;
+        uint32_t next = m_frames[idx].next;
+        uint32_t prev = m_frames[idx].prev;
+
+        if (prev != BUDDY_INVALID_PFN) {
+            m_frames[prev - m_basePfn].next = next;
+        } else {
+            m_freeLists[order] = next;
+        }
+
+        if (next != BUDDY_INVALID_PFN) {
+            m_frames[next - m_basePfn].prev = prev;
+        }
+
+        m_frames[idx].order = BUDDY_NOT_A_FREE_HEAD;
+        m_freeBlockCounts[order]--;
+    }
+
+    void BuddyAllocator::_freeBlock(uint64_t pfn, uint8_t order) {
+        m_freeFrameCount += (1ULL << order);
+
+        // Keep merging with the buddy block for as long as it is free
+        while (order < BUDDY_MAX_ORDER) {
+            uint64_t buddy = pfn ^ (1ULL << order);
+
+            if (!_isTracked(buddy) || !_isTracked(buddy + (1ULL << order) - 1)) {
+                break;
+            }
+
+            if (m_frames[buddy - m_basePfn].order != order) {
+                break;
+            }
+
+            _unlinkBlock(buddy, order);
+
+            pfn &= ~(1ULL << order);
+            ++order;
+        }
+
+        _pushBlock(pfn, order);
+    }
+
+    uint64_t BuddyAllocator::_findFreeBlockContaining(uint64_t pfn, uint8_t* order) {
+        if (!_isTracked(pfn)) {
+            return BUDDY_INVALID_PFN;
+        }
+
+        for (uint8_t currentOrder = 0; currentOrder <= BUDDY_MAX_ORDER; ++currentOrder) {
+            uint64_t head = pfn & ~((1ULL << currentOrder) - 1);
+
+            if (head < m_basePfn) {
+                break;
+            }
+
+            if (m_frames[head - m_basePfn].order == currentOrder) {
+                *order = currentOrder;
+                return head;
+            }
+        }
+
+        return BUDDY_INVALID_PFN;
+    }
+} // namespace paging
@@ -0,0 +1,101 @@
+#ifndef BUDDY_ALLOCATOR_H
+#define BUDDY_ALLOCATOR_H
+#include <ktypes.h>
+
+// Largest block order tracked by the buddy allocator (2^10 frames = 4MB)
+#define BUDDY_MAX_ORDER         10
+
+// Marks the end of a free list or an empty list head
+#define BUDDY_INVALID_PFN       0xffffffff
+
+// Per-frame order value for frames that are not the head of a free block
+#define BUDDY_NOT_A_FREE_HEAD   0xff
+
+namespace paging {
+//
+// Binary buddy allocator operating on page frame numbers (PFNs).
+//
+// Free blocks of 2^order frames are kept in per-order doubly linked
+// lists. The links live in an external per-frame metadata array rather
+// than in the free frames themselves, because not every physical frame
+// is reachable through the kernel's higher half mapping. The metadata of
+// frame N is located at getMetadataSize(N) bytes into a PFN 0 based array,
+// so multiple allocators can share one array as disjoint slices.
+//
+// The allocator itself is not thread-safe, the owner is
+// responsible for serializing access to it.
+//
+class BuddyAllocator {
+public:
+    BuddyAllocator() = default;
+
+    // Returns the number of bytes of metadata needed to track the given amount of frames
+    static uint64_t getMetadataSize(uint64_t frameCount);
+
+    //
+    // Frames in the range [basePfn, basePfn + frameCount) start out as allocated.
+    // The metadata pointer refers to the entry of basePfn, not to the start of the array.
+    //
+    void initialize(uint64_t basePfn, uint64_t frameCount, void* metadata);
+
+    // Returns a range of frames to the allocator coalescing them with free buddies
+    void addFreeRange(uint64_t pfn, uint64_t count);
+
+    //
+    // Takes a range of frames out of the free lists, splitting any free
+    // blocks that only partially overlap the range. Frames in the range that
+    // are not currently free are skipped. Returns the number of frames removed.
+    //
+    uint64_t removeRange(uint64_t pfn, uint64_t count);
+
+    // Allocates a naturally aligned block of 2^order frames, returns BUDDY_INVALID_PFN on failure
+    uint64_t allocateBlock(uint8_t order);
+
+    //
+    // Allocates exactly 'count' contiguous frames out of the smallest fitting
+    // block and returns the unused tail back to the free lists.
+    // Returns BUDDY_INVALID_PFN on failure.
+    //
+    uint64_t allocateFrames(uint64_t count);
+
+    inline uint64_t getBasePfn() const { return m_basePfn; }
+    inline uint64_t getFrameCount() const { return m_frameCount; }
+    inline uint64_t getFreeFrameCount() const { return m_freeFrameCount; }
+    inline uint64_t getFreeBlockCount(uint8_t order) const { return m_freeBlockCounts[order]; }
+
+    // Smallest order whose block can hold the given number of frames
+    static uint8_t getOrderForFrameCount(uint64_t count);
+
+private:
+    struct FrameMetadata {
+        uint32_t next;
+        uint32_t prev;
+        uint8_t  order;
+    } __attribute__((packed));
+
+    uint64_t    m_basePfn = 0;
+    uint64_t    m_frameCount = 0;
+    uint64_t    m_freeFrameCount = 0;
+
+    // Per-frame free list links and free block orders, indexed relative to m_basePfn
+    FrameMetadata* m_frames = nullptr;
+
+    uint32_t    m_freeLists[BUDDY_MAX_ORDER + 1];
+    uint64_t    m_freeBlockCounts[BUDDY_MAX_ORDER + 1];
+
+private:
+    void _pushBlock(uint64_t pfn, uint8_t order);
+    void _unlinkBlock(uint64_t pfn, uint8_t order);
+
+    // Inserts a single free block, merging it with its buddies when possible
+    void _freeBlock(uint64_t pfn, uint8_t order);
+
+    // Returns the head of the free block containing the frame or BUDDY_INVALID_PFN
+    uint64_t _findFreeBlockContaining(uint64_t pfn, uint8_t* order);
+
+    inline bool _isTracked(uint64_t pfn) const {
+        return pfn >= m_basePfn && pfn < m_basePfn + m_frameCount;
+    }
+};
+} // namespace paging
+#endif
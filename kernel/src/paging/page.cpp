@@ -1,6 +1,9 @@
 #include "page.h"
 #include "phys_addr_translation.h"
 #include "tlb.h"
+#include <arch/x86/cpuid.h>
+#include <interrupts/interrupts.h>
+#include <memory/kmemory.h>
 #include <kprint.h>
 
 namespace paging {
@@ -33,13 +36,19 @@ PageTable* getCurrentTopLevelPageTable() {
         :                 // No clobbered register
     );
     
-	void* pml4Vaddr = __va(reinterpret_cast<void*>(cr3_value));
+	// Strip the PCID (or the PWT/PCD bits while PCIDs are disabled)
+	void* pml4Vaddr = __va(reinterpret_cast<void*>(cr3_value & ~CR3_PCID_MASK));
 	return static_cast<PageTable*>(pml4Vaddr);
 }
 
 __PRIVILEGED_CODE
-void setCurrentTopLevelPageTable(PageTable* pml4) {
-    __asm__ volatile("mov %0, %%cr3" : : "r"(reinterpret_cast<uint64_t>(__pa(pml4))));
+void setCurrentTopLevelPageTable(PageTable* pml4, uint16_t pcid, bool noFlush) {
+	uint64_t cr3_value = reinterpret_cast<uint64_t>(__pa(pml4)) | (pcid & CR3_PCID_MASK);
+	if (noFlush) {
+		cr3_value |= CR3_NO_FLUSH;
+	}
+
+    __asm__ volatile("mov %0, %%cr3" : : "r"(cr3_value) : "memory");
 }
 
 pte_t* getPml4Entry(void* vaddr, PageTable* pml4) {
@@ -71,6 +80,131 @@ PageTable* getNextLevelPageTable(pte_t* entry) {
 	return reinterpret_cast<PageTable*>(pageTablePhysicalAddr);
 }
 
+// Size of the page mapped by a leaf entry of the given level, 1 being the page table level
+static inline uint64_t _getLevelPageSize(int level) {
+	return 1ULL << (12 + 9 * (level - 1));
+}
+
+// Index of the entry translating the address in a table of the given level, 4 being the PML4
+static inline uint64_t _getLevelIndex(uint64_t vaddr, int level) {
+	return (vaddr >> (12 + 9 * (level - 1))) & 0x1ff;
+}
+
+// Start of the next naturally aligned region of the given size, or 0 if the address space wraps
+static inline uint64_t _nextRegionBoundary(uint64_t addr, uint64_t regionSize) {
+	return (addr + regionSize) & ~(regionSize - 1);
+}
+
+// Returns the physical address of a fresh zeroed page table or nullptr if no frame is left
+__PRIVILEGED_CODE
+static PageTable* _allocatePageTable(PageFrameAllocator& pageFrameAllocator) {
+	void* page = pageFrameAllocator.requestFreePageZeroed();
+	if (!page) {
+		return nullptr;
+	}
+
+	PageTable* table = (PageTable*)__pa(page);
+	pageFrameAllocator.setPhysicalPageOwner(table, 1, PageOwner::PageTable);
+
+	return table;
+}
+
+//
+// Replaces a large leaf at the given level with a table of 512 leaves of
+// the next smaller size that map the same memory with the same attributes.
+//
+__PRIVILEGED_CODE
+static bool _splitLargeLeaf(pte_t* entry, int level, PageFrameAllocator& pageFrameAllocator) {
+	PageTable* table = _allocatePageTable(pageFrameAllocator);
+	if (!table) {
+		return false;
+	}
+
+	uint64_t childPageSize = _getLevelPageSize(level - 1);
+	uint64_t base = (static_cast<uint64_t>(entry->pageFrameNumber) << 12) & ~(_getLevelPageSize(level) - 1);
+
+	// The PAT bit moves to bit 7 in 4KB entries, which is the page size bit in the upper levels
+	pte_t leaf = *entry;
+	uint64_t pageAccessType = leaf.largePageAccessType;
+	leaf.pageFrameNumber = 0;
+
+	if (level - 1 == 1) {
+		leaf.pageAccessType = pageAccessType;
+	}
+
+	for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		table->entries[i] = leaf;
+		table->entries[i].pageFrameNumber = (base + i * childPageSize) >> 12;
+
+		if (level - 1 > 1) {
+			table->entries[i].largePageAccessType = pageAccessType;
+		}
+	}
+
+	pte_t tableEntry;
+	tableEntry.value = 0;
+	tableEntry.present = 1;
+	tableEntry.readWrite = 1;
+	tableEntry.userSupervisor = USERSPACE_PAGE;
+	tableEntry.pageFrameNumber = reinterpret_cast<uint64_t>(table) >> 12;
+
+	// The translations don't change, so the table can be swapped in with a single write
+	entry->value = tableEntry.value;
+
+	return true;
+}
+
+// Frees a page table along with every page table below it, the frames they map are left alone
+__PRIVILEGED_CODE
+static void _freePageTableTree(PageTable* table, int level, PageFrameAllocator& pageFrameAllocator) {
+	if (level > 1) {
+		for (uint64_t i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			pte_t* entry = &table->entries[i];
+
+			if (entry->present && !entry->pageSize) {
+				_freePageTableTree(getNextLevelPageTable(entry), level - 1, pageFrameAllocator);
+			}
+		}
+	}
+
+	pageFrameAllocator.freePhysicalPage(table);
+}
+
+//
+// Walks down to the entry translating the address at the given level,
+// creating missing page tables and splitting large leaves on the way.
+// Returns nullptr if a page table couldn't be allocated.
+//
+__PRIVILEGED_CODE
+static pte_t* _getOrCreateLeafEntry(uint64_t vaddr, int leafLevel, PageTable* pml4, PageFrameAllocator& pageFrameAllocator) {
+	PageTable* table = pml4;
+
+	for (int level = 4; level > leafLevel; --level) {
+		pte_t* entry = &table->entries[_getLevelIndex(vaddr, level)];
+
+		if (entry->present == 0) {
+			PageTable* nextTable = _allocatePageTable(pageFrameAllocator);
+			if (!nextTable) {
+				return nullptr;
+			}
+
+			entry->present = 1;
+			entry->readWrite = 1;
+			entry->userSupervisor = USERSPACE_PAGE;
+			entry->pageFrameNumber = reinterpret_cast<uint64_t>(nextTable) >> 12;
+		} else if (level < 4 && entry->pageSize) {
+			// A smaller page is being mapped into a large one
+			if (!_splitLargeLeaf(entry, level, pageFrameAllocator)) {
+				return nullptr;
+			}
+		}
+
+		table = getNextLevelPageTable(entry);
+	}
+
+	return &table->entries[_getLevelIndex(vaddr, leafLevel)];
+}
+
 __PRIVILEGED_CODE
 void mapPage(
     void* vaddr,
@@ -80,94 +214,577 @@ void mapPage(
     PageTable* pml4,
     PageFrameAllocator& pageFrameAllocator
 ) {
-    uint64_t pml4Index, pdptIndex, pdtIndex, ptIndex;
-	getPageTableIndicesFromVirtualAddress(
-        reinterpret_cast<uint64_t>(vaddr),
-        &pml4Index, &pdptIndex, &pdtIndex, &ptIndex
-    );
+	// Written from a clean template like any other mapping, replacing a present page flushes its translation
+	mapPages(vaddr, paddr, 1, privilegeLevel, attribs, pml4, pageFrameAllocator);
+}
 
-	PageTable *pdpt = nullptr, *pdt = nullptr, *pt = nullptr;
+__PRIVILEGED_CODE
+bool mapLargePage(
+    void* vaddr,
+    void* paddr,
+    uint64_t pageSize,
+	uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	int leafLevel;
+
+	if (pageSize == PAGE_SIZE) {
+		leafLevel = 1;
+	} else if (pageSize == PAGE_SIZE_2MB) {
+		leafLevel = 2;
+	} else if (pageSize == PAGE_SIZE_1GB && cpuid_is1GbPageSupported()) {
+		leafLevel = 3;
+	} else {
+		return false;
+	}
 
-	pte_t* pml4_entry = &pml4->entries[pml4Index];
+	if ((reinterpret_cast<uint64_t>(vaddr) | reinterpret_cast<uint64_t>(paddr)) & (pageSize - 1)) {
+		return false;
+	}
+
+	pte_t* entry = _getOrCreateLeafEntry(reinterpret_cast<uint64_t>(vaddr), leafLevel, pml4, pageFrameAllocator);
+	if (!entry) {
+		return false;
+	}
 
-	if (pml4_entry->present == 0) {
-		pdpt = (PageTable*)__pa(pageFrameAllocator.requestFreePageZeroed());
+	// A page table in the way gets replaced along with every mapping below it
+	PageTable* replacedTable = nullptr;
+	if (leafLevel > 1 && entry->present && !entry->pageSize) {
+		replacedTable = getNextLevelPageTable(entry);
+	}
 
-		pml4_entry->present = 1;
-		pml4_entry->readWrite = 1;
-		pml4_entry->userSupervisor = USERSPACE_PAGE;
-		pml4_entry->pageFrameNumber = reinterpret_cast<uint64_t>(pdpt) >> 12;
+	pte_t leaf;
+	leaf.value = 0;
+	leaf.present = 1;
+	leaf.readWrite = 1;
+	leaf.userSupervisor = privilegeLevel;
+	leaf.pageCacheDisabled = (attribs & PAGE_ATTRIB_CACHE_DISABLED) ? 1 : 0;
+	leaf.pageWriteThrough = (attribs & PAGE_ATTRIB_WRITE_THROUGH) ? 1 : 0;
+	leaf.global = reinterpret_cast<uint64_t>(vaddr) >= KERNEL_HALF_BASE;
+	leaf.pageFrameNumber = reinterpret_cast<uint64_t>(paddr) >> 12;
+
+	if (leafLevel > 1) {
+		leaf.pageSize = 1;
+		leaf.largePageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
 	} else {
-		pdpt = (PageTable*)((uint64_t)pml4_entry->pageFrameNumber << 12);
+		leaf.pageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
 	}
 
-	pte_t* pdpt_entry = &pdpt->entries[pdptIndex];
-	
-	if (pdpt_entry->present == 0) {
-		pdt = (PageTable*)__pa(pageFrameAllocator.requestFreePageZeroed());
+	entry->value = leaf.value;
 
-		pdpt_entry->present = 1;
-		pdpt_entry->readWrite = 1;
-		pdpt_entry->userSupervisor = USERSPACE_PAGE;
-		pdpt_entry->pageFrameNumber = reinterpret_cast<uint64_t>(pdt) >> 12;
-	} else {
-		pdt = (PageTable*)((uint64_t)pdpt_entry->pageFrameNumber << 12);
+	if (replacedTable) {
+		// Paging structure caches may still point into the old tables
+		shootdownTlbAll(pml4);
+		_freePageTableTree(replacedTable, leafLevel - 1, pageFrameAllocator);
 	}
 
-	pte_t* pdt_entry = &pdt->entries[pdtIndex];
-	
-	if (pdt_entry->present == 0) {
-		pt = (PageTable*)__pa(pageFrameAllocator.requestFreePageZeroed());
+	return true;
+}
 
-		pdt_entry->present = 1;
-		pdt_entry->readWrite = 1;
-		pdt_entry->userSupervisor = USERSPACE_PAGE;
-		pdt_entry->pageFrameNumber = reinterpret_cast<uint64_t>(pt) >> 12;
-	} else {
-		pt = (PageTable*)((uint64_t)pdt_entry->pageFrameNumber << 12);
+__PRIVILEGED_CODE
+uint64_t mapPages(
+    void* vaddr,
+    void* paddr,
+    uint64_t pageCount,
+	uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	uint64_t addr = reinterpret_cast<uint64_t>(vaddr);
+	uint64_t frame = reinterpret_cast<uint64_t>(paddr);
+	uint64_t mapped = 0;
+	bool replaced = false;
+
+	//
+	// Every entry is written from a template with a single store, so no stale
+	// NX, global or PAT bits of a previous mapping leak into the new one.
+	//
+	pte_t leaf;
+	leaf.value = 0;
+	leaf.present = 1;
+	leaf.readWrite = 1;
+	leaf.userSupervisor = privilegeLevel;
+	leaf.pageCacheDisabled = (attribs & PAGE_ATTRIB_CACHE_DISABLED) ? 1 : 0;
+	leaf.pageWriteThrough = (attribs & PAGE_ATTRIB_WRITE_THROUGH) ? 1 : 0;
+	leaf.pageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
+
+	// The kernel half is the same in every address space, its translations can stay cached across switches
+	leaf.global = addr >= KERNEL_HALF_BASE;
+
+	while (mapped < pageCount) {
+		// One walk per page table, the rest of the table's entries follow the first one
+		pte_t* pte = _getOrCreateLeafEntry(addr, 1, pml4, pageFrameAllocator);
+		if (!pte) {
+			kprintError("Failed to allocate a page table to map 0x%llx\n", addr);
+			break;
+		}
+
+		uint64_t tableEntries = PAGE_TABLE_ENTRIES - _getLevelIndex(addr, 1);
+		if (tableEntries > pageCount - mapped) {
+			tableEntries = pageCount - mapped;
+		}
+
+		for (uint64_t i = 0; i < tableEntries; ++i) {
+			replaced |= pte[i].present;
+
+			leaf.pageFrameNumber = (frame + i * PAGE_SIZE) >> 12;
+			pte[i].value = leaf.value;
+		}
+
+		mapped += tableEntries;
+		addr += tableEntries * PAGE_SIZE;
+		frame += tableEntries * PAGE_SIZE;
+	}
+
+	// Fresh mappings of pages that weren't present don't need an invalidation
+	if (replaced) {
+		shootdownTlbRange(vaddr, mapped * PAGE_SIZE, pml4);
+	}
+
+	return mapped;
+}
+
+__PRIVILEGED_CODE
+uint64_t allocateAndMapPages(
+    void* vaddr,
+    uint64_t pageCount,
+	uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageOwner owner,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	uint8_t* base = static_cast<uint8_t*>(vaddr);
+	uint64_t mapped = 0;
+
+	// Physically contiguous frames that haven't been mapped yet
+	uint64_t runFrame = 0;
+	uint64_t runPages = 0;
+
+	auto mapRun = [&]() -> bool {
+		pageFrameAllocator.setPhysicalPageOwner(reinterpret_cast<void*>(runFrame), runPages, owner);
+
+		uint64_t runMapped = mapPages(
+			base + mapped * PAGE_SIZE,
+			reinterpret_cast<void*>(runFrame),
+			runPages,
+			privilegeLevel,
+			attribs,
+			pml4,
+			pageFrameAllocator
+		);
+
+		mapped += runMapped;
+
+		// A page table allocation failed, the rest of the run never got mapped
+		if (runMapped < runPages) {
+			pageFrameAllocator.freePhysicalPages(reinterpret_cast<void*>(runFrame + runMapped * PAGE_SIZE), runPages - runMapped);
+			return false;
+		}
+
+		return true;
+	};
+
+	while (mapped + runPages < pageCount) {
+		void* page = pageFrameAllocator.requestFreePage();
+		if (!page) {
+			break;
+		}
+
+		uint64_t frame = reinterpret_cast<uint64_t>(__pa(page));
+
+		if (runPages && frame == runFrame + runPages * PAGE_SIZE) {
+			++runPages;
+			continue;
+		}
+
+		if (runPages && !mapRun()) {
+			pageFrameAllocator.freePhysicalPage(reinterpret_cast<void*>(frame));
+			return mapped;
+		}
+
+		runFrame = frame;
+		runPages = 1;
 	}
 
-	pte_t* pte = &pt->entries[ptIndex];
-	pte->present = 1;
-	pte->readWrite = 1;
-	pte->userSupervisor = privilegeLevel;
-	pte->pageCacheDisabled = attribs & PAGE_ATTRIB_CACHE_DISABLED;
-	pte->pageWriteThrough = attribs & PAGE_ATTRIB_WRITE_THROUGH;
-	pte->pageAccessType = attribs & PAGE_ATTRIB_ACCESS_TYPE;
-	pte->pageFrameNumber = reinterpret_cast<uint64_t>(paddr) >> 12;
+	if (runPages) {
+		mapRun();
+	}
+
+	return mapped;
+}
+
+//
+// Visits every present leaf mapping a page in [addr, last] with the address
+// and the size of the page it maps, walking down to each page table only
+// once. Large leaves the range only partially covers are split first if
+// 'splitPartialLeaves' is set. Returns false if a split failed.
+//
+template <typename Visitor>
+__PRIVILEGED_CODE
+static bool _walkRangeLeaves(
+    uint64_t addr,
+    uint64_t last,
+    PageTable* pml4,
+    bool splitPartialLeaves,
+    PageFrameAllocator& pageFrameAllocator,
+    Visitor visit
+) {
+	addr &= ~(PAGE_SIZE - 1);
+
+	while (addr <= last) {
+		PageTable* table = pml4;
+		uint64_t next = 0;
+
+		for (int level = 4; level >= 1; --level) {
+			uint64_t levelPageSize = _getLevelPageSize(level);
+			pte_t* entry = &table->entries[_getLevelIndex(addr, level)];
+
+			next = _nextRegionBoundary(addr, levelPageSize);
+
+			if (!entry->present) {
+				break;
+			}
+
+			if (level == 1) {
+				// Walk the 4KB entries of this page table that fall into the range
+				uint64_t tableEnd = _nextRegionBoundary(addr, _getLevelPageSize(2));
+				uint64_t tableLast = (tableEnd == 0 || tableEnd - 1 > last) ? last : tableEnd - 1;
+				uint64_t pteCount = ((tableLast - addr) >> 12) + 1;
+
+				for (uint64_t i = 0; i < pteCount; ++i) {
+					if (entry[i].present) {
+						visit(&entry[i], addr + i * PAGE_SIZE, static_cast<uint64_t>(PAGE_SIZE));
+					}
+				}
+
+				next = addr + pteCount * PAGE_SIZE;
+				break;
+			}
+
+			if (level < 4 && entry->pageSize) {
+				bool covered = (addr & (levelPageSize - 1)) == 0 && (next == 0 || next - 1 <= last);
+
+				if (covered || !splitPartialLeaves) {
+					visit(entry, addr & ~(levelPageSize - 1), levelPageSize);
+					break;
+				}
+
+				if (!_splitLargeLeaf(entry, level, pageFrameAllocator)) {
+					return false;
+				}
+			}
+
+			table = getNextLevelPageTable(entry);
+		}
+
+		// Stop if the end of the address space has been reached
+		if (next <= addr) {
+			break;
+		}
+
+		addr = next;
+	}
+
+	return true;
+}
+
+// Frames waiting to be released, chained through their own first bytes
+struct UnmappedFrameLink {
+	uint64_t next;
+	uint64_t pages;
+};
+
+__PRIVILEGED_CODE
+uint64_t unmapPages(
+    void* vaddr,
+    uint64_t pageCount,
+    PageTable* pml4,
+    bool freeFrames,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	if (pageCount == 0) {
+		return 0;
+	}
+
+	uint64_t start = reinterpret_cast<uint64_t>(vaddr) & ~(PAGE_SIZE - 1);
+	uint64_t last = start + pageCount * PAGE_SIZE - 1;
+
+	uint64_t unmapped = 0;
+	uint64_t frameCount = 0;
+	UnmappedFrameLink* frames = nullptr;
+
+	_walkRangeLeaves(start, last, pml4, true, pageFrameAllocator, [&](pte_t* entry, uint64_t, uint64_t pageSize) {
+		uint64_t paddr = (static_cast<uint64_t>(entry->pageFrameNumber) << 12) & ~(pageSize - 1);
+
+		entry->value = 0;
+		unmapped += pageSize / PAGE_SIZE;
+
+		//
+		// Other translations of the frame may still be cached until the
+		// invalidation, so the frames are only queued up here. Frames are
+		// reached through the identity map just like the page tables.
+		//
+		if (freeFrames) {
+			UnmappedFrameLink* link = reinterpret_cast<UnmappedFrameLink*>(paddr);
+			link->next = reinterpret_cast<uint64_t>(frames);
+			link->pages = pageSize / PAGE_SIZE;
+
+			frames = link;
+			frameCount++;
+		}
+	});
+
+	// Only released frames have to be out of every TLB before the call returns
+	shootdownTlbRange(reinterpret_cast<void*>(start), pageCount * PAGE_SIZE, pml4, freeFrames);
+
+	for (uint64_t i = 0; i < frameCount; ++i) {
+		UnmappedFrameLink* next = reinterpret_cast<UnmappedFrameLink*>(frames->next);
+		uint64_t pages = frames->pages;
+
+		if (pages == 1) {
+			pageFrameAllocator.freePhysicalPage(frames);
+		} else {
+			pageFrameAllocator.freePhysicalPages(frames, pages);
+		}
+
+		frames = next;
+	}
+
+	return unmapped;
+}
+
+// Page currently being moved by migrateMappedPages(), 0 if there is none
+static volatile uint64_t g_migratingPage;
+
+__PRIVILEGED_CODE
+uint64_t migrateMappedPages(
+    void* vaddr,
+    size_t size,
+    uint64_t startPfn,
+    uint64_t endPfn,
+    PageOwner owner,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	if (size == 0) {
+		return 0;
+	}
+
+	uint64_t start = reinterpret_cast<uint64_t>(vaddr) & ~(PAGE_SIZE - 1);
+	uint64_t last = reinterpret_cast<uint64_t>(vaddr) + size - 1;
+	uint64_t moved = 0;
+
+	_walkRangeLeaves(start, last, pml4, false, pageFrameAllocator, [&](pte_t* entry, uint64_t addr, uint64_t pageSize) {
+		uint64_t pfn = entry->pageFrameNumber;
+
+		// Only 4KB mappings are handed out frame by frame
+		if (pageSize != PAGE_SIZE || pfn < startPfn || pfn >= endPfn) {
+			return;
+		}
+
+		void* newPage = pageFrameAllocator.requestFreePage();
+		if (!newPage) {
+			return;
+		}
+
+		void* newFrame = __pa(newPage);
+		pageFrameAllocator.setPhysicalPageOwner(newFrame, 1, owner);
+
+		bool interruptsEnabled = areInterruptsEnabled();
+		disableInterrupts();
+
+		//
+		// Other cpus touching the page fault on the cleared entry and
+		// wait in handlePageMigrationFault() until the copy is in place,
+		// so no write can get lost between the copy and the remap.
+		//
+		g_migratingPage = addr;
+
+		pte_t leaf;
+		leaf.value = __atomic_exchange_n(&entry->value, 0, __ATOMIC_SEQ_CST);
+
+		shootdownTlbRange(reinterpret_cast<void*>(addr), PAGE_SIZE, pml4);
+
+		memcpy(newPage, __va(reinterpret_cast<void*>(pfn << 12)), PAGE_SIZE);
+
+		leaf.pageFrameNumber = reinterpret_cast<uint64_t>(newFrame) >> 12;
+		__atomic_store_n(&entry->value, leaf.value, __ATOMIC_SEQ_CST);
+
+		g_migratingPage = 0;
+
+		if (interruptsEnabled) {
+			enableInterrupts();
+		}
+
+		// The compaction pass releases the old frame along with the rest of the window
+		pageFrameAllocator.setPhysicalPageOwner(reinterpret_cast<void*>(pfn << 12), 1, PageOwner::CompactionReserved);
+		moved++;
+	});
+
+	return moved;
+}
+
+__PRIVILEGED_CODE
+bool handlePageMigrationFault(void* vaddr) {
+	uint64_t page = reinterpret_cast<uint64_t>(vaddr) & ~(PAGE_SIZE - 1);
+
+	while (__atomic_load_n(&g_migratingPage, __ATOMIC_ACQUIRE) == page) {
+		// The migrating cpu may be waiting for this one to acknowledge its shootdown
+		handleTlbShootdownIpi();
+		asm volatile("pause");
+	}
+
+	return getPteForAddr(reinterpret_cast<void*>(page), getCurrentTopLevelPageTable()) != nullptr;
+}
+
+__PRIVILEGED_CODE
+void changeRangeAttribs(
+    void* vaddr,
+    size_t size,
+    uint8_t attribs,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	if (size == 0) {
+		return;
+	}
+
+	uint64_t start = reinterpret_cast<uint64_t>(vaddr);
+	uint64_t last = start + size - 1;
+
+	_walkRangeLeaves(start, last, pml4, true, pageFrameAllocator, [&](pte_t* entry, uint64_t, uint64_t pageSize) {
+		entry->pageCacheDisabled = (attribs & PAGE_ATTRIB_CACHE_DISABLED) ? 1 : 0;
+		entry->pageWriteThrough = (attribs & PAGE_ATTRIB_WRITE_THROUGH) ? 1 : 0;
+
+		// Bit 7 is the page size bit in large leaves, their PAT bit is bit 12
+		if (pageSize == PAGE_SIZE) {
+			entry->pageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
+		} else {
+			entry->largePageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
+		}
+	});
+
+	shootdownTlbRange(vaddr, size, pml4);
+}
+
+__PRIVILEGED_CODE
+pte_t* splitLargePage(void* vaddr, PageTable* pml4, PageFrameAllocator& pageFrameAllocator) {
+	uint64_t pageSize;
+	pte_t* entry = getPteForAddr(vaddr, pml4, &pageSize);
+
+	if (!entry || pageSize == PAGE_SIZE) {
+		return entry;
+	}
+
+	// 1GB leaves are broken up into 2MB leaves first
+	if (pageSize == PAGE_SIZE_1GB) {
+		if (!_splitLargeLeaf(entry, 3, pageFrameAllocator)) {
+			return nullptr;
+		}
+
+		entry = getPdtEntry(vaddr, getNextLevelPageTable(entry));
+	}
+
+	if (!_splitLargeLeaf(entry, 2, pageFrameAllocator)) {
+		return nullptr;
+	}
+
+	return getPteFromPageTable(vaddr, getNextLevelPageTable(entry));
+}
+
+__PRIVILEGED_CODE
+void* unmapPage(void* vaddr, PageTable* pml4) {
+	pte_t* pte = splitLargePage(vaddr, pml4);
+	if (!pte) {
+		return nullptr;
+	}
+
+	void* paddr = reinterpret_cast<void*>(static_cast<uint64_t>(pte->pageFrameNumber) << 12);
+
+	pte->present = 0;
+	pte->pageFrameNumber = 0;
+	shootdownTlbRange(vaddr, PAGE_SIZE, pml4);
+
+	return paddr;
+}
+
+__PRIVILEGED_CODE
+void changeRangePrivilegeLevel(
+    void* vaddr,
+    size_t size,
+    uint8_t privilegeLevel,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator
+) {
+	if (size == 0) {
+		return;
+	}
+
+	// Inclusive bounds, the range is allowed to end at the very top of the address space
+	uint64_t start = reinterpret_cast<uint64_t>(vaddr);
+	uint64_t last = start + size - 1;
+
+	// Memory sharing a large leaf with the range must keep its own privilege level
+	bool updated = _walkRangeLeaves(start, last, pml4, true, pageFrameAllocator, [&](pte_t* entry, uint64_t, uint64_t) {
+		entry->userSupervisor = privilegeLevel;
+	});
+
+	if (!updated) {
+		kprintError("Failed to split a large page to change the privilege level of 0x%llx\n", start);
+	}
 }
 
 __PRIVILEGED_CODE
 void changePageAttribs(void* vaddr, uint8_t attribs, PageTable* pml4) {
-	pte_t* pte = getPteForAddr(vaddr, pml4);
-	pte->pageCacheDisabled = attribs & PAGE_ATTRIB_CACHE_DISABLED;
-	pte->pageWriteThrough = attribs & PAGE_ATTRIB_WRITE_THROUGH;
-	pte->pageAccessType = attribs & PAGE_ATTRIB_ACCESS_TYPE;
-	flushTlbPage(vaddr);
+	pte_t* pte = splitLargePage(vaddr, pml4);
+	if (!pte) {
+		return;
+	}
+
+	pte->pageCacheDisabled = (attribs & PAGE_ATTRIB_CACHE_DISABLED) ? 1 : 0;
+	pte->pageWriteThrough = (attribs & PAGE_ATTRIB_WRITE_THROUGH) ? 1 : 0;
+	pte->pageAccessType = (attribs & PAGE_ATTRIB_ACCESS_TYPE) ? 1 : 0;
+	shootdownTlbRange(vaddr, PAGE_SIZE, pml4);
 }
 
 __PRIVILEGED_CODE
 void markPageUncacheable(void* vaddr, PageTable* pml4) {
-	pte_t* pte = getPteForAddr(vaddr, pml4);
+	pte_t* pte = splitLargePage(vaddr, pml4);
+	if (!pte) {
+		return;
+	}
+
 	pte->pageCacheDisabled = 1;
-	flushTlbPage(vaddr);
+	shootdownTlbRange(vaddr, PAGE_SIZE, pml4);
 }
 
 __PRIVILEGED_CODE
 void markPageWriteThrough(void* vaddr, PageTable* pml4) {
-	pte_t* pte = getPteForAddr(vaddr, pml4);
+	pte_t* pte = splitLargePage(vaddr, pml4);
+	if (!pte) {
+		return;
+	}
+
 	pte->pageWriteThrough = 1;
-	flushTlbPage(vaddr);
+	shootdownTlbRange(vaddr, PAGE_SIZE, pml4);
 }
 
 __PRIVILEGED_CODE
 void markPageAccessType(void* vaddr, PageTable* pml4) {
-	pte_t* pte = getPteForAddr(vaddr, pml4);
+	pte_t* pte = splitLargePage(vaddr, pml4);
+	if (!pte) {
+		return;
+	}
+
 	pte->pageAccessType = 1;
-	flushTlbPage(vaddr);
+	shootdownTlbRange(vaddr, PAGE_SIZE, pml4);
 }
 
-PageTableEntry* getPteForAddr(void* vaddr, PageTable* pml4) {
+PageTableEntry* getPteForAddr(void* vaddr, PageTable* pml4, uint64_t* pageSize) {
 	pte_t* pml4Entry = getPml4Entry(vaddr, pml4);
 	if (!pml4Entry->present) {
 		return nullptr;
@@ -178,16 +795,36 @@ PageTableEntry* getPteForAddr(void* vaddr, PageTable* pml4) {
 		return nullptr;
 	}
 
+	if (pdptEntry->pageSize) {
+		if (pageSize) {
+			*pageSize = PAGE_SIZE_1GB;
+		}
+
+		return pdptEntry;
+	}
+
 	pte_t* pdtEntry = getPdtEntry(vaddr, getNextLevelPageTable(pdptEntry));
 	if (!pdtEntry->present) {
 		return nullptr;
 	}
 
+	if (pdtEntry->pageSize) {
+		if (pageSize) {
+			*pageSize = PAGE_SIZE_2MB;
+		}
+
+		return pdtEntry;
+	}
+
 	pte_t* pte = getPteFromPageTable(vaddr, getNextLevelPageTable(pdtEntry));
 	if (!pte->present) {
 		return nullptr;
 	}
 
+	if (pageSize) {
+		*pageSize = PAGE_SIZE;
+	}
+
 	return pte;
 }
 
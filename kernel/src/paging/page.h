@@ -4,6 +4,10 @@
 
 #define PAGE_TABLE_ENTRIES 512
 
+// Sizes of the pages mapped by large leaf entries in a PDT and a PDPT
+#define PAGE_SIZE_2MB   0x200000ULL
+#define PAGE_SIZE_1GB   0x40000000ULL
+
 #define USERSPACE_PAGE  1
 #define KERNEL_PAGE     0
 
@@ -11,6 +15,15 @@
 #define PAGE_ATTRIB_WRITE_THROUGH  0x02  // Bit 1
 #define PAGE_ATTRIB_ACCESS_TYPE    0x04  // Bit 2
 
+// Addresses from here on belong to the kernel half shared by every address space
+#define KERNEL_HALF_BASE 0xffff800000000000ULL
+
+// Low cr3 bits holding the process-context identifier while CR4.PCIDE is set
+#define CR3_PCID_MASK   0xfffULL
+
+// Keeps the TLB entries tagged with the new PCID when written to cr3
+#define CR3_NO_FLUSH    (1ULL << 63)
+
 namespace paging {
 typedef struct PageTableEntry {
     union
@@ -33,6 +46,15 @@ typedef struct PageTableEntry {
             uint64_t protectionKey        : 4;    // If the PKE bit of CR4 is set, determines the protection key.
             uint64_t executeDisable       : 1;    // If 1, instruction fetches not allowed.
         };
+        // View of the 2MB and 1GB leaves in PDT and PDPT entries
+        struct
+        {
+            uint64_t                      : 7;
+            uint64_t pageSize             : 1;    // If 1, the entry maps a large page instead of a page table.
+            uint64_t                      : 4;
+            uint64_t largePageAccessType  : 1;    // PAT bit of a large page.
+            uint64_t                      : 51;
+        };
         uint64_t value;
     };
 } __attribute__((packed)) pte_t;
@@ -48,9 +70,14 @@ static __attribute__((always_inline)) inline void* pageAlignAddress(void* addr)
 __PRIVILEGED_CODE
 PageTable* getCurrentTopLevelPageTable();
 
+//
+// The PCID and the no-flush hint are only valid
+// while PCIDs are enabled on the current cpu.
+//
 __PRIVILEGED_CODE
-void setCurrentTopLevelPageTable(PageTable* pml4);
+void setCurrentTopLevelPageTable(PageTable* pml4, uint16_t pcid = 0, bool noFlush = false);
 
+// Maps a single 4KB page, a present mapping it replaces gets shot down
 __PRIVILEGED_CODE
 void mapPage(
     void* vaddr,
@@ -61,6 +88,158 @@ void mapPage(
     PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
 );
 
+//
+// Maps a single 4KB, 2MB or 1GB page, both addresses have to be aligned to
+// the page size. Large leaves in the way of a smaller page get split, page
+// tables in the way of a large page get freed along with the mappings they
+// hold. Returns false if a page table couldn't be allocated or 1GB pages
+// aren't supported by the cpu.
+//
+__PRIVILEGED_CODE
+bool mapLargePage(
+    void* vaddr,
+    void* paddr,
+    uint64_t pageSize,
+    uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Maps 'pageCount' consecutive 4KB pages starting at 'vaddr' to the physical
+// range starting at 'paddr'. Every page table on the way is walked to once
+// and its entries are filled in one go, missing tables get allocated and
+// large leaves in the way split. Translations of pages that were already
+// mapped are flushed with a single batched invalidation at the end.
+// Returns the number of pages mapped, which is only short of 'pageCount'
+// if a page table couldn't be allocated.
+//
+__PRIVILEGED_CODE
+uint64_t mapPages(
+    void* vaddr,
+    void* paddr,
+    uint64_t pageCount,
+    uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Backs 'pageCount' 4KB pages starting at 'vaddr' with freshly allocated
+// frames tagged with the given owner. The frames don't have to be
+// contiguous, but runs of consecutive frames (which the per-cpu page
+// magazines hand out in ascending order) are mapped with a single
+// mapPages() call. Returns the number of pages mapped, frames that
+// couldn't be mapped are released again.
+//
+__PRIVILEGED_CODE
+uint64_t allocateAndMapPages(
+    void* vaddr,
+    uint64_t pageCount,
+    uint8_t privilegeLevel,
+    uint8_t attribs,
+    PageOwner owner,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Removes every mapping of the 4KB pages in the range with one walk and one
+// batched TLB invalidation, large leaves partially covered by the range get
+// split first. With 'freeFrames' set, the frames that were mapped are
+// returned to the page frame allocator, but only after the invalidation.
+// Returns the number of 4KB pages that were mapped.
+//
+__PRIVILEGED_CODE
+uint64_t unmapPages(
+    void* vaddr,
+    uint64_t pageCount,
+    PageTable* pml4,
+    bool freeFrames = false,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Moves every 4KB page in the range whose frame lies in [startPfn, endPfn)
+// to a fresh frame tagged with the given owner. Each page is unmapped,
+// shot down, copied and remapped in turn, accesses in the meantime wait in
+// handlePageMigrationFault(). The old frames are tagged CompactionReserved
+// for the calling compaction pass to release. Returns the number of pages
+// moved, the caller has to keep the range from being remapped meanwhile.
+//
+__PRIVILEGED_CODE
+uint64_t migrateMappedPages(
+    void* vaddr,
+    size_t size,
+    uint64_t startPfn,
+    uint64_t endPfn,
+    PageOwner owner,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Called for not-present page faults, waits for a migration of the page to
+// finish. Returns true if the address is mapped now and the faulting access
+// can be retried.
+//
+__PRIVILEGED_CODE
+bool handlePageMigrationFault(void* vaddr);
+
+//
+// Sets the caching attributes of every present mapping in the range with
+// one walk and one batched TLB invalidation. Large leaves fully covered by
+// the range are updated as a whole, partially covered ones get split.
+//
+__PRIVILEGED_CODE
+void changeRangeAttribs(
+    void* vaddr,
+    size_t size,
+    uint8_t attribs,
+    PageTable* pml4 = getCurrentTopLevelPageTable(),
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Breaks the 1GB or 2MB leaf mapping the given address down until the
+// address is mapped by a 4KB entry and returns that entry. The rest of the
+// large page keeps its translation and attributes. Returns nullptr if the
+// address isn't mapped or a page table couldn't be allocated.
+//
+__PRIVILEGED_CODE
+pte_t* splitLargePage(
+    void* vaddr,
+    PageTable* pml4,
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+//
+// Removes the 4KB mapping of the given address and flushes it from the local
+// TLB, a large leaf covering the address gets split first. Returns the physical address the page was mapped to or nullptr if it
+// wasn't mapped, freeing the frame is left to the caller.
+//
+__PRIVILEGED_CODE
+void* unmapPage(void* vaddr, PageTable* pml4);
+
+//
+// Sets the user/supervisor bit of every present leaf mapping in the range.
+// Each page table is looked up only once and 2MB/1GB leaves fully covered
+// by the range are updated with a single write, partially covered ones get
+// split first so the memory around the range keeps its privilege level.
+// The caller is responsible for flushing the TLB.
+//
+__PRIVILEGED_CODE
+void changeRangePrivilegeLevel(
+    void* vaddr,
+    size_t size,
+    uint8_t privilegeLevel,
+    PageTable* pml4 = getCurrentTopLevelPageTable(),
+    PageFrameAllocator& pageFrameAllocator = getGlobalPageFrameAllocator()
+);
+
+// Attribute changes only ever affect the 4KB page, large leaves covering it get split first
 __PRIVILEGED_CODE
 void changePageAttribs(void* vaddr, uint8_t attribs, PageTable* pml4 = getCurrentTopLevelPageTable());
 
@@ -80,7 +259,12 @@ pte_t* getPteFromPageTable(void* vaddr, PageTable* pt);
 
 PageTable* getNextLevelPageTable(pte_t* entry);
 
-PageTableEntry* getPteForAddr(void* vaddr, PageTable* pml4);
+//
+// Leaf entry mapping the address, which is a PDPT or PDT entry for 1GB
+// and 2MB pages. The size of the page it maps is optionally returned
+// through 'pageSize'. Returns nullptr if the address isn't mapped.
+//
+PageTableEntry* getPteForAddr(void* vaddr, PageTable* pml4, uint64_t* pageSize = nullptr);
 
 void dbgPrintPte(pte_t* pte);
 
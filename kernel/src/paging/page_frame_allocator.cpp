@@ -2,10 +2,13 @@
 #include <memory/kmemory.h>
 #include <memory/efimem.h>
 #include <memory/kheap.h>
+#include <memory/vmalloc.h>
 #include "phys_addr_translation.h"
 #include "page.h"
 #include "tlb.h"
-#include <sync.h>
+#include <time/ktime.h>
+#include <acpi/srat.h>
+#include <acpi/slit.h>
 #include <kprint.h>
 
 paging::PageFrameAllocator g_globalAllocator;
@@ -13,15 +16,50 @@ paging::PageFrameAllocator g_globalAllocator;
 extern uint64_t __ksymstart;
 
 DECLARE_SPINLOCK(__kpage_allocator_lock);
-DECLARE_SPINLOCK(__kpage_request_lock);
 
 namespace paging {
-    void PageFrameBitmap::initialize(uint64_t size, uint8_t* buffer) {
-        m_size = size;
-        m_buffer = buffer;
+    static inline uint64_t _wordsForBits(uint64_t bits) {
+        return (bits + 63) / 64;
+    }
+
+    // The kernel isn't linked against libgcc, so __builtin_popcountll isn't available
+    static inline uint64_t _countSetBits(uint64_t value) {
+        value = value - ((value >> 1) & 0x5555555555555555ULL);
+        value = (value & 0x3333333333333333ULL) + ((value >> 2) & 0x3333333333333333ULL);
+        value = (value + (value >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        return (value * 0x0101010101010101ULL) >> 56;
+    }
+
+    static uint64_t _migrateHeapPages(uint64_t startPfn, uint64_t endPfn) {
+        return DynamicMemoryAllocator::get().migratePages(startPfn, endPfn);
+    }
+
+    static uint64_t _migrateVmallocPages(uint64_t startPfn, uint64_t endPfn) {
+        return VmallocAllocator::get().migratePages(startPfn, endPfn);
+    }
+
+    uint64_t PageFrameBitmap::getBufferSize(uint64_t frameCount) {
+        uint64_t wordCount = _wordsForBits(frameCount);
+        uint64_t summaryWordCount = _wordsForBits(wordCount);
+        uint64_t topSummaryWordCount = _wordsForBits(summaryWordCount);
 
-        // Initially mark all pages as used
-        memset(buffer, 0xff, size);
+        return (wordCount + summaryWordCount + topSummaryWordCount) * sizeof(uint64_t);
+    }
+
+    void PageFrameBitmap::initialize(uint64_t frameCount, void* buffer) {
+        m_frameCount = frameCount;
+        m_wordCount = _wordsForBits(frameCount);
+        m_summaryWordCount = _wordsForBits(m_wordCount);
+        m_topSummaryWordCount = _wordsForBits(m_summaryWordCount);
+
+        m_words = static_cast<uint64_t*>(buffer);
+        m_summary = m_words + m_wordCount;
+        m_topSummary = m_summary + m_summaryWordCount;
+
+        // Initially mark all pages as used, which also
+        // means that no summary bit is set at this point.
+        memset(m_words, 0xff, m_wordCount * sizeof(uint64_t));
+        memset(m_summary, 0, (m_summaryWordCount + m_topSummaryWordCount) * sizeof(uint64_t));
     }
 
     int PageFrameBitmap::markPageFree(void* addr) {
@@ -40,35 +78,187 @@ namespace paging {
         return (_getPageValue(addr) == true);
     }
 
+    uint64_t PageFrameBitmap::markPagesFree(void* addr, uint64_t pages) {
+        return _setRangeValue(addr, pages, false);
+    }
+
+    uint64_t PageFrameBitmap::markPagesUsed(void* addr, uint64_t pages) {
+        return _setRangeValue(addr, pages, true);
+    }
+
+    uint64_t PageFrameBitmap::findFirstFree(uint64_t startIndex) {
+        if (startIndex >= m_frameCount) {
+            return PAGE_FRAME_BITMAP_NO_INDEX;
+        }
+
+        // Check the remainder of the starting word first
+        uint64_t wordIdx = startIndex / 64;
+        uint64_t freeBits = ~m_words[wordIdx] & (~0ULL << (startIndex % 64));
+        if (freeBits) {
+            return wordIdx * 64 + __builtin_ctzll(freeBits);
+        }
+
+        // Look for the next word with a free frame in the first summary level
+        uint64_t nextWordIdx = wordIdx + 1;
+        if (nextWordIdx >= m_wordCount) {
+            return PAGE_FRAME_BITMAP_NO_INDEX;
+        }
+
+        uint64_t summaryIdx = nextWordIdx / 64;
+        uint64_t summaryBits = m_summary[summaryIdx] & (~0ULL << (nextWordIdx % 64));
+
+        if (!summaryBits) {
+            // Fall back to the top level to skip over fully used summary words
+            uint64_t nextSummaryIdx = summaryIdx + 1;
+            if (nextSummaryIdx >= m_summaryWordCount) {
+                return PAGE_FRAME_BITMAP_NO_INDEX;
+            }
+
+            uint64_t topIdx = nextSummaryIdx / 64;
+            uint64_t topBits = m_topSummary[topIdx] & (~0ULL << (nextSummaryIdx % 64));
+
+            while (!topBits) {
+                if (++topIdx >= m_topSummaryWordCount) {
+                    return PAGE_FRAME_BITMAP_NO_INDEX;
+                }
+
+                topBits = m_topSummary[topIdx];
+            }
+
+            summaryIdx = topIdx * 64 + __builtin_ctzll(topBits);
+            summaryBits = m_summary[summaryIdx];
+        }
+
+        wordIdx = summaryIdx * 64 + __builtin_ctzll(summaryBits);
+        return wordIdx * 64 + __builtin_ctzll(~m_words[wordIdx]);
+    }
+
+    uint64_t PageFrameBitmap::findFirstUsed(uint64_t startIndex) {
+        if (startIndex >= m_frameCount) {
+            return m_frameCount;
+        }
+
+        uint64_t wordIdx = startIndex / 64;
+        uint64_t usedBits = m_words[wordIdx] & (~0ULL << (startIndex % 64));
+
+        while (!usedBits) {
+            if (++wordIdx >= m_wordCount) {
+                return m_frameCount;
+            }
+
+            usedBits = m_words[wordIdx];
+        }
+
+        uint64_t index = wordIdx * 64 + __builtin_ctzll(usedBits);
+        return (index < m_frameCount) ? index : m_frameCount;
+    }
+
     bool PageFrameBitmap::_setPageValue(void* addr, bool value) {
         uint64_t index = _addrToIndex(addr);
 
         // Preventing bitmap buffer overflow
-        if (index > (m_size * 8))
+        if (index >= m_frameCount)
             return false;
 
-        uint64_t byteIdx = index / 8;
-        uint8_t bitIdx = index % 8;
-        uint8_t mask = 0b00000001 << bitIdx;
-
-        // First disable the bit
-        m_buffer[byteIdx] &= ~mask;
+        uint64_t wordIdx = index / 64;
+        uint64_t mask = 1ULL << (index % 64);
 
-        // Now enable the bit if needed
         if (value) {
-            m_buffer[byteIdx] |= mask;
+            m_words[wordIdx] |= mask;
+        } else {
+            m_words[wordIdx] &= ~mask;
         }
 
+        _updateSummary(wordIdx);
         return true;
     }
 
     bool PageFrameBitmap::_getPageValue(void* addr) {
         uint64_t index = _addrToIndex(addr);
-        uint64_t byteIdx = index / 8;
-        uint8_t bitIdx = index % 8;
-        uint8_t mask = 0b00000001 << bitIdx;
 
-        return (m_buffer[byteIdx] & mask) > 0;
+        // Untracked frames are never available
+        if (index >= m_frameCount)
+            return true;
+
+        return (m_words[index / 64] & (1ULL << (index % 64))) != 0;
+    }
+
+    uint64_t PageFrameBitmap::_setRangeValue(void* addr, uint64_t pages, bool value) {
+        uint64_t start = _addrToIndex(addr);
+        uint64_t end = start + pages;
+
+        // Preventing bitmap buffer overflow
+        if (end > m_frameCount)
+            end = m_frameCount;
+
+        if (start >= end)
+            return 0;
+
+        uint64_t firstWord = start / 64;
+        uint64_t lastWord = (end - 1) / 64;
+        uint64_t changed = 0;
+
+        for (uint64_t wordIdx = firstWord; wordIdx <= lastWord; ++wordIdx) {
+            uint64_t mask = ~0ULL;
+
+            // Only the first and the last word can be partially covered
+            if (wordIdx == firstWord) {
+                mask &= ~0ULL << (start % 64);
+            }
+
+            if (wordIdx == lastWord && (end % 64)) {
+                mask &= ~0ULL >> (64 - end % 64);
+            }
+
+            uint64_t word = m_words[wordIdx];
+
+            if (value) {
+                changed += _countSetBits(~word & mask);
+            } else {
+                changed += _countSetBits(word & mask);
+            }
+
+            if (mask != ~0ULL) {
+                m_words[wordIdx] = value ? (word | mask) : (word & ~mask);
+            }
+        }
+
+        // Fully covered words in the middle of the range
+        uint64_t firstFullWord = (start % 64) ? firstWord + 1 : firstWord;
+        uint64_t lastFullWord = (end % 64) ? lastWord : lastWord + 1;
+
+        if (firstFullWord < lastFullWord) {
+            memset(
+                &m_words[firstFullWord],
+                value ? 0xff : 0x00,
+                (lastFullWord - firstFullWord) * sizeof(uint64_t)
+            );
+        }
+
+        for (uint64_t wordIdx = firstWord; wordIdx <= lastWord; ++wordIdx) {
+            _updateSummary(wordIdx);
+        }
+
+        return changed;
+    }
+
+    void PageFrameBitmap::_updateSummary(uint64_t wordIdx) {
+        uint64_t summaryIdx = wordIdx / 64;
+        uint64_t summaryMask = 1ULL << (wordIdx % 64);
+
+        if (m_words[wordIdx] != ~0ULL) {
+            m_summary[summaryIdx] |= summaryMask;
+        } else {
+            m_summary[summaryIdx] &= ~summaryMask;
+        }
+
+        uint64_t topMask = 1ULL << (summaryIdx % 64);
+
+        if (m_summary[summaryIdx]) {
+            m_topSummary[summaryIdx / 64] |= topMask;
+        } else {
+            m_topSummary[summaryIdx / 64] &= ~topMask;
+        }
     }
 
     uint64_t PageFrameBitmap::_addrToIndex(void* addr) {
@@ -85,6 +275,7 @@ namespace paging {
         uint64_t memoryDescriptorSize,
         uint64_t memoryDescriptorCount
     ) {
+        uint64_t ingestionStart = rdtsc();
         auto& heapAllocator = DynamicMemoryAllocator::get();
 
         void*       largestFreeMemorySegment = nullptr;
@@ -130,7 +321,14 @@ namespace paging {
         }
 
         // Calculate the page frame bitmap size
-        uint64_t pageBitmapSize = m_totalSystemMemory / PAGE_SIZE / 8 + 1;
+        uint64_t trackedFrameCount = m_totalSystemMemory / PAGE_SIZE + 1;
+        uint64_t pageBitmapSize = PageFrameBitmap::getBufferSize(trackedFrameCount);
+
+        // Buddy allocator metadata lives in the pages right after the bitmap, followed by the page owner tags
+        uint64_t buddyMetadataOffset = (uint64_t)pageAlignAddress((void*)pageBitmapSize);
+        uint64_t buddyMetadataSize = BuddyAllocator::getMetadataSize(trackedFrameCount);
+        uint64_t frameOwnersOffset = buddyMetadataOffset + buddyMetadataSize;
+        uint64_t allocatorMetadataSize = frameOwnersOffset + trackedFrameCount;
 
         // Set the page frame bitmap base by default
         // to the beginning of the largest free segment.
@@ -148,7 +346,7 @@ namespace paging {
                 if (desc->type != 7)
                     continue;
 
-                if (desc->pageCount * PAGE_SIZE >= pageBitmapSize) {
+                if (desc->pageCount * PAGE_SIZE >= allocatorMetadataSize) {
                     pageBitmapBase = static_cast<uint8_t*>(desc->paddr);
                     pageBitmapVirtualBase = (uint8_t*)__va(pageBitmapBase);
                     break;
@@ -156,14 +354,27 @@ namespace paging {
             }
         }
 
-        m_pageFrameBitmap.initialize(pageBitmapSize, pageBitmapVirtualBase);
+        m_pageFrameBitmap.initialize(trackedFrameCount, pageBitmapVirtualBase);
 
-        // Initialize the kernel heap
-        uint64_t kernelHeapBase = reinterpret_cast<uint64_t>(pageBitmapVirtualBase) + pageBitmapSize;
-        heapAllocator.init(kernelHeapBase, KERNEL_HEAP_INIT_SIZE);
-        // kprint("pageBitmapVirtualBase : %llx\n", pageBitmapVirtualBase);
-        // kprint("pageBitmapSize        : %llx\n", pageBitmapSize);
-        // kprint("kernelHeapBase        : %llx\n", kernelHeapBase);
+        m_frameOwners = pageBitmapVirtualBase + frameOwnersOffset;
+        zeromem(m_frameOwners, trackedFrameCount);
+
+        m_memoryMap = memoryMap;
+        m_memoryDescriptorSize = memoryDescriptorSize;
+        m_memoryDescriptorCount = memoryDescriptorCount;
+
+        // Until the NUMA topology is known all memory belongs to a single node 0 zone
+        m_buddyMetadata = pageBitmapVirtualBase + buddyMetadataOffset;
+        m_zoneCount = 1;
+        m_zones[0].node = 0;
+        m_zones[0].basePfn = 0;
+        m_zones[0].frameCount = trackedFrameCount;
+        m_zones[0].managedFrames = m_freeSystemMemory / PAGE_SIZE;
+        m_zones[0].buddy.initialize(0, trackedFrameCount, m_buddyMetadata);
+
+        m_nodeCount = 1;
+        m_nodeDistances[0][0] = SLIT_LOCAL_DISTANCE;
+        m_nodeFallbackOrder[0][0] = 0;
 
         // Get the address of PML4 table from cr3
         auto pml4 = getCurrentTopLevelPageTable();
@@ -177,245 +388,1320 @@ namespace paging {
             if (desc->type != 7)
                 continue;
 
-            uint8_t* frameStart = reinterpret_cast<uint8_t*>(desc->paddr);
-            uint8_t* frameEnd = reinterpret_cast<uint8_t*>(desc->paddr) + desc->pageCount * PAGE_SIZE;
-
-            for (uint8_t* freePagePtr = frameStart; freePagePtr < frameEnd; freePagePtr += PAGE_SIZE) {
-                m_pageFrameBitmap.markPageFree(freePagePtr);
+            // Free the whole region in the bitmap a word at a time
+            m_pageFrameBitmap.markPagesFree(desc->paddr, desc->pageCount);
 
-                // Mark free page's higher half virtual address with usermode permissions
-                auto pte = getPteForAddr(__va(freePagePtr), pml4);
-                pte->userSupervisor = USERSPACE_PAGE;
-            }
+            // Hand the whole region over to the buddy allocator
+            _addFreeFrames((uint64_t)desc->paddr / PAGE_SIZE, desc->pageCount);
         }
 
-        // Mark higher-half pages where bitmap lives as accessible to usermode code
-        for (uint8_t* bitmapPage = pageBitmapVirtualBase; bitmapPage < pageBitmapVirtualBase + pageBitmapSize; bitmapPage += PAGE_SIZE) {
-            // Mark free page with usermode permissions
-            auto pte = getPteForAddr(bitmapPage, pml4);
-            pte->userSupervisor = USERSPACE_PAGE;
+        m_usedSystemMemory = m_totalSystemMemory - m_freeSystemMemory;
+
+        // Lock the pages used for the bitmap and the buddy allocator metadata
+        uint64_t allocatorMetadataPages = allocatorMetadataSize / PAGE_SIZE + 1;
+        lockPhysicalPages(pageBitmapBase, allocatorMetadataPages);
+        lockPages(pageBitmapVirtualBase, allocatorMetadataPages);
+
+        //
+        // Mark the regions' higher half virtual addresses with usermode
+        // permissions. Large leaves that reach past a region get split,
+        // which takes page tables from the allocator, so this only runs
+        // once all free memory is registered and the metadata is locked.
+        //
+        for (uint64_t i = 0; i < memoryDescriptorCount; ++i) {
+            EFI_MEMORY_DESCRIPTOR* desc =
+                (EFI_MEMORY_DESCRIPTOR*)((uint64_t)memoryMap + (i * memoryDescriptorSize));
+
+            if (desc->type != 7)
+                continue;
+
+            changeRangePrivilegeLevel(__va(desc->paddr), desc->pageCount * PAGE_SIZE, USERSPACE_PAGE, pml4, *this);
         }
 
+        // Mark higher-half pages where the allocator metadata lives as accessible to usermode code
+        changeRangePrivilegeLevel(pageBitmapVirtualBase, allocatorMetadataSize, USERSPACE_PAGE, pml4, *this);
+
         // Flush the TLB to activate new usermode permissions
         flushTlbAll();
 
-        // Identify the first usable page index
-        for (
-            uint8_t* page = NULL;
-            page < reinterpret_cast<uint8_t*>(m_totalSystemMemory);
-            page += PAGE_SIZE
-        ) {
-            if (m_pageFrameBitmap.isPageFree(page)) {
-                m_lastTrackedFreePage = page;
-                break;
-            }
-        }
+        m_memoryMapIngestionCycles = rdtsc() - ingestionStart;
 
-        m_usedSystemMemory = m_totalSystemMemory - m_freeSystemMemory;
+        // Initialize the kernel heap. It only reserves its address space
+        // and commits frames on demand, which requires the free memory
+        // to have been registered with the allocator already.
+        heapAllocator.initGrowable(KERNEL_HEAP_VIRTUAL_BASE, KERNEL_HEAP_RESERVED_SIZE, KERNEL_HEAP_INITIAL_COMMIT_SIZE);
 
-        // Lock the pages used for the bitmap
-        lockPhysicalPages(pageBitmapBase, pageBitmapSize / PAGE_SIZE + 1);
-        lockPages(pageBitmapVirtualBase, pageBitmapSize / PAGE_SIZE + 1);
+        // Heap and vmalloc frames are only referenced by their mappings, compaction can move them
+        registerPageMigrationHandler(PageOwner::Heap, _migrateHeapPages);
+        registerPageMigrationHandler(PageOwner::Vmalloc, _migrateVmallocPages);
+        // kprint("pageBitmapVirtualBase : %llx\n", pageBitmapVirtualBase);
+        // kprint("pageBitmapSize        : %llx\n", pageBitmapSize);
     }
 
     void PageFrameAllocator::freePhysicalPage(void* paddr) {
         acquireSpinlock(&__kpage_allocator_lock);
+        _freePhysicalPage(paddr);
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
 
-        // Check if the page is already free
-        if (m_pageFrameBitmap.isPageFree(paddr)) {
-            releaseSpinlock(&__kpage_allocator_lock);
+    void PageFrameAllocator::freePhysicalPages(void* paddr, uint64_t pages) {
+        acquireSpinlock(&__kpage_allocator_lock);
+        _freePhysicalPages(paddr, pages);
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
+
+    void PageFrameAllocator::lockPhysicalPage(void* paddr) {
+        acquireSpinlock(&__kpage_allocator_lock);
+        _lockPhysicalPage(paddr);
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
+
+    void PageFrameAllocator::lockPhysicalPages(void* paddr, uint64_t pages) {
+        acquireSpinlock(&__kpage_allocator_lock);
+        _lockPhysicalPages(paddr, pages);
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
+
+    void PageFrameAllocator::freePage(void* vaddr) {
+        void* paddr = __pa(vaddr);
+        uint64_t pfn = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+
+        //
+        // Reject frames that aren't allocated before they get cached, a frame
+        // freed twice would otherwise sit in a magazine twice and be handed
+        // out to two owners. The bitmap and the owner tag of an allocated
+        // frame only change through its owner, so no lock is needed to read them.
+        //
+        if (
+            pfn >= m_pageFrameBitmap.getFrameCount() ||
+            m_pageFrameBitmap.isPageFree(paddr) ||
+            m_frameOwners[pfn] == static_cast<uint8_t>(PageOwner::Cached)
+        ) {
+            kprintError("Attempted to free page 0x%llx that isn't allocated\n", reinterpret_cast<uint64_t>(paddr));
             return;
         }
 
-        if (m_pageFrameBitmap.markPageFree(paddr)) {
-            m_freeSystemMemory += PAGE_SIZE;
-            m_usedSystemMemory -= PAGE_SIZE;
+        PageMagazine* magazine = &m_pageMagazines[getCurrentCpuIndex()];
+
+        // Another task on this core is in the middle of using the magazine
+        if (!tryAcquireSpinlock(&magazine->lock)) {
+            _freePageGlobal(paddr);
+            return;
         }
 
-        releaseSpinlock(&__kpage_allocator_lock);
+        // Make room by handing the oldest batch back to the global allocator
+        if (magazine->count == PAGE_MAGAZINE_CAPACITY) {
+            _drainPageMagazine(magazine, PAGE_MAGAZINE_BATCH_SIZE);
+        }
+
+        // Cached frames don't belong to their previous owner anymore
+        m_frameOwners[pfn] = static_cast<uint8_t>(PageOwner::Cached);
+
+        magazine->frames[magazine->count++] = paddr;
+        releaseSpinlock(&magazine->lock);
     }
 
-    void PageFrameAllocator::freePhysicalPages(void* paddr, uint64_t pages) {
-        for (uint64_t i = 0; i < pages; ++i) {
-            void* page = (void*)((uint64_t)paddr + (i * PAGE_SIZE));
-            freePhysicalPage(page);
-        }
+    void PageFrameAllocator::freePages(void* vaddr, uint64_t pages) {
+        freePhysicalPages(__pa(vaddr), pages);
     }
 
-    void PageFrameAllocator::lockPhysicalPage(void* paddr) {
+    void PageFrameAllocator::lockPage(void* vaddr) {
         acquireSpinlock(&__kpage_allocator_lock);
+        _lockPhysicalPage(__pa(vaddr));
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
 
-        // Check if the page is already in use
-        if (m_pageFrameBitmap.isPageUsed(paddr)) {
-            releaseSpinlock(&__kpage_allocator_lock);
-            return;
+    void PageFrameAllocator::lockPages(void* vaddr, uint64_t pages) {
+        lockPhysicalPages(__pa(vaddr), pages);
+    }
+
+    void* PageFrameAllocator::requestFreePage() {
+        PageMagazine* magazine = &m_pageMagazines[getCurrentCpuIndex()];
+
+        // Another task on this core is in the middle of using the magazine
+        if (!tryAcquireSpinlock(&magazine->lock)) {
+            return _requestFreePageGlobal();
         }
 
-        if (m_pageFrameBitmap.markPageUsed(paddr)) {
-            m_freeSystemMemory -= PAGE_SIZE;
-            m_usedSystemMemory += PAGE_SIZE;
+        if (magazine->count > 0) {
+            magazine->hits++;
+        } else {
+            magazine->misses++;
+            _refillPageMagazine(magazine);
         }
 
-        releaseSpinlock(&__kpage_allocator_lock);
+        void* page = nullptr;
+        if (magazine->count > 0) {
+            page = magazine->frames[--magazine->count];
+            m_frameOwners[reinterpret_cast<uint64_t>(page) / PAGE_SIZE] = static_cast<uint8_t>(PageOwner::Kernel);
+        }
+
+        releaseSpinlock(&magazine->lock);
+
+        if (!page) {
+            // The last free frames might be cached on other cores
+            drainPageMagazines();
+            return _requestFreePageGlobal();
+        }
+
+        return __va(page);
     }
 
-    void PageFrameAllocator::lockPhysicalPages(void* paddr, uint64_t pages) {
-        for (uint64_t i = 0; i < pages; ++i) {
-            void* page = (void*)((uint64_t)paddr + (i * PAGE_SIZE));
-            lockPhysicalPage(page);
+    void* PageFrameAllocator::requestFreePageZeroed() {
+        // Pages zeroed ahead of time by the idle loop
+        void* page = _takeZeroedPages(1);
+        if (page) {
+            return page;
+        }
+
+        page = requestFreePage();
+        if (!page) {
+            return nullptr;
         }
+
+        zeromem(page, PAGE_SIZE);
+
+        return page;
     }
 
-    void PageFrameAllocator::freePage(void* vaddr) {
+    void* PageFrameAllocator::requestFreePages(size_t pages) {
+        return requestFreePagesOnNode(pages, getCurrentNode());
+    }
+
+    void* PageFrameAllocator::requestFreePagesOnNode(size_t pages, uint8_t node) {
+        if (node >= m_nodeCount) {
+            node = 0;
+        }
+
         acquireSpinlock(&__kpage_allocator_lock);
+        void* page = _takeFreePhysicalPageRun(pages, node);
+        releaseSpinlock(&__kpage_allocator_lock);
 
-        void* paddr = __pa(vaddr);
+        // Frames cached in the per-cpu magazines might be able to complete the run
+        if (!page && drainPageMagazines() > 0) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            page = _takeFreePhysicalPageRun(pages, node);
+            releaseSpinlock(&__kpage_allocator_lock);
+        }
 
-        // Check if the page is already free
-        if (m_pageFrameBitmap.isPageFree(paddr)) {
+        // Under memory pressure the heap gives back the free chunks it has committed
+        if (!page && DynamicMemoryAllocator::get().trim() > 0) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            page = _takeFreePhysicalPageRun(pages, node);
             releaseSpinlock(&__kpage_allocator_lock);
-            return;
         }
 
-        if (m_pageFrameBitmap.markPageFree(paddr)) {
-            m_freeSystemMemory += PAGE_SIZE;
-            m_usedSystemMemory -= PAGE_SIZE;
+        // Free frames may still be scattered, compaction moves heap and vmalloc pages out of the way
+        if (!page && pages > 1 && compactMemory(pages, node)) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            page = _takeFreePhysicalPageRun(pages, node);
+            releaseSpinlock(&__kpage_allocator_lock);
         }
 
-        releaseSpinlock(&__kpage_allocator_lock);
+        if (!page) {
+            // If there are no more pages in RAM to give out,
+            // a disk page frame swap is required to request more pages,
+            // but Stellux kernel doesn't support it yet.
+            kprintError("Out of RAM! Disk page frame swap is not yet implemented\n");
+            return nullptr;
+        }
+
+        return __va(page);
     }
 
-    void PageFrameAllocator::freePages(void* vaddr, uint64_t pages) {
-        for (uint64_t i = 0; i < pages; ++i) {
-            void* page = (void*)((uint64_t)vaddr + (i * PAGE_SIZE));
-            freePage(page);
+    void* PageFrameAllocator::requestFreePagesZeroed(size_t pages) {
+        if (pages == 1) {
+            return requestFreePageZeroed();
+        }
+
+        void* page = nullptr;
+        if (pages == ZEROED_BLOCK_PAGES) {
+            page = _takeZeroedPages(pages);
+            if (page) {
+                return page;
+            }
+        }
+
+        page = requestFreePages(pages);
+        if (!page) {
+            return nullptr;
         }
+
+        zeromem(page, PAGE_SIZE * pages);
+
+        return page;
     }
 
-    void PageFrameAllocator::lockPage(void* vaddr) {
-        acquireSpinlock(&__kpage_allocator_lock);
+    void* PageFrameAllocator::requestFreePhysicalPages(size_t pages, uint64_t maxPhysicalAddress, uint64_t alignment) {
+        uint64_t limitPfn = maxPhysicalAddress / PAGE_SIZE;
 
-        void* paddr = __pa(vaddr);
+        acquireSpinlock(&__kpage_allocator_lock);
+        void* run = _takeFreePhysicalPagesBelow(pages, limitPfn, alignment);
+        releaseSpinlock(&__kpage_allocator_lock);
 
-        // Check if the page is already in use
-        if (m_pageFrameBitmap.isPageUsed(paddr)) {
+        // Frames cached in the per-cpu magazines might be able to complete the run
+        if (!run && drainPageMagazines() > 0) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            run = _takeFreePhysicalPagesBelow(pages, limitPfn, alignment);
             releaseSpinlock(&__kpage_allocator_lock);
-            return;
         }
 
-        if (m_pageFrameBitmap.markPageUsed(paddr)) {
-            m_freeSystemMemory -= PAGE_SIZE;
-            m_usedSystemMemory += PAGE_SIZE;
+        return run;
+    }
+
+    void* PageFrameAllocator::requestHugeFrame(uint8_t order, HugeFrameFallback fallback, uint8_t* allocatedOrder) {
+        if (order != HUGE_FRAME_ORDER_2MB && order != HUGE_FRAME_ORDER_1GB) {
+            return nullptr;
         }
 
+        uint8_t node = getCurrentNode();
+
+        acquireSpinlock(&__kpage_allocator_lock);
+        void* frame = _takeHugeFrame(order, node);
         releaseSpinlock(&__kpage_allocator_lock);
-    }
 
-    void PageFrameAllocator::lockPages(void* vaddr, uint64_t pages) {
-        for (uint64_t i = 0; i < pages; ++i) {
-            void* page = (void*)((uint64_t)vaddr + (i * PAGE_SIZE));
-            lockPage(page);
+        // Single frames cached per-cpu can break up an otherwise free huge frame
+        if (!frame && drainPageMagazines() > 0) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            frame = _takeHugeFrame(order, node);
+            releaseSpinlock(&__kpage_allocator_lock);
         }
-    }
 
-    void* PageFrameAllocator::requestFreePage() {
-        acquireSpinlock(&__kpage_request_lock);
+        if (!frame && fallback == HugeFrameFallback::SmallerOrder && order == HUGE_FRAME_ORDER_1GB) {
+            order = HUGE_FRAME_ORDER_2MB;
 
-        for (
-            uint8_t* page = reinterpret_cast<uint8_t*>(m_lastTrackedFreePage);
-            page < reinterpret_cast<uint8_t*>(m_totalSystemMemory);
-            page += PAGE_SIZE
-        ) {
-            // Skip pages that are already in use
-            if (m_pageFrameBitmap.isPageUsed(page)) {
-                continue;
+            acquireSpinlock(&__kpage_allocator_lock);
+            frame = _takeHugeFrame(order, node);
+            releaseSpinlock(&__kpage_allocator_lock);
+
+            if (frame) {
+                m_hugeFrameStats.fallbacks++;
             }
+        }
 
-            lockPhysicalPage(page);
+        if (!frame) {
+            m_hugeFrameStats.failures++;
+            return nullptr;
+        }
 
-            m_lastTrackedFreePage = page + PAGE_SIZE;
-            releaseSpinlock(&__kpage_request_lock);
-            return __va(page);
+        if (order == HUGE_FRAME_ORDER_1GB) {
+            m_hugeFrameStats.allocated1GB++;
+        } else {
+            m_hugeFrameStats.allocated2MB++;
         }
 
-        releaseSpinlock(&__kpage_request_lock);
+        if (allocatedOrder) {
+            *allocatedOrder = order;
+        }
 
-        // If there are no more pages in RAM to give out,
-        // a disk page frame swap is required to request more pages,
-        // but Stellux kernel doesn't support it yet.
-        kprintError("Out of RAM! Disk page frame swap is not yet implemented\n");
-        return NULL;
+        return frame;
     }
 
-    void* PageFrameAllocator::requestFreePageZeroed() {
-        void* page = requestFreePage();
-        zeromem(page, PAGE_SIZE);
+    void PageFrameAllocator::freeHugeFrame(void* paddr, uint8_t order) {
+        if (order != HUGE_FRAME_ORDER_2MB && order != HUGE_FRAME_ORDER_1GB) {
+            return;
+        }
 
-        return page;
+        freePhysicalPages(paddr, 1ULL << order);
     }
 
-    void* PageFrameAllocator::requestFreePages(size_t pages) {
-        acquireSpinlock(&__kpage_request_lock);
+    bool PageFrameAllocator::_lockPhysicalPage(void* paddr) {
+        return _lockPhysicalPages(paddr, 1) != 0;
+    }
 
-        for (
-            uint8_t* page = reinterpret_cast<uint8_t*>(m_lastTrackedFreePage);
-            page < reinterpret_cast<uint8_t*>(m_totalSystemMemory);
-            page += PAGE_SIZE
-        ) {
-            bool freeContiguousBlockFound = true;
+    bool PageFrameAllocator::_freePhysicalPage(void* paddr) {
+        return _freePhysicalPages(paddr, 1) != 0;
+    }
 
-            // Skip contiguous page blocks that are already in use
-            for (uint8_t* pageBlockPtr = page; pageBlockPtr < (page + PAGE_SIZE * pages); pageBlockPtr += PAGE_SIZE) {
-                if (m_pageFrameBitmap.isPageUsed(pageBlockPtr)) {
-                    freeContiguousBlockFound = false;
-                    break;
-                }
+    uint64_t PageFrameAllocator::_lockPhysicalPages(void* paddr, uint64_t pages) {
+        uint64_t start = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+        uint64_t end = start + pages;
+
+        // Take every run of free pages in the range out of the buddy allocator.
+        // Used pages are skipped a whole bitmap word at a time.
+        uint64_t runStart = m_pageFrameBitmap.findFirstFree(start);
+        while (runStart < end) {
+            uint64_t runEnd = m_pageFrameBitmap.findFirstUsed(runStart);
+            if (runEnd > end) {
+                runEnd = end;
             }
 
-            // Skip this page if the free contiguous block of memory wasn't found
-            if (!freeContiguousBlockFound) {
-                continue;
-            }
+            _removeFreeFrames(runStart, runEnd - runStart);
+            runStart = m_pageFrameBitmap.findFirstFree(runEnd);
+        }
+
+        uint64_t locked = m_pageFrameBitmap.markPagesUsed(paddr, pages);
+
+        m_freeSystemMemory -= locked * PAGE_SIZE;
+        m_usedSystemMemory += locked * PAGE_SIZE;
+        return locked;
+    }
+
+    uint64_t PageFrameAllocator::_freePhysicalPages(void* paddr, uint64_t pages) {
+        uint64_t start = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+        uint64_t end = start + pages;
+
+        if (end > m_pageFrameBitmap.getFrameCount()) {
+            end = m_pageFrameBitmap.getFrameCount();
+        }
 
-            // Lock all pages in the contiguous region
-            for (uint8_t* pageBlockPtr = page; pageBlockPtr < (page + PAGE_SIZE * pages); pageBlockPtr += PAGE_SIZE) {
-                lockPhysicalPage(pageBlockPtr);
+        // Hand every run of used pages in the range back to the buddy allocator,
+        // pages that are already free must not be inserted a second time.
+        uint64_t runStart = start;
+        while (runStart < end) {
+            runStart = m_pageFrameBitmap.findFirstUsed(runStart);
+            if (runStart >= end) {
+                break;
             }
 
-            // Check if we skipped over a free page in search for a
-            // contiguous block and assign the last tracked free page to it.
-            for (
-                uint8_t* pg = reinterpret_cast<uint8_t*>(m_lastTrackedFreePage);
-                pg < reinterpret_cast<uint8_t*>(m_totalSystemMemory);
-                pg += PAGE_SIZE
-            ) {
-                if (m_pageFrameBitmap.isPageFree(pg)) {
-                    m_lastTrackedFreePage = pg;
-                    break;
-                }
+            uint64_t runEnd = m_pageFrameBitmap.findFirstFree(runStart);
+            if (runEnd > end) {
+                runEnd = end;
             }
 
-            releaseSpinlock(&__kpage_request_lock);
-            return __va(page);
+            _addFreeFrames(runStart, runEnd - runStart);
+            runStart = runEnd;
         }
 
-        releaseSpinlock(&__kpage_request_lock);
+        uint64_t freed = m_pageFrameBitmap.markPagesFree(paddr, pages);
 
-        // If there are no more pages in RAM to give out,
-        // a disk page frame swap is required to request more pages,
-        // but Stellux kernel doesn't support it yet.
-        kprintError("Out of RAM! Disk page frame swap is not yet implemented\n");
-        return nullptr;
+        if (start < end) {
+            memset(m_frameOwners + start, static_cast<uint8_t>(PageOwner::Kernel), end - start);
+        }
+
+        m_freeSystemMemory += freed * PAGE_SIZE;
+        m_usedSystemMemory -= freed * PAGE_SIZE;
+        return freed;
     }
 
-    void* PageFrameAllocator::requestFreePagesZeroed(size_t pages) {
-        void* page = requestFreePages(pages);
-        if (!page) {
-            return nullptr;
+    PageMagazineStats PageFrameAllocator::getPageMagazineStats(int cpu) const {
+        PageMagazineStats stats = { 0, 0, 0 };
+
+        for (int i = 0; i < MAX_CPUS; ++i) {
+            if (cpu != -1 && cpu != i) {
+                continue;
+            }
+
+            stats.hits += m_pageMagazines[i].hits;
+            stats.misses += m_pageMagazines[i].misses;
+            stats.cachedFrames += m_pageMagazines[i].count;
         }
 
-        zeromem(page, PAGE_SIZE * pages);
+        return stats;
+    }
 
-        return page;
+    uint64_t PageFrameAllocator::drainPageMagazines() {
+        uint64_t drained = 0;
+
+        for (int i = 0; i < MAX_CPUS; ++i) {
+            PageMagazine* magazine = &m_pageMagazines[i];
+
+            // Magazines that are currently in use are skipped
+            if (!tryAcquireSpinlock(&magazine->lock)) {
+                continue;
+            }
+
+            drained += _drainPageMagazine(magazine, magazine->count);
+            releaseSpinlock(&magazine->lock);
+        }
+
+        for (int i = 0; i < MAX_CPUS; ++i) {
+            ZeroedPagePool* pool = &m_zeroedPagePools[i];
+
+            if (!tryAcquireSpinlock(&pool->lock)) {
+                continue;
+            }
+
+            drained += _drainZeroedPagePool(pool);
+            releaseSpinlock(&pool->lock);
+        }
+
+        return drained;
+    }
+
+    bool PageFrameAllocator::refillZeroedPagePool() {
+        ZeroedPagePool* pool = &m_zeroedPagePools[getCurrentCpuIndex()];
+
+        // Blocks go first since every new task takes two of them for its stacks
+        size_t pages;
+        if (pool->blockCount < ZEROED_BLOCK_POOL_CAPACITY) {
+            pages = ZEROED_BLOCK_PAGES;
+        } else if (pool->pageCount < ZEROED_PAGE_POOL_CAPACITY) {
+            pages = 1;
+        } else {
+            return false;
+        }
+
+        // Go straight to the zones, running out of memory here is not an error
+        acquireSpinlock(&__kpage_allocator_lock);
+        void* paddr = _takeFreePhysicalPageRun(pages, getCurrentNode());
+        releaseSpinlock(&__kpage_allocator_lock);
+
+        if (!paddr) {
+            return false;
+        }
+
+        zeromem(__va(paddr), pages * PAGE_SIZE);
+
+        // Pooled frames are tagged like magazine frames, so freePage() rejects a double free of one
+        uint64_t pfn = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+        memset(m_frameOwners + pfn, static_cast<uint8_t>(PageOwner::Cached), pages);
+
+        bool pooled = false;
+        if (tryAcquireSpinlock(&pool->lock)) {
+            if (pages == 1 && pool->pageCount < ZEROED_PAGE_POOL_CAPACITY) {
+                pool->pages[pool->pageCount++] = paddr;
+                pooled = true;
+            } else if (pages == ZEROED_BLOCK_PAGES && pool->blockCount < ZEROED_BLOCK_POOL_CAPACITY) {
+                pool->blocks[pool->blockCount++] = paddr;
+                pooled = true;
+            }
+
+            releaseSpinlock(&pool->lock);
+        }
+
+        // The pool got filled up or is busy, give the frames back
+        if (!pooled) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            _freePhysicalPages(paddr, pages);
+            releaseSpinlock(&__kpage_allocator_lock);
+        }
+
+        return pooled;
+    }
+
+    ZeroedPagePoolStats PageFrameAllocator::getZeroedPagePoolStats(int cpu) const {
+        ZeroedPagePoolStats stats = { 0, 0, 0 };
+
+        for (int i = 0; i < MAX_CPUS; ++i) {
+            if (cpu != -1 && cpu != i) {
+                continue;
+            }
+
+            stats.hits += m_zeroedPagePools[i].hits;
+            stats.misses += m_zeroedPagePools[i].misses;
+            stats.cachedPages += m_zeroedPagePools[i].pageCount;
+            stats.cachedPages += m_zeroedPagePools[i].blockCount * ZEROED_BLOCK_PAGES;
+        }
+
+        return stats;
+    }
+
+    void PageFrameAllocator::setPageOwner(void* vaddr, uint64_t pages, PageOwner owner) {
+        setPhysicalPageOwner(__pa(vaddr), pages, owner);
+    }
+
+    void PageFrameAllocator::setPhysicalPageOwner(void* paddr, uint64_t pages, PageOwner owner) {
+        uint64_t start = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+        uint64_t end = start + pages;
+
+        if (end > m_pageFrameBitmap.getFrameCount()) {
+            end = m_pageFrameBitmap.getFrameCount();
+        }
+
+        if (start < end) {
+            memset(m_frameOwners + start, static_cast<uint8_t>(owner), end - start);
+        }
+    }
+
+    PageOwner PageFrameAllocator::getPhysicalPageOwner(void* paddr) const {
+        uint64_t pfn = reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE;
+        if (pfn >= m_pageFrameBitmap.getFrameCount()) {
+            return PageOwner::Kernel;
+        }
+
+        return static_cast<PageOwner>(m_frameOwners[pfn]);
+    }
+
+    void PageFrameAllocator::registerPageMigrationHandler(PageOwner owner, PageMigrationHandler handler) {
+        if (owner >= PageOwner::CompactionReserved) {
+            return;
+        }
+
+        m_migrationHandlers[static_cast<int>(owner)] = handler;
+    }
+
+    bool PageFrameAllocator::compactMemory(size_t pages, uint8_t node) {
+        // Only one pass at a time, this also keeps migrations that need memory from recursing
+        if (!tryAcquireSpinlock(&m_compactionLock)) {
+            return false;
+        }
+
+        uint64_t start = rdtsc();
+        m_compactionStats.runs++;
+
+        // Frames parked in the per-cpu caches are the cheapest ones to reclaim
+        drainPageMagazines();
+
+        if (node >= m_nodeCount) {
+            node = 0;
+        }
+
+        bool evacuated = false;
+        uint64_t searchPfn = 0;
+
+        for (int attempt = 0; attempt < COMPACTION_MAX_WINDOW_ATTEMPTS && !evacuated; ++attempt) {
+            uint64_t windowPfn;
+
+            acquireSpinlock(&__kpage_allocator_lock);
+
+            if (!_findCompactionWindow(pages, node, searchPfn, &windowPfn)) {
+                releaseSpinlock(&__kpage_allocator_lock);
+                break;
+            }
+
+            uint64_t windowEnd = windowPfn + pages;
+
+            // Hold on to the free frames in the window so that migrated pages can't land in it
+            uint64_t runStart = m_pageFrameBitmap.findFirstFree(windowPfn);
+            while (runStart < windowEnd) {
+                uint64_t runEnd = m_pageFrameBitmap.findFirstUsed(runStart);
+                if (runEnd > windowEnd) {
+                    runEnd = windowEnd;
+                }
+
+                _lockPhysicalPages(reinterpret_cast<void*>(runStart * PAGE_SIZE), runEnd - runStart);
+                memset(m_frameOwners + runStart, static_cast<uint8_t>(PageOwner::CompactionReserved), runEnd - runStart);
+
+                runStart = m_pageFrameBitmap.findFirstFree(runEnd);
+            }
+
+            releaseSpinlock(&__kpage_allocator_lock);
+
+            // Let the owners move their frames out, the old frames come back tagged CompactionReserved
+            bool ownerPresent[static_cast<int>(PageOwner::Count)] = {};
+
+            uint64_t pfn = m_pageFrameBitmap.findFirstUsed(windowPfn);
+            while (pfn < windowEnd) {
+                ownerPresent[m_frameOwners[pfn]] = true;
+                pfn = m_pageFrameBitmap.findFirstUsed(pfn + 1);
+            }
+
+            for (int owner = 0; owner < static_cast<int>(PageOwner::CompactionReserved); ++owner) {
+                if (ownerPresent[owner] && m_migrationHandlers[owner]) {
+                    m_compactionStats.pagesMoved += m_migrationHandlers[owner](windowPfn, windowEnd);
+                }
+            }
+
+            // Frames an owner couldn't move right now keep the window from being usable
+            evacuated = true;
+
+            pfn = m_pageFrameBitmap.findFirstUsed(windowPfn);
+            while (pfn < windowEnd) {
+                if (m_frameOwners[pfn] != static_cast<uint8_t>(PageOwner::CompactionReserved)) {
+                    evacuated = false;
+                    break;
+                }
+
+                pfn = m_pageFrameBitmap.findFirstUsed(pfn + 1);
+            }
+
+            // Hand the held back frames over to the allocator again
+            acquireSpinlock(&__kpage_allocator_lock);
+
+            for (pfn = windowPfn; pfn < windowEnd; ++pfn) {
+                if (m_frameOwners[pfn] != static_cast<uint8_t>(PageOwner::CompactionReserved)) {
+                    continue;
+                }
+
+                uint64_t reservedEnd = pfn;
+                while (reservedEnd < windowEnd && m_frameOwners[reservedEnd] == static_cast<uint8_t>(PageOwner::CompactionReserved)) {
+                    ++reservedEnd;
+                }
+
+                _freePhysicalPages(reinterpret_cast<void*>(pfn * PAGE_SIZE), reservedEnd - pfn);
+                pfn = reservedEnd;
+            }
+
+            releaseSpinlock(&__kpage_allocator_lock);
+
+            // A failed window is skipped by the next attempt
+            searchPfn = windowEnd;
+        }
+
+        if (evacuated) {
+            m_compactionStats.successfulRuns++;
+        }
+
+        m_compactionStats.cycles += rdtsc() - start;
+        releaseSpinlock(&m_compactionLock);
+
+        return evacuated;
+    }
+
+    // Returns the compact node id of a proximity domain, registering the domain if it hasn't been seen yet
+    static uint8_t _getNodeForDomain(uint32_t* nodeDomains, uint8_t* nodeCount, uint32_t domain) {
+        for (uint8_t node = 0; node < *nodeCount; ++node) {
+            if (nodeDomains[node] == domain) {
+                return node;
+            }
+        }
+
+        // Domains that don't fit anymore are folded into node 0
+        if (*nodeCount == MAX_NUMA_NODES) {
+            return 0;
+        }
+
+        nodeDomains[*nodeCount] = domain;
+        return (*nodeCount)++;
+    }
+
+    __PRIVILEGED_CODE
+    void PageFrameAllocator::initializeNumaZones(Srat* srat, Slit* slit) {
+        if (!srat || srat->getMemoryRangeCount() == 0) {
+            return;
+        }
+
+        struct NodeRange {
+            uint64_t startPfn;
+            uint64_t endPfn;
+            uint8_t  node;
+        };
+
+        uint32_t nodeDomains[MAX_NUMA_NODES];
+        uint8_t nodeCount = 0;
+
+        NodeRange ranges[MAX_MEMORY_ZONES];
+        uint64_t rangeCount = 0;
+
+        // Collect the memory ranges sorted by their base address
+        for (size_t i = 0; i < srat->getMemoryRangeCount() && rangeCount < MAX_MEMORY_ZONES; ++i) {
+            SratMemoryRange& memoryRange = srat->getMemoryRange(i);
+
+            NodeRange range;
+            range.startPfn = memoryRange.base / PAGE_SIZE;
+            range.endPfn = (memoryRange.base + memoryRange.length) / PAGE_SIZE;
+            range.node = _getNodeForDomain(nodeDomains, &nodeCount, memoryRange.proximityDomain);
+
+            uint64_t pos = rangeCount++;
+            while (pos > 0 && ranges[pos - 1].startPfn > range.startPfn) {
+                ranges[pos] = ranges[pos - 1];
+                --pos;
+            }
+
+            ranges[pos] = range;
+        }
+
+        // Cpus can live in memoryless domains that still need a node id
+        for (size_t i = 0; i < srat->getCpuAffinityCount(); ++i) {
+            _getNodeForDomain(nodeDomains, &nodeCount, srat->getCpuAffinity(i).proximityDomain);
+        }
+
+        //
+        // Partition all tracked frames into zones. Holes between the SRAT
+        // ranges are attached to the node of the preceding range, and
+        // neighboring pieces of the same node get merged into one zone.
+        //
+        NodeRange zones[MAX_MEMORY_ZONES];
+        uint64_t zoneCount = 0;
+        uint64_t trackedFrameCount = m_pageFrameBitmap.getFrameCount();
+        uint64_t cursor = 0;
+        uint8_t lastNode = ranges[0].node;
+
+        for (uint64_t i = 0; i <= rangeCount; ++i) {
+            // The final iteration covers whatever is left after the last range
+            uint64_t start = (i < rangeCount) ? ranges[i].startPfn : trackedFrameCount;
+            uint64_t end = (i < rangeCount) ? ranges[i].endPfn : trackedFrameCount;
+            uint8_t node = (i < rangeCount) ? ranges[i].node : lastNode;
+
+            if (start < cursor) {
+                start = cursor;
+            }
+
+            if (end > trackedFrameCount) {
+                end = trackedFrameCount;
+            }
+
+            NodeRange pieces[2] = {
+                { cursor, (start < trackedFrameCount) ? start : trackedFrameCount, lastNode },
+                { start, end, node }
+            };
+
+            for (int p = 0; p < 2; ++p) {
+                if (pieces[p].startPfn >= pieces[p].endPfn) {
+                    continue;
+                }
+
+                bool merge = zoneCount > 0 && (
+                    zones[zoneCount - 1].node == pieces[p].node || zoneCount == MAX_MEMORY_ZONES
+                );
+
+                if (merge) {
+                    zones[zoneCount - 1].endPfn = pieces[p].endPfn;
+                } else {
+                    zones[zoneCount++] = pieces[p];
+                }
+
+                cursor = pieces[p].endPfn;
+            }
+
+            if (end > start) {
+                lastNode = node;
+            }
+        }
+
+        acquireSpinlock(&__kpage_allocator_lock);
+
+        for (uint64_t z = 0; z < zoneCount; ++z) {
+            MemoryZone* zone = &m_zones[z];
+            uint64_t zoneEnd = zones[z].endPfn;
+
+            zone->node = zones[z].node;
+            zone->basePfn = zones[z].startPfn;
+            zone->frameCount = zoneEnd - zone->basePfn;
+            zone->managedFrames = 0;
+
+            void* metadata = static_cast<uint8_t*>(m_buddyMetadata) + BuddyAllocator::getMetadataSize(zone->basePfn);
+            zone->buddy.initialize(zone->basePfn, zone->frameCount, metadata);
+
+            // Rebuild the zone's free lists from the bitmap
+            uint64_t runStart = m_pageFrameBitmap.findFirstFree(zone->basePfn);
+            while (runStart < zoneEnd) {
+                uint64_t runEnd = m_pageFrameBitmap.findFirstUsed(runStart);
+                if (runEnd > zoneEnd) {
+                    runEnd = zoneEnd;
+                }
+
+                zone->buddy.addFreeRange(runStart, runEnd - runStart);
+                runStart = m_pageFrameBitmap.findFirstFree(runEnd);
+            }
+
+            // Count the usable frames of the zone for the per-node statistics
+            for (uint64_t i = 0; i < m_memoryDescriptorCount; ++i) {
+                EFI_MEMORY_DESCRIPTOR* desc =
+                    (EFI_MEMORY_DESCRIPTOR*)((uint64_t)m_memoryMap + (i * m_memoryDescriptorSize));
+
+                // Only track EfiConventionalMemory
+                if (desc->type != 7)
+                    continue;
+
+                uint64_t descStart = (uint64_t)desc->paddr / PAGE_SIZE;
+                uint64_t descEnd = descStart + desc->pageCount;
+
+                uint64_t start = (descStart > zone->basePfn) ? descStart : zone->basePfn;
+                uint64_t end = (descEnd < zoneEnd) ? descEnd : zoneEnd;
+
+                if (start < end) {
+                    zone->managedFrames += end - start;
+                }
+            }
+        }
+
+        m_zoneCount = zoneCount;
+        m_nodeCount = nodeCount;
+
+        // Cpus without an affinity entry stay on node 0
+        memset(m_cpuNodes, 0, sizeof(m_cpuNodes));
+
+        for (size_t i = 0; i < srat->getCpuAffinityCount(); ++i) {
+            SratCpuAffinity& affinity = srat->getCpuAffinity(i);
+
+            if (affinity.apicId < MAX_CPUS) {
+                m_cpuNodes[affinity.apicId] = _getNodeForDomain(nodeDomains, &nodeCount, affinity.proximityDomain);
+            }
+        }
+
+        for (uint8_t from = 0; from < m_nodeCount; ++from) {
+            for (uint8_t to = 0; to < m_nodeCount; ++to) {
+                if (slit) {
+                    m_nodeDistances[from][to] = slit->getDistance(nodeDomains[from], nodeDomains[to]);
+                } else {
+                    m_nodeDistances[from][to] = (from == to) ? SLIT_LOCAL_DISTANCE : SLIT_REMOTE_DISTANCE;
+                }
+            }
+
+            // Sort the nodes by distance, the node itself always comes first
+            for (uint8_t i = 0; i < m_nodeCount; ++i) {
+                uint8_t candidate = (i == 0) ? from : ((i <= from) ? i - 1 : i);
+                uint8_t pos = i;
+
+                while (pos > 1 && m_nodeDistances[from][m_nodeFallbackOrder[from][pos - 1]] > m_nodeDistances[from][candidate]) {
+                    m_nodeFallbackOrder[from][pos] = m_nodeFallbackOrder[from][pos - 1];
+                    --pos;
+                }
+
+                m_nodeFallbackOrder[from][pos] = candidate;
+            }
+        }
+
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
+
+    uint8_t PageFrameAllocator::getNodeForPfn(uint64_t pfn) const {
+        for (uint64_t z = 0; z < m_zoneCount; ++z) {
+            const MemoryZone* zone = &m_zones[z];
+
+            if (pfn >= zone->basePfn && pfn < zone->basePfn + zone->frameCount) {
+                return zone->node;
+            }
+        }
+
+        return 0;
+    }
+
+    uint8_t PageFrameAllocator::getCurrentNode() const {
+        // Avoid the cpu index lookup on machines without a NUMA topology
+        if (m_nodeCount <= 1) {
+            return 0;
+        }
+
+        return m_cpuNodes[getCurrentCpuIndex()];
+    }
+
+    NumaNodeStats PageFrameAllocator::getNodeStats(uint8_t node) const {
+        NumaNodeStats stats = { 0, 0, 0 };
+
+        for (uint64_t z = 0; z < m_zoneCount; ++z) {
+            const MemoryZone* zone = &m_zones[z];
+            if (zone->node != node) {
+                continue;
+            }
+
+            // Cached magazine frames are counted as used
+            stats.totalMemory += zone->managedFrames * PAGE_SIZE;
+            stats.freeMemory += zone->buddy.getFreeFrameCount() * PAGE_SIZE;
+        }
+
+        stats.usedMemory = (stats.totalMemory > stats.freeMemory) ? stats.totalMemory - stats.freeMemory : 0;
+        return stats;
+    }
+
+    void* PageFrameAllocator::_takeFreePhysicalPage(uint8_t node) {
+        for (uint8_t i = 0; i < m_nodeCount; ++i) {
+            uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+            for (uint64_t z = 0; z < m_zoneCount; ++z) {
+                MemoryZone* zone = &m_zones[z];
+                if (zone->node != candidate) {
+                    continue;
+                }
+
+                // Frames freed anywhere in the zone become available again right away
+                uint64_t index = m_pageFrameBitmap.findFirstFree(zone->basePfn);
+                if (index >= zone->basePfn + zone->frameCount) {
+                    continue;
+                }
+
+                void* page = reinterpret_cast<void*>(index * PAGE_SIZE);
+                _lockPhysicalPage(page);
+
+                return page;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void* PageFrameAllocator::_takeFreePhysicalPageRun(size_t pages, uint8_t node) {
+        void* page = nullptr;
+
+        // Prefer a buddy block from the closest node that has one
+        for (uint8_t i = 0; i < m_nodeCount && !page; ++i) {
+            uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+            for (uint64_t z = 0; z < m_zoneCount; ++z) {
+                MemoryZone* zone = &m_zones[z];
+                if (zone->node != candidate) {
+                    continue;
+                }
+
+                uint64_t pfn = zone->buddy.allocateFrames(pages);
+                if (pfn != BUDDY_INVALID_PFN) {
+                    page = reinterpret_cast<void*>(pfn * PAGE_SIZE);
+                    break;
+                }
+            }
+        }
+
+        if (!page) {
+            // The buddy allocator only hands out naturally aligned blocks,
+            // so there still might be an unaligned run of free pages.
+            for (uint8_t i = 0; i < m_nodeCount && !page; ++i) {
+                uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+                for (uint64_t z = 0; z < m_zoneCount && !page; ++z) {
+                    if (m_zones[z].node == candidate) {
+                        page = _findFreePageRun(&m_zones[z], pages);
+                    }
+                }
+            }
+
+            // Finally allow the run to cross zone boundaries
+            if (!page) {
+                page = _findFreePageRun(nullptr, pages);
+            }
+
+            if (!page) {
+                return nullptr;
+            }
+
+            _removeFreeFrames(reinterpret_cast<uint64_t>(page) / PAGE_SIZE, pages);
+        }
+
+        // The buddy allocator has already taken the pages
+        // off its free lists, only the bitmap needs updating.
+        m_pageFrameBitmap.markPagesUsed(page, pages);
+
+        m_freeSystemMemory -= pages * PAGE_SIZE;
+        m_usedSystemMemory += pages * PAGE_SIZE;
+        return page;
+    }
+
+    void* PageFrameAllocator::_takeFreePhysicalPagesBelow(size_t pages, uint64_t limitPfn, uint64_t alignment) {
+        // Zones are sorted by their base, so the first run found is also the lowest one
+        for (uint64_t z = 0; z < m_zoneCount; ++z) {
+            MemoryZone* zone = &m_zones[z];
+            if (zone->basePfn >= limitPfn) {
+                break;
+            }
+
+            void* run = _findFreePageRun(zone, pages, alignment);
+            if (!run) {
+                continue;
+            }
+
+            if (reinterpret_cast<uint64_t>(run) / PAGE_SIZE + pages > limitPfn) {
+                break;
+            }
+
+            _lockPhysicalPages(run, pages);
+            return run;
+        }
+
+        return nullptr;
+    }
+
+    bool PageFrameAllocator::_findCompactionWindow(size_t pages, uint8_t node, uint64_t startPfn, uint64_t* windowPfn) {
+        bool found = false;
+        uint64_t bestMovable = 0;
+
+        for (uint8_t i = 0; i < m_nodeCount && !found; ++i) {
+            uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+            for (uint64_t z = 0; z < m_zoneCount; ++z) {
+                MemoryZone* zone = &m_zones[z];
+                if (zone->node != candidate) {
+                    continue;
+                }
+
+                uint64_t zoneStart = (zone->basePfn > startPfn) ? zone->basePfn : startPfn;
+                uint64_t zoneEnd = zone->basePfn + zone->frameCount;
+
+                if (zoneStart >= zoneEnd || zoneEnd - zoneStart < pages) {
+                    continue;
+                }
+
+                //
+                // Candidate windows start at the beginning of a free run. Used
+                // frames inside a window are visited with findFirstUsed(), which
+                // steps over free memory a word at a time, and a pinned frame
+                // moves the search to the next free frame through the summary
+                // levels, so fully used stretches are skipped as well.
+                //
+                uint64_t windowStart = zoneStart;
+
+                while (windowStart < zoneEnd && zoneEnd - windowStart >= pages) {
+                    uint64_t windowEnd = windowStart + pages;
+                    uint64_t movable = 0;
+                    bool pinned = false;
+
+                    uint64_t pfn = m_pageFrameBitmap.findFirstUsed(windowStart);
+                    while (pfn < windowEnd) {
+                        if (!_isFrameMovable(pfn)) {
+                            pinned = true;
+                            break;
+                        }
+
+                        // The window can't beat the best one anymore
+                        if (++movable >= bestMovable && found) {
+                            break;
+                        }
+
+                        pfn = m_pageFrameBitmap.findFirstUsed(pfn + 1);
+                    }
+
+                    if (!pinned && (!found || movable < bestMovable)) {
+                        found = true;
+                        bestMovable = movable;
+                        *windowPfn = windowStart;
+
+                        if (movable == 0) {
+                            return true;
+                        }
+                    }
+
+                    // Move on to the next free run, windows overlapping a pinned frame can't be evacuated
+                    uint64_t runEnd = pinned ? pfn + 1 : m_pageFrameBitmap.findFirstUsed(windowStart);
+                    windowStart = m_pageFrameBitmap.findFirstFree(runEnd);
+                }
+            }
+        }
+
+        return found;
+    }
+
+    bool PageFrameAllocator::_isFrameMovable(uint64_t pfn) {
+        uint8_t owner = m_frameOwners[pfn];
+        if (owner >= static_cast<uint8_t>(PageOwner::CompactionReserved)) {
+            return false;
+        }
+
+        return m_migrationHandlers[owner] != nullptr;
+    }
+
+    void* PageFrameAllocator::_takeHugeFrame(uint8_t order, uint8_t node) {
+        uint64_t pages = 1ULL << order;
+
+        for (uint8_t i = 0; i < m_nodeCount; ++i) {
+            uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+            for (uint64_t z = 0; z < m_zoneCount; ++z) {
+                MemoryZone* zone = &m_zones[z];
+                if (zone->node != candidate) {
+                    continue;
+                }
+
+                // Blocks up to the maximum buddy order are naturally aligned already
+                if (order <= BUDDY_MAX_ORDER) {
+                    uint64_t pfn = zone->buddy.allocateBlock(order);
+                    if (pfn == BUDDY_INVALID_PFN) {
+                        continue;
+                    }
+
+                    void* frame = reinterpret_cast<void*>(pfn * PAGE_SIZE);
+                    m_pageFrameBitmap.markPagesUsed(frame, pages);
+
+                    m_freeSystemMemory -= pages * PAGE_SIZE;
+                    m_usedSystemMemory += pages * PAGE_SIZE;
+                    return frame;
+                }
+
+                // Larger frames are found by skipping through the bitmap's summary levels
+                void* frame = _findFreePageRun(zone, pages, pages);
+                if (frame) {
+                    _lockPhysicalPages(frame, pages);
+                    return frame;
+                }
+            }
+        }
+
+        return nullptr;
+    }
+
+    void* PageFrameAllocator::_requestFreePageGlobal() {
+        acquireSpinlock(&__kpage_allocator_lock);
+        void* page = _takeFreePhysicalPage(getCurrentNode());
+        releaseSpinlock(&__kpage_allocator_lock);
+
+        // Under memory pressure the heap gives back the free chunks it has committed
+        if (!page && DynamicMemoryAllocator::get().trim() > 0) {
+            acquireSpinlock(&__kpage_allocator_lock);
+            page = _takeFreePhysicalPage(getCurrentNode());
+            releaseSpinlock(&__kpage_allocator_lock);
+        }
+
+        if (!page) {
+            // If there are no more pages in RAM to give out,
+            // a disk page frame swap is required to request more pages,
+            // but Stellux kernel doesn't support it yet.
+            kprintError("Out of RAM! Disk page frame swap is not yet implemented\n");
+            return nullptr;
+        }
+
+        return __va(page);
+    }
+
+    void PageFrameAllocator::_freePageGlobal(void* paddr) {
+        acquireSpinlock(&__kpage_allocator_lock);
+        _freePhysicalPage(paddr);
+        releaseSpinlock(&__kpage_allocator_lock);
+    }
+
+    uint32_t PageFrameAllocator::_refillPageMagazine(PageMagazine* magazine) {
+        uint32_t refilled = 0;
+        uint8_t node = m_cpuNodes[magazine - m_pageMagazines];
+        uint64_t pfn = BUDDY_INVALID_PFN;
+
+        acquireSpinlock(&__kpage_allocator_lock);
+
+        // Grab a whole naturally aligned batch with a single buddy allocation,
+        // preferring the zones of the node that the magazine's cpu belongs to.
+        for (uint8_t i = 0; i < m_nodeCount && pfn == BUDDY_INVALID_PFN; ++i) {
+            uint8_t candidate = m_nodeFallbackOrder[node][i];
+
+            for (uint64_t z = 0; z < m_zoneCount && pfn == BUDDY_INVALID_PFN; ++z) {
+                if (m_zones[z].node == candidate) {
+                    pfn = m_zones[z].buddy.allocateBlock(PAGE_MAGAZINE_BATCH_ORDER);
+                }
+            }
+        }
+
+        if (pfn != BUDDY_INVALID_PFN) {
+            m_pageFrameBitmap.markPagesUsed(reinterpret_cast<void*>(pfn * PAGE_SIZE), PAGE_MAGAZINE_BATCH_SIZE);
+            memset(m_frameOwners + pfn, static_cast<uint8_t>(PageOwner::Cached), PAGE_MAGAZINE_BATCH_SIZE);
+
+            // Frames are pushed in reverse so that they get handed out in ascending order
+            for (int64_t i = PAGE_MAGAZINE_BATCH_SIZE - 1; i >= 0; --i) {
+                magazine->frames[magazine->count++] = reinterpret_cast<void*>((pfn + i) * PAGE_SIZE);
+            }
+
+            refilled = PAGE_MAGAZINE_BATCH_SIZE;
+            m_freeSystemMemory -= PAGE_MAGAZINE_BATCH_SIZE * PAGE_SIZE;
+            m_usedSystemMemory += PAGE_MAGAZINE_BATCH_SIZE * PAGE_SIZE;
+        } else {
+            // Memory is too fragmented for a whole batch, take whatever single pages are left
+            while (refilled < PAGE_MAGAZINE_BATCH_SIZE && magazine->count < PAGE_MAGAZINE_CAPACITY) {
+                void* paddr = _takeFreePhysicalPage(node);
+                if (!paddr) {
+                    break;
+                }
+
+                m_frameOwners[reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE] = static_cast<uint8_t>(PageOwner::Cached);
+                magazine->frames[magazine->count++] = paddr;
+                ++refilled;
+            }
+        }
+
+        releaseSpinlock(&__kpage_allocator_lock);
+        return refilled;
+    }
+
+    uint32_t PageFrameAllocator::_drainPageMagazine(PageMagazine* magazine, uint32_t count) {
+        if (count > magazine->count) {
+            count = magazine->count;
+        }
+
+        if (count == 0) {
+            return 0;
+        }
+
+        acquireSpinlock(&__kpage_allocator_lock);
+
+        // The oldest frames sit at the bottom of the magazine
+        for (uint32_t i = 0; i < count; ++i) {
+            _freePhysicalPage(magazine->frames[i]);
+        }
+
+        releaseSpinlock(&__kpage_allocator_lock);
+
+        // Keep the recently freed (cache-hot) frames
+        magazine->count -= count;
+        memmove(magazine->frames, magazine->frames + count, magazine->count * sizeof(void*));
+
+        return count;
+    }
+
+    uint64_t PageFrameAllocator::_drainZeroedPagePool(ZeroedPagePool* pool) {
+        uint64_t drained = 0;
+
+        acquireSpinlock(&__kpage_allocator_lock);
+
+        for (uint32_t i = 0; i < pool->pageCount; ++i) {
+            drained += _freePhysicalPages(pool->pages[i], 1);
+        }
+
+        for (uint32_t i = 0; i < pool->blockCount; ++i) {
+            drained += _freePhysicalPages(pool->blocks[i], ZEROED_BLOCK_PAGES);
+        }
+
+        releaseSpinlock(&__kpage_allocator_lock);
+
+        pool->pageCount = 0;
+        pool->blockCount = 0;
+
+        return drained;
+    }
+
+    void* PageFrameAllocator::_takeZeroedPages(size_t pages) {
+        ZeroedPagePool* pool = &m_zeroedPagePools[getCurrentCpuIndex()];
+
+        // Another task on this core is in the middle of using the pool
+        if (!tryAcquireSpinlock(&pool->lock)) {
+            return nullptr;
+        }
+
+        void* paddr = nullptr;
+        if (pages == 1 && pool->pageCount > 0) {
+            paddr = pool->pages[--pool->pageCount];
+        } else if (pages == ZEROED_BLOCK_PAGES && pool->blockCount > 0) {
+            paddr = pool->blocks[--pool->blockCount];
+        }
+
+        if (paddr) {
+            pool->hits++;
+        } else {
+            pool->misses++;
+        }
+
+        releaseSpinlock(&pool->lock);
+
+        if (!paddr) {
+            return nullptr;
+        }
+
+        memset(m_frameOwners + reinterpret_cast<uint64_t>(paddr) / PAGE_SIZE, static_cast<uint8_t>(PageOwner::Kernel), pages);
+
+        return __va(paddr);
+    }
+
+    void* PageFrameAllocator::_findFreePageRun(MemoryZone* zone, size_t pages, uint64_t alignment) {
+        uint64_t searchStart = zone ? zone->basePfn : 0;
+        uint64_t searchEnd = zone ? zone->basePfn + zone->frameCount : m_pageFrameBitmap.getFrameCount();
+
+        uint64_t runStart = m_pageFrameBitmap.findFirstFree(searchStart);
+
+        while (runStart < searchEnd) {
+            // Move the start of the run up to the next aligned frame
+            runStart = (runStart + alignment - 1) / alignment * alignment;
+            if (runStart >= searchEnd) {
+                break;
+            }
+
+            // A used page ends the current run
+            uint64_t runEnd = m_pageFrameBitmap.findFirstUsed(runStart);
+            if (runEnd > searchEnd) {
+                runEnd = searchEnd;
+            }
+
+            if (runEnd - runStart >= pages) {
+                return reinterpret_cast<void*>(runStart * PAGE_SIZE);
+            }
+
+            runStart = m_pageFrameBitmap.findFirstFree(runEnd);
+        }
+
+        return nullptr;
+    }
+
+    void PageFrameAllocator::_addFreeFrames(uint64_t pfn, uint64_t count) {
+        uint64_t end = pfn + count;
+
+        for (uint64_t z = 0; z < m_zoneCount; ++z) {
+            MemoryZone* zone = &m_zones[z];
+            uint64_t zoneEnd = zone->basePfn + zone->frameCount;
+
+            uint64_t start = (pfn > zone->basePfn) ? pfn : zone->basePfn;
+            uint64_t stop = (end < zoneEnd) ? end : zoneEnd;
+
+            if (start < stop) {
+                zone->buddy.addFreeRange(start, stop - start);
+            }
+        }
+    }
+
+    void PageFrameAllocator::_removeFreeFrames(uint64_t pfn, uint64_t count) {
+        uint64_t end = pfn + count;
+
+        for (uint64_t z = 0; z < m_zoneCount; ++z) {
+            MemoryZone* zone = &m_zones[z];
+            uint64_t zoneEnd = zone->basePfn + zone->frameCount;
+
+            uint64_t start = (pfn > zone->basePfn) ? pfn : zone->basePfn;
+            uint64_t stop = (end < zoneEnd) ? end : zoneEnd;
+
+            if (start < stop) {
+                zone->buddy.removeRange(start, stop - start);
+            }
+        }
     }
 } // namespace paging
@@ -1,17 +1,64 @@
 #ifndef PAGE_FRAME_ALLOCATOR_H
 #define PAGE_FRAME_ALLOCATOR_H
-#include <ktypes.h>
+#include "buddy_allocator.h"
+#include <arch/x86/per_cpu_data.h>
+#include <sync.h>
 
 #define PAGE_SIZE 0x1000
 
+// Maximum number of order-0 frames cached by each per-cpu page magazine
+#define PAGE_MAGAZINE_CAPACITY      64
+
+// Frames are moved between a magazine and the global allocator in batches of 2^order
+#define PAGE_MAGAZINE_BATCH_ORDER   5
+#define PAGE_MAGAZINE_BATCH_SIZE    (1 << PAGE_MAGAZINE_BATCH_ORDER)
+
+// Number of pre-zeroed single pages and 2-page blocks kept in each per-cpu zeroed page pool
+#define ZEROED_PAGE_POOL_CAPACITY   32
+#define ZEROED_BLOCK_POOL_CAPACITY  16
+
+// Size of the blocks in the zeroed block pool (kernel and user task stacks)
+#define ZEROED_BLOCK_PAGES          2
+
+// Orders (in 4KB frames) of the huge frames that can be requested with requestHugeFrame()
+#define HUGE_FRAME_ORDER_2MB        9
+#define HUGE_FRAME_ORDER_1GB        18
+
+// Maximum number of candidate windows a single compaction pass tries to evacuate
+#define COMPACTION_MAX_WINDOW_ATTEMPTS  4
+
+// Maximum number of NUMA nodes and physical memory zones tracked by the allocator
+#define MAX_NUMA_NODES      8
+#define MAX_MEMORY_ZONES    32
+
+// Returned by PageFrameBitmap searches when no matching frame exists
+#define PAGE_FRAME_BITMAP_NO_INDEX  0xffffffffffffffff
+
+class Srat;
+class Slit;
+
 namespace paging {
-// PageFrameBitmap expects physical page addresses
+//
+// PageFrameBitmap expects physical page addresses.
+//
+// Frames are tracked in 64-bit words (a set bit means the frame is used)
+// with two summary levels on top. A bit in the first summary level is set
+// when the corresponding bitmap word still has a free frame, and a bit in
+// the second level is set when the corresponding first level word is
+// non-zero. Finding a free frame anywhere in memory therefore only takes
+// a few trailing zero count operations instead of a bit-by-bit scan.
+//
 class PageFrameBitmap {
 public:
     PageFrameBitmap() = default;
-    void initialize(uint64_t size, uint8_t* buffer);
 
-    inline uint64_t getSize() const { return m_size; }
+    // Returns the number of bytes needed to track the given amount of frames
+    static uint64_t getBufferSize(uint64_t frameCount);
+
+    // All frames start out as used
+    void initialize(uint64_t frameCount, void* buffer);
+
+    inline uint64_t getFrameCount() const { return m_frameCount; }
 
     int markPageFree(void* addr);
     int markPageUsed(void* addr);
@@ -19,14 +66,173 @@ public:
     bool isPageFree(void* addr);
     bool isPageUsed(void* addr);
 
+    //
+    // Range variants operating on whole words at a time, frames outside
+    // of the tracked range are ignored. Both return the number of frames
+    // whose state has actually changed.
+    //
+    uint64_t markPagesFree(void* addr, uint64_t pages);
+    uint64_t markPagesUsed(void* addr, uint64_t pages);
+
+    // Index of the first free frame at or after startIndex, or PAGE_FRAME_BITMAP_NO_INDEX
+    uint64_t findFirstFree(uint64_t startIndex = 0);
+
+    // Index of the first used frame at or after startIndex, or the frame count if there is none
+    uint64_t findFirstUsed(uint64_t startIndex);
+
 private:
     bool _setPageValue(void* addr, bool value);
     bool _getPageValue(void* addr);
 
+    uint64_t _setRangeValue(void* addr, uint64_t pages, bool value);
+
+    // Brings both summary levels up to date after a bitmap word has changed
+    void _updateSummary(uint64_t wordIdx);
+
     uint64_t _addrToIndex(void* addr);
 
-    uint64_t m_size;
-    uint8_t* m_buffer;
+    uint64_t  m_frameCount;
+    uint64_t  m_wordCount;
+    uint64_t  m_summaryWordCount;
+    uint64_t  m_topSummaryWordCount;
+
+    uint64_t* m_words;
+    uint64_t* m_summary;
+    uint64_t* m_topSummary;
+};
+
+//
+// Per-cpu cache of single physical frames sitting in front of the global
+// allocator. The lock is only ever try-acquired by the fast path, so it is
+// contended only when a task gets preempted or migrated mid-operation, in
+// which case the caller simply falls back to the global allocator.
+// Cached frames are accounted as used by the global allocator.
+//
+struct PageMagazine {
+    Spinlock    lock;
+    uint32_t    count;
+    uint64_t    hits;
+    uint64_t    misses;
+
+    // Physical addresses of the cached frames
+    void*       frames[PAGE_MAGAZINE_CAPACITY];
+} __attribute__((aligned(64)));
+
+struct PageMagazineStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t cachedFrames;
+};
+
+//
+// Per-cpu pool of frames that have already been zeroed by the cpu's idle
+// loop, letting zeroed allocations skip the memset on the hot path. Single
+// pages and 2-page blocks (task stacks) are kept in separate arrays.
+// Pooled frames are accounted as used by the global allocator.
+//
+struct ZeroedPagePool {
+    Spinlock    lock;
+    uint32_t    pageCount;
+    uint32_t    blockCount;
+    uint64_t    hits;
+    uint64_t    misses;
+
+    // Physical addresses of the zeroed single pages and blocks
+    void*       pages[ZEROED_PAGE_POOL_CAPACITY];
+    void*       blocks[ZEROED_BLOCK_POOL_CAPACITY];
+} __attribute__((aligned(64)));
+
+struct ZeroedPagePoolStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t cachedPages;
+};
+
+// What requestHugeFrame() does when no free frame of the requested order exists
+enum class HugeFrameFallback {
+    // Fail the request
+    None,
+
+    // Hand out a frame of the next smaller huge order (1GB -> 2MB) instead
+    SmallerOrder
+};
+
+struct HugeFrameStats {
+    uint64_t allocated2MB;
+    uint64_t allocated1GB;
+
+    // Requests served with a smaller order than requested
+    uint64_t fallbacks;
+
+    // Requests that couldn't be served at all
+    uint64_t failures;
+};
+
+//
+// Owner of an allocated frame. Frames whose owner has a registered
+// migration handler are movable and can be relocated by compaction,
+// everything else is pinned in place. Freed frames revert to Kernel
+// (Cached while they sit in a per-cpu page magazine or zeroed page pool).
+//
+enum class PageOwner : uint8_t {
+    Kernel = 0,
+    PageTable,
+
+    // Frames only reachable through the mappings of the growable heap or a vmalloc area
+    Heap,
+    Vmalloc,
+
+    // Heap arenas and slabs living in the direct map, their frames are pinned
+    HeapArena,
+    Slab,
+
+    Dma,
+    TaskStack,
+
+    // Frames held back by a compaction pass, both free ones and the ones pages were migrated away from
+    CompactionReserved,
+
+    // Frames sitting in a per-cpu page magazine or zeroed page pool
+    Cached,
+
+    Count
+};
+
+//
+// Moves the owner's frames in [startPfn, endPfn) somewhere else, copying
+// their contents and tagging the old frames CompactionReserved so that the
+// compaction pass releases them. Returns the number of frames that were
+// moved, frames that can't be moved right now are left in place.
+//
+typedef uint64_t (*PageMigrationHandler)(uint64_t startPfn, uint64_t endPfn);
+
+struct CompactionStats {
+    uint64_t runs;
+    uint64_t successfulRuns;
+    uint64_t pagesMoved;
+    uint64_t cycles;
+};
+
+//
+// Physically contiguous range of frames belonging to a single NUMA node.
+// Every tracked frame belongs to exactly one zone, and each zone owns
+// the slice of the buddy allocator metadata that covers its frames.
+//
+struct MemoryZone {
+    uint8_t         node;
+    uint64_t        basePfn;
+    uint64_t        frameCount;
+
+    // Number of usable (conventional memory) frames in the zone
+    uint64_t        managedFrames;
+
+    BuddyAllocator  buddy;
+};
+
+struct NumaNodeStats {
+    uint64_t totalMemory;
+    uint64_t freeMemory;
+    uint64_t usedMemory;
 };
 
 class PageFrameAllocator {
@@ -53,23 +259,203 @@ public:
     void* requestFreePage();
     void* requestFreePageZeroed();
 
+    // Multi-page requests are served from the calling cpu's NUMA node first
     void* requestFreePages(size_t pages);
     void* requestFreePagesZeroed(size_t pages);
 
+    // Prefers the given node and falls back to the other nodes in order of distance
+    void* requestFreePagesOnNode(size_t pages, uint8_t node);
+
+    // Tags allocated pages with their owner, the tags are reset once the pages are freed
+    void setPageOwner(void* vaddr, uint64_t pages, PageOwner owner);
+    void setPhysicalPageOwner(void* paddr, uint64_t pages, PageOwner owner);
+    PageOwner getPhysicalPageOwner(void* paddr) const;
+
+    // Makes pages tagged with the given owner movable
+    void registerPageMigrationHandler(PageOwner owner, PageMigrationHandler handler);
+
+    //
+    // Tries to open up a free run of 'pages' contiguous frames, preferring
+    // the given node, by migrating movable pages out of the way. Returns
+    // true if a window has been fully evacuated. Multi-page allocations
+    // fall back to it once every other source of free frames is exhausted.
+    //
+    bool compactMemory(size_t pages, uint8_t node);
+
+    inline CompactionStats getCompactionStats() const { return m_compactionStats; }
+
+    //
+    // Takes a physically contiguous run of pages starting at a multiple of
+    // 'alignment' pages and lying entirely below maxPhysicalAddress, intended
+    // for devices with a limited addressing range. Returns the physical address.
+    //
+    void* requestFreePhysicalPages(size_t pages, uint64_t maxPhysicalAddress, uint64_t alignment = 1);
+
+    //
+    // Allocates a naturally aligned, physically contiguous frame of 2^order pages
+    // (HUGE_FRAME_ORDER_2MB or HUGE_FRAME_ORDER_1GB), preferring the calling cpu's
+    // NUMA node. Returns the physical address since huge frames generally lie
+    // outside of the kernel's higher half mapping and get mapped explicitly.
+    // The order actually allocated is stored in allocatedOrder (if not null),
+    // which can be smaller than requested depending on the fallback policy.
+    //
+    void* requestHugeFrame(
+        uint8_t order,
+        HugeFrameFallback fallback = HugeFrameFallback::None,
+        uint8_t* allocatedOrder = nullptr
+    );
+
+    // Frees a frame returned by requestHugeFrame(), order has to be the allocated order
+    void freeHugeFrame(void* paddr, uint8_t order);
+
+    inline HugeFrameStats getHugeFrameStats() const { return m_hugeFrameStats; }
+
+    //
+    // Splits physical memory into per-node zones as described by the ACPI
+    // SRAT, with the SLIT (optional) providing the fallback order between
+    // nodes. Without calling this all memory belongs to node 0.
+    //
+    __PRIVILEGED_CODE
+    void initializeNumaZones(Srat* srat, Slit* slit);
+
+    inline uint8_t getNodeCount() const { return m_nodeCount; }
+    uint8_t getNodeForPfn(uint64_t pfn) const;
+
+    // NUMA node of the calling cpu
+    uint8_t getCurrentNode() const;
+
+    NumaNodeStats getNodeStats(uint8_t node) const;
+
+    inline uint64_t getZoneCount() const { return m_zoneCount; }
+    inline MemoryZone& getZone(uint64_t idx) { return m_zones[idx]; }
+
     inline uint64_t getTotalSystemMemory() const { return m_totalSystemMemory; }
     inline uint64_t getFreeSystemMemory() const { return m_freeSystemMemory; }
     inline uint64_t getUsedSystemMemory() const { return m_usedSystemMemory; }
 
+    // TSC cycles spent ingesting the memory map in initializeFromMemoryMap()
+    inline uint64_t getMemoryMapIngestionCycles() const { return m_memoryMapIngestionCycles; }
+
+    // Returns the magazine counters of the given cpu, or the sum across all cpus if cpu is -1
+    PageMagazineStats getPageMagazineStats(int cpu = -1) const;
+
+    // Returns all frames cached in the per-cpu magazines and zeroed page pools
+    // back to the global allocator, returns the number of frames
+    uint64_t drainPageMagazines();
+
+    //
+    // Zeroes a single page or block into the calling cpu's zeroed page pool.
+    // Meant to be called from idle loops, does at most one unit of work per
+    // call and returns false once the pool is full (or memory ran out).
+    //
+    bool refillZeroedPagePool();
+
+    // Returns the zeroed page pool counters of the given cpu, or the sum across all cpus if cpu is -1
+    ZeroedPagePoolStats getZeroedPagePoolStats(int cpu = -1) const;
+
+    inline PageFrameBitmap& getPageFrameBitmap() { return m_pageFrameBitmap; }
+
 private:
     uint64_t m_totalSystemMemory = 0;
     uint64_t m_freeSystemMemory = 0;
     uint64_t m_usedSystemMemory = 0;
+    uint64_t m_memoryMapIngestionCycles = 0;
 
-    // Pointer to the last available free
-    // page that is currently in the page bitmap.
-    void*    m_lastTrackedFreePage = nullptr;
+    HugeFrameStats m_hugeFrameStats;
+    CompactionStats m_compactionStats;
 
     PageFrameBitmap m_pageFrameBitmap;
+
+    // Memory map handed over by the bootloader
+    void*           m_memoryMap = nullptr;
+    uint64_t        m_memoryDescriptorSize = 0;
+    uint64_t        m_memoryDescriptorCount = 0;
+
+    // Shared metadata array for the buddy allocators of all zones
+    void*           m_buddyMetadata = nullptr;
+
+    // One PageOwner tag per tracked frame
+    uint8_t*        m_frameOwners = nullptr;
+
+    PageMigrationHandler m_migrationHandlers[static_cast<int>(PageOwner::Count)];
+
+    // Serializes compaction passes, also stops migrations from recursing into compaction
+    Spinlock        m_compactionLock;
+
+    // Buddy allocator backed zones sorted by base PFN, used for contiguous multi-page requests
+    MemoryZone      m_zones[MAX_MEMORY_ZONES];
+    uint64_t        m_zoneCount = 0;
+
+    uint8_t         m_nodeCount = 1;
+    uint8_t         m_cpuNodes[MAX_CPUS];
+    uint8_t         m_nodeDistances[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+    // Nodes sorted by distance from each node, starting with the node itself
+    uint8_t         m_nodeFallbackOrder[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+    // Lock-free (on the local core) caches for single page requests
+    PageMagazine    m_pageMagazines[MAX_CPUS];
+
+    // Frames zeroed ahead of time by each cpu's idle loop
+    ZeroedPagePool  m_zeroedPagePools[MAX_CPUS];
+
+private:
+    // Both helpers expect the caller to hold the page frame allocator lock
+    // and return true if the state of the page has changed.
+    bool _lockPhysicalPage(void* paddr);
+    bool _freePhysicalPage(void* paddr);
+
+    // Range variants of the above, return the number of pages whose state has changed
+    uint64_t _lockPhysicalPages(void* paddr, uint64_t pages);
+    uint64_t _freePhysicalPages(void* paddr, uint64_t pages);
+
+    //
+    // Search for a contiguous run of free pages inside of a zone used when
+    // the buddy allocator can't provide a suitable block (e.g. requests larger
+    // than the maximum buddy order). The run starts at a multiple of 'alignment'
+    // pages. Returns the physical address of the run.
+    //
+    void* _findFreePageRun(MemoryZone* zone, size_t pages, uint64_t alignment = 1);
+
+    // Both helpers expect the caller to hold the page frame allocator lock, mark the
+    // taken pages as used and return their physical address. The node is only a preference.
+    void* _takeFreePhysicalPage(uint8_t node);
+    void* _takeFreePhysicalPageRun(size_t pages, uint8_t node);
+
+    // Lowest suitable run below the limit, expects the caller to hold the page frame allocator lock
+    void* _takeFreePhysicalPagesBelow(size_t pages, uint64_t limitPfn, uint64_t alignment);
+
+    //
+    // Finds the window of 'pages' frames at or after startPfn within a zone of the given
+    // node that contains no pinned frames and as few movable frames as possible.
+    // Expects the caller to hold the page frame allocator lock.
+    //
+    bool _findCompactionWindow(size_t pages, uint8_t node, uint64_t startPfn, uint64_t* windowPfn);
+
+    // A used frame is movable if its owner has a migration handler
+    bool _isFrameMovable(uint64_t pfn);
+
+    // Takes a naturally aligned block of 2^order pages, expects the caller to hold the page frame allocator lock
+    void* _takeHugeFrame(uint8_t order, uint8_t node);
+
+    // Keep the buddy allocators of all zones covering the range in sync with the bitmap
+    void _addFreeFrames(uint64_t pfn, uint64_t count);
+    void _removeFreeFrames(uint64_t pfn, uint64_t count);
+
+    // Global allocator slow paths, both acquire the page frame allocator lock
+    void* _requestFreePageGlobal();
+    void _freePageGlobal(void* paddr);
+
+    // Moves up to PAGE_MAGAZINE_BATCH_SIZE frames between the magazine and the global allocator,
+    // caller holds the magazine lock. Returns the number of frames moved.
+    uint32_t _refillPageMagazine(PageMagazine* magazine);
+    uint32_t _drainPageMagazine(PageMagazine* magazine, uint32_t count);
+
+    // Returns every frame in the pool to the global allocator, caller holds the pool lock
+    uint64_t _drainZeroedPagePool(ZeroedPagePool* pool);
+
+    // Pops a pre-zeroed frame (ZEROED_BLOCK_PAGES == pages for blocks) from the calling cpu's pool
+    void* _takeZeroedPages(size_t pages);
 };
 
 EXTERN_C PageFrameAllocator& getGlobalPageFrameAllocator();
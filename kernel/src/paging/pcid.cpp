@@ -0,0 +1,257 @@
+#include "pcid.h"
+#include "phys_addr_translation.h"
+#include <arch/x86/cpuid.h>
+#include <arch/x86/x86_cpu_control.h>
+#include <arch/x86/per_cpu_data.h>
+#include <memory/kmemory.h>
+#include <sync.h>
+
+namespace paging {
+struct PcidCpuState {
+    // Bit N is set while the TLB entries tagged with PCID N are coherent with the page tables
+    volatile uint64_t       coherentPcids;
+
+    // Root page table last loaded by a task switch
+    PageTable* volatile     activeRoot;
+
+    AddressSpaceSwitchStats stats;
+} __attribute__((aligned(64)));
+
+// Guards the PCID owners, PCID 0 is never reassigned and can be loaded without it
+DECLARE_SPINLOCK(g_pcidLock);
+
+// Physical address of the root page table owning each PCID, 0 if the PCID is free
+uint64_t g_pcidOwners[PCID_ADDRESS_SPACES];
+
+// Next PCID to evict once all of them are taken
+uint16_t g_nextVictimPcid = 1;
+
+PcidCpuState g_pcidCpuStates[MAX_CPUS];
+
+__PRIVILEGED_CODE
+static uint64_t _readCr3() {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return cr3;
+}
+
+// Expects the caller to hold the PCID lock
+__PRIVILEGED_CODE
+static uint16_t _findAddressSpacePcid(uint64_t root) {
+    for (uint16_t pcid = PCID_KERNEL_ROOT + 1; pcid < PCID_ADDRESS_SPACES; ++pcid) {
+        if (g_pcidOwners[pcid] == root) {
+            return pcid;
+        }
+    }
+
+    return PCID_KERNEL_ROOT;
+}
+
+// Makes every cpu flush the PCID before loading it again
+__PRIVILEGED_CODE
+static void _invalidatePcidOnAllCpus(uint16_t pcid) {
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        __sync_fetch_and_and(&g_pcidCpuStates[cpu].coherentPcids, ~(1ULL << pcid));
+    }
+}
+
+// Expects the caller to hold the PCID lock
+__PRIVILEGED_CODE
+static uint16_t _assignAddressSpacePcid(uint64_t root) {
+    uint16_t pcid = _findAddressSpacePcid(root);
+    if (pcid != PCID_KERNEL_ROOT) {
+        return pcid;
+    }
+
+    pcid = _findAddressSpacePcid(0);
+
+    if (pcid == PCID_KERNEL_ROOT) {
+        pcid = g_nextVictimPcid;
+
+        if (++g_nextVictimPcid == PCID_ADDRESS_SPACES) {
+            g_nextVictimPcid = PCID_KERNEL_ROOT + 1;
+        }
+    }
+
+    //
+    // Whatever a cpu still has cached for the PCID belongs to
+    // the previous owner (or to an already released address space).
+    //
+    _invalidatePcidOnAllCpus(pcid);
+    g_pcidOwners[pcid] = root;
+
+    return pcid;
+}
+
+__PRIVILEGED_CODE
+static void _loadAddressSpace(PcidCpuState* state, PageTable* pml4, uint16_t pcid) {
+    uint64_t pcidBit = 1ULL << pcid;
+    bool noFlush = (state->coherentPcids & pcidBit) != 0;
+
+    setCurrentTopLevelPageTable(pml4, pcid, noFlush);
+
+    if (noFlush) {
+        state->stats.preservingSwitches++;
+    } else {
+        state->stats.flushingSwitches++;
+        __sync_fetch_and_or(&state->coherentPcids, pcidBit);
+    }
+}
+
+__PRIVILEGED_CODE
+void enablePcid() {
+    if (!cpuid_isPcidSupported() || x86_cpu_is_pcid_enabled()) {
+        return;
+    }
+
+    // Setting CR4.PCIDE faults unless the low cr3 bits are clear
+    uint64_t cr3 = _readCr3();
+    if (cr3 & CR3_PCID_MASK) {
+        setCurrentTopLevelPageTable(getCurrentTopLevelPageTable());
+    }
+
+    x86_cpu_pcid_enable();
+
+    g_pcidCpuStates[current->cpu].coherentPcids = 1ULL << PCID_KERNEL_ROOT;
+}
+
+__PRIVILEGED_CODE
+bool isPcidEnabled() {
+    return x86_cpu_is_pcid_enabled();
+}
+
+__PRIVILEGED_CODE
+uint16_t getCurrentPcid() {
+    if (!isPcidEnabled()) {
+        return PCID_KERNEL_ROOT;
+    }
+
+    return static_cast<uint16_t>(_readCr3() & CR3_PCID_MASK);
+}
+
+__PRIVILEGED_CODE
+uint16_t getAddressSpacePcid(PageTable* pml4) {
+    if (pml4 == g_kernelRootPageTable) {
+        return PCID_KERNEL_ROOT;
+    }
+
+    acquireSpinlock(&g_pcidLock);
+    uint16_t pcid = _assignAddressSpacePcid(reinterpret_cast<uint64_t>(__pa(pml4)));
+    releaseSpinlock(&g_pcidLock);
+
+    return pcid;
+}
+
+__PRIVILEGED_CODE
+void releaseAddressSpacePcid(PageTable* pml4) {
+    uint64_t root = reinterpret_cast<uint64_t>(__pa(pml4));
+
+    acquireSpinlock(&g_pcidLock);
+
+    uint16_t pcid = _findAddressSpacePcid(root);
+    if (pcid != PCID_KERNEL_ROOT) {
+        g_pcidOwners[pcid] = 0;
+    }
+
+    releaseSpinlock(&g_pcidLock);
+}
+
+__PRIVILEGED_CODE
+void switchAddressSpace(int cpu, PageTable* pml4) {
+    PcidCpuState* state = &g_pcidCpuStates[cpu];
+    state->activeRoot = pml4;
+
+    //
+    // Every kernel task shares the kernel root page table, so switching
+    // between them doesn't need to touch cr3 (and the TLB) at all.
+    //
+    if (getCurrentTopLevelPageTable() == pml4) {
+        state->stats.elidedSwitches++;
+        return;
+    }
+
+    if (!isPcidEnabled()) {
+        setCurrentTopLevelPageTable(pml4);
+        state->stats.flushingSwitches++;
+        return;
+    }
+
+    if (pml4 == g_kernelRootPageTable) {
+        _loadAddressSpace(state, pml4, PCID_KERNEL_ROOT);
+        return;
+    }
+
+    //
+    // The lock is held until the PCID is marked coherent so another
+    // cpu can't evict it in between and leave the stale bit behind.
+    //
+    acquireSpinlock(&g_pcidLock);
+    uint16_t pcid = _assignAddressSpacePcid(reinterpret_cast<uint64_t>(__pa(pml4)));
+    _loadAddressSpace(state, pml4, pcid);
+    releaseSpinlock(&g_pcidLock);
+}
+
+__PRIVILEGED_CODE
+void setActiveAddressSpace(int cpu, PageTable* pml4) {
+    g_pcidCpuStates[cpu].activeRoot = pml4;
+}
+
+__PRIVILEGED_CODE
+uint64_t getAddressSpaceCpuMask(PageTable* pml4) {
+    uint64_t mask = 0;
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        if (g_pcidCpuStates[cpu].activeRoot == pml4) {
+            mask |= 1ULL << cpu;
+        }
+    }
+
+    return mask;
+}
+
+__PRIVILEGED_CODE
+void invalidateAddressSpacePcid(PageTable* pml4) {
+    if (pml4 == g_kernelRootPageTable) {
+        _invalidatePcidOnAllCpus(PCID_KERNEL_ROOT);
+        return;
+    }
+
+    uint64_t root = reinterpret_cast<uint64_t>(__pa(pml4));
+
+    acquireSpinlock(&g_pcidLock);
+
+    uint16_t pcid = _findAddressSpacePcid(root);
+    if (pcid != PCID_KERNEL_ROOT) {
+        _invalidatePcidOnAllCpus(pcid);
+    }
+
+    releaseSpinlock(&g_pcidLock);
+}
+
+__PRIVILEGED_CODE
+void invalidateInactivePcids() {
+    if (!isPcidEnabled()) {
+        return;
+    }
+
+    uint64_t pcidBit = 1ULL << (_readCr3() & CR3_PCID_MASK);
+    __sync_fetch_and_and(&g_pcidCpuStates[current->cpu].coherentPcids, pcidBit);
+}
+
+AddressSpaceSwitchStats getAddressSpaceSwitchStats(int cpu) {
+    AddressSpaceSwitchStats stats;
+    zeromem(&stats, sizeof(AddressSpaceSwitchStats));
+
+    for (int i = 0; i < MAX_CPUS; ++i) {
+        if (cpu != -1 && cpu != i) {
+            continue;
+        }
+
+        stats.elidedSwitches += g_pcidCpuStates[i].stats.elidedSwitches;
+        stats.preservingSwitches += g_pcidCpuStates[i].stats.preservingSwitches;
+        stats.flushingSwitches += g_pcidCpuStates[i].stats.flushingSwitches;
+    }
+
+    return stats;
+}
+} // namespace paging
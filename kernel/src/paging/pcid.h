@@ -0,0 +1,79 @@
+#ifndef PCID_H
+#define PCID_H
+#include "page.h"
+
+// Number of PCIDs handed out to address spaces, PCID 0 always belongs to the kernel root page table
+#define PCID_ADDRESS_SPACES 64
+
+#define PCID_KERNEL_ROOT    0
+
+namespace paging {
+struct AddressSpaceSwitchStats {
+    // The incoming task already ran on the loaded root page table, cr3 wasn't touched
+    uint64_t elidedSwitches;
+
+    // cr3 got written with the no-flush bit, the TLB entries of the new PCID survived
+    uint64_t preservingSwitches;
+
+    // cr3 got written without the no-flush bit, every non-global translation was refilled
+    uint64_t flushingSwitches;
+};
+
+//
+// Tags TLB entries with a process-context identifier (PCID) per address
+// space so switching between root page tables doesn't throw away the
+// translations of the other ones. Every cpu keeps a mask of the PCIDs whose
+// entries in its TLB are still coherent with the page tables. A local flush
+// only reaches the current PCID, so it drops every other PCID from the mask
+// and the next switch to one of those writes cr3 without the no-flush bit.
+//
+// Without PCID support every switch to a different root page table flushes,
+// switches to the already loaded one are elided either way.
+//
+
+// Sets CR4.PCIDE on the calling cpu if supported, expects the PCID bits of cr3 to be 0
+__PRIVILEGED_CODE
+void enablePcid();
+
+__PRIVILEGED_CODE
+bool isPcidEnabled();
+
+__PRIVILEGED_CODE
+uint16_t getCurrentPcid();
+
+// Returns the PCID of the address space, assigning one (possibly evicting another owner) if needed
+__PRIVILEGED_CODE
+uint16_t getAddressSpacePcid(PageTable* pml4);
+
+// Returns the PCID of an address space that's about to be torn down
+__PRIVILEGED_CODE
+void releaseAddressSpacePcid(PageTable* pml4);
+
+// Loads the root page table on the given (calling) cpu unless it's already loaded
+__PRIVILEGED_CODE
+void switchAddressSpace(int cpu, PageTable* pml4);
+
+// Records the root page table a cpu came up with, before its first task switch
+__PRIVILEGED_CODE
+void setActiveAddressSpace(int cpu, PageTable* pml4);
+
+// Returns the mask of cpus the root page table is currently loaded on
+__PRIVILEGED_CODE
+uint64_t getAddressSpaceCpuMask(PageTable* pml4);
+
+// Makes every cpu flush the address space's PCID the next time it gets loaded
+__PRIVILEGED_CODE
+void invalidateAddressSpacePcid(PageTable* pml4);
+
+//
+// Called after the local TLB got flushed for the current PCID,
+// marks the translations cached for the other PCIDs as stale.
+//
+__PRIVILEGED_CODE
+void invalidateInactivePcids();
+
+// Returns the switch counters of the given cpu, or the sum across all cpus if cpu is -1
+AddressSpaceSwitchStats getAddressSpaceSwitchStats(int cpu = -1);
+} // namespace paging
+
+#endif
@@ -1,16 +1,361 @@
 #include "tlb.h"
+#include "pcid.h"
+#include <arch/x86/apic.h>
+#include <arch/x86/per_cpu_data.h>
+#include <arch/x86/x86_cpu_control.h>
+#include <interrupts/interrupts.h>
+#include <memory/kmemory.h>
+#include <sync.h>
 
 namespace paging {
+struct TlbShootdownRange {
+    // Page aligned, end is exclusive
+    uint64_t start;
+    uint64_t end;
+};
+
+struct TlbShootdownQueue {
+    Spinlock            lock;
+
+    uint32_t            rangeCount;
+
+    // Set once the queue overflowed or a full flush got requested
+    bool                fullFlush;
+
+    // An IPI was sent and the cpu hasn't picked up the queue yet
+    bool                ipiPending;
+
+    TlbShootdownRange   ranges[TLB_SHOOTDOWN_QUEUE_DEPTH];
+
+    // Sequence numbers of the last request queued and the last one handled
+    uint64_t            requested;
+    volatile uint64_t   completed;
+
+    TlbShootdownStats   stats;
+} __attribute__((aligned(64)));
+
+TlbShootdownQueue g_tlbShootdownQueues[MAX_CPUS];
+
+// Cpus able to receive shootdown IPIs
+volatile uint64_t g_tlbShootdownCpus;
 
 __PRIVILEGED_CODE
 void flushTlbPage(void* vaddr) {
     asm volatile("invlpg (%0)" : : "r" (vaddr) : "memory");
+
+    // invlpg only reaches the translations tagged with the current PCID
+    invalidateInactivePcids();
 }
 
 __PRIVILEGED_CODE
 void flushTlbAll() {
-    PageTable* pml4 = getCurrentTopLevelPageTable();
-    setCurrentTopLevelPageTable(pml4);
+    //
+    // Kernel half translations are global and survive cr3 writes,
+    // toggling CR4.PGE drops them along with those of every PCID.
+    //
+    if (x86_cpu_is_pge_enabled()) {
+        x86_cpu_pge_clear();
+        x86_cpu_pge_enable();
+    } else {
+        PageTable* pml4 = getCurrentTopLevelPageTable();
+        setCurrentTopLevelPageTable(pml4, getCurrentPcid());
+    }
+
+    invalidateInactivePcids();
+}
+
+__PRIVILEGED_CODE
+void flushTlbRange(void* vaddr, size_t size) {
+    if (size == 0) {
+        return;
+    }
+
+    uint64_t start = reinterpret_cast<uint64_t>(vaddr) & ~(PAGE_SIZE - 1);
+    uint64_t pages = (reinterpret_cast<uint64_t>(vaddr) + size - 1 - start) / PAGE_SIZE + 1;
+
+    if (pages > TLB_FLUSH_SINGLE_PAGE_LIMIT) {
+        flushTlbAll();
+        return;
+    }
+
+    for (uint64_t page = 0; page < pages; ++page) {
+        asm volatile("invlpg (%0)" : : "r" (start + page * PAGE_SIZE) : "memory");
+    }
+
+    invalidateInactivePcids();
+}
+
+//
+// The queues are also taken from the IPI handler, so
+// they're never held with interrupts enabled.
+//
+__PRIVILEGED_CODE
+static bool _lockShootdownQueue(TlbShootdownQueue* queue) {
+    bool interruptsEnabled = areInterruptsEnabled();
+    disableInterrupts();
+
+    acquireSpinlock(&queue->lock);
+    return interruptsEnabled;
+}
+
+__PRIVILEGED_CODE
+static void _unlockShootdownQueue(TlbShootdownQueue* queue, bool interruptsEnabled) {
+    releaseSpinlock(&queue->lock);
+
+    if (interruptsEnabled) {
+        enableInterrupts();
+    }
+}
+
+// Returns the sequence number of the request, sets 'sendIpi' if the cpu has to be interrupted
+__PRIVILEGED_CODE
+static uint64_t _queueShootdownRequest(int cpu, uint64_t start, uint64_t end, bool fullFlush, bool* sendIpi) {
+    TlbShootdownQueue* queue = &g_tlbShootdownQueues[cpu];
+    bool interruptsEnabled = _lockShootdownQueue(queue);
+
+    if (fullFlush) {
+        queue->fullFlush = true;
+    } else if (!queue->fullFlush) {
+        bool merged = false;
+
+        for (uint32_t i = 0; i < queue->rangeCount; ++i) {
+            TlbShootdownRange* range = &queue->ranges[i];
+
+            // Overlapping and adjacent ranges are flushed as one
+            if (start <= range->end && end >= range->start) {
+                range->start = start < range->start ? start : range->start;
+                range->end = end > range->end ? end : range->end;
+                merged = true;
+                break;
+            }
+        }
+
+        if (!merged) {
+            if (queue->rangeCount < TLB_SHOOTDOWN_QUEUE_DEPTH) {
+                queue->ranges[queue->rangeCount++] = { start, end };
+            } else {
+                queue->fullFlush = true;
+            }
+        }
+    }
+
+    uint64_t sequence = ++queue->requested;
+
+    *sendIpi = !queue->ipiPending;
+    queue->ipiPending = true;
+
+    _unlockShootdownQueue(queue, interruptsEnabled);
+
+    return sequence;
+}
+
+__PRIVILEGED_CODE
+static void _sendShootdownIpi(int cpu) {
+    auto& lapic = Apic::__irqGetLocalApic();
+
+    // Both ICR halves have to be written without another IPI in between
+    bool interruptsEnabled = areInterruptsEnabled();
+    disableInterrupts();
+
+    while (lapic->read(APIC_ICR_LO) & APIC_ICR_DELIVERY_PENDING) {
+        asm volatile("pause");
+    }
+
+    // Cpu indices are the cores' APIC IDs
+    lapic->sendIpi(static_cast<uint8_t>(cpu), IRQ_TLB_SHOOTDOWN);
+
+    if (interruptsEnabled) {
+        enableInterrupts();
+    }
+}
+
+// Flushes everything queued for the cpu, expects to run on that cpu
+__PRIVILEGED_CODE
+static void _processShootdownQueue(int cpu) {
+    TlbShootdownQueue* queue = &g_tlbShootdownQueues[cpu];
+    TlbShootdownRange ranges[TLB_SHOOTDOWN_QUEUE_DEPTH];
+
+    bool interruptsEnabled = _lockShootdownQueue(queue);
+
+    if (!queue->ipiPending) {
+        _unlockShootdownQueue(queue, interruptsEnabled);
+        return;
+    }
+
+    uint32_t rangeCount = queue->rangeCount;
+    bool fullFlush = queue->fullFlush;
+    uint64_t sequence = queue->requested;
+
+    memcpy(ranges, queue->ranges, rangeCount * sizeof(TlbShootdownRange));
+
+    queue->rangeCount = 0;
+    queue->fullFlush = false;
+    queue->ipiPending = false;
+
+    _unlockShootdownQueue(queue, interruptsEnabled);
+
+    uint64_t pages = 0;
+    for (uint32_t i = 0; i < rangeCount; ++i) {
+        pages += (ranges[i].end - ranges[i].start) / PAGE_SIZE;
+    }
+
+    if (fullFlush || pages > TLB_FLUSH_SINGLE_PAGE_LIMIT) {
+        flushTlbAll();
+        queue->stats.fullFlushes++;
+    } else {
+        for (uint32_t i = 0; i < rangeCount; ++i) {
+            flushTlbRange(reinterpret_cast<void*>(ranges[i].start), ranges[i].end - ranges[i].start);
+        }
+
+        queue->stats.rangeFlushes++;
+    }
+
+    // A nested handler may have already completed a later request
+    uint64_t completed = queue->completed;
+    while (completed < sequence) {
+        uint64_t previous = __sync_val_compare_and_swap(&queue->completed, completed, sequence);
+        if (previous == completed) {
+            break;
+        }
+
+        completed = previous;
+    }
+}
+
+// Expects interrupts to be disabled, so that the calling cpu can't change underneath it
+__PRIVILEGED_CODE
+static void _shootdownTlbOnCpu(uint64_t start, uint64_t end, bool fullFlush, PageTable* pml4, bool wait) {
+    bool sharedHalf = fullFlush || start >= KERNEL_HALF_BASE;
+    bool loadedLocally = sharedHalf || getCurrentTopLevelPageTable() == pml4;
+
+    uint64_t targets = g_tlbShootdownCpus;
+
+    // Before the first cpu registers there is no one else to notify
+    int self = targets ? current->cpu : BSP_CPU_ID;
+    targets &= ~(1ULL << self);
+
+    if (!sharedHalf) {
+        targets &= getAddressSpaceCpuMask(pml4);
+
+        // Cpus that switched away from the address space still cache its PCID
+        invalidateAddressSpacePcid(pml4);
+    }
+
+    if (loadedLocally) {
+        if (fullFlush) {
+            flushTlbAll();
+        } else {
+            flushTlbRange(reinterpret_cast<void*>(start), end - start);
+        }
+    }
+
+    if (targets == 0) {
+        return;
+    }
+
+    TlbShootdownStats* stats = &g_tlbShootdownQueues[self].stats;
+    uint64_t sequences[MAX_CPUS];
+
+    stats->shootdowns++;
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        if (!(targets & (1ULL << cpu))) {
+            continue;
+        }
+
+        bool sendIpi;
+        sequences[cpu] = _queueShootdownRequest(cpu, start, end, fullFlush, &sendIpi);
+
+        if (sendIpi) {
+            _sendShootdownIpi(cpu);
+            stats->ipisSent++;
+        } else {
+            stats->coalescedRequests++;
+        }
+    }
+
+    if (!wait) {
+        return;
+    }
+
+    for (int cpu = 0; cpu < MAX_CPUS; ++cpu) {
+        if (!(targets & (1ULL << cpu))) {
+            continue;
+        }
+
+        // The target may itself be waiting on this cpu
+        while (g_tlbShootdownQueues[cpu].completed < sequences[cpu]) {
+            _processShootdownQueue(self);
+            asm volatile("pause");
+        }
+    }
 }
 
+__PRIVILEGED_CODE
+static void _shootdownTlb(uint64_t start, uint64_t end, bool fullFlush, PageTable* pml4, bool wait) {
+    //
+    // A task preempted and migrated after picking 'self' would flush the
+    // wrong cpu and skip its new one. The wait loop keeps handling the
+    // requests queued for this cpu, so interrupts can stay off throughout.
+    //
+    bool interruptsEnabled = areInterruptsEnabled();
+    disableInterrupts();
+
+    _shootdownTlbOnCpu(start, end, fullFlush, pml4, wait);
+
+    if (interruptsEnabled) {
+        enableInterrupts();
+    }
+}
+
+__PRIVILEGED_CODE
+void registerTlbShootdownCpu() {
+    int cpu = current->cpu;
+
+    setActiveAddressSpace(cpu, getCurrentTopLevelPageTable());
+    __sync_fetch_and_or(&g_tlbShootdownCpus, 1ULL << cpu);
+}
+
+__PRIVILEGED_CODE
+void shootdownTlbRange(void* vaddr, size_t size, PageTable* pml4, bool wait) {
+    if (size == 0) {
+        return;
+    }
+
+    uint64_t start = reinterpret_cast<uint64_t>(vaddr) & ~(PAGE_SIZE - 1);
+    uint64_t end = (reinterpret_cast<uint64_t>(vaddr) + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    _shootdownTlb(start, end, false, pml4, wait);
+}
+
+__PRIVILEGED_CODE
+void shootdownTlbAll(PageTable* pml4, bool wait) {
+    _shootdownTlb(0, 0, true, pml4, wait);
+}
+
+__PRIVILEGED_CODE
+void handleTlbShootdownIpi() {
+    _processShootdownQueue(current->cpu);
+}
+
+TlbShootdownStats getTlbShootdownStats(int cpu) {
+    TlbShootdownStats stats;
+    zeromem(&stats, sizeof(TlbShootdownStats));
+
+    for (int i = 0; i < MAX_CPUS; ++i) {
+        if (cpu != -1 && cpu != i) {
+            continue;
+        }
+
+        TlbShootdownStats* cpuStats = &g_tlbShootdownQueues[i].stats;
+
+        stats.shootdowns += cpuStats->shootdowns;
+        stats.ipisSent += cpuStats->ipisSent;
+        stats.coalescedRequests += cpuStats->coalescedRequests;
+        stats.rangeFlushes += cpuStats->rangeFlushes;
+        stats.fullFlushes += cpuStats->fullFlushes;
+    }
+
+    return stats;
+}
 } // namespace paging
@@ -2,6 +2,12 @@
 #define TLB_H
 #include "page.h"
 
+// Ranges spanning more pages than this get a full flush instead of one invlpg per page
+#define TLB_FLUSH_SINGLE_PAGE_LIMIT 32
+
+// Distinct ranges a cpu can have pending before its next shootdown turns into a full flush
+#define TLB_SHOOTDOWN_QUEUE_DEPTH   8
+
 namespace paging {
 
 __PRIVILEGED_CODE
@@ -10,5 +16,57 @@ void flushTlbPage(void* vaddr);
 __PRIVILEGED_CODE
 void flushTlbAll();
 
+// Flushes the translations of every page overlapping the range from the local TLB
+__PRIVILEGED_CODE
+void flushTlbRange(void* vaddr, size_t size);
+
+struct TlbShootdownStats {
+    // Shootdowns started by the cpu that reached at least one other cpu
+    uint64_t shootdowns;
+    uint64_t ipisSent;
+
+    // Requests queued behind an IPI that was already on its way
+    uint64_t coalescedRequests;
+
+    // Requests handled by the cpu, by the kind of flush they ended up as
+    uint64_t rangeFlushes;
+    uint64_t fullFlushes;
+};
+
+//
+// Cross-cpu TLB invalidation. Every cpu has a queue of pending ranges that
+// other cpus append to; overlapping and adjacent ranges get merged, and an
+// IPI is only sent if the queue didn't already have one on its way, so a
+// burst of requests is handled in a single interrupt. The handler picks
+// invlpg or a full flush based on the total size of the pending ranges.
+//
+// Changes to the kernel half reach every online cpu since all address
+// spaces share it, changes to the lower half only the cpus the address
+// space is currently loaded on. The initiating cpu flushes its own TLB
+// directly.
+//
+// Waiting for the other cpus is only needed when the old translations must
+// be gone before the caller proceeds, e.g. before the frames they point to
+// get reused, a waiting initiator keeps draining its own queue so two cpus
+// shooting down each other can't deadlock.
+//
+
+// Brings the calling cpu into the shootdown targets, expects its LAPIC to be initialized
+__PRIVILEGED_CODE
+void registerTlbShootdownCpu();
+
+__PRIVILEGED_CODE
+void shootdownTlbRange(void* vaddr, size_t size, PageTable* pml4 = getCurrentTopLevelPageTable(), bool wait = true);
+
+__PRIVILEGED_CODE
+void shootdownTlbAll(PageTable* pml4 = getCurrentTopLevelPageTable(), bool wait = true);
+
+// Processes the requests queued for the calling cpu
+__PRIVILEGED_CODE
+void handleTlbShootdownIpi();
+
+// Returns the shootdown counters of the given cpu, or the sum across all cpus if cpu is -1
+TlbShootdownStats getTlbShootdownStats(int cpu = -1);
+
 } // namespace paging
 #endif
@@ -1,5 +1,6 @@
 #include "process.h"
 #include <paging/page.h>
+#include <paging/pcid.h>
 #include <arch/x86/per_cpu_data.h>
 #include <sched/sched.h>
 #include <kelevate/kelevate.h>
@@ -80,8 +81,8 @@ void switchContextInIrq(int oldCpu, int newCpu, PCB* from, PCB* to, PtRegs* fram
     // Restore the context from the 'to' PCB
     restoreCpuContext(&to->context, frame);
 
-    // Read top level page table pointer from cr3
-    paging::setCurrentTopLevelPageTable(reinterpret_cast<paging::PageTable*>(to->cr3));
+    // Load the new task's address space, a no-op if it shares the current one
+    paging::switchAddressSpace(newCpu, reinterpret_cast<paging::PageTable*>(to->cr3));
 
     // Set the new value of currentTask
     __per_cpu_data.__cpu[newCpu].currentTask = to;
@@ -94,8 +95,8 @@ void exitAndSwitchCurrentContext(int cpu, PCB* newCtx, PtRegs* regs) {
     // Restore the context from the 'to' PCB
     restoreCpuContext(&newCtx->context, regs);
 
-    // Read top level page table pointer from cr3
-    paging::setCurrentTopLevelPageTable(reinterpret_cast<paging::PageTable*>(newCtx->cr3));
+    // Load the new task's address space, a no-op if it shares the current one
+    paging::switchAddressSpace(cpu, reinterpret_cast<paging::PageTable*>(newCtx->cr3));
 
     // Set the new value of currentTask
     __per_cpu_data.__cpu[cpu].currentTask = newCtx;
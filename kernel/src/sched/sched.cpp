@@ -1,5 +1,6 @@
 #include "sched.h"
 #include <memory/kmemory.h>
+#include <memory/object_cache.h>
 #include <paging/page.h>
 #include <gdt/gdt.h>
 #include <kelevate/kelevate.h>
@@ -8,6 +9,9 @@
 RRScheduler s_globalRRScheduler;
 Task g_kernelSwapperTasks[MAX_CPUS] = {};
 
+// Process control blocks get touched on every context switch, keep them on their own cache lines
+kstl::ObjectCache<Task> g_taskCache("task", nullptr, OBJECT_CACHE_ALIGN_CACHELINE);
+
 DECLARE_SPINLOCK(__sched_lock);
 DECLARE_SPINLOCK(__sched_load_balancing_lock);
 
@@ -266,7 +270,7 @@ int RRScheduler::_getNextAvailableCpu() {
 }
 
 Task* createKernelTask(void (*taskEntry)(), int priority) {
-    Task* task = (Task*)kmalloc(sizeof(Task));
+    Task* task = g_taskCache.allocate();
     zeromem(task, sizeof(Task));
 
     // Initialize the task's process control block
@@ -275,8 +279,16 @@ Task* createKernelTask(void (*taskEntry)(), int priority) {
     task->priority = priority;
 
     // Allocate both user and kernel stacks
-    void* userStack = zallocPages(2);
-    void* kernelStack = zallocPages(2);
+    void* userStack = zallocPages(TASK_STACK_PAGES);
+    void* kernelStack = zallocPages(TASK_STACK_PAGES);
+
+    //
+    // Stacks are pinned, raw pointers into them (saved frame pointers,
+    // addresses of locals handed to other code) can't be found and rebased.
+    //
+    auto& allocator = paging::getGlobalPageFrameAllocator();
+    allocator.setPageOwner(userStack, TASK_STACK_PAGES, paging::PageOwner::TaskStack);
+    allocator.setPageOwner(kernelStack, TASK_STACK_PAGES, paging::PageOwner::TaskStack);
 
     // Initialize the CPU context
     task->context.rsp = (uint64_t)userStack + PAGE_SIZE; // Point to the top of the stack
@@ -6,6 +6,9 @@
 
 #define MAX_QUEUED_PROCESSES 128
 
+// Size of the user and kernel stacks allocated for every kernel task
+#define TASK_STACK_PAGES 2
+
 using Task = PCB;
 
 EXTERN_C Task g_kernelSwapperTasks[MAX_CPUS];